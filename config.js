@@ -55,6 +55,20 @@ config.MONGO_AGENTS_N2N_PORT = 60100;
 
 config.N2N_OFFER_INTERNAL = false;
 
+// utp tuning of nudp connections - the defaults fit a low latency lan.
+// autotune grows the buffers of every connection to its measured bandwidth delay product
+// up to NUDP_AUTOTUNE_MAX_BUF, to fill high latency links between sites.
+config.NUDP_TARGET_DELAY_MICROS = 10000;
+config.NUDP_SNDBUF = 128 * 1024;
+config.NUDP_RCVBUF = 128 * 1024;
+config.NUDP_AUTOTUNE = false;
+config.NUDP_AUTOTUNE_MAX_BUF = 16 * 1024 * 1024;
+
+// ntcp connections send messages as multiplexed streams of interleaved chunks,
+// so small rpc messages are not blocked behind large block writes.
+// any ntcp endpoint can receive both framings, but older ones can only receive plain messages.
+config.NTCP_MUX = false;
+
 /////////////////////
 // ENDPOINT CONFIG //
 /////////////////////
@@ -216,12 +230,40 @@ config.OBJECT_RECLAIMER_ERROR_DELAY = 3000;
 // SPLIT
 config.CHUNK_SPLIT_AVG_CHUNK = 4 * 1024 * 1024;
 config.CHUNK_SPLIT_DELTA_CHUNK = config.CHUNK_SPLIT_AVG_CHUNK / 4;
+// large uploads calculate the object md5/sha256 on a separate thread from the split scan
+config.CHUNK_SPLIT_DIGEST_THREAD_MIN_SIZE = 1024 * 1024 * 1024;
 
 // CODER
 config.CHUNK_CODER_DIGEST_TYPE = 'sha384';
 config.CHUNK_CODER_FRAG_DIGEST_TYPE = 'sha1';
 config.CHUNK_CODER_COMPRESS_TYPE = process.env.NOOBAA_DISABLE_COMPRESSION === 'true' ? undefined : 'snappy';
+// undefined means the default level of the compress type, buckets can override it in chunk_coder_config
+config.CHUNK_CODER_COMPRESS_LEVEL = undefined;
+// chunks that are expected to compress by less than this percent (by an entropy probe)
+// are stored uncompressed - mostly media, archives and client side encrypted data. 0 always compresses.
+config.CHUNK_CODER_COMPRESS_MIN_GAIN = 5;
+// compression dictionaries are trained per bucket (zstd only) from a sample of its newest
+// small chunks - these are where a dictionary pays off, larger chunks carry their own context.
+config.CHUNK_CODER_COMPRESS_DICT_SIZE = 64 * 1024;
+config.CHUNK_CODER_COMPRESS_DICT_SAMPLES = 2000;
+config.CHUNK_CODER_COMPRESS_DICT_SAMPLE_MAX_SIZE = 64 * 1024;
 config.CHUNK_CODER_CIPHER_TYPE = 'aes-256-gcm';
+// gcm chunks are stored with an auth tag that reads verify while decrypting,
+// so these reads skip the chunk digest pass. chunks stored without a tag still use the digest.
+config.CHUNK_CODER_GCM_AUTH_TAG = true;
+// native threads of the shared work stealing pool that codes the chunks (and runs the native
+// ThreadPool workers) - a core is left for the event loop, up to 16 threads.
+// 0 means coding on the uv threadpool, where a batch is split into a few uv works.
+config.CHUNK_CODER_POOL_THREADS = Math.min(16, Math.max(1,
+    Math.floor(Number(process.env.CONTAINER_CPU_LIMIT) || os.cpus().length) - 1));
+// chunks that are coded in the same event loop tick are sent to the native coder
+// in batches of up to this many chunks, see src/util/chunk_coder_batch.js
+config.CHUNK_CODER_BATCH_SIZE = 32;
+// pinning of the coder threads - 'none', 'cores' (a thread per cpu) or 'numa' (a thread per node cpus).
+// when pinned every chunk is coded on a thread of the numa node that holds its input buffers.
+// it applies to the threads of CHUNK_CODER_POOL_THREADS, so it does nothing when that is 0
+// (coding on the uv threadpool) - set both, e.g. 'numa' with the default threads on multi-socket hosts.
+config.CHUNK_CODER_POOL_PLACEMENT = 'none';
 
 // ERASURE CODES
 config.CHUNK_CODER_EC_DATA_FRAGS = 4;
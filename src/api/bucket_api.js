@@ -327,6 +327,54 @@ module.exports = {
             }
         },
 
+        train_bucket_compress_dict: {
+            method: 'PUT',
+            params: {
+                type: 'object',
+                required: ['name'],
+                properties: {
+                    name: { $ref: 'common_api#/definitions/bucket_name' },
+                    // max size of the dictionary in bytes
+                    dict_size: { type: 'integer' },
+                }
+            },
+            reply: {
+                type: 'object',
+                required: ['compress_dict_id', 'dict_size', 'samples', 'sample_bytes'],
+                properties: {
+                    compress_dict_id: { type: 'integer' },
+                    dict_size: { type: 'integer' },
+                    samples: { type: 'integer' },
+                    sample_bytes: { type: 'integer' },
+                }
+            },
+            auth: {
+                system: 'admin'
+            }
+        },
+
+        read_compress_dict: {
+            method: 'GET',
+            params: {
+                type: 'object',
+                required: ['dict_id'],
+                properties: {
+                    dict_id: { type: 'integer' },
+                }
+            },
+            reply: {
+                type: 'object',
+                required: ['dict_id', 'dict_b64'],
+                properties: {
+                    dict_id: { type: 'integer' },
+                    dict_b64: { type: 'string' },
+                }
+            },
+            auth: {
+                system: ['admin', 'user']
+            }
+        },
+
         update_bucket: {
             method: 'PUT',
             params: {
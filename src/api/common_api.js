@@ -604,7 +604,7 @@ module.exports = {
 
         compress_type: {
             type: 'string',
-            enum: ['snappy', 'zlib']
+            enum: ['snappy', 'zlib', 'zstd', 'lz4']
         },
 
         cipher_type: {
@@ -617,11 +617,18 @@ module.exports = {
             enum: ['isa-c1', 'isa-rs', 'cm256']
         },
 
+        split_type: {
+            type: 'string',
+            enum: ['rabin', 'gear']
+        },
+
         chunk_split_config: {
             type: 'object',
             properties: {
                 avg_chunk: { type: 'integer' },
                 delta_chunk: { type: 'integer' },
+                // missing means rabin which all the existing chunks were split with
+                split_type: { $ref: '#/definitions/split_type' },
             }
         },
 
@@ -631,6 +638,13 @@ module.exports = {
                 digest_type: { $ref: '#/definitions/digest_type' },
                 frag_digest_type: { $ref: '#/definitions/digest_type' },
                 compress_type: { $ref: '#/definitions/compress_type' },
+                // missing means the default level of the compress type
+                // (zlib 1-9, zstd 1-22 or negative for faster, lz4 0 is fast and 3-12 is lz4hc)
+                compress_level: { type: 'integer' },
+                // zstd dictionary trained for the bucket, the dictionary itself is kept in the
+                // md store compressdicts by {system, dict_id} and is loaded into the native coder
+                // on first use
+                compress_dict_id: { type: 'integer' },
                 cipher_type: { $ref: '#/definitions/cipher_type' },
                 // Data Copies:
                 replicas: { type: 'integer' },
@@ -641,7 +655,11 @@ module.exports = {
                 // LRC:
                 lrc_group: { type: 'integer' },
                 lrc_frags: { type: 'integer' },
-                lrc_type: { $ref: '#/definitions/parity_type' },
+                // missing means isa-c1, cm256 is not supported for local groups
+                lrc_type: {
+                    type: 'string',
+                    enum: ['isa-c1', 'isa-rs']
+                },
             }
         },
 
@@ -2,6 +2,7 @@
 #include "coder.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,12 +13,24 @@
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
 #include "../third_party/cm256/cm256.h"
 #include "../third_party/isa-l/include/erasure_code.h"
+#include "../util/aes_gcm.h"
 #include "../util/b64.h"
+#include "../util/buf_pool.h"
 #include "../util/common.h"
+#include "../util/lz4.h"
+#include "../util/mb_digest.h"
+#include "../util/mutex.h"
 #include "../util/snappy.h"
 #include "../util/zlib.h"
+#include "../util/zstd.h"
 
 namespace noobaa
 {
@@ -27,23 +40,86 @@ namespace noobaa
 #define MAX_TOTAL_FRAGS (MAX_DATA_FRAGS + MAX_PARITY_FRAGS)
 #define MAX_MATRIX_SIZE (MAX_DATA_FRAGS * MAX_TOTAL_FRAGS)
 
-// for now just ignore the auth tag to save performance
-// our chunk digest is already covering for data integrity
-#define USE_GCM_AUTH_TAG false
+// bounds the number of (parity_type, k, m, erasures) table sets kept by the coder.
+// every entry takes up to 32 * k * (m - k) bytes so the worst case is about 8 MB
+#define EC_TABLES_CACHE_SIZE 256
+
+// the encoder runs the chunk digest, cipher and frag digests over the data in tiles of this size.
+// erasure coding is tiled by columns of every frag, so its working set is multiplied by k+m.
+#define ENCODE_TILE_SIZE (64 * 1024)
+#define ENCODE_EC_TILE_SIZE (16 * 1024)
+
+// the compress probe estimates the order-0 entropy of the chunk from evenly spaced samples
+// and skips compression of chunks that are already compressed or encrypted.
+// smaller chunks are always compressed since the estimate would not be reliable (nor worth it).
+#define COMPRESS_PROBE_SAMPLES 16
+#define COMPRESS_PROBE_SAMPLE_SIZE 256
+#define COMPRESS_PROBE_MIN_SIZE (16 * 1024)
+
+// running digests of the encoder, see _nb_encode()
+struct NB_Encode_Digests {
+    const EVP_MD* md;
+    const EVP_MD* md_frag;
+    // the chunk digest while it is pending on the data stream
+    // and the number of bytes it still covers (padding is excluded)
+    EVP_MD_CTX* chunk_ctx;
+    int chunk_left;
+    // frag digests are finalized by the stage that completes the frag block
+    EVP_MD_CTX** frags_ctx;
+    int frags_count;
+};
+
+// the cipher of a chunk - the isa-l aes-gcm kernels when the cpu has them,
+// otherwise EVP (e.g. aes-256-ctr) on a context that the thread reuses for all its chunks.
+// only a provided key (which comes with an iv) is kept in the thread context for the next chunks,
+// a random chunk key is never used again, so _nb_cipher_done() wipes it with its schedule.
+struct NB_Chunk_Cipher {
+    struct NB_Aes_Gcm* gcm;
+    EVP_CIPHER_CTX* evp;
+    bool encrypt;
+    bool keep_key;
+};
 
 static void _nb_encode(struct NB_Coder_Chunk* chunk);
-static void _nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher);
-static void _nb_no_encrypt(struct NB_Coder_Chunk* chunk);
-static void _nb_erasure(struct NB_Coder_Chunk* chunk);
+static void _nb_encrypt(
+    struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher, struct NB_Encode_Digests* digests);
+static void _nb_no_encrypt(struct NB_Coder_Chunk* chunk, struct NB_Encode_Digests* digests);
+static void _nb_erasure(struct NB_Coder_Chunk* chunk, struct NB_Encode_Digests* digests);
+static void _nb_lrc_erasure(struct NB_Coder_Chunk* chunk);
 
 static void _nb_decode(struct NB_Coder_Chunk* chunk);
 static void
 _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int total_frags);
-static void _nb_decrypt(
+static void _nb_lrc_derasure(
+    struct NB_Coder_Chunk* chunk,
+    struct NB_Coder_Frag** frags_map,
+    int* p_num_avail_data_frags,
+    int* p_num_avail_parity_frags);
+static bool _nb_decrypt(
     struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, const EVP_CIPHER* evp_cipher);
 static void _nb_no_decrypt(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map);
 
+static const EVP_CIPHER* _nb_cipher_by_name(const char* name);
+static bool _nb_cipher_init(
+    struct NB_Chunk_Cipher* cipher,
+    const EVP_CIPHER* evp_cipher,
+    const uint8_t* key,
+    const uint8_t* iv,
+    bool encrypt,
+    bool keep_key);
+static bool
+_nb_cipher_update(struct NB_Chunk_Cipher* cipher, uint8_t* out, const uint8_t* in, int len);
+static bool _nb_cipher_final(struct NB_Chunk_Cipher* cipher, uint8_t* tag, int tag_len);
+static void _nb_cipher_done(struct NB_Chunk_Cipher* cipher);
+
 static void _nb_digest(const EVP_MD* md, struct NB_Bufs* bufs, struct NB_Buf* digest);
+static EVP_MD_CTX* _nb_digest_init(const EVP_MD* md);
+static void _nb_digest_final(
+    const EVP_MD* md, EVP_MD_CTX* ctx, struct NB_Buf* digest, struct NB_Arena* arena);
+static void _nb_digest_tap(void* arg, const uint8_t* data, int len);
+static int _nb_frags_mb_digest_nid(const EVP_MD* md, int frags_count);
+static void _nb_frags_mb_digest(
+    int nid, struct NB_Coder_Frag* frags, struct NB_Buf* digests, int count);
 static bool _nb_digest_match(const EVP_MD* md, struct NB_Bufs* data, struct NB_Buf* digest);
 
 static inline int
@@ -58,6 +134,223 @@ _nb_align_up(int n, int align)
     return _nb_div_up(n, align) * align;
 }
 
+static inline void
+_nb_encode_digest_chunk(struct NB_Encode_Digests* digests, const uint8_t* data, int len)
+{
+    if (!digests->chunk_ctx) return;
+    if (len > digests->chunk_left) len = digests->chunk_left;
+    if (len <= 0) return;
+    EVP_DigestUpdate(digests->chunk_ctx, data, len);
+    digests->chunk_left -= len;
+}
+
+static inline void
+_nb_encode_digest_frag(struct NB_Encode_Digests* digests, int i, const uint8_t* data, int len)
+{
+    if (!digests->frags_ctx) return;
+    EVP_DigestUpdate(digests->frags_ctx[i], data, len);
+}
+
+static inline void
+_nb_encode_digest_frag_final(
+    struct NB_Encode_Digests* digests, struct NB_Coder_Chunk* chunk, int i)
+{
+    if (!digests->frags_ctx || !digests->frags_ctx[i]) return;
+    _nb_digest_final(
+        digests->md_frag, digests->frags_ctx[i], &chunk->frags[i].digest, &chunk->arena);
+    digests->frags_ctx[i] = 0;
+}
+
+/**
+ * ECTablesCache keeps the isa-l expanded tables of encode and decode matrices.
+ * Generating the matrix, inverting it and expanding the tables costs more than
+ * the actual encoding of small chunks, and there are very few distinct configs
+ * and erasure patterns, so the tables are shared by all the coder threads.
+ */
+class ECTablesCache
+{
+public:
+    struct Key {
+        NB_Parity_Type parity_type;
+        int k;
+        int m;
+        // bit i is set when row i of the m rows is not available (0 for encode)
+        uint64_t erasures;
+        bool operator==(const Key& o) const
+        {
+            return parity_type == o.parity_type && k == o.k && m == o.m && erasures == o.erasures;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<uint64_t>()(key.erasures) ^
+                (((size_t)key.parity_type << 16) | ((size_t)key.k << 8) | (size_t)key.m);
+        }
+    };
+
+    struct Tables {
+        // false when the decode matrix is not invertible
+        bool ok;
+        // number of output rows the table produces
+        // for decode these are the missing data rows listed in out_index
+        int out_len;
+        uint8_t out_index[MAX_TOTAL_FRAGS];
+        uint8_t table[1];
+    };
+
+    typedef std::shared_ptr<const Tables> TablesPtr;
+
+    TablesPtr get(const Key& key);
+    void stats(struct NB_Coder_Stats* stats);
+
+private:
+    typedef std::list<Key> LRU;
+    typedef std::unordered_map<Key, std::pair<TablesPtr, LRU::iterator>, KeyHash> Map;
+    Mutex _mutex;
+    Map _map;
+    LRU _lru;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+
+    static TablesPtr _make_tables(const Key& key);
+};
+
+static ECTablesCache _ec_tables_cache;
+
+// percent of expected compression gain below which the encoder leaves chunks uncompressed
+static std::atomic<int> _compress_min_gain(0);
+static std::atomic<uint64_t> _compress_probes(0);
+static std::atomic<uint64_t> _compress_skips(0);
+static std::atomic<uint64_t> _compress_skipped_bytes(0);
+
+// gcm chunks are encoded with an auth tag that the decoder verifies in the decryption pass
+// instead of the separate pass of the chunk digest. chunks without a tag still use the digest.
+static std::atomic<bool> _gcm_auth_tag(false);
+static std::atomic<uint64_t> _auth_tags(0);
+static std::atomic<uint64_t> _auth_tags_verified(0);
+static std::atomic<uint64_t> _digest_skips(0);
+
+ECTablesCache::TablesPtr
+ECTablesCache::get(const Key& key)
+{
+    {
+        Mutex::Lock lock(_mutex);
+        auto it = _map.find(key);
+        if (it != _map.end()) {
+            _hits++;
+            _lru.splice(_lru.begin(), _lru, it->second.second);
+            return it->second.first;
+        }
+        _misses++;
+    }
+
+    // computing outside the lock - concurrent misses on the same key
+    // might compute it more than once, but only the first one is kept
+    TablesPtr tables = _make_tables(key);
+
+    Mutex::Lock lock(_mutex);
+    auto it = _map.find(key);
+    if (it != _map.end()) return it->second.first;
+    _lru.push_front(key);
+    _map.emplace(key, std::make_pair(tables, _lru.begin()));
+    while (_map.size() > EC_TABLES_CACHE_SIZE) {
+        _map.erase(_lru.back());
+        _lru.pop_back();
+        _evictions++;
+    }
+    return tables;
+}
+
+void
+ECTablesCache::stats(struct NB_Coder_Stats* stats)
+{
+    Mutex::Lock lock(_mutex);
+    stats->ec_tables_hits = _hits;
+    stats->ec_tables_misses = _misses;
+    stats->ec_tables_evictions = _evictions;
+    stats->ec_tables_size = _map.size();
+}
+
+ECTablesCache::TablesPtr
+ECTablesCache::_make_tables(const Key& key)
+{
+    const int k = key.k;
+    const int m = key.m;
+    uint8_t a[MAX_MATRIX_SIZE];
+    uint8_t b[MAX_MATRIX_SIZE];
+    uint8_t inv[MAX_MATRIX_SIZE];
+
+    Tables* t = (Tables*)nb_new_mem(sizeof(Tables) + (32 * k * (m - k)));
+    TablesPtr tables(t, [](const Tables* p) { nb_free((void*)p); });
+    t->ok = true;
+    t->out_len = 0;
+
+    if (key.parity_type == NB_Parity_Type::C1) {
+        gf_gen_cauchy1_matrix(a, m, k);
+    } else {
+        gf_gen_rs_matrix(a, m, k);
+    }
+
+    if (!key.erasures) {
+        t->out_len = m - k;
+        ec_init_tables(k, m - k, &a[k * k], t->table);
+        return tables;
+    }
+
+    // select the first k available rows, collecting the missing data rows on the way.
+    // this must match the order of buffers selected by _nb_ec_select_available_fragments()
+    for (int i = 0, r = 0; i < k; ++i, ++r) {
+        while (r < m && (key.erasures & (1ULL << r))) {
+            if (r < k) t->out_index[t->out_len++] = r;
+            ++r;
+        }
+        if (r >= m) {
+            t->ok = false;
+            return tables;
+        }
+        memcpy(&b[k * i], &a[k * r], k);
+    }
+    if (gf_invert_matrix(b, inv, k) < 0) {
+        t->ok = false;
+        return tables;
+    }
+    // select rows of missing data fragments
+    for (int i = 0; i < t->out_len; ++i) {
+        memcpy(&b[k * i], &inv[k * t->out_index[i]], k);
+    }
+    ec_init_tables(k, t->out_len, b, t->table);
+    return tables;
+}
+
+static NB_Parity_Type
+_nb_parse_parity_type(const char* parity_type)
+{
+    if (strcmp(parity_type, "isa-c1") == 0) {
+        return NB_Parity_Type::C1;
+    } else if (strcmp(parity_type, "isa-rs") == 0) {
+        return NB_Parity_Type::RS;
+    } else if (strcmp(parity_type, "cm256") == 0) {
+        return NB_Parity_Type::CM;
+    } else {
+        return NB_Parity_Type::NONE;
+    }
+}
+
+// local groups are coded with the isa-l matrices, cauchy unless lrc_type says otherwise
+static NB_Parity_Type
+_nb_parse_lrc_type(const char* lrc_type)
+{
+    if (!lrc_type[0]) return NB_Parity_Type::C1;
+    const NB_Parity_Type lrc_parity_type = _nb_parse_parity_type(lrc_type);
+    if (lrc_parity_type == NB_Parity_Type::C1 || lrc_parity_type == NB_Parity_Type::RS) {
+        return lrc_parity_type;
+    }
+    return NB_Parity_Type::NONE;
+}
+
 void
 nb_chunk_coder_init()
 {
@@ -72,6 +365,43 @@ nb_chunk_coder_init()
 #endif
 }
 
+void
+nb_chunk_coder_stats(struct NB_Coder_Stats* stats)
+{
+    _ec_tables_cache.stats(stats);
+    stats->ec_tables_capacity = EC_TABLES_CACHE_SIZE;
+    stats->compress_probes = _compress_probes;
+    stats->compress_skips = _compress_skips;
+    stats->compress_skipped_bytes = _compress_skipped_bytes;
+    stats->auth_tags = _auth_tags;
+    stats->auth_tags_verified = _auth_tags_verified;
+    stats->digest_skips = _digest_skips;
+}
+
+void
+nb_chunk_coder_set_compress_min_gain(int percent)
+{
+    _compress_min_gain = percent;
+}
+
+int
+nb_chunk_coder_get_compress_min_gain()
+{
+    return _compress_min_gain;
+}
+
+void
+nb_chunk_coder_set_gcm_auth_tag(bool enabled)
+{
+    _gcm_auth_tag = enabled;
+}
+
+bool
+nb_chunk_coder_get_gcm_auth_tag()
+{
+    return _gcm_auth_tag;
+}
+
 void
 nb_chunk_init(struct NB_Coder_Chunk* chunk)
 {
@@ -80,9 +410,11 @@ nb_chunk_init(struct NB_Coder_Chunk* chunk)
     chunk->compress_type[0] = 0;
     chunk->cipher_type[0] = 0;
     chunk->parity_type[0] = 0;
+    chunk->lrc_type[0] = 0;
 
-    nb_bufs_init(&chunk->data);
-    nb_bufs_init(&chunk->errors);
+    nb_arena_init(&chunk->arena);
+    nb_bufs_init_arena(&chunk->data, &chunk->arena);
+    nb_bufs_init_arena(&chunk->errors, &chunk->arena);
     nb_buf_init(&chunk->digest);
     nb_buf_init(&chunk->cipher_key);
     nb_buf_init(&chunk->cipher_iv);
@@ -92,6 +424,8 @@ nb_chunk_init(struct NB_Coder_Chunk* chunk)
     chunk->coder = NB_Coder_Type::ENCODER;
     chunk->size = 0;
     chunk->compress_size = 0;
+    chunk->compress_level = 0;
+    chunk->compress_dict_id = 0;
     chunk->data_frags = 1;
     chunk->parity_frags = 0;
     chunk->lrc_group = 0;
@@ -114,8 +448,10 @@ nb_chunk_free(struct NB_Coder_Chunk* chunk)
             struct NB_Coder_Frag* f = chunk->frags + i;
             nb_frag_free(f);
         }
-        nb_free(chunk->frags);
     }
+
+    // last since everything above might use the arena memory
+    nb_arena_free(&chunk->arena);
 }
 
 void
@@ -142,9 +478,9 @@ nb_chunk_error(struct NB_Coder_Chunk* chunk, const char* fmt, ...)
 }
 
 void
-nb_frag_init(struct NB_Coder_Frag* f)
+nb_frag_init(struct NB_Coder_Frag* f, struct NB_Arena* arena)
 {
-    nb_bufs_init(&f->block);
+    nb_bufs_init_arena(&f->block, arena);
     nb_buf_init(&f->digest);
     f->data_index = -1;
     f->parity_index = -1;
@@ -158,6 +494,59 @@ nb_frag_free(struct NB_Coder_Frag* f)
     nb_buf_free(&f->digest);
 }
 
+/**
+ * Estimates the gain of compressing the chunk from the byte histogram of a few samples
+ * and returns true when it is not worth compressing. order-0 entropy does not see repeated
+ * strings, so it can only miss gains on high entropy data, which is rare in practice.
+ */
+static bool
+_nb_compress_probe_skip(struct NB_Coder_Chunk* chunk)
+{
+    const int min_gain = _compress_min_gain;
+    if (min_gain <= 0 || chunk->data.len < COMPRESS_PROBE_MIN_SIZE) return false;
+
+    uint32_t hist[256] = { 0 };
+    const int stride = chunk->data.len / COMPRESS_PROBE_SAMPLES;
+    int n = 0;
+    int index = 0;
+    int base = 0; // data offset of bufs[index]
+    for (int i = 0; i < COMPRESS_PROBE_SAMPLES; ++i) {
+        int pos = i * stride;
+        int left = COMPRESS_PROBE_SAMPLE_SIZE;
+        while (left > 0 && index < chunk->data.count) {
+            struct NB_Buf* b = nb_bufs_get(&chunk->data, index);
+            if (pos >= base + b->len) {
+                base += b->len;
+                index++;
+                continue;
+            }
+            const uint8_t* p = b->data + (pos - base);
+            const int len = std::min(left, base + b->len - pos);
+            for (int j = 0; j < len; ++j) {
+                hist[p[j]]++;
+            }
+            n += len;
+            pos += len;
+            left -= len;
+        }
+    }
+
+    // entropy in bits per byte, the compressed size is at best entropy/8 of the input
+    double sum = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (hist[i]) sum += hist[i] * log2(hist[i]);
+    }
+    const double entropy = log2(n) - sum / n;
+    const bool skip = (8 - entropy) * 100 < min_gain * 8;
+
+    _compress_probes++;
+    if (skip) {
+        _compress_skips++;
+        _compress_skipped_bytes += chunk->data.len;
+    }
+    return skip;
+}
+
 static void
 _nb_encode(struct NB_Coder_Chunk* chunk)
 {
@@ -183,7 +572,7 @@ _nb_encode(struct NB_Coder_Chunk* chunk)
     }
 
     if (chunk->cipher_type[0]) {
-        evp_cipher = EVP_get_cipherbyname(chunk->cipher_type);
+        evp_cipher = _nb_cipher_by_name(chunk->cipher_type);
         if (!evp_cipher) {
             nb_chunk_error(chunk, "Chunk Encoder: unsupported cipher type %s", chunk->cipher_type);
             return;
@@ -208,21 +597,78 @@ _nb_encode(struct NB_Coder_Chunk* chunk)
         return;
     }
 
-    if (evp_md) {
-        _nb_digest(evp_md, &chunk->data, &chunk->digest);
-    }
+    // the digests are computed by the stages that stream the data - the chunk digest by
+    // the compressor tap or by the cipher/split stage, and the frag digests by the stage
+    // that writes the frag blocks. compression and the cipher/split stage are still a pass
+    // each over the chunk - the frag size is the compressed size / data_frags, so the cipher
+    // cannot write into the frag blocks before the compressor finished.
+    // measured with 4MB chunks this is on par with a digest pass per stage, not faster.
+    struct NB_Encode_Digests digests;
+    digests.md = evp_md;
+    digests.md_frag = evp_md_frag;
+    digests.chunk_ctx = evp_md ? _nb_digest_init(evp_md) : 0;
+    digests.chunk_left = chunk->size;
+    digests.frags_ctx = 0;
+    digests.frags_count = 0;
+
+    StackCleaner cleaner([&] {
+        EVP_MD_CTX_free(digests.chunk_ctx);
+        if (digests.frags_ctx) {
+            for (int i = 0; i < digests.frags_count; ++i) {
+                EVP_MD_CTX_free(digests.frags_ctx[i]);
+            }
+        }
+    });
 
+    chunk->compress_size = 0;
+    if (chunk->compress_dict_id && strcmp(chunk->compress_type, "zstd") != 0) {
+        nb_chunk_error(
+            chunk, "Chunk Encoder: compress dict is not supported by compress type %s", chunk->compress_type);
+        return;
+    }
     if (chunk->compress_type[0]) {
+        NB_Bufs_Tap tap = digests.chunk_ctx ? _nb_digest_tap : 0;
+        // chunks skipped by the probe are stored uncompressed in the frame format of the
+        // compress type, so every reader of that type (including older ones) decodes them
+        const bool store = _nb_compress_probe_skip(chunk);
         if (strcmp(chunk->compress_type, "snappy") == 0) {
-            if (nb_snappy_compress(&chunk->data, &chunk->errors)) return;
+            if (store ? nb_snappy_store(&chunk->data, &chunk->errors, tap, digests.chunk_ctx)
+                      : nb_snappy_compress(&chunk->data, &chunk->errors, tap, digests.chunk_ctx)) {
+                return;
+            }
         } else if (strcmp(chunk->compress_type, "zlib") == 0) {
-            if (nb_zlib_compress(&chunk->data, &chunk->errors)) return;
+            if (store ? nb_zlib_store(&chunk->data, &chunk->errors, tap, digests.chunk_ctx)
+                      : nb_zlib_compress(
+                            &chunk->data, chunk->compress_level, &chunk->errors, tap, digests.chunk_ctx)) {
+                return;
+            }
+        } else if (strcmp(chunk->compress_type, "zstd") == 0) {
+            if (store ? nb_zstd_store(&chunk->data, &chunk->errors, tap, digests.chunk_ctx)
+                      : nb_zstd_compress(
+                            &chunk->data,
+                            chunk->compress_level,
+                            chunk->compress_dict_id,
+                            &chunk->errors,
+                            tap,
+                            digests.chunk_ctx)) {
+                return;
+            }
+        } else if (strcmp(chunk->compress_type, "lz4") == 0) {
+            if (store ? nb_lz4_store(&chunk->data, &chunk->errors, tap, digests.chunk_ctx)
+                      : nb_lz4_compress(
+                            &chunk->data, chunk->compress_level, &chunk->errors, tap, digests.chunk_ctx)) {
+                return;
+            }
         } else {
             nb_chunk_error(
                 chunk, "Chunk Encoder: unsupported compress type %s", chunk->compress_type);
             return;
         }
         chunk->compress_size = chunk->data.len;
+        if (digests.chunk_ctx) {
+            _nb_digest_final(evp_md, digests.chunk_ctx, &chunk->digest, &chunk->arena);
+            digests.chunk_ctx = 0;
+        }
     }
 
     const int lrc_groups =
@@ -240,10 +686,10 @@ _nb_encode(struct NB_Coder_Chunk* chunk)
     // init frags
     chunk->frag_size = chunk->data.len / chunk->data_frags;
     chunk->frags_count = total_frags;
-    chunk->frags = nb_new_arr(total_frags, struct NB_Coder_Frag);
+    chunk->frags = nb_arena_new_arr(&chunk->arena, total_frags, struct NB_Coder_Frag);
     for (int i = 0; i < chunk->frags_count; ++i) {
         struct NB_Coder_Frag* f = chunk->frags + i;
-        nb_frag_init(f);
+        nb_frag_init(f, &chunk->arena);
         if (i < chunk->data_frags) {
             f->data_index = i;
         } else if (i < chunk->data_frags + chunk->parity_frags) {
@@ -253,41 +699,75 @@ _nb_encode(struct NB_Coder_Chunk* chunk)
         }
     }
 
+    // frags are hashed together in the multi-buffer lanes once they are all complete
+    // which beats streaming them one by one. otherwise fallback to the tiled EVP digests.
+    const int mb_frag_nid = _nb_frags_mb_digest_nid(evp_md_frag, total_frags);
+
+    if (evp_md_frag && !mb_frag_nid) {
+        digests.frags_ctx = nb_arena_new_arr(&chunk->arena, total_frags, EVP_MD_CTX*);
+        digests.frags_count = total_frags;
+        for (int i = 0; i < total_frags; ++i) {
+            digests.frags_ctx[i] = _nb_digest_init(evp_md_frag);
+        }
+    }
+
     if (evp_cipher) {
-        _nb_encrypt(chunk, evp_cipher);
+        _nb_encrypt(chunk, evp_cipher, &digests);
     } else {
-        _nb_no_encrypt(chunk);
+        _nb_no_encrypt(chunk, &digests);
     }
 
     if (chunk->errors.count) return;
 
+    if (digests.chunk_ctx) {
+        assert(!digests.chunk_left);
+        _nb_digest_final(evp_md, digests.chunk_ctx, &chunk->digest, &chunk->arena);
+        digests.chunk_ctx = 0;
+    }
+
     if (chunk->parity_type[0]) {
-        _nb_erasure(chunk);
+        _nb_erasure(chunk, &digests);
     }
 
     if (chunk->errors.count) return;
 
-    if (evp_md_frag) {
+    if (lrc_total_frags > 0) {
+        _nb_lrc_erasure(chunk);
+    }
+
+    if (chunk->errors.count) return;
+
+    if (mb_frag_nid) {
+        _nb_frags_mb_digest(mb_frag_nid, chunk->frags, 0, chunk->frags_count);
+
+    // digest the frags that were not streamed by a tiled stage (cm256 and lrc parity)
+    } else if (evp_md_frag) {
         for (int i = 0; i < chunk->frags_count; ++i) {
             struct NB_Coder_Frag* f = chunk->frags + i;
-            _nb_digest(evp_md_frag, &f->block, &f->digest);
+            if (!digests.frags_ctx[i]) continue;
+            for (int j = 0; j < f->block.count; ++j) {
+                struct NB_Buf* b = nb_bufs_get(&f->block, j);
+                _nb_encode_digest_frag(&digests, i, b->data, b->len);
+            }
+            _nb_encode_digest_frag_final(&digests, chunk, i);
         }
     }
 }
 
 static void
-_nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher)
+_nb_encrypt(
+    struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher, struct NB_Encode_Digests* digests)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    struct NB_Chunk_Cipher cipher = {0, 0, true, false};
     struct NB_Buf iv;
-    int evp_ret = 0;
 
     // generate random cipher key
     // using iv of zeros since we generate random key per chunk
     const int key_len = EVP_CIPHER_key_length(evp_cipher);
     const int iv_len = EVP_CIPHER_iv_length(evp_cipher);
+    const bool key_provided = chunk->cipher_key.len > 0;
 
-    if (chunk->cipher_key.len) {
+    if (key_provided) {
         assert(chunk->cipher_key.len == key_len);
         if (chunk->cipher_iv.len) {
             // key provided iv provided => key=provided, iv=provided
@@ -296,7 +776,7 @@ _nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher)
         } else {
             // key provided iv not provided => key=provided, iv=random
             nb_buf_free(&chunk->cipher_iv);
-            nb_buf_init_alloc(&chunk->cipher_iv, iv_len);
+            nb_buf_init_arena(&chunk->cipher_iv, &chunk->arena, iv_len);
             RAND_bytes(chunk->cipher_iv.data, chunk->cipher_iv.len);
             nb_buf_init_shared(&iv, chunk->cipher_iv.data, chunk->cipher_iv.len);
         }
@@ -305,17 +785,16 @@ _nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher)
         nb_buf_init_zeros(&iv, iv_len);
         nb_buf_free(&chunk->cipher_iv);
         nb_buf_free(&chunk->cipher_key);
-        nb_buf_init_alloc(&chunk->cipher_key, key_len);
+        nb_buf_init_arena(&chunk->cipher_key, &chunk->arena, key_len);
         RAND_bytes(chunk->cipher_key.data, chunk->cipher_key.len);
     }
 
     StackCleaner cleaner([&] {
-        EVP_CIPHER_CTX_free(ctx);
+        _nb_cipher_done(&cipher);
         nb_buf_free(&iv);
     });
 
-    evp_ret = EVP_EncryptInit_ex(ctx, evp_cipher, NULL, chunk->cipher_key.data, iv.data);
-    if (!evp_ret) {
+    if (!_nb_cipher_init(&cipher, evp_cipher, chunk->cipher_key.data, iv.data, true, key_provided)) {
         nb_chunk_error(chunk, "Chunk Encoder: cipher encrypt init failed %s", chunk->cipher_type);
         return;
     }
@@ -323,7 +802,7 @@ _nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher)
     // allocate blocks for all data frags
     for (int i = 0; i < chunk->data_frags; ++i) {
         struct NB_Coder_Frag* f = chunk->frags + i;
-        nb_bufs_push_alloc(&f->block, chunk->frag_size);
+        nb_bufs_push_pooled(&f->block, chunk->frag_size);
     }
 
     int frag_pos = 0;
@@ -357,18 +836,21 @@ _nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher)
 
             const int needed = fb->len - frag_pos;
             const int avail = b->len - pos;
-            const int len = avail < needed ? avail : needed;
+            int len = avail < needed ? avail : needed;
+            if (len > ENCODE_TILE_SIZE) len = ENCODE_TILE_SIZE;
+
+            _nb_encode_digest_chunk(digests, b->data + pos, len);
 
-            int out_len = 0;
-            evp_ret = EVP_EncryptUpdate(ctx, fb->data + frag_pos, &out_len, b->data + pos, len);
-            if (!evp_ret) {
+            if (!_nb_cipher_update(&cipher, fb->data + frag_pos, b->data + pos, len)) {
                 nb_chunk_error(
                     chunk, "Chunk Encoder: cipher encrypt update failed %s", chunk->cipher_type);
                 return;
             }
 
+            _nb_encode_digest_frag(digests, f - chunk->frags, fb->data + frag_pos, len);
+
             pos += len;
-            frag_pos += out_len;
+            frag_pos += len;
         }
     }
 
@@ -389,29 +871,26 @@ _nb_encrypt(struct NB_Coder_Chunk* chunk, const EVP_CIPHER* evp_cipher)
         return;
     }
 
-    int out_len = 0;
-    evp_ret = EVP_EncryptFinal_ex(ctx, 0, &out_len);
-    if (!evp_ret) {
-        nb_chunk_error(chunk, "Chunk Encoder: cipher encrypt final failed %s", chunk->cipher_type);
-        return;
+    for (int i = 0; i < chunk->data_frags; ++i) {
+        _nb_encode_digest_frag_final(digests, chunk, i);
     }
-    assert(!out_len);
 
-    if (USE_GCM_AUTH_TAG && EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_GCM_MODE) {
-        nb_buf_free(&chunk->cipher_auth_tag);
-        nb_buf_init_alloc(&chunk->cipher_auth_tag, 16);
-        evp_ret = EVP_CIPHER_CTX_ctrl(
-            ctx, EVP_CTRL_GCM_GET_TAG, chunk->cipher_auth_tag.len, chunk->cipher_auth_tag.data);
-        if (!evp_ret) {
-            nb_chunk_error(
-                chunk, "Chunk Encoder: cipher encrypt get tag failed %s", chunk->cipher_type);
-            return;
-        }
+    uint8_t* tag = 0;
+    nb_buf_free(&chunk->cipher_auth_tag);
+    if (_gcm_auth_tag && EVP_CIPHER_mode(evp_cipher) == EVP_CIPH_GCM_MODE) {
+        nb_buf_init_arena(&chunk->cipher_auth_tag, &chunk->arena, NB_AES_GCM_TAG_LEN);
+        tag = chunk->cipher_auth_tag.data;
+    }
+
+    if (!_nb_cipher_final(&cipher, tag, tag ? NB_AES_GCM_TAG_LEN : 0)) {
+        nb_chunk_error(chunk, "Chunk Encoder: cipher encrypt final failed %s", chunk->cipher_type);
+        return;
     }
+    if (tag) _auth_tags++;
 }
 
 static void
-_nb_no_encrypt(struct NB_Coder_Chunk* chunk)
+_nb_no_encrypt(struct NB_Coder_Chunk* chunk, struct NB_Encode_Digests* digests)
 {
     struct NB_Coder_Frag* f = chunk->frags;
 
@@ -442,6 +921,13 @@ _nb_no_encrypt(struct NB_Coder_Chunk* chunk)
             const int len = avail < needed ? avail : needed;
 
             nb_bufs_push_shared(&f->block, b->data + pos, len);
+
+            for (int t = 0; t < len; t += ENCODE_TILE_SIZE) {
+                const int n = len - t < ENCODE_TILE_SIZE ? len - t : ENCODE_TILE_SIZE;
+                _nb_encode_digest_chunk(digests, b->data + pos + t, n);
+                _nb_encode_digest_frag(digests, f - chunk->frags, b->data + pos + t, n);
+            }
+
             pos += len;
         }
     }
@@ -462,23 +948,16 @@ _nb_no_encrypt(struct NB_Coder_Chunk* chunk)
             chunk->cipher_type);
         return;
     }
+
+    for (int i = 0; i < chunk->data_frags; ++i) {
+        _nb_encode_digest_frag_final(digests, chunk, i);
+    }
 }
 
 static void
-_nb_erasure(struct NB_Coder_Chunk* chunk)
+_nb_erasure(struct NB_Coder_Chunk* chunk, struct NB_Encode_Digests* digests)
 {
-    struct NB_Buf parity_buf;
-
-    NB_Parity_Type parity_type;
-    if (strcmp(chunk->parity_type, "isa-c1") == 0) {
-        parity_type = NB_Parity_Type::C1;
-    } else if (strcmp(chunk->parity_type, "isa-rs") == 0) {
-        parity_type = NB_Parity_Type::RS;
-    } else if (strcmp(chunk->parity_type, "cm256") == 0) {
-        parity_type = NB_Parity_Type::CM;
-    } else {
-        parity_type = NB_Parity_Type::NONE;
-    }
+    const NB_Parity_Type parity_type = _nb_parse_parity_type(chunk->parity_type);
 
     if (parity_type == NB_Parity_Type::NONE || chunk->parity_frags <= 0) return;
 
@@ -497,37 +976,39 @@ _nb_erasure(struct NB_Coder_Chunk* chunk)
         return;
     }
 
-    // allocate a single buffer for all the parity blocks
-    // the first parity fragment will become the owner of the entire allocation
-    // and the rest will share it
-    nb_buf_init_alloc(&parity_buf, chunk->parity_frags * chunk->frag_size);
+    // every parity block gets its own pooled buffer so that each one can be handed over
+    // to JS without a copy and recycled separately when released
     for (int i = 0; i < chunk->parity_frags; ++i) {
         struct NB_Coder_Frag* f = chunk->frags + chunk->data_frags + i;
-        if (i == 0) {
-            nb_bufs_push_owned(&f->block, parity_buf.data, chunk->frag_size);
-        } else {
-            nb_bufs_push_shared(
-                &f->block, parity_buf.data + (i * chunk->frag_size), chunk->frag_size);
-        }
+        nb_bufs_push_pooled(&f->block, chunk->frag_size);
     }
 
     if (parity_type == NB_Parity_Type::C1 || parity_type == NB_Parity_Type::RS) {
-        uint8_t ec_matrix_encode[MAX_MATRIX_SIZE];
-        uint8_t ec_table[MAX_MATRIX_SIZE * 32];
         uint8_t* ec_blocks[MAX_TOTAL_FRAGS];
+        uint8_t* tile_blocks[MAX_TOTAL_FRAGS];
         const int k = chunk->data_frags;
         const int m = chunk->data_frags + chunk->parity_frags;
         for (int i = 0; i < m; ++i) {
             struct NB_Coder_Frag* f = chunk->frags + i;
             ec_blocks[i] = nb_bufs_merge(&f->block, 0);
         }
-        if (parity_type == NB_Parity_Type::C1) {
-            gf_gen_cauchy1_matrix(ec_matrix_encode, m, k);
-        } else {
-            gf_gen_rs_matrix(ec_matrix_encode, m, k);
+        auto tables = _ec_tables_cache.get({ parity_type, k, m, 0 });
+        // encode by column tiles and digest each parity tile while it is hot
+        for (int off = 0; off < chunk->frag_size; off += ENCODE_EC_TILE_SIZE) {
+            const int len = chunk->frag_size - off < ENCODE_EC_TILE_SIZE
+                ? chunk->frag_size - off
+                : ENCODE_EC_TILE_SIZE;
+            for (int i = 0; i < m; ++i) {
+                tile_blocks[i] = ec_blocks[i] + off;
+            }
+            ec_encode_data(len, k, m - k, (uint8_t*)tables->table, tile_blocks, &tile_blocks[k]);
+            for (int i = k; i < m; ++i) {
+                _nb_encode_digest_frag(digests, i, tile_blocks[i], len);
+            }
+        }
+        for (int i = k; i < m; ++i) {
+            _nb_encode_digest_frag_final(digests, chunk, i);
         }
-        ec_init_tables(k, m - k, &ec_matrix_encode[k * k], ec_table);
-        ec_encode_data(chunk->frag_size, k, m - k, ec_table, ec_blocks, &ec_blocks[k]);
     } else if (parity_type == NB_Parity_Type::CM) {
         cm256_encoder_params cm_params;
         cm256_block cm_blocks[MAX_DATA_FRAGS];
@@ -539,7 +1020,15 @@ _nb_erasure(struct NB_Coder_Chunk* chunk)
             cm_blocks[i].Index = i;
             cm_blocks[i].Block = nb_bufs_merge(&f->block, 0);
         }
-        int encode_err = cm256_encode(cm_params, cm_blocks, parity_buf.data);
+        // cm256_encode_block does not validate its params, so check them the same way
+        // cm256_encode does and report with its error codes
+        int encode_err = 0;
+        if (cm_params.OriginalCount <= 0 || cm_params.RecoveryCount <= 0 ||
+            cm_params.BlockBytes <= 0) {
+            encode_err = -1;
+        } else if (cm_params.OriginalCount + cm_params.RecoveryCount > 256) {
+            encode_err = -2;
+        }
         if (encode_err) {
             nb_chunk_error(
                 chunk,
@@ -555,6 +1044,78 @@ _nb_erasure(struct NB_Coder_Chunk* chunk)
                 chunk->parity_frags);
             return;
         }
+        for (int i = 0; i < chunk->parity_frags; ++i) {
+            struct NB_Coder_Frag* f = chunk->frags + chunk->data_frags + i;
+            cm256_encode_block(
+                cm_params, cm_blocks, chunk->data_frags + i, nb_bufs_get(&f->block, 0)->data);
+        }
+    }
+}
+
+static void
+_nb_lrc_erasure(struct NB_Coder_Chunk* chunk)
+{
+    const int lrc_groups = (chunk->data_frags + chunk->parity_frags) / chunk->lrc_group;
+    const int lrc_start = chunk->data_frags + chunk->parity_frags;
+    const int k = chunk->lrc_group;
+    const int m = chunk->lrc_group + chunk->lrc_frags;
+    const NB_Parity_Type lrc_type = _nb_parse_lrc_type(chunk->lrc_type);
+
+    if (lrc_type == NB_Parity_Type::NONE) {
+        nb_chunk_error(chunk, "Chunk Encoder: unsupported lrc type %s", chunk->lrc_type);
+        return;
+    }
+
+    if (k > MAX_DATA_FRAGS || chunk->lrc_frags > MAX_PARITY_FRAGS) {
+        nb_chunk_error(
+            chunk,
+            "Chunk Encoder: lrc above hardcoded limits"
+            " lrc_group %i"
+            " MAX_DATA_FRAGS %i"
+            " lrc_frags %i"
+            " MAX_PARITY_FRAGS %i",
+            k,
+            MAX_DATA_FRAGS,
+            chunk->lrc_frags,
+            MAX_PARITY_FRAGS);
+        return;
+    }
+
+    // local groups span global parity frags too (see data_chunk_schema)
+    // so the global parity must have been computed before we get here
+    for (int i = 0; i < lrc_groups * k; ++i) {
+        struct NB_Coder_Frag* f = chunk->frags + i;
+        if (f->block.len != chunk->frag_size) {
+            nb_chunk_error(
+                chunk,
+                "Chunk Encoder: lrc group missing source frag %i parity_type %s",
+                i,
+                chunk->parity_type);
+            return;
+        }
+    }
+
+    // pooled blocks for the lrc frags like we do for global parity
+    for (int i = 0; i < lrc_groups * chunk->lrc_frags; ++i) {
+        struct NB_Coder_Frag* f = chunk->frags + lrc_start + i;
+        nb_bufs_push_pooled(&f->block, chunk->frag_size);
+    }
+
+    // every group is encoded with the same matrix - cauchy (the default) is MDS for any size,
+    // so each group can locally repair up to lrc_frags missing frags.
+    uint8_t* ec_blocks[MAX_DATA_FRAGS];
+    uint8_t* lrc_blocks[MAX_PARITY_FRAGS];
+    auto tables = _ec_tables_cache.get({ lrc_type, k, m, 0 });
+    for (int g = 0; g < lrc_groups; ++g) {
+        for (int i = 0; i < k; ++i) {
+            struct NB_Coder_Frag* f = chunk->frags + (g * k) + i;
+            ec_blocks[i] = nb_bufs_merge(&f->block, 0);
+        }
+        for (int i = 0; i < m - k; ++i) {
+            struct NB_Coder_Frag* f = chunk->frags + lrc_start + (g * chunk->lrc_frags) + i;
+            lrc_blocks[i] = nb_bufs_merge(&f->block, 0);
+        }
+        ec_encode_data(chunk->frag_size, k, m - k, (uint8_t*)tables->table, ec_blocks, lrc_blocks);
     }
 }
 
@@ -565,10 +1126,7 @@ _nb_decode(struct NB_Coder_Chunk* chunk)
     const EVP_MD* evp_md_frag = 0;
     const EVP_CIPHER* evp_cipher = 0;
     struct NB_Coder_Frag** frags_map = 0;
-
-    StackCleaner cleaner([&] {
-        if (frags_map) nb_free(frags_map);
-    });
+    bool authenticated = false;
 
     if (chunk->digest_type[0]) {
         evp_md = EVP_get_digestbyname(chunk->digest_type);
@@ -588,7 +1146,7 @@ _nb_decode(struct NB_Coder_Chunk* chunk)
     }
 
     if (chunk->cipher_type[0]) {
-        evp_cipher = EVP_get_cipherbyname(chunk->cipher_type);
+        evp_cipher = _nb_cipher_by_name(chunk->cipher_type);
         if (!evp_cipher) {
             nb_chunk_error(chunk, "Chunk Decoder: unsupported cipher type %s", chunk->cipher_type);
             return;
@@ -621,14 +1179,14 @@ _nb_decode(struct NB_Coder_Chunk* chunk)
         return;
     }
 
-    frags_map = nb_new_arr(total_frags, struct NB_Coder_Frag*);
+    frags_map = nb_arena_new_arr(&chunk->arena, total_frags, struct NB_Coder_Frag*);
 
     _nb_derasure(chunk, frags_map, total_frags);
 
     if (chunk->errors.count) return;
 
     if (evp_cipher) {
-        _nb_decrypt(chunk, frags_map, evp_cipher);
+        authenticated = _nb_decrypt(chunk, frags_map, evp_cipher);
     } else {
         _nb_no_decrypt(chunk, frags_map);
     }
@@ -646,11 +1204,18 @@ _nb_decode(struct NB_Coder_Chunk* chunk)
 
     nb_bufs_truncate(&chunk->data, decrypted_size);
 
-    if (chunk->compress_type[0]) {
-        if (strcmp(chunk->compress_type, "snappy") == 0) {
+    if (chunk->compress_type[0] && chunk->compress_size > 0) {
+        if (chunk->compress_dict_id && strcmp(chunk->compress_type, "zstd") != 0) {
+            nb_chunk_error(
+                chunk, "Chunk Decoder: compress dict is not supported by compress type %s", chunk->compress_type);
+        } else if (strcmp(chunk->compress_type, "snappy") == 0) {
             nb_snappy_uncompress(&chunk->data, &chunk->errors);
         } else if (strcmp(chunk->compress_type, "zlib") == 0) {
             nb_zlib_uncompress(&chunk->data, chunk->size, &chunk->errors);
+        } else if (strcmp(chunk->compress_type, "zstd") == 0) {
+            nb_zstd_uncompress(&chunk->data, chunk->size, chunk->compress_dict_id, &chunk->errors);
+        } else if (strcmp(chunk->compress_type, "lz4") == 0) {
+            nb_lz4_uncompress(&chunk->data, chunk->size, &chunk->errors);
         } else {
             nb_chunk_error(
                 chunk, "Chunk Decoder: unsupported compress type %s", chunk->compress_type);
@@ -665,41 +1230,40 @@ _nb_decode(struct NB_Coder_Chunk* chunk)
         return;
     }
 
-    // check that chunk data digest matches the digest computed during encoding
-    if (evp_md) {
+    // check that chunk data digest matches the digest computed during encoding.
+    // data that the gcm tag authenticated is already verified - the decompression and
+    // the size check above are deterministic so the digest pass would only repeat it.
+    if (evp_md && authenticated) {
+        _digest_skips++;
+    } else if (evp_md) {
         if (!_nb_digest_match(evp_md, &chunk->data, &chunk->digest)) {
             nb_chunk_error(chunk, "Chunk Decoder: chunk digest mismatch %s", chunk->digest_type);
         }
     }
 }
 
+static uint64_t
+_nb_ec_erasures(struct NB_Coder_Frag** frags_map, int m)
+{
+    uint64_t erasures = 0;
+    for (int r = 0; r < m; ++r) {
+        if (!frags_map[r]) erasures |= 1ULL << r;
+    }
+    return erasures;
+}
+
 static void
 _nb_ec_select_available_fragments(
-    struct NB_Coder_Frag** frags_map,
-    int k,
-    int m,
-    uint8_t* a,
-    uint8_t* b,
-    uint8_t* out_index,
-    int* p_out_len,
-    uint8_t** in_bufs)
+    struct NB_Coder_Frag** frags_map, int k, int m, uint8_t** in_bufs)
 {
-    int out_len = 0;
     for (int i = 0, r = 0; i < k; ++i, ++r) {
         assert(r >= 0 && r < m);
         while (!frags_map[r]) {
-            if (r < k) {
-                // decoding only data fragments
-                out_index[out_len] = r;
-                ++out_len;
-            }
             ++r;
             assert(r >= 0 && r < m);
         }
         in_bufs[i] = nb_bufs_merge(&frags_map[r]->block, 0);
-        memcpy(&b[k * i], &a[k * r], k);
     }
-    *p_out_len = out_len;
 }
 
 static void
@@ -721,7 +1285,7 @@ _nb_ec_update_decoded_fragments(
         struct NB_Coder_Frag* f = frags_map[r];
         f->data_index = j;
         nb_bufs_free(&f->block);
-        nb_bufs_init(&f->block);
+        nb_bufs_init_arena(&f->block, f->block.arena);
         nb_bufs_push_owned(&f->block, out_bufs[i], frag_size);
         frags_map[r] = 0;
         frags_map[j] = f;
@@ -735,16 +1299,7 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
     int num_avail_data_frags = 0;
     int num_avail_parity_frags = 0;
 
-    NB_Parity_Type parity_type;
-    if (strcmp(chunk->parity_type, "isa-c1") == 0) {
-        parity_type = NB_Parity_Type::C1;
-    } else if (strcmp(chunk->parity_type, "isa-rs") == 0) {
-        parity_type = NB_Parity_Type::RS;
-    } else if (strcmp(chunk->parity_type, "cm256") == 0) {
-        parity_type = NB_Parity_Type::CM;
-    } else {
-        parity_type = NB_Parity_Type::NONE;
-    }
+    const NB_Parity_Type parity_type = _nb_parse_parity_type(chunk->parity_type);
 
     if (chunk->frag_digest_type[0]) {
         evp_md_frag = EVP_get_digestbyname(chunk->frag_digest_type);
@@ -754,6 +1309,24 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
         frags_map[i] = 0;
     }
 
+    // when the frag digests can be computed in multi-buffer lanes, compute all of them
+    // up front and only compare in the loop below
+    struct NB_Buf mb_digests[MAX_TOTAL_FRAGS];
+    int mb_digests_count = 0;
+    const int mb_frag_nid = _nb_frags_mb_digest_nid(evp_md_frag, chunk->frags_count);
+    if (mb_frag_nid) {
+        mb_digests_count = chunk->frags_count < MAX_TOTAL_FRAGS ? chunk->frags_count : MAX_TOTAL_FRAGS;
+        for (int i = 0; i < mb_digests_count; ++i) {
+            nb_buf_init(&mb_digests[i]);
+        }
+        _nb_frags_mb_digest(mb_frag_nid, chunk->frags, mb_digests, mb_digests_count);
+    }
+    StackCleaner cleaner([&] {
+        for (int i = 0; i < mb_digests_count; ++i) {
+            nb_buf_free(&mb_digests[i]);
+        }
+    });
+
     for (int i = 0; i < chunk->frags_count; ++i) {
         struct NB_Coder_Frag* f = chunk->frags + i;
         int index = -1;
@@ -762,7 +1335,7 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
         } else if (f->parity_index >= 0 && f->parity_index < chunk->parity_frags) {
             index = chunk->data_frags + f->parity_index;
         } else if (f->lrc_index >= 0 && f->lrc_index < total_frags - chunk->data_frags - chunk->parity_frags) {
-            continue; // lrc not yet applicable
+            index = chunk->data_frags + chunk->parity_frags + f->lrc_index;
         } else {
             continue; // invalid chunk index
         }
@@ -780,7 +1353,12 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
         if (frags_map[index]) {
             continue; // duplicate frag
         }
-        if (evp_md_frag) {
+        if (i < mb_digests_count) {
+            if (mb_digests[i].len != f->digest.len ||
+                memcmp(mb_digests[i].data, f->digest.data, f->digest.len) != 0) {
+                continue; // mismatching block digest
+            }
+        } else if (evp_md_frag) {
             if (!_nb_digest_match(evp_md_frag, &f->block, &f->digest)) {
                 continue; // mismatching block digest
             }
@@ -788,13 +1366,20 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
         frags_map[index] = f;
         if (index < chunk->data_frags) {
             num_avail_data_frags++;
-        } else {
+        } else if (index < chunk->data_frags + chunk->parity_frags) {
             num_avail_parity_frags++;
         }
     }
 
     assert(num_avail_data_frags <= chunk->data_frags);
 
+    // prefer repairing from the local groups which needs only lrc_group frags per missing frag
+    // and fallback to the global parity for whatever is still missing after that
+    if (num_avail_data_frags < chunk->data_frags && total_frags > chunk->data_frags + chunk->parity_frags) {
+        _nb_lrc_derasure(chunk, frags_map, &num_avail_data_frags, &num_avail_parity_frags);
+        if (chunk->errors.count) return;
+    }
+
     if (num_avail_data_frags < chunk->data_frags) {
 
         if (chunk->parity_frags <= 0) {
@@ -809,22 +1394,10 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
         if (parity_type == NB_Parity_Type::C1 || parity_type == NB_Parity_Type::RS) {
             const int k = chunk->data_frags;
             const int m = chunk->data_frags + chunk->parity_frags;
-            uint8_t ec_table[MAX_MATRIX_SIZE * 32];
-            uint8_t a[MAX_MATRIX_SIZE];
-            uint8_t b[MAX_MATRIX_SIZE];
             uint8_t* in_bufs[MAX_DATA_FRAGS];
             uint8_t* out_bufs[MAX_PARITY_FRAGS];
-            uint8_t out_index[MAX_PARITY_FRAGS];
-            int out_len = 0;
-            // calculate the decode matrix:
-            if (parity_type == NB_Parity_Type::C1) {
-                gf_gen_cauchy1_matrix(a, m, k);
-            } else {
-                gf_gen_rs_matrix(a, m, k);
-            }
-            _nb_ec_select_available_fragments(frags_map, k, m, a, b, out_index, &out_len, in_bufs);
-            assert(out_len == chunk->data_frags - num_avail_data_frags);
-            if (gf_invert_matrix(b, a, k) < 0) {
+            auto tables = _ec_tables_cache.get({ parity_type, k, m, _nb_ec_erasures(frags_map, m) });
+            if (!tables->ok) {
                 nb_chunk_error(
                     chunk,
                     "Chunk Decoder: erasure decode invert failed"
@@ -836,13 +1409,14 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
                     chunk->parity_frags);
                 return;
             }
-            // select rows of missing data fragments
+            const int out_len = tables->out_len;
+            assert(out_len == chunk->data_frags - num_avail_data_frags);
+            _nb_ec_select_available_fragments(frags_map, k, m, in_bufs);
             for (int i = 0; i < out_len; ++i) {
-                memcpy(&b[k * i], &a[k * out_index[i]], k);
                 out_bufs[i] = nb_new_mem(chunk->frag_size);
             }
-            ec_init_tables(k, out_len, b, ec_table);
-            ec_encode_data(chunk->frag_size, k, out_len, ec_table, in_bufs, out_bufs);
+            ec_encode_data(
+                chunk->frag_size, k, out_len, (uint8_t*)tables->table, in_bufs, out_bufs);
             _nb_ec_update_decoded_fragments(frags_map, k, m, out_len, out_bufs, chunk->frag_size);
 
         } else if (parity_type == NB_Parity_Type::CM) {
@@ -901,13 +1475,106 @@ _nb_derasure(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, int
 }
 
 static void
+_nb_lrc_derasure(
+    struct NB_Coder_Chunk* chunk,
+    struct NB_Coder_Frag** frags_map,
+    int* p_num_avail_data_frags,
+    int* p_num_avail_parity_frags)
+{
+    const int lrc_groups = (chunk->data_frags + chunk->parity_frags) / chunk->lrc_group;
+    const int lrc_start = chunk->data_frags + chunk->parity_frags;
+    const int k = chunk->lrc_group;
+    const int m = chunk->lrc_group + chunk->lrc_frags;
+    const NB_Parity_Type lrc_type = _nb_parse_lrc_type(chunk->lrc_type);
+
+    if (lrc_type == NB_Parity_Type::NONE) {
+        nb_chunk_error(chunk, "Chunk Decoder: unsupported lrc type %s", chunk->lrc_type);
+        return;
+    }
+
+    if (k > MAX_DATA_FRAGS || chunk->lrc_frags > MAX_PARITY_FRAGS) return;
+
+    uint8_t* in_bufs[MAX_DATA_FRAGS];
+    uint8_t* out_bufs[MAX_PARITY_FRAGS];
+    struct NB_Coder_Frag** group_map[MAX_DATA_FRAGS + MAX_PARITY_FRAGS];
+
+    for (int g = 0; g < lrc_groups; ++g) {
+
+        // group rows are the source frags followed by the local parity frags of the group
+        int num_missing = 0;
+        int num_avail_lrc = 0;
+        uint64_t erasures = 0;
+        for (int r = 0; r < m; ++r) {
+            group_map[r] = r < k ? frags_map + (g * k) + r
+                                 : frags_map + lrc_start + (g * chunk->lrc_frags) + (r - k);
+            if (!*group_map[r]) erasures |= 1ULL << r;
+            if (r < k && !*group_map[r]) num_missing++;
+            if (r >= k && *group_map[r]) num_avail_lrc++;
+        }
+        if (!num_missing || num_missing > num_avail_lrc) continue;
+
+        auto tables = _ec_tables_cache.get({ lrc_type, k, m, erasures });
+        if (!tables->ok) {
+            nb_chunk_error(
+                chunk,
+                "Chunk Decoder: lrc decode invert failed"
+                " group %i missing %i lrc_frags %i/%i",
+                g,
+                num_missing,
+                num_avail_lrc,
+                chunk->lrc_frags);
+            return;
+        }
+        const int out_len = tables->out_len;
+        assert(out_len == num_missing);
+
+        // select k available rows in the same order used for the decode tables
+        for (int i = 0, r = 0; i < k; ++i, ++r) {
+            assert(r >= 0 && r < m);
+            while (!*group_map[r]) {
+                ++r;
+                assert(r >= 0 && r < m);
+            }
+            in_bufs[i] = nb_bufs_merge(&(*group_map[r])->block, 0);
+        }
+        for (int i = 0; i < out_len; ++i) {
+            out_bufs[i] = nb_new_mem(chunk->frag_size);
+        }
+        ec_encode_data(chunk->frag_size, k, out_len, (uint8_t*)tables->table, in_bufs, out_bufs);
+
+        // reuse the lrc frags of the group to hold the repaired frags
+        for (int i = 0, r = k; i < out_len; ++i, ++r) {
+            assert(r >= k && r < m);
+            while (!*group_map[r]) {
+                ++r;
+                assert(r >= k && r < m);
+            }
+            const int index = (g * k) + tables->out_index[i];
+            struct NB_Coder_Frag* f = *group_map[r];
+            f->lrc_index = -1;
+            if (index < chunk->data_frags) {
+                f->data_index = index;
+                (*p_num_avail_data_frags)++;
+            } else {
+                f->parity_index = index - chunk->data_frags;
+                (*p_num_avail_parity_frags)++;
+            }
+            nb_bufs_free(&f->block);
+            nb_bufs_init_arena(&f->block, f->block.arena);
+            nb_bufs_push_owned(&f->block, out_bufs[i], chunk->frag_size);
+            *group_map[r] = 0;
+            frags_map[index] = f;
+        }
+    }
+}
+
+// returns true when the data was authenticated by the gcm tag of the chunk
+static bool
 _nb_decrypt(
     struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map, const EVP_CIPHER* evp_cipher)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    struct NB_Chunk_Cipher cipher = {0, 0, false, false};
     struct NB_Buf iv;
-    int evp_ret = 0;
-    bool skip_auth = false;
 
     // const int key_len = EVP_CIPHER_key_length(evp_cipher);
     const int iv_len = EVP_CIPHER_iv_length(evp_cipher);
@@ -922,31 +1589,24 @@ _nb_decrypt(
     }
 
     StackCleaner cleaner([&] {
-        EVP_CIPHER_CTX_free(ctx);
+        _nb_cipher_done(&cipher);
         nb_buf_free(&iv);
     });
 
-    evp_ret = EVP_DecryptInit_ex(ctx, evp_cipher, NULL, chunk->cipher_key.data, iv.data);
-    if (!evp_ret) {
-        nb_chunk_error(chunk, "Chunk Decoder: cipher decrypt init failed %s", chunk->cipher_type);
-        return;
+    // without a tag the gcm data is decrypted but not authenticated
+    const bool verify_tag =
+        EVP_CIPHER_mode(evp_cipher) == EVP_CIPH_GCM_MODE && chunk->cipher_auth_tag.len;
+    if (verify_tag && chunk->cipher_auth_tag.len != NB_AES_GCM_TAG_LEN) {
+        nb_chunk_error(
+            chunk, "Chunk Decoder: cipher auth tag length %i", chunk->cipher_auth_tag.len);
+        return false;
     }
 
-    if (EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_GCM_MODE) {
-        if (USE_GCM_AUTH_TAG && chunk->cipher_auth_tag.len) {
-            evp_ret = EVP_CIPHER_CTX_ctrl(
-                ctx,
-                EVP_CTRL_GCM_SET_TAG,
-                chunk->cipher_auth_tag.len,
-                chunk->cipher_auth_tag.data);
-            if (!evp_ret) {
-                nb_chunk_error(
-                    chunk, "Chunk Decoder: cipher decrypt set tag failed %s", chunk->cipher_type);
-                return;
-            }
-        } else {
-            skip_auth = true;
-        }
+    // a chunk has an iv only when its key was provided (see _nb_encrypt)
+    if (!_nb_cipher_init(
+            &cipher, evp_cipher, chunk->cipher_key.data, iv.data, false, chunk->cipher_iv.len > 0)) {
+        nb_chunk_error(chunk, "Chunk Decoder: cipher decrypt init failed %s", chunk->cipher_type);
+        return false;
     }
 
     int pos = 0;
@@ -957,24 +1617,158 @@ _nb_decrypt(
         for (int j = 0; j < f->block.count; ++j) {
             struct NB_Buf* fb = nb_bufs_get(&f->block, j);
 
-            int out_len = 0;
-            evp_ret = EVP_DecryptUpdate(ctx, b->data + pos, &out_len, fb->data, fb->len);
-            if (!evp_ret) {
+            if (!_nb_cipher_update(&cipher, b->data + pos, fb->data, fb->len)) {
                 nb_chunk_error(
                     chunk, "Chunk Decoder: cipher decrypt update failed %s", chunk->cipher_type);
-                return;
+                return false;
             }
-            pos += out_len;
+            pos += fb->len;
         }
     }
 
-    int out_len = 0;
-    evp_ret = EVP_DecryptFinal_ex(ctx, 0, &out_len);
-    if (!evp_ret && !skip_auth) {
+    if (!_nb_cipher_final(
+            &cipher,
+            verify_tag ? chunk->cipher_auth_tag.data : 0,
+            verify_tag ? chunk->cipher_auth_tag.len : 0)) {
         nb_chunk_error(chunk, "Chunk Decoder: cipher decrypt final failed %s", chunk->cipher_type);
-        return;
+        return false;
+    }
+    if (verify_tag) _auth_tags_verified++;
+    return verify_tag;
+}
+
+// chunks of a stream use the same cipher so the last lookup of the thread is kept
+static const EVP_CIPHER*
+_nb_cipher_by_name(const char* name)
+{
+    static thread_local NB_Coder_Short_String t_name;
+    static thread_local const EVP_CIPHER* t_cipher = 0;
+    if (!t_cipher || strncmp(t_name, name, sizeof(t_name))) {
+        const EVP_CIPHER* evp_cipher = EVP_get_cipherbyname(name);
+        if (!evp_cipher) return 0;
+        strncpy(t_name, name, sizeof(t_name) - 1);
+        t_name[sizeof(t_name) - 1] = 0;
+        t_cipher = evp_cipher;
+    }
+    return t_cipher;
+}
+
+// the EVP context of the thread, allocated once instead of per chunk
+struct NB_Thread_Cipher_Ctx {
+    EVP_CIPHER_CTX* ctx;
+    const EVP_CIPHER* cipher;
+    NB_Thread_Cipher_Ctx()
+        : ctx(EVP_CIPHER_CTX_new())
+        , cipher(0)
+    {
+    }
+    ~NB_Thread_Cipher_Ctx() { EVP_CIPHER_CTX_free(ctx); }
+};
+
+static NB_Thread_Cipher_Ctx&
+_nb_thread_cipher_ctx()
+{
+    static thread_local NB_Thread_Cipher_Ctx t_ctx;
+    return t_ctx;
+}
+
+static bool
+_nb_cipher_init(
+    struct NB_Chunk_Cipher* cipher,
+    const EVP_CIPHER* evp_cipher,
+    const uint8_t* key,
+    const uint8_t* iv,
+    bool encrypt,
+    bool keep_key)
+{
+    cipher->gcm = 0;
+    cipher->evp = 0;
+    cipher->encrypt = encrypt;
+    cipher->keep_key = keep_key;
+
+    const int key_len = EVP_CIPHER_key_length(evp_cipher);
+    if (EVP_CIPHER_mode(evp_cipher) == EVP_CIPH_GCM_MODE &&
+        EVP_CIPHER_iv_length(evp_cipher) == NB_AES_GCM_IV_LEN &&
+        nb_aes_gcm_supported(key_len)) {
+        cipher->gcm = nb_aes_gcm_thread_ctx();
+        nb_aes_gcm_init(cipher->gcm, key, key_len, iv);
+        return true;
+    }
+
+    NB_Thread_Cipher_Ctx& t_ctx = _nb_thread_cipher_ctx();
+    if (!t_ctx.ctx) return false;
+    // the same cipher only sets the new key and iv on the existing cipher data
+    const EVP_CIPHER* init_cipher = t_ctx.cipher == evp_cipher ? NULL : evp_cipher;
+    if (init_cipher) t_ctx.cipher = 0;
+    // set before the init so that a failed init is wiped as well
+    cipher->evp = t_ctx.ctx;
+    if (!EVP_CipherInit_ex(t_ctx.ctx, init_cipher, NULL, key, iv, encrypt ? 1 : 0)) {
+        return false;
     }
+    t_ctx.cipher = evp_cipher;
+    return true;
+}
+
+static void
+_nb_cipher_done(struct NB_Chunk_Cipher* cipher)
+{
+    if (cipher->keep_key) return;
+    if (cipher->gcm) {
+        nb_aes_gcm_wipe(cipher->gcm);
+    }
+    if (cipher->evp) {
+        // the reset cleanses and frees the cipher data, so the next init sets the cipher again
+        EVP_CIPHER_CTX_reset(cipher->evp);
+        _nb_thread_cipher_ctx().cipher = 0;
+    }
+    cipher->gcm = 0;
+    cipher->evp = 0;
+}
+
+// the ciphers have block size 1 so the output is always as long as the input
+static bool
+_nb_cipher_update(struct NB_Chunk_Cipher* cipher, uint8_t* out, const uint8_t* in, int len)
+{
+    if (cipher->gcm) {
+        if (cipher->encrypt) {
+            nb_aes_gcm_encrypt(cipher->gcm, out, in, len);
+        } else {
+            nb_aes_gcm_decrypt(cipher->gcm, out, in, len);
+        }
+        return true;
+    }
+    int out_len = 0;
+    if (!EVP_CipherUpdate(cipher->evp, out, &out_len, in, len)) return false;
+    assert(out_len == len);
+    return out_len == len;
+}
+
+// with a tag the encryption outputs it and the decryption verifies it
+static bool
+_nb_cipher_final(struct NB_Chunk_Cipher* cipher, uint8_t* tag, int tag_len)
+{
+    if (cipher->gcm) {
+        if (!tag) return true;
+        if (cipher->encrypt) {
+            nb_aes_gcm_encrypt_final(cipher->gcm, tag, tag_len);
+            return true;
+        }
+        return nb_aes_gcm_decrypt_final(cipher->gcm, tag, tag_len);
+    }
+    if (tag && !cipher->encrypt) {
+        if (!EVP_CIPHER_CTX_ctrl(cipher->evp, EVP_CTRL_GCM_SET_TAG, tag_len, tag)) return false;
+    }
+    int out_len = 0;
+    const int evp_ret = EVP_CipherFinal_ex(cipher->evp, 0, &out_len);
     assert(!out_len);
+    // gcm decryption without a tag fails the final check, which only means it was not authenticated
+    const bool unauthenticated =
+        !tag && !cipher->encrypt && EVP_CIPHER_CTX_mode(cipher->evp) == EVP_CIPH_GCM_MODE;
+    if (!evp_ret && !unauthenticated) return false;
+    if (tag && cipher->encrypt) {
+        if (!EVP_CIPHER_CTX_ctrl(cipher->evp, EVP_CTRL_GCM_GET_TAG, tag_len, tag)) return false;
+    }
+    return true;
 }
 
 static void
@@ -992,23 +1786,76 @@ _nb_no_decrypt(struct NB_Coder_Chunk* chunk, struct NB_Coder_Frag** frags_map)
 static void
 _nb_digest(const EVP_MD* md, struct NB_Bufs* data, struct NB_Buf* digest)
 {
-    EVP_MD_CTX *ctx_md = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(ctx_md, md, NULL);
+    EVP_MD_CTX *ctx_md = _nb_digest_init(md);
 
     struct NB_Buf* b = nb_bufs_get(data, 0);
     for (int i = 0; i < data->count; ++i, ++b) {
         EVP_DigestUpdate(ctx_md, b->data, b->len);
     }
 
+    _nb_digest_final(md, ctx_md, digest, 0);
+}
+
+static EVP_MD_CTX*
+_nb_digest_init(const EVP_MD* md)
+{
+    EVP_MD_CTX *ctx_md = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx_md, md, NULL);
+    return ctx_md;
+}
+
+// finalizes the digest and frees the context,
+// the digest is allocated in the arena if given
+static void
+_nb_digest_final(const EVP_MD* md, EVP_MD_CTX* ctx_md, struct NB_Buf* digest, struct NB_Arena* arena)
+{
     uint32_t digest_len = EVP_MD_size(md);
     nb_buf_free(digest);
-    nb_buf_init_alloc(digest, digest_len);
+    if (arena) {
+        nb_buf_init_arena(digest, arena, digest_len);
+    } else {
+        nb_buf_init_alloc(digest, digest_len);
+    }
     EVP_DigestFinal_ex(ctx_md, digest->data, &digest_len);
     assert((int)digest_len == digest->len);
 
     EVP_MD_CTX_free(ctx_md);
 }
 
+static void
+_nb_digest_tap(void* arg, const uint8_t* data, int len)
+{
+    EVP_DigestUpdate((EVP_MD_CTX*)arg, data, len);
+}
+
+// returns the nid to use for multi-buffer frag digests, or 0 to use EVP.
+// a single frag would only occupy one lane, and EVP is faster for that.
+static int
+_nb_frags_mb_digest_nid(const EVP_MD* md, int frags_count)
+{
+    if (!md || frags_count < 2) return 0;
+    const int nid = EVP_MD_type(md);
+    return nb_mb_digest_supported(nid) ? nid : 0;
+}
+
+// computes the digests of the frags blocks in multi-buffer lanes,
+// into the given digests array, or into the frags digest if digests is null.
+// lrc frags can take the count above MAX_TOTAL_FRAGS so the frags are hashed in batches.
+static void
+_nb_frags_mb_digest(int nid, struct NB_Coder_Frag* frags, struct NB_Buf* digests, int count)
+{
+    struct NB_Bufs* bufs[MAX_TOTAL_FRAGS];
+    struct NB_Buf* out[MAX_TOTAL_FRAGS];
+    for (int start = 0; start < count; start += MAX_TOTAL_FRAGS) {
+        const int n = std::min(count - start, MAX_TOTAL_FRAGS);
+        for (int i = 0; i < n; ++i) {
+            bufs[i] = &frags[start + i].block;
+            out[i] = digests ? digests + start + i : &frags[start + i].digest;
+        }
+        nb_mb_digest(nid, bufs, out, n);
+    }
+}
+
 static bool
 _nb_digest_match(const EVP_MD* md, struct NB_Bufs* data, struct NB_Buf* digest)
 {
@@ -1,6 +1,7 @@
 /* Copyright (C) 2016 NooBaa */
 #pragma once
 
+#include "../util/arena.h"
 #include "../util/struct_buf.h"
 #include <stdint.h>
 
@@ -35,6 +36,8 @@ struct NB_Coder_Chunk {
     NB_Coder_Short_String compress_type;
     NB_Coder_Short_String cipher_type;
     NB_Coder_Short_String parity_type;
+    // parity of the local groups, isa-c1 (the default) or isa-rs
+    NB_Coder_Short_String lrc_type;
 
     struct NB_Bufs data;
     struct NB_Bufs errors;
@@ -43,10 +46,18 @@ struct NB_Coder_Chunk {
     struct NB_Buf cipher_iv;
     struct NB_Buf cipher_auth_tag;
     struct NB_Coder_Frag* frags;
+    // transient memory of the chunk - frags, digests, keys and bufs arrays
+    struct NB_Arena arena;
 
     NB_Coder_Type coder;
     int size;
+    // the size after compression (or after storing in the compress type frame when
+    // skipped by the probe), 0 when not compressed
     int compress_size;
+    // 0 means the default level of the compress type
+    int compress_level;
+    // 0 means no dictionary, otherwise a zstd dictionary loaded by nb_zstd_dict_load()
+    int compress_dict_id;
     int data_frags;
     int parity_frags;
     int lrc_group;
@@ -55,13 +66,34 @@ struct NB_Coder_Chunk {
     int frag_size;
 };
 
+struct NB_Coder_Stats {
+    uint64_t ec_tables_hits;
+    uint64_t ec_tables_misses;
+    uint64_t ec_tables_evictions;
+    int ec_tables_size;
+    int ec_tables_capacity;
+    uint64_t compress_probes;
+    uint64_t compress_skips;
+    uint64_t compress_skipped_bytes;
+    uint64_t auth_tags;
+    uint64_t auth_tags_verified;
+    uint64_t digest_skips;
+};
+
 void nb_chunk_coder_init();
+void nb_chunk_coder_stats(struct NB_Coder_Stats* stats);
+// chunks with less expected gain (in percent) are stored uncompressed, 0 always compresses
+void nb_chunk_coder_set_compress_min_gain(int percent);
+int nb_chunk_coder_get_compress_min_gain();
+// gcm chunks get an auth tag, and decoding verifies it instead of the chunk digest
+void nb_chunk_coder_set_gcm_auth_tag(bool enabled);
+bool nb_chunk_coder_get_gcm_auth_tag();
 
 void nb_chunk_init(struct NB_Coder_Chunk* chunk);
 void nb_chunk_free(struct NB_Coder_Chunk* chunk);
 void nb_chunk_coder(struct NB_Coder_Chunk* chunk);
 void nb_chunk_error(struct NB_Coder_Chunk* chunk, const char* str, ...);
 
-void nb_frag_init(struct NB_Coder_Frag* f);
+void nb_frag_init(struct NB_Coder_Frag* f, struct NB_Arena* arena);
 void nb_frag_free(struct NB_Coder_Frag* f);
 }
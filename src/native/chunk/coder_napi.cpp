@@ -1,28 +1,95 @@
 /* Copyright (C) 2016 NooBaa */
 #include "../util/b64.h"
+#include "../util/buf_pool.h"
 #include "../util/napi.h"
+#include "../util/zstd.h"
 #include "coder.h"
+#include "coder_pool.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
 namespace noobaa
 {
 
-#define CODER_JS_SIGNATURE "function chunk_coder('enc'|'dec', chunk/s, callback?)"
+#define CODER_JS_SIGNATURE "function chunk_coder('enc'|'dec', chunk/s, callback?, options?)"
+
+// without the coder pool a batch is coded by at most this many works of the uv threadpool
+// (4 threads by default, shared with fs and dns), each coding its share of the chunks,
+// so a single batch cannot queue a work per chunk ahead of everything else.
+#define CODER_UV_MAX_WORKS 4
+
+struct DictTrainAsync {
+    struct NB_Bufs samples;
+    struct NB_Bufs dict;
+    struct NB_Bufs errors;
+    int dict_size;
+    napi_ref r_params;
+    napi_ref r_callback;
+    napi_async_work work;
+};
+
+struct CoderAsyncWork;
 
 struct CoderAsync {
     struct NB_Coder_Chunk* chunks;
     int chunks_count;
     napi_ref r_chunks;
     napi_ref r_callback;
+    // without the coder pool the chunks are split between a few works of the uv threadpool
+    struct CoderAsyncWork* works;
+    int works_count;
+    int works_pending;
+    WorkStealingPool::Priority priority;
+    napi_threadsafe_function tsfn;
+};
+
+struct CoderAsyncWork {
+    struct CoderAsync* async;
+    // the work codes the chunks index, index + works_count, ...
+    int index;
     napi_async_work work;
 };
 
+// without the coder pool the priority classes cannot order the works of the uv threadpool,
+// so low priority batches get a single work and only one of them is queued at a time -
+// background coding (e.g. rebuilds) then takes at most one uv thread and the batches queued
+// after it are not stuck behind a backlog of low ones. the rest are held here in order.
+// batches are submitted and completed on the event loop thread, so this is per thread.
+struct CoderUvLow {
+    bool queued;
+    std::deque<struct CoderAsync*> held;
+};
+
+static thread_local CoderUvLow _nb_coder_uv_low;
+static std::atomic<uint64_t> _nb_coder_uv_batches(0);
+static std::atomic<uint64_t> _nb_coder_uv_low_held(0);
+
 static napi_value _nb_chunk_coder(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_stats(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_pool_threads(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_pool_placement(napi_env env, napi_callback_info info);
+static napi_value _nb_work_stealing_shared(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_compress_min_gain(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_gcm_auth_tag(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_release(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_dict_load(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_dict_unload(napi_env env, napi_callback_info info);
+static napi_value _nb_chunk_coder_dict_train(napi_env env, napi_callback_info info);
+static void _nb_dict_train_execute(napi_env env, void* data);
+static void _nb_dict_train_complete(napi_env env, napi_status status, void* data);
+static int _nb_coder_release_buf(napi_env env, napi_value obj, const char* name);
+static void _nb_coder_uv_submit(napi_env env, struct CoderAsync* async);
 static void _nb_coder_async_execute(napi_env env, void* data);
 static void _nb_coder_async_complete(napi_env env, napi_status status, void* data);
+static void _nb_coder_pool_done(void* arg);
+static void _nb_coder_pool_call_js(napi_env env, napi_value js_callback, void* context, void* data);
+static void _nb_coder_async_finish(napi_env env, struct CoderAsync* async);
 static void _nb_coder_load_chunk(napi_env env, napi_value v_chunk, struct NB_Coder_Chunk* chunk);
 static void _nb_coder_update_chunk(
     napi_env env, napi_value v_chunk, napi_value* v_err, struct NB_Coder_Chunk* chunk);
@@ -34,30 +101,519 @@ chunk_coder_napi(napi_env env, napi_value exports)
     napi_value func = 0;
     napi_create_function(env, "chunk_coder", NAPI_AUTO_LENGTH, _nb_chunk_coder, NULL, &func);
     napi_set_named_property(env, exports, "chunk_coder", func);
+    napi_create_function(
+        env, "chunk_coder_stats", NAPI_AUTO_LENGTH, _nb_chunk_coder_stats, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_stats", func);
+    napi_create_function(
+        env, "chunk_coder_pool_threads", NAPI_AUTO_LENGTH, _nb_chunk_coder_pool_threads, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_pool_threads", func);
+    napi_create_function(
+        env, "chunk_coder_pool_placement", NAPI_AUTO_LENGTH, _nb_chunk_coder_pool_placement, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_pool_placement", func);
+    napi_create_function(
+        env, "work_stealing_shared", NAPI_AUTO_LENGTH, _nb_work_stealing_shared, NULL, &func);
+    napi_set_named_property(env, exports, "work_stealing_shared", func);
+    napi_create_function(
+        env, "chunk_coder_compress_min_gain", NAPI_AUTO_LENGTH, _nb_chunk_coder_compress_min_gain, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_compress_min_gain", func);
+    napi_create_function(
+        env, "chunk_coder_gcm_auth_tag", NAPI_AUTO_LENGTH, _nb_chunk_coder_gcm_auth_tag, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_gcm_auth_tag", func);
+    napi_create_function(
+        env, "chunk_coder_release", NAPI_AUTO_LENGTH, _nb_chunk_coder_release, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_release", func);
+    napi_create_function(
+        env, "chunk_coder_dict_load", NAPI_AUTO_LENGTH, _nb_chunk_coder_dict_load, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_dict_load", func);
+    napi_create_function(
+        env, "chunk_coder_dict_unload", NAPI_AUTO_LENGTH, _nb_chunk_coder_dict_unload, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_dict_unload", func);
+    napi_create_function(
+        env, "chunk_coder_dict_train", NAPI_AUTO_LENGTH, _nb_chunk_coder_dict_train, NULL, &func);
+    napi_set_named_property(env, exports, "chunk_coder_dict_train", func);
+}
+
+/**
+ * chunk_coder_dict_load(dict_id, dict) digests a compression dictionary and keeps it
+ * for chunks whose chunk_coder_config has this compress_dict_id.
+ * loading the same dictionary again does nothing, a different one with the same id throws.
+ */
+static napi_value
+_nb_chunk_coder_dict_load(napi_env env, napi_callback_info info)
+{
+    size_t argc = 2;
+    napi_value argv[] = { 0, 0 };
+    napi_valuetype typeof_dict_id = napi_undefined;
+    bool is_buffer = false;
+    int dict_id = 0;
+    void* data = 0;
+    size_t len = 0;
+    struct NB_Bufs errors;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_dict_id);
+    napi_is_buffer(env, argv[1], &is_buffer);
+    if (typeof_dict_id != napi_number || !is_buffer) {
+        napi_throw_type_error(env, 0, "arguments should be dict_id (Number) and dict (Buffer)");
+        return 0;
+    }
+    napi_get_value_int32(env, argv[0], &dict_id);
+    napi_get_buffer_info(env, argv[1], &data, &len);
+    nb_bufs_init(&errors);
+    if (nb_zstd_dict_load(dict_id, (const uint8_t*)data, (int)len, &errors)) {
+        napi_throw_error(env, 0, (const char*)nb_bufs_get(&errors, 0)->data);
+    }
+    nb_bufs_free(&errors);
+    return 0;
+}
+
+/**
+ * chunk_coder_dict_unload(dict_id) drops the dictionary once the running chunks are done with it,
+ * and returns false if it was not loaded.
+ */
+static napi_value
+_nb_chunk_coder_dict_unload(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[] = { 0 };
+    napi_valuetype typeof_dict_id = napi_undefined;
+    napi_value v_unloaded = 0;
+    int dict_id = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_dict_id);
+    if (typeof_dict_id != napi_number) {
+        napi_throw_type_error(env, 0, "1st argument should be dict_id (Number)");
+        return 0;
+    }
+    napi_get_value_int32(env, argv[0], &dict_id);
+    napi_get_boolean(env, nb_zstd_dict_unload(dict_id), &v_unloaded);
+    return v_unloaded;
+}
+
+/**
+ * chunk_coder_dict_train({ samples, dict_size }, callback) trains a zstd dictionary
+ * from the samples (Buffer[] of uncompressed chunks) on the uv threadpool,
+ * and calls back with the dictionary buffer of up to dict_size bytes.
+ */
+static napi_value
+_nb_chunk_coder_dict_train(napi_env env, napi_callback_info info)
+{
+    size_t argc = 2;
+    napi_value argv[] = { 0, 0 };
+    napi_valuetype typeof_params = napi_undefined;
+    napi_valuetype typeof_callback = napi_undefined;
+    napi_value v_async_resource_name = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_params);
+    napi_typeof(env, argv[1], &typeof_callback);
+    if (typeof_params != napi_object || typeof_callback != napi_function) {
+        napi_throw_type_error(env, 0, "arguments should be params ({ samples, dict_size }) and callback (Function)");
+        return 0;
+    }
+
+    struct DictTrainAsync* async = nb_new(struct DictTrainAsync);
+    nb_bufs_init(&async->samples);
+    nb_bufs_init(&async->dict);
+    nb_bufs_init(&async->errors);
+    async->dict_size = 0;
+    // the samples are shared with the js buffers which are kept referenced by the params
+    nb_napi_get_bufs(env, argv[0], "samples", &async->samples);
+    nb_napi_get_int(env, argv[0], "dict_size", &async->dict_size);
+    napi_create_reference(env, argv[0], 1, &async->r_params);
+    napi_create_reference(env, argv[1], 1, &async->r_callback);
+    napi_create_string_utf8(env, "DictTrainResource", NAPI_AUTO_LENGTH, &v_async_resource_name);
+    napi_create_async_work(
+        env, v_async_resource_name, v_async_resource_name, _nb_dict_train_execute, _nb_dict_train_complete, async, &async->work);
+    napi_queue_async_work(env, async->work);
+    return 0;
+}
+
+static void
+_nb_dict_train_execute(napi_env env, void* data)
+{
+    struct DictTrainAsync* async = (struct DictTrainAsync*)data;
+    if (async->dict_size <= 0) {
+        nb_bufs_push_printf(&async->errors, 256, "nb_zstd_dict_train: invalid dict_size %i", async->dict_size);
+        return;
+    }
+    nb_zstd_dict_train(&async->samples, async->dict_size, &async->dict, &async->errors);
+}
+
+static void
+_nb_dict_train_complete(napi_env env, napi_status status, void* data)
+{
+    struct DictTrainAsync* async = (struct DictTrainAsync*)data;
+    napi_value v_global = 0;
+    napi_value v_callback = 0;
+    napi_value v_err = 0;
+    napi_value v_dict = 0;
+
+    napi_get_global(env, &v_global);
+    napi_get_reference_value(env, async->r_callback, &v_callback);
+    napi_get_null(env, &v_err);
+    napi_get_undefined(env, &v_dict);
+
+    if (async->errors.count) {
+        napi_value v_msg = 0;
+        napi_create_string_utf8(
+            env, (const char*)nb_bufs_get(&async->errors, 0)->data, NAPI_AUTO_LENGTH, &v_msg);
+        napi_create_error(env, 0, v_msg, &v_err);
+    } else {
+        napi_value v_res = 0;
+        napi_create_object(env, &v_res);
+        nb_napi_set_bufs(env, v_res, "dict", &async->dict);
+        napi_get_named_property(env, v_res, "dict", &v_dict);
+    }
+
+    napi_value v_callback_args[] = { v_err, v_dict };
+    napi_make_callback(env, 0, v_global, v_callback, 2, v_callback_args, 0);
+
+    napi_delete_reference(env, async->r_params);
+    napi_delete_reference(env, async->r_callback);
+    napi_delete_async_work(env, async->work);
+    nb_bufs_free(&async->samples);
+    nb_bufs_free(&async->dict);
+    nb_bufs_free(&async->errors);
+    nb_free(async);
+}
+
+/**
+ * chunk_coder_release(chunk/s) returns the pooled buffers of the chunks and their frags
+ * to the buffer pool without waiting for them to be collected, and unsets them.
+ * the caller must not keep any other reference to these buffers.
+ * returns the number of buffers released.
+ */
+static napi_value
+_nb_chunk_coder_release(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[] = { 0 };
+    napi_value v_chunks = 0;
+    napi_value v_released = 0;
+    bool is_chunks_array = false;
+    uint32_t chunks_len = 1;
+    int released = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    v_chunks = argv[0];
+
+    napi_valuetype typeof_chunks = napi_undefined;
+    napi_typeof(env, v_chunks, &typeof_chunks);
+    if (typeof_chunks != napi_object) {
+        napi_throw_type_error(env, 0, "1st argument should be chunk (Object) or chunks (Object[])");
+        return 0;
+    }
+    napi_is_array(env, v_chunks, &is_chunks_array);
+    if (is_chunks_array) napi_get_array_length(env, v_chunks, &chunks_len);
+
+    for (uint32_t i = 0; i < chunks_len; ++i) {
+        napi_value v_chunk = v_chunks;
+        napi_value v_frags = 0;
+        bool is_frags_array = false;
+        if (is_chunks_array) napi_get_element(env, v_chunks, i, &v_chunk);
+        released += _nb_coder_release_buf(env, v_chunk, "data");
+        napi_get_named_property(env, v_chunk, "frags", &v_frags);
+        napi_is_array(env, v_frags, &is_frags_array);
+        if (!is_frags_array) continue;
+        uint32_t frags_len = 0;
+        napi_get_array_length(env, v_frags, &frags_len);
+        for (uint32_t j = 0; j < frags_len; ++j) {
+            napi_value v_frag = 0;
+            napi_get_element(env, v_frags, j, &v_frag);
+            released += _nb_coder_release_buf(env, v_frag, "data");
+        }
+    }
+
+    napi_create_int32(env, released, &v_released);
+    return v_released;
+}
+
+static int
+_nb_coder_release_buf(napi_env env, napi_value obj, const char* name)
+{
+    napi_value v = 0;
+    napi_value v_null = 0;
+    bool is_buffer = false;
+    void* data = 0;
+    napi_valuetype typeof_obj = napi_undefined;
+    napi_typeof(env, obj, &typeof_obj);
+    if (typeof_obj != napi_object) return 0;
+    napi_get_named_property(env, obj, name, &v);
+    napi_is_buffer(env, v, &is_buffer);
+    if (!is_buffer) return 0;
+    napi_get_buffer_info(env, v, &data, 0);
+    // only buffers that the pool exposed are released, anything else is left alone
+    if (!data || !nb_buf_pool_release((uint8_t*)data)) return 0;
+    napi_get_null(env, &v_null);
+    napi_set_named_property(env, obj, name, v_null);
+    return 1;
+}
+
+/**
+ * chunk_coder_pool_threads(nthreads?) sets the number of threads of the shared native pool
+ * (which also runs the ThreadPool workers of nb_native_nan) and returns the current number.
+ * with 0 threads async coding uses the uv threadpool.
+ */
+static napi_value
+_nb_chunk_coder_pool_threads(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[] = { 0 };
+    napi_valuetype typeof_nthreads = napi_undefined;
+    napi_value v_nthreads = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_nthreads);
+    if (typeof_nthreads == napi_number) {
+        int nthreads = 0;
+        napi_get_value_int32(env, argv[0], &nthreads);
+        CoderPool::instance().set_nthreads(nthreads);
+    } else if (typeof_nthreads != napi_undefined) {
+        napi_throw_type_error(env, 0, "1st argument should be number of threads or undefined");
+        return 0;
+    }
+    napi_create_int32(env, CoderPool::instance().get_nthreads(), &v_nthreads);
+    return v_nthreads;
+}
+
+/**
+ * chunk_coder_pool_placement(placement?) pins the native coder threads
+ * and returns the current placement:
+ * 'none' lets the threads float, 'cores' pins every thread to a cpu,
+ * and 'numa' pins every thread to a numa node.
+ * with 'cores' or 'numa' every chunk is coded on the node that owns its input buffers.
+ */
+static napi_value
+_nb_chunk_coder_pool_placement(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[] = { 0 };
+    napi_valuetype typeof_placement = napi_undefined;
+    napi_value v_placement = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_placement);
+    if (typeof_placement == napi_string) {
+        char name[16];
+        WorkStealingPool::Placement placement = WorkStealingPool::PLACEMENT_NONE;
+        napi_get_value_string_utf8(env, argv[0], name, sizeof(name), 0);
+        if (!WorkStealingPool::placement_parse(name, &placement)) {
+            napi_throw_type_error(env, 0, "1st argument should be one of none, cores, numa");
+            return 0;
+        }
+        CoderPool::instance().set_placement(placement);
+    } else if (typeof_placement != napi_undefined) {
+        napi_throw_type_error(env, 0, "1st argument should be placement name or undefined");
+        return 0;
+    }
+    const char* name = WorkStealingPool::placement_name(CoderPool::instance().get_placement());
+    napi_create_string_utf8(env, name, NAPI_AUTO_LENGTH, &v_placement);
+    return v_placement;
+}
+
+/**
+ * work_stealing_shared() returns the address of the shared pool in a buffer,
+ * only for nb_native.js to attach nb_native_nan to it (see WorkStealingPool::shared).
+ */
+static napi_value
+_nb_work_stealing_shared(napi_env env, napi_callback_info info)
+{
+    WorkStealingPool* pool = &WorkStealingPool::shared();
+    napi_value v_buf = 0;
+    napi_create_buffer_copy(env, sizeof(pool), &pool, 0, &v_buf);
+    return v_buf;
+}
+
+/**
+ * chunk_coder_compress_min_gain(percent?) sets the expected compression gain in percent
+ * below which the encoder stores chunks uncompressed, and returns the current value.
+ * 0 disables the probe and every chunk with compress_type is compressed.
+ */
+static napi_value
+_nb_chunk_coder_compress_min_gain(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[] = { 0 };
+    napi_valuetype typeof_percent = napi_undefined;
+    napi_value v_percent = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_percent);
+    if (typeof_percent == napi_number) {
+        int percent = 0;
+        napi_get_value_int32(env, argv[0], &percent);
+        nb_chunk_coder_set_compress_min_gain(percent);
+    } else if (typeof_percent != napi_undefined) {
+        napi_throw_type_error(env, 0, "1st argument should be percent or undefined");
+        return 0;
+    }
+    napi_create_int32(env, nb_chunk_coder_get_compress_min_gain(), &v_percent);
+    return v_percent;
+}
+
+/**
+ * chunk_coder_gcm_auth_tag(enabled?) sets if gcm chunks are encoded with an auth tag,
+ * and returns the current value.
+ * decoding always verifies the tag of chunks that have one, and skips their chunk digest.
+ */
+static napi_value
+_nb_chunk_coder_gcm_auth_tag(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[] = { 0 };
+    napi_valuetype typeof_enabled = napi_undefined;
+    napi_value v_enabled = 0;
+    napi_get_cb_info(env, info, &argc, argv, 0, 0);
+    napi_typeof(env, argv[0], &typeof_enabled);
+    if (typeof_enabled == napi_boolean) {
+        bool enabled = false;
+        napi_get_value_bool(env, argv[0], &enabled);
+        nb_chunk_coder_set_gcm_auth_tag(enabled);
+    } else if (typeof_enabled != napi_undefined) {
+        napi_throw_type_error(env, 0, "1st argument should be boolean or undefined");
+        return 0;
+    }
+    napi_get_boolean(env, nb_chunk_coder_get_gcm_auth_tag(), &v_enabled);
+    return v_enabled;
+}
+
+static napi_value
+_nb_chunk_coder_stats(napi_env env, napi_callback_info info)
+{
+    struct NB_Coder_Stats stats;
+    struct NB_Coder_Pool_Stats pool_stats;
+    struct NB_Buf_Pool_Stats buf_pool_stats;
+    struct NB_Arena_Stats arena_stats;
+    struct NB_Zstd_Dict_Stats dict_stats;
+    napi_value v_stats = 0;
+    napi_value v_ec_tables = 0;
+    napi_value v_compress = 0;
+    napi_value v_cipher = 0;
+    napi_value v_dicts = 0;
+    napi_value v_pool = 0;
+    napi_value v_thread_nodes = 0;
+    napi_value v_thread_cpus = 0;
+    napi_value v_priorities = 0;
+    napi_value v_buf_pool = 0;
+    napi_value v_arena = 0;
+    nb_chunk_coder_stats(&stats);
+    CoderPool::instance().stats(&pool_stats);
+    nb_buf_pool_stats(&buf_pool_stats);
+    nb_arena_stats(&arena_stats);
+    nb_zstd_dict_stats(&dict_stats);
+    napi_create_object(env, &v_stats);
+    napi_create_object(env, &v_ec_tables);
+    napi_set_named_property(env, v_stats, "ec_tables", v_ec_tables);
+    nb_napi_set_int64(env, v_ec_tables, "hits", stats.ec_tables_hits);
+    nb_napi_set_int64(env, v_ec_tables, "misses", stats.ec_tables_misses);
+    nb_napi_set_int64(env, v_ec_tables, "evictions", stats.ec_tables_evictions);
+    nb_napi_set_int(env, v_ec_tables, "size", stats.ec_tables_size);
+    nb_napi_set_int(env, v_ec_tables, "capacity", stats.ec_tables_capacity);
+    napi_create_object(env, &v_compress);
+    napi_set_named_property(env, v_stats, "compress", v_compress);
+    nb_napi_set_int64(env, v_compress, "probes", stats.compress_probes);
+    nb_napi_set_int64(env, v_compress, "skips", stats.compress_skips);
+    nb_napi_set_int64(env, v_compress, "skipped_bytes", stats.compress_skipped_bytes);
+    napi_create_object(env, &v_cipher);
+    napi_set_named_property(env, v_stats, "cipher", v_cipher);
+    nb_napi_set_int64(env, v_cipher, "auth_tags", stats.auth_tags);
+    nb_napi_set_int64(env, v_cipher, "auth_tags_verified", stats.auth_tags_verified);
+    nb_napi_set_int64(env, v_cipher, "digest_skips", stats.digest_skips);
+    // compress and uncompress count the chunks coded with a dictionary
+    napi_create_object(env, &v_dicts);
+    napi_set_named_property(env, v_compress, "dicts", v_dicts);
+    nb_napi_set_int(env, v_dicts, "loaded", dict_stats.dicts);
+    nb_napi_set_int64(env, v_dicts, "bytes", dict_stats.dict_bytes);
+    nb_napi_set_int(env, v_dicts, "cdicts", dict_stats.cdicts);
+    nb_napi_set_int(env, v_dicts, "ddicts", dict_stats.ddicts);
+    nb_napi_set_int64(env, v_dicts, "compress", dict_stats.compress);
+    nb_napi_set_int64(env, v_dicts, "uncompress", dict_stats.uncompress);
+    napi_create_object(env, &v_pool);
+    napi_set_named_property(env, v_stats, "pool", v_pool);
+    nb_napi_set_int(env, v_pool, "threads", pool_stats.nthreads);
+    nb_napi_set_int64(env, v_pool, "batches", pool_stats.batches);
+    nb_napi_set_int64(env, v_pool, "chunks", pool_stats.chunks);
+    nb_napi_set_int64(env, v_pool, "steals", pool_stats.steals);
+    // batches coded on the uv threadpool when the pool has no threads,
+    // and how many low priority ones waited for the one before them
+    nb_napi_set_int64(env, v_pool, "uv_batches", _nb_coder_uv_batches);
+    nb_napi_set_int64(env, v_pool, "uv_low_held", _nb_coder_uv_low_held);
+    // routed counts the chunks sent to a thread on the node of their input,
+    // and thread_nodes and thread_cpus are -1 for threads that are not pinned.
+    nb_napi_set_str(env, v_pool, "placement", pool_stats.threads.placement, -1);
+    nb_napi_set_int(env, v_pool, "numa_nodes", pool_stats.threads.numa_nodes);
+    nb_napi_set_int(env, v_pool, "numa_cpus", pool_stats.threads.numa_cpus);
+    nb_napi_set_int64(env, v_pool, "routed", pool_stats.threads.routed);
+    nb_napi_set_int64(env, v_pool, "steals_remote", pool_stats.threads.steals_remote);
+    napi_create_array_with_length(env, pool_stats.nthreads, &v_thread_nodes);
+    napi_create_array_with_length(env, pool_stats.nthreads, &v_thread_cpus);
+    napi_set_named_property(env, v_pool, "thread_nodes", v_thread_nodes);
+    napi_set_named_property(env, v_pool, "thread_cpus", v_thread_cpus);
+    for (int i = 0; i < pool_stats.nthreads && i < WORK_STEALING_MAX_THREADS; ++i) {
+        napi_value v = 0;
+        napi_create_int32(env, pool_stats.threads.thread_nodes[i], &v);
+        napi_set_element(env, v_thread_nodes, i, v);
+        napi_create_int32(env, pool_stats.threads.thread_cpus[i], &v);
+        napi_set_element(env, v_thread_cpus, i, v);
+    }
+    // per priority class - pending is the queue depth, wait_us and run_us are totals,
+    // so wait_us / tasks is the average queueing latency of the class
+    napi_create_object(env, &v_priorities);
+    napi_set_named_property(env, v_pool, "priorities", v_priorities);
+    for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+        const struct NB_Work_Stealing_Priority_Stats& ps = pool_stats.threads.priorities[p];
+        napi_value v_priority = 0;
+        napi_create_object(env, &v_priority);
+        napi_set_named_property(
+            env, v_priorities, WorkStealingPool::priority_name((WorkStealingPool::Priority)p), v_priority);
+        nb_napi_set_int64(env, v_priority, "tasks", ps.tasks);
+        nb_napi_set_int(env, v_priority, "pending", ps.pending);
+        nb_napi_set_int64(env, v_priority, "wait_us", ps.wait_us);
+        nb_napi_set_int64(env, v_priority, "wait_max_us", ps.wait_max_us);
+        nb_napi_set_int64(env, v_priority, "run_us", ps.run_us);
+    }
+    napi_create_object(env, &v_buf_pool);
+    napi_set_named_property(env, v_stats, "buf_pool", v_buf_pool);
+    nb_napi_set_int64(env, v_buf_pool, "allocs", buf_pool_stats.allocs);
+    nb_napi_set_int64(env, v_buf_pool, "reuses", buf_pool_stats.reuses);
+    nb_napi_set_int64(env, v_buf_pool, "frees", buf_pool_stats.frees);
+    nb_napi_set_int64(env, v_buf_pool, "releases", buf_pool_stats.releases);
+    nb_napi_set_int64(env, v_buf_pool, "retained_bytes", buf_pool_stats.retained_bytes);
+    nb_napi_set_int64(env, v_buf_pool, "exposed_bytes", buf_pool_stats.exposed_bytes);
+    // allocs counts the chunk allocations served by bump allocation instead of malloc,
+    // blocks and large_blocks count the (pooled) blocks that the arenas took.
+    napi_create_object(env, &v_arena);
+    napi_set_named_property(env, v_stats, "arena", v_arena);
+    nb_napi_set_int64(env, v_arena, "allocs", arena_stats.allocs);
+    nb_napi_set_int64(env, v_arena, "bytes", arena_stats.bytes);
+    nb_napi_set_int64(env, v_arena, "blocks", arena_stats.blocks);
+    nb_napi_set_int64(env, v_arena, "large_blocks", arena_stats.large_blocks);
+    nb_napi_set_int64(env, v_arena, "frees", arena_stats.frees);
+    return v_stats;
 }
 
 static napi_value
 _nb_chunk_coder(napi_env env, napi_callback_info info)
 {
-    size_t argc = 3;
-    napi_value argv[] = { 0, 0, 0 };
+    size_t argc = 4;
+    napi_value argv[] = { 0, 0, 0, 0 };
     napi_get_cb_info(env, info, &argc, argv, 0, 0);
 
     napi_value v_coder = argv[0];
     napi_value v_chunks = argv[1];
     napi_value v_callback = argv[2];
+    napi_value v_options = argv[3];
     napi_value v_async_resource_name = 0;
     napi_value v_null = 0;
     napi_valuetype typeof_chunks = napi_undefined;
     napi_valuetype typeof_callback = napi_undefined;
+    napi_valuetype typeof_options = napi_undefined;
     bool is_chunks_array = false;
     uint32_t chunks_len = 1;
     char coder_str[8];
     NB_Coder_Type coder_type = NB_Coder_Type::ENCODER;
+    char priority_str[8] = "";
+    WorkStealingPool::Priority priority = WorkStealingPool::PRIORITY_NORMAL;
 
     napi_get_null(env, &v_null);
     napi_typeof(env, v_chunks, &typeof_chunks);
     napi_typeof(env, v_callback, &typeof_callback);
+    napi_typeof(env, v_options, &typeof_options);
 
     napi_get_value_string_utf8(env, v_coder, coder_str, sizeof(coder_str), 0);
     if (strncmp(coder_str, "enc", sizeof(coder_str)) == 0) {
@@ -91,6 +647,24 @@ _nb_chunk_coder(napi_env env, napi_callback_info info)
             "3rd argument should be callback (Function) or undefined - " CODER_JS_SIGNATURE);
         return 0;
     }
+    // options.priority is the class of the chunks - 'high', 'normal' or 'low'
+    // in the coder pool, or without it on the uv threadpool (see _nb_coder_uv_submit)
+    if (typeof_options == napi_object && v_options != v_null) {
+        nb_napi_get_str(env, v_options, "priority", priority_str, sizeof(priority_str));
+        if (priority_str[0] && !WorkStealingPool::priority_parse(priority_str, &priority)) {
+            napi_throw_type_error(
+                env,
+                0,
+                "4th argument priority should be 'high', 'normal' or 'low' - " CODER_JS_SIGNATURE);
+            return 0;
+        }
+    } else if (typeof_options != napi_undefined) {
+        napi_throw_type_error(
+            env,
+            0,
+            "4th argument should be options (Object) or undefined - " CODER_JS_SIGNATURE);
+        return 0;
+    }
 
     if (typeof_callback == napi_undefined) {
 
@@ -128,16 +702,60 @@ _nb_chunk_coder(napi_env env, napi_callback_info info)
             _nb_coder_load_chunk(env, v_chunk, chunk);
         }
 
+        async->works = 0;
+        async->works_count = 0;
+        async->works_pending = 0;
+        async->priority = priority;
+        async->tsfn = 0;
         napi_create_reference(env, v_chunks, 1, &async->r_chunks);
         napi_create_reference(env, v_callback, 1, &async->r_callback);
         napi_create_string_utf8(env, "CoderResource", NAPI_AUTO_LENGTH, &v_async_resource_name);
-        napi_create_async_work(
-            env, v_async_resource_name, v_async_resource_name, _nb_coder_async_execute, _nb_coder_async_complete, async, &async->work);
-        napi_queue_async_work(env, async->work);
+
+        if (CoderPool::instance().get_nthreads() > 0) {
+            // the whole batch is fanned out to the coder pool threads
+            // and the thread that completes the last chunk calls back to the event loop
+            napi_create_threadsafe_function(
+                env, 0, 0, v_async_resource_name, 0, 1, 0, 0, async, _nb_coder_pool_call_js, &async->tsfn);
+            CoderPool::instance().submit(
+                async->chunks, async->chunks_count, _nb_coder_pool_done, async, priority);
+        } else {
+            _nb_coder_uv_submit(env, async);
+        }
         return 0;
     }
 }
 
+// the chunks run in parallel on a few works of the uv threadpool
+// and the work that completes last calls back once for the batch
+static void
+_nb_coder_uv_submit(napi_env env, struct CoderAsync* async)
+{
+    const bool low = async->priority == WorkStealingPool::PRIORITY_LOW;
+    if (low) {
+        if (_nb_coder_uv_low.queued) {
+            _nb_coder_uv_low.held.push_back(async);
+            _nb_coder_uv_low_held++;
+            return;
+        }
+        _nb_coder_uv_low.queued = true;
+    }
+    _nb_coder_uv_batches++;
+    napi_value v_async_resource_name = 0;
+    napi_create_string_utf8(env, "CoderResource", NAPI_AUTO_LENGTH, &v_async_resource_name);
+    const int works_count = low ? 1 : std::max(1, std::min(async->chunks_count, CODER_UV_MAX_WORKS));
+    async->works = nb_new_arr(works_count, struct CoderAsyncWork);
+    async->works_count = works_count;
+    async->works_pending = works_count;
+    for (int i = 0; i < works_count; ++i) {
+        struct CoderAsyncWork* w = async->works + i;
+        w->async = async;
+        w->index = i;
+        napi_create_async_work(
+            env, v_async_resource_name, v_async_resource_name, _nb_coder_async_execute, _nb_coder_async_complete, w, &w->work);
+        napi_queue_async_work(env, w->work);
+    }
+}
+
 static void
 _nb_coder_load_chunk(napi_env env, napi_value v_chunk, struct NB_Coder_Chunk* chunk)
 {
@@ -147,6 +765,8 @@ _nb_coder_load_chunk(napi_env env, napi_value v_chunk, struct NB_Coder_Chunk* ch
         env, v_config, "digest_type", chunk->digest_type, sizeof(chunk->digest_type));
     nb_napi_get_str(
         env, v_config, "compress_type", chunk->compress_type, sizeof(chunk->compress_type));
+    nb_napi_get_int(env, v_config, "compress_level", &chunk->compress_level);
+    nb_napi_get_int(env, v_config, "compress_dict_id", &chunk->compress_dict_id);
     nb_napi_get_str(
         env, v_config, "cipher_type", chunk->cipher_type, sizeof(chunk->cipher_type));
     nb_napi_get_str(
@@ -156,6 +776,7 @@ _nb_coder_load_chunk(napi_env env, napi_value v_chunk, struct NB_Coder_Chunk* ch
     nb_napi_get_str(env, v_config, "parity_type", chunk->parity_type, sizeof(chunk->parity_type));
     nb_napi_get_int(env, v_config, "lrc_group", &chunk->lrc_group);
     nb_napi_get_int(env, v_config, "lrc_frags", &chunk->lrc_frags);
+    nb_napi_get_str(env, v_config, "lrc_type", chunk->lrc_type, sizeof(chunk->lrc_type));
 
     nb_napi_get_int(env, v_chunk, "size", &chunk->size);
     nb_napi_get_int(env, v_chunk, "frag_size", &chunk->frag_size);
@@ -189,11 +810,11 @@ _nb_coder_load_chunk(napi_env env, napi_value v_chunk, struct NB_Coder_Chunk* ch
             napi_get_array_length(env, v_frags, &frags_len);
 
             chunk->frags_count = frags_len;
-            chunk->frags = nb_new_arr(chunk->frags_count, struct NB_Coder_Frag);
+            chunk->frags = nb_arena_new_arr(&chunk->arena, chunk->frags_count, struct NB_Coder_Frag);
 
             for (uint32_t i = 0; i < frags_len; ++i) {
                 struct NB_Coder_Frag* f = chunk->frags + i;
-                nb_frag_init(f);
+                nb_frag_init(f, &chunk->arena);
                 napi_get_element(env, v_frags, i, &v_frag);
                 nb_napi_get_int(env, v_frag, "data_index", &f->data_index);
                 nb_napi_get_int(env, v_frag, "parity_index", &f->parity_index);
@@ -208,17 +829,61 @@ _nb_coder_load_chunk(napi_env env, napi_value v_chunk, struct NB_Coder_Chunk* ch
 static void
 _nb_coder_async_execute(napi_env env, void* data)
 {
-    struct CoderAsync* async = (struct CoderAsync*)data;
-    for (int i = 0; i < async->chunks_count; ++i) {
-        struct NB_Coder_Chunk* chunk = async->chunks + i;
-        nb_chunk_coder(chunk);
+    struct CoderAsyncWork* w = (struct CoderAsyncWork*)data;
+    struct CoderAsync* async = w->async;
+    for (int i = w->index; i < async->chunks_count; i += async->works_count) {
+        nb_chunk_coder(async->chunks + i);
     }
 }
 
 static void
 _nb_coder_async_complete(napi_env env, napi_status status, void* data)
+{
+    struct CoderAsyncWork* w = (struct CoderAsyncWork*)data;
+    struct CoderAsync* async = w->async;
+    napi_delete_async_work(env, w->work);
+    if (--async->works_pending > 0) return;
+    // the next held low batch is queued before the callback can submit more
+    if (async->priority == WorkStealingPool::PRIORITY_LOW) {
+        _nb_coder_uv_low.queued = false;
+        if (!_nb_coder_uv_low.held.empty()) {
+            struct CoderAsync* next = _nb_coder_uv_low.held.front();
+            _nb_coder_uv_low.held.pop_front();
+            _nb_coder_uv_submit(env, next);
+        }
+    }
+    _nb_coder_async_finish(env, async);
+}
+
+// called by the coder pool thread that completed the batch
+static void
+_nb_coder_pool_done(void* arg)
+{
+    struct CoderAsync* async = (struct CoderAsync*)arg;
+    napi_threadsafe_function tsfn = async->tsfn;
+    napi_call_threadsafe_function(tsfn, async, napi_tsfn_nonblocking);
+    napi_release_threadsafe_function(tsfn, napi_tsfn_release);
+}
+
+static void
+_nb_coder_pool_call_js(napi_env env, napi_value js_callback, void* context, void* data)
 {
     struct CoderAsync* async = (struct CoderAsync*)data;
+    // env is null when the environment is torn down and the callback cannot be called
+    if (!env) {
+        for (int i = 0; i < async->chunks_count; ++i) {
+            nb_chunk_free(async->chunks + i);
+        }
+        nb_free(async->chunks);
+        nb_free(async);
+        return;
+    }
+    _nb_coder_async_finish(env, async);
+}
+
+static void
+_nb_coder_async_finish(napi_env env, struct CoderAsync* async)
+{
     napi_value v_global = 0;
     napi_value v_chunks = 0;
     napi_value v_callback = 0;
@@ -244,8 +909,7 @@ _nb_coder_async_complete(napi_env env, napi_status status, void* data)
 
     napi_delete_reference(env, async->r_chunks);
     napi_delete_reference(env, async->r_callback);
-    napi_delete_async_work(env, async->work);
-
+    if (async->works) nb_free(async->works);
     nb_free(async->chunks);
     nb_free(async);
 }
@@ -0,0 +1,94 @@
+/* Copyright (C) 2016 NooBaa */
+#include "coder_pool.h"
+
+namespace noobaa
+{
+
+CoderPool&
+CoderPool::instance()
+{
+    // never deleted to avoid racing with threads that are still running at exit
+    static CoderPool* pool = new CoderPool();
+    return *pool;
+}
+
+CoderPool::CoderPool()
+    : _pool(WorkStealingPool::shared())
+    , _batches(0)
+    , _chunks(0)
+{
+}
+
+void
+CoderPool::submit(
+    struct NB_Coder_Chunk* chunks,
+    int count,
+    Callback callback,
+    void* callback_arg,
+    WorkStealingPool::Priority priority)
+{
+    _batches++;
+
+    if (count <= 0) {
+        callback(callback_arg);
+        return;
+    }
+
+    // the batch owns its tasks and is deleted by the thread that completes the last one
+    Batch* batch = new Batch;
+    batch->pending = count;
+    batch->callback = callback;
+    batch->callback_arg = callback_arg;
+    batch->tasks.resize(count);
+    std::vector<WorkStealingPool::Task*> tasks(count);
+    const bool route = _pool.get_placement() != WorkStealingPool::PLACEMENT_NONE;
+    for (int i = 0; i < count; ++i) {
+        ChunkTask& task = batch->tasks[i];
+        task.chunk = chunks + i;
+        task.batch = batch;
+        task.pool = this;
+        task.node = route ? chunk_node(task.chunk) : -1;
+        task.priority = priority;
+        tasks[i] = &task;
+    }
+    _pool.submit(tasks.data(), count);
+}
+
+// the node of the first input buffer - the data of an encoded chunk or the first frag to decode
+int
+CoderPool::chunk_node(struct NB_Coder_Chunk* chunk)
+{
+    struct NB_Bufs* input = &chunk->data;
+    if (chunk->coder == NB_Coder_Type::DECODER) {
+        if (chunk->frags_count <= 0 || !chunk->frags) return -1;
+        input = &chunk->frags[0].block;
+    }
+    if (input->count <= 0) return -1;
+    return nb_numa_node_of_addr(nb_bufs_get(input, 0)->data);
+}
+
+void
+CoderPool::ChunkTask::run()
+{
+    nb_chunk_coder(chunk);
+    pool->_chunks++;
+    if (batch->pending.fetch_sub(1) == 1) {
+        Batch* b = batch;
+        b->callback(b->callback_arg);
+        delete b;
+    }
+}
+
+void
+CoderPool::stats(struct NB_Coder_Pool_Stats* stats)
+{
+    struct NB_Work_Stealing_Stats pool_stats;
+    _pool.stats(&pool_stats);
+    stats->nthreads = pool_stats.nthreads;
+    stats->batches = _batches;
+    stats->chunks = _chunks;
+    stats->steals = pool_stats.steals;
+    stats->threads = pool_stats;
+}
+
+} // namespace noobaa
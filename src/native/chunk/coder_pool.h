@@ -0,0 +1,86 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "../util/work_stealing.h"
+#include "coder.h"
+
+namespace noobaa
+{
+
+struct NB_Coder_Pool_Stats {
+    int nthreads;
+    uint64_t batches;
+    uint64_t chunks;
+    uint64_t steals;
+    struct NB_Work_Stealing_Stats threads;
+};
+
+/**
+ *
+ * CoderPool
+ *
+ * Runs batches of chunks on native threads instead of the uv threadpool,
+ * which is shared with fs and dns and is easily saturated by coding.
+ * Every chunk is a task of the shared WorkStealingPool so a batch spreads over all the threads,
+ * and its callback is called only once, from the thread that completed the last chunk of the batch.
+ * With a placement the threads are pinned, and every chunk is routed to a thread
+ * on the numa node that owns its input buffers.
+ *
+ */
+class CoderPool
+{
+public:
+    typedef void (*Callback)(void* arg);
+
+    static CoderPool& instance();
+
+    /**
+     * sets the threads of the shared pool, which ThreadPool workers run on too.
+     * nthreads == 0: no threads, the caller should use the uv threadpool
+     * nthreads >= 1: create threads (shrinking lets threads exit once the queues are empty)
+     */
+    void set_nthreads(int nthreads) { _pool.set_nthreads(nthreads); }
+    int get_nthreads() { return _pool.get_nthreads(); }
+
+    void set_placement(WorkStealingPool::Placement placement) { _pool.set_placement(placement); }
+    WorkStealingPool::Placement get_placement() { return _pool.get_placement(); }
+
+    void submit(
+        struct NB_Coder_Chunk* chunks,
+        int count,
+        Callback callback,
+        void* callback_arg,
+        WorkStealingPool::Priority priority = WorkStealingPool::PRIORITY_NORMAL);
+
+    void stats(struct NB_Coder_Pool_Stats* stats);
+
+private:
+    struct Batch;
+
+    struct ChunkTask : public WorkStealingPool::Task {
+        struct NB_Coder_Chunk* chunk;
+        Batch* batch;
+        CoderPool* pool;
+        virtual void run();
+    };
+
+    struct Batch {
+        std::atomic<int> pending;
+        Callback callback;
+        void* callback_arg;
+        std::vector<ChunkTask> tasks;
+    };
+
+    CoderPool();
+
+    static int chunk_node(struct NB_Coder_Chunk* chunk);
+
+    WorkStealingPool& _pool;
+    std::atomic<uint64_t> _batches;
+    std::atomic<uint64_t> _chunks;
+};
+
+} // namespace noobaa
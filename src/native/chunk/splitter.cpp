@@ -16,13 +16,20 @@ namespace noobaa
 // and it's not really valuable to make them dynamic
 Rabin Splitter::_rabin(NB_RABIN_POLY, NB_RABIN_DEGREE, NB_RABIN_WINDOW_LEN);
 
+// the gear table seed is part of the chunking format - never change it
+#define NB_GEAR_SEED 0x4e6f6f4261436443ULL
+Gear Splitter::_gear(NB_GEAR_SEED);
+
 Splitter::Splitter(
+    SplitType split_type,
     int min_chunk,
     int max_chunk,
     int avg_chunk_bits,
     bool calc_md5,
-    bool calc_sha256)
-    : _min_chunk(min_chunk)
+    bool calc_sha256,
+    bool digest_thread)
+    : _split_type(split_type)
+    , _min_chunk(min_chunk)
     , _max_chunk(max_chunk)
     , _avg_chunk_bits(avg_chunk_bits)
     , _calc_md5(calc_md5)
@@ -32,6 +39,13 @@ Splitter::Splitter(
     , _hash(0)
     , _md5_ctx(0)
     , _sha256_ctx(0)
+    , _digest_thread(digest_thread && (calc_md5 || calc_sha256))
+    , _digest_ctx(0)
+    , _digest_stop(false)
+    , _digest_pushed(0)
+    , _digest_done(0)
+    , _digest_producer_waiting(false)
+    , _digest_consumer_waiting(false)
 {
     assert(_min_chunk > 0);
     assert(_min_chunk <= _max_chunk);
@@ -46,10 +60,15 @@ Splitter::Splitter(
         _sha256_ctx = EVP_MD_CTX_new();
         EVP_DigestInit_ex(_sha256_ctx, EVP_sha256(), NULL);
     }
+    if (_digest_thread) {
+        _digest_ctx = calc_sha256 ? _sha256_ctx : _md5_ctx;
+        uv_thread_create(&_digest_tid, &_digest_thread_main_uv, this);
+    }
 }
 
 Splitter::~Splitter()
 {
+    _digest_join();
     nb_buf_free(&_window);
     if (_calc_md5) EVP_MD_CTX_free(_md5_ctx);
     if (_calc_sha256) EVP_MD_CTX_free(_sha256_ctx);
@@ -58,21 +77,129 @@ Splitter::~Splitter()
 void
 Splitter::push(const uint8_t* data, int len)
 {
-    if (_calc_md5) EVP_DigestUpdate(_md5_ctx, data, len);
-    if (_calc_sha256) EVP_DigestUpdate(_sha256_ctx, data, len);
+    if (_digest_thread) {
+        _digest_push(data, len);
+    } else {
+        _digest_update(data, len);
+    }
+    if (_split_type == SPLIT_GEAR) {
+        while (_next_point_gear(&data, &len)) {
+            _split_points.push_back(_chunk_pos);
+            _chunk_pos = 0;
+        }
+        return;
+    }
     while (_next_point(&data, &len)) {
         _split_points.push_back(_chunk_pos);
         _chunk_pos = 0;
     }
 }
 
+void
+Splitter::sync()
+{
+    if (!_digest_thread) return;
+    if (_digest_done == _digest_pushed) return;
+    MutexCond::Lock lock(_digest_cond);
+    _digest_producer_waiting = true;
+    while (_digest_done < _digest_pushed) {
+        _digest_cond.wait();
+    }
+    _digest_producer_waiting = false;
+}
+
 void
 Splitter::finish(uint8_t* md5, uint8_t* sha256)
 {
+    // no more data is expected so the thread can exit now and not wait for the destructor
+    _digest_join();
     if (md5 && _calc_md5) EVP_DigestFinal_ex(_md5_ctx, md5, 0);
     if (sha256 && _calc_sha256) EVP_DigestFinal_ex(_sha256_ctx, sha256, 0);
 }
 
+void
+Splitter::_digest_update(const uint8_t* data, int len)
+{
+    if (_calc_md5) EVP_DigestUpdate(_md5_ctx, data, len);
+    if (_calc_sha256) EVP_DigestUpdate(_sha256_ctx, data, len);
+}
+
+// the cond is only locked when the other side is sleeping on it -
+// the sleeper sets its waiting flag before checking the counters,
+// and the waker changes the counters before checking the flag,
+// and since these atomics are all seq_cst at least one of them sees the other.
+
+void
+Splitter::_digest_push(const uint8_t* data, int len)
+{
+    DigestItem item;
+    item.data = data;
+    item.len = len;
+    if (!_digest_ring.try_push(item)) {
+        MutexCond::Lock lock(_digest_cond);
+        _digest_producer_waiting = true;
+        while (_digest_pushed - _digest_done >= DIGEST_RING_SIZE) {
+            _digest_cond.wait();
+        }
+        _digest_producer_waiting = false;
+        const bool pushed = _digest_ring.try_push(item);
+        assert(pushed);
+        (void)pushed;
+    }
+    _digest_pushed++;
+    if (_digest_consumer_waiting) {
+        MutexCond::Lock lock(_digest_cond);
+        _digest_cond.broadcast();
+    }
+    // when both digests are needed the thread takes sha256,
+    // and md5 stays with the scan to split the work between the two threads.
+    if (_digest_ctx != _md5_ctx && _calc_md5) EVP_DigestUpdate(_md5_ctx, data, len);
+}
+
+void
+Splitter::_digest_join()
+{
+    if (!_digest_thread) return;
+    {
+        MutexCond::Lock lock(_digest_cond);
+        _digest_stop = true;
+        _digest_cond.broadcast();
+    }
+    uv_thread_join(&_digest_tid);
+    _digest_thread = false;
+}
+
+void
+Splitter::_digest_thread_main()
+{
+    DigestItem item;
+    while (true) {
+        if (_digest_ring.try_pop(&item)) {
+            EVP_DigestUpdate(_digest_ctx, item.data, item.len);
+            _digest_done++;
+            // wakes up the producer waiting for room in the ring or for sync()
+            if (_digest_producer_waiting) {
+                MutexCond::Lock lock(_digest_cond);
+                _digest_cond.broadcast();
+            }
+            continue;
+        }
+        MutexCond::Lock lock(_digest_cond);
+        _digest_consumer_waiting = true;
+        while (_digest_done == _digest_pushed && !_digest_stop) {
+            _digest_cond.wait();
+        }
+        _digest_consumer_waiting = false;
+        if (_digest_stop && _digest_done == _digest_pushed) return;
+    }
+}
+
+void
+Splitter::_digest_thread_main_uv(void* arg)
+{
+    static_cast<Splitter*>(arg)->_digest_thread_main();
+}
+
 bool
 Splitter::_next_point(const uint8_t** const p_data, int* const p_len)
 {
@@ -142,4 +269,75 @@ Splitter::_next_point(const uint8_t** const p_data, int* const p_len)
         return false;
     }
 }
+
+bool
+Splitter::_next_point_gear(const uint8_t** const p_data, int* const p_len)
+{
+    int chunk_pos = _chunk_pos;
+    const int total = chunk_pos + (*p_len);
+    const int min = total < _min_chunk ? total : _min_chunk;
+    const int max = total < _max_chunk ? total : _max_chunk;
+
+    // normalized chunking - the expected chunk length is min + 2^avg_chunk_bits like rabin,
+    // but we use a harder mask before that point and an easier one after it,
+    // which narrows the chunk length distribution around the average.
+    const int avg_pos = _min_chunk + (_avg_chunk_bits < 30 ? (1 << _avg_chunk_bits) : _max_chunk);
+    const int normal = max < avg_pos ? max : avg_pos;
+    const int hard_bits = _avg_chunk_bits ? _avg_chunk_bits + 1 : 0;
+    const int easy_bits = _avg_chunk_bits ? _avg_chunk_bits - 1 : 0;
+    const Gear::Hash hard_mask = Gear::mask(hard_bits);
+    const Gear::Hash easy_mask = Gear::mask(easy_bits);
+
+    Gear::Hash hash = _hash;
+    const uint8_t* data = *p_data;
+    bool boundary = false;
+
+    // skip byte scanning as long as below min chunk length
+    if (chunk_pos < min) {
+        data += min - chunk_pos;
+        chunk_pos = min;
+    }
+
+    // the hash only needs a shift and an add per byte with a single table lookup,
+    // and has no window to pop bytes from, so the loops are as tight as possible.
+    if (chunk_pos < normal) {
+        const uint8_t* const end = data + (normal - chunk_pos);
+        while (data < end) {
+            hash = _gear.update(hash, *data);
+            data++;
+            if (!(hash & hard_mask)) {
+                boundary = true;
+                break;
+            }
+        }
+        chunk_pos = normal - (int)(end - data);
+    }
+    if (!boundary && chunk_pos < max) {
+        const uint8_t* const end = data + (max - chunk_pos);
+        while (data < end) {
+            hash = _gear.update(hash, *data);
+            data++;
+            if (!(hash & easy_mask)) {
+                boundary = true;
+                break;
+            }
+        }
+        chunk_pos = max - (int)(end - data);
+    }
+
+    if (boundary || chunk_pos >= _max_chunk) {
+        const int n = (int)(data - (*p_data));
+        _chunk_pos = chunk_pos;
+        _hash = 0;
+        *p_data = data;
+        *p_len -= n;
+        return true;
+    } else {
+        _chunk_pos = chunk_pos;
+        _hash = hash;
+        *p_data = 0;
+        *p_len = 0;
+        return false;
+    }
+}
 }
@@ -1,11 +1,15 @@
 /* Copyright (C) 2016 NooBaa */
 #pragma once
 
+#include <atomic>
 #include <vector>
 
 #include <openssl/evp.h>
 
+#include "../util/gear.h"
+#include "../util/mutex.h"
 #include "../util/rabin.h"
+#include "../util/spsc_ring.h"
 #include "../util/struct_buf.h"
 
 namespace noobaa
@@ -17,17 +21,39 @@ public:
     typedef int Point;
     typedef std::vector<Point> Points;
 
+    /**
+     * SPLIT_RABIN is the original rabin fingerprint over a 64 bytes window,
+     * and its points must stay the same to dedup with existing chunks.
+     * SPLIT_GEAR is a FastCDC style gear hash with normalized chunking,
+     * which is much cheaper per byte but splits differently,
+     * so it should be set per bucket and never change for it.
+     */
+    enum SplitType {
+        SPLIT_RABIN,
+        SPLIT_GEAR,
+    };
+
     Splitter(
+        SplitType split_type,
         int min_chunk,
         int max_chunk,
         int avg_chunk_bits,
         bool calc_md5,
-        bool calc_sha256);
+        bool calc_sha256,
+        bool digest_thread = false);
 
     ~Splitter();
 
+    /**
+     * with digest_thread the md5/sha256 of the pushed data are calculated
+     * by a dedicated thread concurrently with the boundary scan,
+     * so the pushed data must stay valid until sync() returns.
+     */
     void push(const uint8_t* data, int len);
 
+    // wait for the digest thread to consume all the pushed data (noop without it)
+    void sync();
+
     void finish(uint8_t* md5, uint8_t* sha256);
 
     bool calc_md5() { return _calc_md5; }
@@ -35,6 +61,7 @@ public:
     Points extract_points() { return std::move(_split_points); }
 
 private:
+    const SplitType _split_type;
     const int _min_chunk;
     const int _max_chunk;
     const int _avg_chunk_bits;
@@ -49,8 +76,34 @@ private:
     EVP_MD_CTX *_md5_ctx;
     EVP_MD_CTX *_sha256_ctx;
 
+    struct DigestItem {
+        const uint8_t* data;
+        int len;
+    };
+
+    // digest thread - the ring passes buffer references from push() to the thread
+    // and the cond is only used to sleep when the ring is empty/full or on sync().
+    bool _digest_thread;
+    uv_thread_t _digest_tid;
+    EVP_MD_CTX* _digest_ctx;
+    static const int DIGEST_RING_SIZE = 64;
+    SpscRing<DigestItem, DIGEST_RING_SIZE> _digest_ring;
+    MutexCond _digest_cond;
+    bool _digest_stop;
+    std::atomic<uint64_t> _digest_pushed;
+    std::atomic<uint64_t> _digest_done;
+    std::atomic<bool> _digest_producer_waiting;
+    std::atomic<bool> _digest_consumer_waiting;
+
     static Rabin _rabin;
+    static Gear _gear;
 
     bool _next_point(const uint8_t** const p_data, int* const p_len);
+    bool _next_point_gear(const uint8_t** const p_data, int* const p_len);
+    void _digest_update(const uint8_t* data, int len);
+    void _digest_push(const uint8_t* data, int len);
+    void _digest_join();
+    void _digest_thread_main();
+    static void _digest_thread_main_uv(void* arg);
 };
 }
@@ -7,9 +7,14 @@ namespace noobaa
 {
 #define SPLITTER_JS_SIGNATURE "function chunk_splitter(state, buffers, callback?)"
 
+// split points are returned as an Int32Array -
+// when state.points_array is an Int32Array that can fit them, they are written to it
+// and a view of it is returned, so a stream can reuse the same memory for every call.
+static_assert(sizeof(Splitter::Point) == sizeof(int32_t), "split points are int32");
+
 static Napi::Value _chunk_splitter(const Napi::CallbackInfo& info);
 static Napi::Value _splitter_finish(Napi::Env env, Splitter* splitter);
-static Napi::Value _splitter_result(Napi::Env env, Splitter* splitter);
+static Napi::Value _splitter_result(Napi::Env env, Napi::Object state, Splitter* splitter);
 
 void
 splitter_napi(Napi::Env env, Napi::Object exports)
@@ -55,11 +60,13 @@ public:
         for (int i = 0; i < _input.count; ++i, ++b) {
             _splitter->push(b->data, b->len);
         }
+        // the input buffers are released with the worker
+        _splitter->sync();
     }
 
     virtual void OnOK()
     {
-        auto result = _splitter_result(Env(), _splitter);
+        auto result = _splitter_result(Env(), _state_ref.Value(), _splitter);
         Callback().MakeCallback(Env().Global(), {Env().Null(), result});
     }
 
@@ -106,11 +113,20 @@ _chunk_splitter(const Napi::CallbackInfo& info)
         const int avg_chunk_bits = Napi::Value(state["avg_chunk_bits"]).As<Napi::Number>();
         const bool calc_md5 = Napi::Value(state["calc_md5"]).As<Napi::Boolean>();
         const bool calc_sha256 = Napi::Value(state["calc_sha256"]).As<Napi::Boolean>();
-        if (min_chunk <= 0 || max_chunk < min_chunk || avg_chunk_bits < 0) {
+        const bool digest_thread = Napi::Value(state["digest_thread"]).ToBoolean();
+        Napi::Value split_type_val = state["split_type"];
+        const std::string split_type = split_type_val.IsString()
+            ? split_type_val.As<Napi::String>().Utf8Value()
+            : "rabin";
+        if (min_chunk <= 0 || max_chunk < min_chunk || avg_chunk_bits < 0 ||
+            (split_type != "rabin" && split_type != "gear")) {
             throw Napi::Error::New(info.Env(), "Invalid splitter config");
         }
-        splitter = new Splitter(min_chunk, max_chunk, avg_chunk_bits, calc_md5, calc_sha256);
-        state["splitter"] = Napi::External<Splitter>::New(info.Env(), splitter);
+        splitter = new Splitter(
+            split_type == "gear" ? Splitter::SPLIT_GEAR : Splitter::SPLIT_RABIN,
+            min_chunk, max_chunk, avg_chunk_bits, calc_md5, calc_sha256, digest_thread);
+        state["splitter"] = Napi::External<Splitter>::New(
+            info.Env(), splitter, [](Napi::Env env, Splitter* s) { delete s; });
     }
 
     auto buffers = info[1].As<Napi::Array>();
@@ -120,13 +136,15 @@ _chunk_splitter(const Napi::CallbackInfo& info)
         for (int i = 0; i < buffers_len; ++i) {
             Napi::Value buf_val = buffers[i];
             if (!buf_val.IsBuffer()) {
+                splitter->sync();
                 throw Napi::TypeError::New(
                     info.Env(), "Argument 'buffers[i] should be buffer - " SPLITTER_JS_SIGNATURE);
             }
             auto buf = buf_val.As<Napi::Buffer<uint8_t>>();
             splitter->push(buf.Data(), buf.Length());
         }
-        return _splitter_result(info.Env(), splitter);
+        splitter->sync();
+        return _splitter_result(info.Env(), state, splitter);
 
     } else {
         auto callback = info[2].As<Napi::Function>();
@@ -157,14 +175,21 @@ _splitter_finish(Napi::Env env, Splitter* splitter)
 }
 
 static Napi::Value
-_splitter_result(Napi::Env env, Splitter* splitter)
+_splitter_result(Napi::Env env, Napi::Object state, Splitter* splitter)
 {
     auto split_points = splitter->extract_points();
-    int count = split_points.size();
-    auto arr = Napi::Array::New(env, count);
-    for (int i = 0; i < count; ++i) {
-        arr[i] = Napi::Number::New(env, split_points[i]);
+    const size_t count = split_points.size();
+    Napi::Value points_val = state["points_array"];
+    if (points_val.IsTypedArray() &&
+        points_val.As<Napi::TypedArray>().TypedArrayType() == napi_int32_array) {
+        auto points = points_val.As<Napi::Int32Array>();
+        if (points.ElementLength() >= count) {
+            if (count) memcpy(points.Data(), split_points.data(), count * sizeof(int32_t));
+            return Napi::Int32Array::New(env, count, points.ArrayBuffer(), points.ByteOffset());
+        }
     }
+    auto arr = Napi::Int32Array::New(env, count);
+    if (count) memcpy(arr.Data(), split_points.data(), count * sizeof(int32_t));
     return arr;
 }
 }
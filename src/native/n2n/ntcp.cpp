@@ -1,7 +1,11 @@
 /* Copyright (C) 2016 NooBaa */
 #include "ntcp.h"
 
+#include <algorithm>
+#include <limits.h>
+
 #include "../util/buf.h"
+#include "../util/buf_pool.h"
 #include "../util/endian.h"
 
 namespace noobaa
@@ -10,9 +14,16 @@ namespace noobaa
 DBG_INIT(0);
 
 Nan::Persistent<v8::Function> Ntcp::_ctor;
+std::vector<Ntcp::Msg*> Ntcp::_msg_pool;
+std::vector<Ntcp::WriteBatch*> Ntcp::_write_batch_pool;
 
 static const int NTCP_SNDBUF_SIZE = 128 * 1024;
 static const int NTCP_RCVBUF_SIZE = 128 * 1024;
+#ifdef IOV_MAX
+static const int NTCP_WRITE_BATCH_MAX_IOVECS = IOV_MAX;
+#else
+static const int NTCP_WRITE_BATCH_MAX_IOVECS = 1024;
+#endif
 
 NAN_MODULE_INIT(Ntcp::setup)
 {
@@ -26,6 +37,7 @@ NAN_MODULE_INIT(Ntcp::setup)
     Nan::SetPrototypeMethod(tpl, "listen", Ntcp::listen);
     Nan::SetPrototypeMethod(tpl, "connect", Ntcp::connect);
     Nan::SetPrototypeMethod(tpl, "write", Ntcp::write);
+    Nan::SetPrototypeMethod(tpl, "stats", Ntcp::stats);
     auto func = Nan::GetFunction(tpl).ToLocalChecked();
     _ctor.Reset(func);
     NAN_SET(target, name, func);
@@ -35,23 +47,47 @@ NAN_METHOD(Ntcp::new_instance)
 {
     NAN_MAKE_CTOR_CALL(_ctor);
     Ntcp* obj = new Ntcp();
+    if (info.Length() > 0 && info[0]->IsObject()) {
+        auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+        obj->_mux = Nan::To<bool>(NAN_GET(options, "mux")).FromJust();
+    }
     obj->Wrap(info.This());
     info.GetReturnValue().Set(info.This());
 }
 
 Ntcp::Ntcp()
-    : _recv_payload(NULL)
-    , _recv_hdr_pos(0)
+    : _recv_is_mux(false)
+    , _recv_block(NULL)
+    , _recv_block_start(0)
+    , _recv_block_end(0)
+    , _recv_payload(NULL)
     , _recv_payload_pos(0)
+    , _recv_payload_len(0)
+    , _recv_syscalls(0)
+    , _recv_messages(0)
+    , _recv_bytes(0)
+    , _recv_direct(0)
+    , _recv_blocks(0)
     // , _send_msg_seq(1)
     , _recv_msg_seq(1)
     , _closed(false)
     , _reading(false)
     , _local_port(0)
+    , _mux(false)
+    , _mux_next_stream_id(1)
+    , _mux_send_streams(0)
+    , _mux_send_bytes(0)
+    , _mux_inflight(0)
+    , _mux_recv_bytes(0)
+    , _write_inflight(0)
+    , _write_batches(0)
+    , _write_messages(0)
 {
     DBG2("Ntcp::Ntcp");
     NAUV_CALL(uv_tcp_init(uv_default_loop(), &_tcp_handle));
     _tcp_handle.data = this;
+    NAUV_CALL(uv_prepare_init(uv_default_loop(), &_write_prepare_handle));
+    _write_prepare_handle.data = this;
 }
 
 Ntcp::~Ntcp()
@@ -76,11 +112,49 @@ Ntcp::_close()
     _closed = true;
     DBG0("Ntcp::close: local_port " << _local_port);
     uv_close(reinterpret_cast<uv_handle_t*>(&_tcp_handle), NULL);
+    NAUV_CALL(uv_prepare_stop(&_write_prepare_handle));
+    uv_close(reinterpret_cast<uv_handle_t*>(&_write_prepare_handle), NULL);
     if (_recv_payload) {
-        delete[] _recv_payload;
+        nb_buf_pool_free(reinterpret_cast<uint8_t*>(_recv_payload));
+        _recv_payload = NULL;
+    }
+    if (_recv_block) {
+        _recv_block_unref(_recv_block);
+        _recv_block = NULL;
     }
+    for (auto& it : _mux_recv_streams) {
+        for (auto& chunk : it.second.chunks) {
+            _recv_slice_free(chunk);
+        }
+    }
+    _mux_recv_streams.clear();
+    _mux_recv_bytes = 0;
+    _mux_send_streams = 0;
+    _mux_send_bytes = 0;
     Nan::HandleScope scope;
     _reading_persistent.Reset();
+    while (!_mux_pending.empty()) {
+        Msg* m = _mux_pending.front();
+        _mux_pending.pop_front();
+        m->done("Ntcp::write: CLOSED");
+        Msg::release(m);
+    }
+    // chunks already in uv_write are canceled by uv_close and release their message later
+    while (!_mux_queue.empty()) {
+        Msg* m = _mux_queue.front();
+        _mux_queue.pop_front();
+        m->done("Ntcp::write: CLOSED");
+        if (!m->inflight) {
+            Msg::release(m);
+        }
+    }
+    // batches already in uv_write are canceled by uv_close as well
+    while (!_write_queue.empty()) {
+        Msg* m = _write_queue.front();
+        _write_queue.pop_front();
+        m->done("Ntcp::write: CLOSED");
+        Msg::release(m);
+    }
     if (*handle()) {
         v8::Local<v8::Value> argv[] = {NAN_STR("close")};
         NAN_CALLBACK(handle(), "emit", 1, argv);
@@ -143,6 +217,7 @@ NAUV_CALLBACK_STATUS(Ntcp::_connection_callback, uv_stream_t* listener)
     v8::Local<v8::Value> obj(Nan::CallAsConstructor(Nan::New(Ntcp::_ctor), 0, 0).ToLocalChecked());
     Ntcp& conn = *NAN_UNWRAP_OBJ(Ntcp, obj);
     conn._local_port = self._local_port;
+    conn._mux = self._mux;
     conn._accept(listener);
     v8::Local<v8::Value> argv[] = {NAN_STR("connection"), obj};
     NAN_CALLBACK(self.handle(), "emit", 2, argv);
@@ -215,11 +290,16 @@ NAUV_CALLBACK_STATUS(Ntcp::_connect_callback, uv_connect_t* req)
 NAN_METHOD(Ntcp::write)
 {
     Ntcp& self = *NAN_UNWRAP_THIS(Ntcp);
-    NanCallbackSharedPtr callback(new Nan::Callback(info[1].As<v8::Function>()));
+    NanCallbackSharedPtr callback;
+    if (info[1]->IsFunction()) {
+        callback.reset(new Nan::Callback(info[1].As<v8::Function>()));
+    }
     if (self._closed) {
         DBG5("Ntcp::write: closed. thats an error.");
-        v8::Local<v8::Value> argv[] = {NAN_ERR("Ntcp::write: CLOSED")};
-        Nan::Call(*callback, 1, argv);
+        if (callback) {
+            v8::Local<v8::Value> argv[] = {NAN_ERR("Ntcp::write: CLOSED")};
+            Nan::Call(*callback, 1, argv);
+        }
         return;
     }
     // if (!self._local_port) {
@@ -228,9 +308,7 @@ NAN_METHOD(Ntcp::write)
     //     Nan::Call(*callback, 1, argv);
     //     return;
     // }
-    uv_write_t* write_req = new uv_write_t;
-    Msg* m = new Msg;
-    write_req->data = m;
+    Msg* m = Msg::alloc();
     m->callback = callback;
     v8::Local<v8::Object> buffer_or_buffers = Nan::To<v8::Object>(info[0]).ToLocalChecked();
     m->persistent.Reset(buffer_or_buffers); // keep persistent ref to the buffer
@@ -255,45 +333,256 @@ NAN_METHOD(Ntcp::write)
             m->hdr.len += len;
         }
     } else {
+        Msg::release(m);
         return Nan::ThrowError("Ntcp::write: expected buffer or array of buffers");
     }
+    if (m->hdr.len > MAX_MSG_LEN) {
+        // the peer would close the connection on it
+        m->done("Ntcp::write: message too big");
+        Msg::release(m);
+        NAN_RETURN(Nan::Undefined());
+    }
+    if (self._mux) {
+        // the message is queued as a new stream without the plain header
+        m->stream_id = self._mux_next_stream_id++;
+        m->iov_index = 1;
+        DBG2(
+            "Ntcp::write: mux"
+            << " stream "
+            << m->stream_id
+            << " len "
+            << m->hdr.len
+            << " local_port "
+            << self._local_port);
+        self._mux_pending.push_back(m);
+        self._mux_pump();
+        NAN_RETURN(Nan::Undefined());
+    }
     // m->hdr.seq = self._send_msg_seq++;
     DBG2(
         "Ntcp::write:"
         //  << " seq " << m->hdr.seq
         << " len "
         << m->hdr.len
+        << " queue "
+        << self._write_queue.size()
         << " local_port "
         << self._local_port);
     m->hdr.encode();
-    NAUV_CALL(uv_write(
-        write_req,
-        reinterpret_cast<uv_stream_t*>(&self._tcp_handle),
-        m->iovecs.data(),
-        m->iovecs.size(),
-        &Ntcp::_write_callback));
+    self._write_queue.push_back(m);
+    if (self._write_queue.size() == 1 && !self._write_inflight) {
+        self._write_flush();
+    } else {
+        NAUV_CALL(uv_prepare_start(&self._write_prepare_handle, &Ntcp::_write_prepare_callback));
+    }
     NAN_RETURN(Nan::Undefined());
 }
 
+NAUV_CALLBACK(Ntcp::_write_prepare_callback, uv_prepare_t* handle)
+{
+    Nan::HandleScope scope;
+    Ntcp& self = *reinterpret_cast<Ntcp*>(handle->data);
+    self._write_flush();
+}
+
+/**
+ * write the queued messages, coalescing as many as the batch limits allow to every uv_write.
+ */
+void
+Ntcp::_write_flush()
+{
+    NAUV_CALL(uv_prepare_stop(&_write_prepare_handle));
+    while (!_closed && !_write_queue.empty()) {
+        WriteBatch* b;
+        if (_write_batch_pool.empty()) {
+            b = new WriteBatch;
+        } else {
+            b = _write_batch_pool.back();
+            _write_batch_pool.pop_back();
+        }
+        b->req.data = b;
+        b->ntcp = this;
+        int bytes = 0;
+        while (!_write_queue.empty()) {
+            Msg* m = _write_queue.front();
+            int len = 0;
+            for (const uv_buf_t& iov : m->iovecs) {
+                len += iov.len;
+            }
+            // a message that exceeds the limits by itself is still written as a batch of one
+            if (!b->msgs.empty()
+                && (b->iovecs.size() + m->iovecs.size() > size_t(NTCP_WRITE_BATCH_MAX_IOVECS)
+                    || bytes + len > WRITE_BATCH_MAX_BYTES)) {
+                break;
+            }
+            _write_queue.pop_front();
+            b->msgs.push_back(m);
+            b->iovecs.insert(b->iovecs.end(), m->iovecs.begin(), m->iovecs.end());
+            bytes += len;
+        }
+        DBG3(
+            "Ntcp::_write_flush:"
+            << " messages "
+            << b->msgs.size()
+            << " iovecs "
+            << b->iovecs.size()
+            << " bytes "
+            << bytes
+            << " queue "
+            << _write_queue.size());
+        if (!_write_inflight) {
+            // keep the connection alive until its batches are written or canceled
+            _write_persistent.Reset(handle());
+        }
+        _write_inflight += 1;
+        _write_batches += 1;
+        _write_messages += b->msgs.size();
+        NAUV_CALL(uv_write(
+            &b->req,
+            reinterpret_cast<uv_stream_t*>(&_tcp_handle),
+            b->iovecs.data(),
+            b->iovecs.size(),
+            &Ntcp::_write_callback));
+    }
+}
+
 NAUV_CALLBACK_STATUS(Ntcp::_write_callback, uv_write_t* req)
 {
     Nan::HandleScope scope;
-    Msg* m = reinterpret_cast<Msg*>(req->data);
-    m->hdr.decode();
-    if (status < 0) {
-        v8::Local<v8::Value> argv[] = {NAN_ERR("Ntcp::write: ERROR")};
-        Nan::Call(*m->callback, 1, argv);
+    WriteBatch* b = reinterpret_cast<WriteBatch*>(req->data);
+    Ntcp& self = *b->ntcp;
+    // messages written from the callbacks can go out right away once nothing is in flight
+    self._write_inflight -= 1;
+    for (Msg* m : b->msgs) {
+        m->hdr.decode();
+        if (status < 0) {
+            m->done("Ntcp::write: ERROR");
+        } else {
+            DBG2(
+                "Ntcp::_write_callback:"
+                // << " seq " << m->hdr.seq
+                << " len "
+                << m->hdr.len);
+            m->done(NULL);
+        }
+        Msg::release(m);
+    }
+    b->msgs.clear();
+    b->iovecs.clear();
+    if (_write_batch_pool.size() < size_t(WRITE_BATCH_POOL_MAX)) {
+        _write_batch_pool.push_back(b);
     } else {
-        DBG2(
-            "Ntcp::_write_callback:"
-            // << " seq " << m->hdr.seq
-            << " len "
-            << m->hdr.len);
-        v8::Local<v8::Value> args[] = {Nan::Undefined()};
-        Nan::Call(*m->callback, 1, args);
+        delete b;
+    }
+    if (!self._write_inflight && self._write_queue.empty()) {
+        self._write_persistent.Reset();
+    }
+}
+
+/**
+ * hand the next chunks to uv_write, taking one chunk of the message at the front
+ * and moving the message to the back of the queue until all of it was sent.
+ */
+void
+Ntcp::_mux_pump()
+{
+    // start the pending messages as new streams within the limits the peer enforces
+    while (!_closed && !_mux_pending.empty()) {
+        Msg* m = _mux_pending.front();
+        if (_mux_send_streams &&
+            (_mux_send_streams >= MUX_MAX_STREAMS ||
+             _mux_send_bytes + int(m->hdr.len) > MUX_MAX_STREAMS_BYTES)) {
+            break;
+        }
+        _mux_pending.pop_front();
+        _mux_send_streams += 1;
+        _mux_send_bytes += m->hdr.len;
+        _mux_queue.push_back(m);
+    }
+    while (!_closed && _mux_inflight < MUX_MAX_INFLIGHT && !_mux_queue.empty()) {
+        Msg* m = _mux_queue.front();
+        _mux_queue.pop_front();
+        MuxChunk* c = new MuxChunk;
+        c->req.data = c;
+        c->ntcp = this;
+        c->msg = m;
+        c->hdr.stream_id = m->stream_id;
+        c->iovecs.push_back(uv_buf_init(reinterpret_cast<char*>(&c->hdr), MUX_HDR_SIZE));
+        int len = 0;
+        while (m->iov_index < m->iovecs.size() && len < MUX_CHUNK_SIZE) {
+            const uv_buf_t& iov = m->iovecs[m->iov_index];
+            const int n = std::min<size_t>(iov.len - m->iov_offset, MUX_CHUNK_SIZE - len);
+            c->iovecs.push_back(uv_buf_init(iov.base + m->iov_offset, n));
+            len += n;
+            m->iov_offset += n;
+            if (m->iov_offset >= iov.len) {
+                m->iov_index++;
+                m->iov_offset = 0;
+            }
+        }
+        c->hdr.len = len;
+        c->last = m->iov_index >= m->iovecs.size();
+        if (c->last) {
+            c->hdr.flags |= MUX_FLAG_END;
+            // the peer ends the stream on this chunk before it can see the next stream
+            _mux_send_streams -= 1;
+            _mux_send_bytes -= m->hdr.len;
+        } else {
+            _mux_queue.push_back(m);
+        }
+        DBG3(
+            "Ntcp::_mux_pump:"
+            << " stream "
+            << m->stream_id
+            << " chunk "
+            << len
+            << (c->last ? " last" : "")
+            << " queue "
+            << _mux_queue.size());
+        c->hdr.encode();
+        if (!_mux_inflight) {
+            // keep the connection alive until its chunks are written or canceled
+            _mux_persistent.Reset(handle());
+        }
+        m->inflight += 1;
+        _mux_inflight += 1;
+        NAUV_CALL(uv_write(
+            &c->req,
+            reinterpret_cast<uv_stream_t*>(&_tcp_handle),
+            c->iovecs.data(),
+            c->iovecs.size(),
+            &Ntcp::_mux_write_callback));
+    }
+}
+
+NAUV_CALLBACK_STATUS(Ntcp::_mux_write_callback, uv_write_t* req)
+{
+    Nan::HandleScope scope;
+    MuxChunk* c = reinterpret_cast<MuxChunk*>(req->data);
+    Ntcp& self = *c->ntcp;
+    Msg* m = c->msg;
+    const bool last = c->last;
+    delete c;
+    self._mux_inflight -= 1;
+    m->inflight -= 1;
+    if (status < 0 && !m->failed) {
+        if (m->iov_index < m->iovecs.size()) {
+            // the stream was not ended yet
+            self._mux_queue.remove(m);
+            self._mux_send_streams -= 1;
+            self._mux_send_bytes -= m->hdr.len;
+        }
+        m->done("Ntcp::write: ERROR");
+    } else if (last && !m->failed) {
+        m->done(NULL);
+    }
+    if (!m->inflight && (last || m->failed)) {
+        Msg::release(m);
+    }
+    self._mux_pump();
+    if (!self._mux_inflight) {
+        self._mux_persistent.Reset();
     }
-    delete m;
-    delete req;
 }
 
 void
@@ -331,113 +620,353 @@ Ntcp::_callback_read(uv_stream_t* handle, ssize_t nread, const uv_buf_t* buf)
 void
 Ntcp::_alloc_for_read(uv_buf_t* buf, size_t suggested_size)
 {
-    if (!_recv_payload) {
-        buf->len = MSG_HDR_SIZE - _recv_hdr_pos;
-        buf->base = reinterpret_cast<char*>(&_recv_hdr) + _recv_hdr_pos;
-        DBG8(
-            "Ntcp::_alloc_for_read: allocate hdr pos " << _recv_hdr_pos << " len " << buf->len
-                                                       << " suggested "
-                                                       << suggested_size);
-    } else {
-        buf->len = _recv_hdr.len - _recv_payload_pos;
+    // every alloc is followed by a single read syscall
+    _recv_syscalls += 1;
+    if (_recv_payload) {
+        buf->len = _recv_payload_len - _recv_payload_pos;
         buf->base = _recv_payload + _recv_payload_pos;
         DBG8(
             "Ntcp::_alloc_for_read: allocate payload pos " << _recv_payload_pos << " len "
                                                            << buf->len
                                                            << " suggested "
                                                            << suggested_size);
+        return;
+    }
+    if (!_recv_block) {
+        _recv_new_block();
+    } else if (RECV_BLOCK_SIZE - _recv_block_end < RECV_MIN_READ) {
+        if (_recv_block->refs == 1) {
+            // no slices of the block are alive so the partial frame can move to the front
+            const int partial = _recv_block_end - _recv_block_start;
+            memmove(_recv_block->data, _recv_block->data + _recv_block_start, partial);
+            _recv_block_start = 0;
+            _recv_block_end = partial;
+        } else {
+            _recv_new_block();
+        }
     }
+    buf->len = RECV_BLOCK_SIZE - _recv_block_end;
+    buf->base = _recv_block->data + _recv_block_end;
+    DBG8(
+        "Ntcp::_alloc_for_read: allocate block pos " << _recv_block_end << " len " << buf->len
+                                                     << " suggested "
+                                                     << suggested_size);
 }
 
 void
-Ntcp::_read_data(const uv_buf_t* buf, size_t nread)
+Ntcp::_read_data(const uv_buf_t* buf, ssize_t nread)
 {
     DBG3("Ntcp::_read_data: nread " << nread);
+    if (nread < 0) {
+        DBG0("Ntcp::_read_data: " << uv_strerror(nread) << " local_port " << _local_port);
+        _close();
+        return;
+    }
     if (DBG_VISIBLE(9)) {
         Buf::hexdump(buf->base, nread > 128 ? 128 : nread, "Ntcp::_read_data");
     }
-    // if (nread < 0) {
-    //     // TODO
-    //     PANIC("Ntcp::_read_data failed");
-    //     return;
-    // }
     if (nread == 0) {
         return; // means EGAIN/EWOULDBLOCK so we can ignore
     }
-    if (!_recv_payload) {
-        _recv_hdr_pos += nread;
-        // process the header when full
-        if (_recv_hdr_pos >= MSG_HDR_SIZE) {
-            if (DBG_VISIBLE(9)) {
-                Buf::hexdump(&_recv_hdr, MSG_HDR_SIZE, "Ntcp::_read_data: (header)");
-            }
+    if (_recv_payload) {
+        _recv_payload_pos += nread;
+        // process the payload when full
+        if (_recv_payload_pos >= _recv_payload_len) {
+            _recv_direct_done();
+        }
+        return;
+    }
+    _recv_block_end += nread;
+    _recv_parse();
+}
+
+/**
+ * process all the complete frames in the block - small payloads are emitted as slices
+ * of the block, and a large payload switches the next reads to its own pooled buffer.
+ */
+void
+Ntcp::_recv_parse()
+{
+    while (!_closed && !_recv_payload) {
+        char* p = _recv_block->data + _recv_block_start;
+        const int avail = _recv_block_end - _recv_block_start;
+        if (avail < 1) {
+            return;
+        }
+        // the first bytes are the same for both headers and tell which one it is
+        const bool mux = p[0] & MUX_FLAG;
+        const int hdr_size = mux ? MUX_HDR_SIZE : MSG_HDR_SIZE;
+        if (avail < hdr_size) {
+            return;
+        }
+        if (mux) {
+            memcpy(&_recv_mux_hdr, p, MUX_HDR_SIZE);
+            _recv_mux_hdr.decode();
+            _recv_payload_len = _recv_mux_hdr.len;
+        } else {
+            memcpy(&_recv_hdr, p, MSG_HDR_SIZE);
             _recv_hdr.decode();
-            DBG3(
-                "Ntcp::_read_data: incoming message"
-                //  << " seq " << _recv_hdr.seq
+            _recv_payload_len = _recv_hdr.len;
+        }
+        if (_recv_payload_len < 0 || _recv_payload_len > MAX_MSG_LEN) {
+            // the rest of the stream cannot be framed anymore
+            LOG("Ntcp::_read_data: message too big:"
+                // << " magic " << _recv_hdr.magic
+                // << " seq " << _recv_hdr.seq
+                // << " seq " << _recv_msg_seq
                 << " len "
-                << _recv_hdr.len
+                << _recv_payload_len
                 << " local_port "
                 << _local_port);
-            if (_recv_hdr.len > MAX_MSG_LEN) {
-                // TODO close connection instead of panic
-                LOG("Ntcp::_read_data: message too big:"
-                    // << " magic " << _recv_hdr.magic
-                    // << " seq " << _recv_hdr.seq
-                    // << " seq " << _recv_msg_seq
-                    << " len "
-                    << _recv_hdr.len);
-                _recv_hdr.len = 0;
+            _recv_payload_len = 0;
+            _close();
+            return;
+        }
+        _recv_is_mux = mux;
+        const int len = _recv_payload_len;
+        if (len > RECV_DIRECT_MIN_LEN) {
+            // copy what was already read and let the next reads fill the rest in place
+            const int n = std::min(avail - hdr_size, len);
+            _recv_payload = reinterpret_cast<char*>(nb_buf_pool_alloc(len));
+            memcpy(_recv_payload, p + hdr_size, n);
+            _recv_payload_pos = n;
+            _recv_block_start += hdr_size + n;
+            _recv_direct += 1;
+            if (n >= len) {
+                _recv_direct_done();
             }
-            _recv_payload = new char[_recv_hdr.len];
-            _recv_hdr_pos = 0;
-            _recv_payload_pos = 0;
+            continue;
         }
+        if (avail < hdr_size + len) {
+            return;
+        }
+        _recv_block_start += hdr_size + len;
+        RecvSlice slice = {p + hdr_size, len, NULL};
+        if (len) {
+            slice.block = _recv_block;
+            _recv_block->refs += 1;
+        }
+        _recv_frame_done(slice);
+    }
+}
+
+void
+Ntcp::_recv_new_block()
+{
+    RecvBlock* block = new RecvBlock;
+    block->data = reinterpret_cast<char*>(nb_buf_pool_alloc(RECV_BLOCK_SIZE));
+    block->refs = 1;
+    int partial = 0;
+    if (_recv_block) {
+        // the partial frame is smaller than a direct payload so it fits the new block
+        partial = _recv_block_end - _recv_block_start;
+        memcpy(block->data, _recv_block->data + _recv_block_start, partial);
+        _recv_block_unref(_recv_block);
+    }
+    _recv_block = block;
+    _recv_block_start = 0;
+    _recv_block_end = partial;
+    _recv_blocks += 1;
+}
+
+void
+Ntcp::_recv_direct_done()
+{
+    RecvSlice slice = {_recv_payload, _recv_payload_len, NULL};
+    _recv_payload = NULL;
+    _recv_payload_len = 0;
+    _recv_payload_pos = 0;
+    _recv_frame_done(slice);
+}
+
+void
+Ntcp::_recv_block_unref(RecvBlock* block)
+{
+    block->refs -= 1;
+    if (!block->refs) {
+        nb_buf_pool_free(reinterpret_cast<uint8_t*>(block->data));
+        delete block;
+    }
+}
+
+void
+Ntcp::_recv_block_buf_free(char* data, void* hint)
+{
+    _recv_block_unref(reinterpret_cast<RecvBlock*>(hint));
+}
+
+static void
+_ntcp_pool_buf_free(char* data, void* hint)
+{
+    nb_buf_pool_free(reinterpret_cast<uint8_t*>(data));
+}
+
+void
+Ntcp::_recv_slice_free(const RecvSlice& slice)
+{
+    if (!slice.len) {
+        return;
+    }
+    if (slice.block) {
+        _recv_block_unref(slice.block);
     } else {
-        _recv_payload_pos += nread;
-        // process the payload when full
-        if (_recv_payload_pos >= (int)_recv_hdr.len) {
-            if (!_recv_hdr.is_valid()
-                // || _recv_hdr.seq != _recv_msg_seq
-            ) {
-                Buf::hexdump(&_recv_hdr, MSG_HDR_SIZE, "Ntcp::_read_data: (header decoded)");
-                Buf::hexdump(
-                    _recv_payload,
-                    _recv_hdr.len > 128 ? 128 : _recv_hdr.len,
-                    "Ntcp::_read_data: (payload)");
-                // TODO close connection instead of panic
-                PANIC(
-                    "Ntcp::_read_data: bad message:"
-                    //   << " magic " << _recv_hdr.magic
-                    //   << " seq " << _recv_hdr.seq
-                    //   << " expected " << _recv_msg_seq
-                    << " len "
-                    << _recv_hdr.len);
-            }
-            _recv_msg_seq += 1;
-            // ownership on memory passed to the node buffer
-            Nan::HandleScope scope;
-            v8::Local<v8::Object> node_buf =
-                Nan::NewBuffer(_recv_payload, _recv_hdr.len).ToLocalChecked();
-            _recv_payload = NULL;
-            _recv_hdr_pos = 0;
-            _recv_payload_pos = 0;
-            // emit the message buffer
-            DBG3(
-                "Ntcp::_read_data: incoming message completed"
-                //  << " seq " << _recv_hdr.seq
+        nb_buf_pool_free(reinterpret_cast<uint8_t*>(slice.data));
+    }
+}
+
+v8::Local<v8::Object>
+Ntcp::_recv_slice_buffer(const RecvSlice& slice)
+{
+    // ownership on the slice passed to the node buffer
+    if (!slice.len) {
+        return Nan::NewBuffer(0).ToLocalChecked();
+    }
+    if (slice.block) {
+        return Nan::NewBuffer(slice.data, slice.len, _recv_block_buf_free, slice.block).ToLocalChecked();
+    }
+    return Nan::NewBuffer(slice.data, slice.len, _ntcp_pool_buf_free, NULL).ToLocalChecked();
+}
+
+void
+Ntcp::_recv_frame_done(const RecvSlice& slice)
+{
+    const int len = slice.len;
+    _recv_bytes += len;
+    Nan::HandleScope scope;
+
+    if (_recv_is_mux) {
+        const uint32_t stream_id = _recv_mux_hdr.stream_id;
+        DBG3(
+            "Ntcp::_read_data: incoming chunk"
+            << " stream "
+            << stream_id
+            << " len "
+            << len
+            << " flags "
+            << int(_recv_mux_hdr.flags)
+            << " local_port "
+            << _local_port);
+        auto it = _mux_recv_streams.find(stream_id);
+        if (it == _mux_recv_streams.end() && int(_mux_recv_streams.size()) >= MUX_MAX_STREAMS) {
+            LOG("Ntcp::_read_data: too many streams:"
+                << " stream "
+                << stream_id
+                << " streams "
+                << _mux_recv_streams.size()
+                << " local_port "
+                << _local_port);
+            _recv_slice_free(slice);
+            _close();
+            return;
+        }
+        MuxRecvStream& stream = it == _mux_recv_streams.end() ? _mux_recv_streams[stream_id] : it->second;
+        if (stream.len + len > MAX_MSG_LEN || _mux_recv_bytes + len > MUX_MAX_STREAMS_BYTES) {
+            LOG("Ntcp::_read_data: message too big:"
+                << " stream "
+                << stream_id
                 << " len "
-                << _recv_hdr.len
+                << stream.len + len
+                << " streams bytes "
+                << _mux_recv_bytes + len
                 << " local_port "
                 << _local_port);
-            v8::Local<v8::Value> argv[] = {NAN_STR("message"), node_buf};
-            NAN_CALLBACK(handle(), "emit", 2, argv);
+            _recv_slice_free(slice);
+            _close();
+            return;
+        }
+        stream.chunks.push_back(slice);
+        stream.len += len;
+        _mux_recv_bytes += len;
+        if (!(_recv_mux_hdr.flags & MUX_FLAG_END)) {
+            return;
+        }
+        const int num_chunks = stream.chunks.size();
+        auto node_bufs = Nan::New<v8::Array>(num_chunks);
+        for (int i = 0; i < num_chunks; ++i) {
+            Nan::Set(node_bufs, i, _recv_slice_buffer(stream.chunks[i]));
         }
+        DBG3(
+            "Ntcp::_read_data: incoming message completed"
+            << " stream "
+            << stream_id
+            << " len "
+            << stream.len
+            << " chunks "
+            << num_chunks
+            << " local_port "
+            << _local_port);
+        _mux_recv_bytes -= stream.len;
+        _mux_recv_streams.erase(stream_id);
+        _recv_msg_seq += 1;
+        _recv_messages += 1;
+        v8::Local<v8::Value> argv[] = {NAN_STR("message"), node_bufs};
+        NAN_CALLBACK(handle(), "emit", 2, argv);
+        return;
+    }
+
+    if (!_recv_hdr.is_valid()
+        // || _recv_hdr.seq != _recv_msg_seq
+    ) {
+        Buf::hexdump(&_recv_hdr, MSG_HDR_SIZE, "Ntcp::_read_data: (header decoded)");
+        Buf::hexdump(slice.data, len > 128 ? 128 : len, "Ntcp::_read_data: (payload)");
+        LOG("Ntcp::_read_data: bad message:"
+            //   << " magic " << _recv_hdr.magic
+            //   << " seq " << _recv_hdr.seq
+            //   << " expected " << _recv_msg_seq
+            << " len "
+            << len
+            << " local_port "
+            << _local_port);
+        _recv_slice_free(slice);
+        _close();
+        return;
     }
+    _recv_msg_seq += 1;
+    _recv_messages += 1;
+    v8::Local<v8::Object> node_buf = _recv_slice_buffer(slice);
+    // emit the message buffer
+    DBG3(
+        "Ntcp::_read_data: incoming message completed"
+        //  << " seq " << _recv_hdr.seq
+        << " len "
+        << len
+        << (slice.block ? " slice" : "")
+        << " local_port "
+        << _local_port);
+    v8::Local<v8::Value> argv[] = {NAN_STR("message"), node_buf};
+    NAN_CALLBACK(handle(), "emit", 2, argv);
+}
+
+NAN_METHOD(Ntcp::stats)
+{
+    Ntcp& self = *NAN_UNWRAP_THIS(Ntcp);
+    auto obj = NAN_NEW_OBJ();
+    NAN_SET_NUM(obj, "recv_syscalls", self._recv_syscalls);
+    NAN_SET_NUM(obj, "recv_messages", self._recv_messages);
+    NAN_SET_NUM(obj, "recv_bytes", self._recv_bytes);
+    NAN_SET_NUM(obj, "recv_direct", self._recv_direct);
+    NAN_SET_NUM(obj, "recv_blocks", self._recv_blocks);
+    NAN_SET_NUM(
+        obj,
+        "recv_syscalls_per_message",
+        self._recv_messages ? double(self._recv_syscalls) / self._recv_messages : 0);
+    NAN_SET_NUM(obj, "write_batches", self._write_batches);
+    NAN_SET_NUM(obj, "write_messages", self._write_messages);
+    NAN_SET_NUM(
+        obj,
+        "write_messages_per_batch",
+        self._write_batches ? double(self._write_messages) / self._write_batches : 0);
+    NAN_RETURN(obj);
 }
 
 Ntcp::Msg::Msg()
-    : iov_index(0) {}
+    : iov_index(0)
+    , stream_id(0)
+    , iov_offset(0)
+    , inflight(0)
+    , failed(false)
+{
+}
 
 Ntcp::Msg::~Msg()
 {
@@ -445,6 +974,69 @@ Ntcp::Msg::~Msg()
     callback.reset();
 }
 
+Ntcp::Msg*
+Ntcp::Msg::alloc()
+{
+    if (_msg_pool.empty()) {
+        return new Msg;
+    }
+    Msg* m = _msg_pool.back();
+    _msg_pool.pop_back();
+    return m;
+}
+
+void
+Ntcp::Msg::release(Msg* m)
+{
+    if (_msg_pool.size() >= size_t(MSG_POOL_MAX)) {
+        delete m;
+        return;
+    }
+    m->persistent.Reset();
+    m->callback.reset();
+    m->iovecs.clear();
+    m->iov_index = 0;
+    m->hdr = MsgHdr();
+    m->stream_id = 0;
+    m->iov_offset = 0;
+    m->inflight = 0;
+    m->failed = false;
+    _msg_pool.push_back(m);
+}
+
+void
+Ntcp::Msg::done(const char* err)
+{
+    if (err) {
+        failed = true;
+    }
+    // the callback is optional when the caller does not wait for the write
+    if (!callback) {
+        return;
+    }
+    if (err) {
+        v8::Local<v8::Value> argv[] = {NAN_ERR(err)};
+        Nan::Call(*callback, 1, argv);
+    } else {
+        v8::Local<v8::Value> argv[] = {Nan::Undefined()};
+        Nan::Call(*callback, 1, argv);
+    }
+}
+
+void
+Ntcp::MuxHdr::encode()
+{
+    stream_id = htobe32(stream_id);
+    len = htobe32(len);
+}
+
+void
+Ntcp::MuxHdr::decode()
+{
+    stream_id = be32toh(stream_id);
+    len = be32toh(len);
+}
+
 void
 Ntcp::MsgHdr::encode()
 {
@@ -1,6 +1,10 @@
 /* Copyright (C) 2016 NooBaa */
 #pragma once
 
+#include <list>
+#include <unordered_map>
+#include <vector>
+
 #include "../util/nan.h"
 
 namespace noobaa
@@ -19,12 +23,15 @@ private:
     static NAN_METHOD(listen);
     static NAN_METHOD(connect);
     static NAN_METHOD(write);
+    static NAN_METHOD(stats);
 
 private:
     // uv callbacks
     static NAUV_CALLBACK_STATUS(_connection_callback, uv_stream_t* handle);
     static NAUV_CALLBACK_STATUS(_connect_callback, uv_connect_t* handle);
     static NAUV_CALLBACK_STATUS(_write_callback, uv_write_t* handle);
+    static NAUV_CALLBACK_STATUS(_mux_write_callback, uv_write_t* handle);
+    static NAUV_CALLBACK(_write_prepare_callback, uv_prepare_t* handle);
     static NAUV_ALLOC_CB_WRAP(_callback_alloc_wrap, _callback_alloc);
     static NAUV_READ_CB_WRAP(_callback_read_wrap, _callback_read);
     static void _callback_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
@@ -54,18 +61,114 @@ private:
     };
 #pragma pack(pop)
 
+    // multiplexed framing - every message is a stream that is sent in chunks,
+    // and the chunks of the queued messages are interleaved round robin,
+    // so small messages are not blocked behind a large one on the same connection.
+    // the first header byte tells the framing of every frame, since a plain header
+    // starts with the high byte of a length that cannot exceed MAX_MSG_LEN.
+    static const uint8_t MUX_FLAG = 0x80;
+    static const uint8_t MUX_FLAG_END = 0x01;
+    static const int MUX_CHUNK_SIZE = 256 * 1024;
+    // chunks handed to uv_write at once, more chunks only delay the next message
+    static const int MUX_MAX_INFLIGHT = 2;
+    // the sender interleaves at most this many messages with at most this many bytes in total
+    // (a single message is always allowed), and the receiver closes a connection that exceeds
+    // them instead of reassembling without bound.
+    static const int MUX_MAX_STREAMS = 64;
+    static const int MUX_MAX_STREAMS_BYTES = 2 * MAX_MSG_LEN;
+
+#pragma pack(push, 1)
+    struct MuxHdr {
+        uint8_t flags;
+        uint8_t reserved[3];
+        uint32_t stream_id;
+        uint32_t len;
+        MuxHdr()
+            : flags(MUX_FLAG)
+            , stream_id(0)
+            , len(0)
+        {
+            memset(reserved, 0, sizeof(reserved));
+        }
+        void encode();
+        void decode();
+    };
+#pragma pack(pop)
+
     struct Msg {
         Nan::Persistent<v8::Object> persistent;
         NanCallbackSharedPtr callback;
         std::vector<uv_buf_t> iovecs;
         size_t iov_index;
         MsgHdr hdr;
+        // mux sending state
+        uint32_t stream_id;
+        size_t iov_offset;
+        int inflight;
+        bool failed;
 
         Msg();
         ~Msg();
+        void done(const char* err);
+        // messages are reused from a free list to save the allocations per write
+        static Msg* alloc();
+        static void release(Msg* m);
+    };
+
+    // plain messages written in the same loop tick are coalesced to a single uv_write,
+    // a lone message is written right away and the following ones wait for the
+    // prepare phase of the loop while the previous write is still in flight.
+    static const int WRITE_BATCH_MAX_BYTES = 256 * 1024;
+    static const int MSG_POOL_MAX = 1024;
+    static const int WRITE_BATCH_POOL_MAX = 64;
+
+    struct WriteBatch {
+        uv_write_t req;
+        Ntcp* ntcp;
+        std::vector<Msg*> msgs;
+        std::vector<uv_buf_t> iovecs;
+    };
+
+    struct MuxChunk {
+        uv_write_t req;
+        Ntcp* ntcp;
+        Msg* msg;
+        MuxHdr hdr;
+        std::vector<uv_buf_t> iovecs;
+        bool last;
+    };
+
+    // small frames are read in batches into a pooled block and emitted as slices of it,
+    // the block returns to the pool when the ntcp and all the slice buffers released it.
+    static const int RECV_BLOCK_SIZE = 64 * 1024;
+    // payloads above this length are read directly into their own pooled buffer
+    static const int RECV_DIRECT_MIN_LEN = 16 * 1024;
+    // a new block is started when the free tail of the current one is smaller than this
+    static const int RECV_MIN_READ = 4 * 1024;
+
+    struct RecvBlock {
+        char* data;
+        int refs;
+    };
+
+    // a received payload is either a slice of a block or a whole pooled buffer (block is NULL)
+    struct RecvSlice {
+        char* data;
+        int len;
+        RecvBlock* block;
+    };
+
+    struct MuxRecvStream {
+        std::vector<RecvSlice> chunks;
+        int len;
+        MuxRecvStream()
+            : len(0)
+        {
+        }
     };
 
     static const int MSG_HDR_SIZE = sizeof(MsgHdr);
+    static const int MUX_HDR_SIZE = sizeof(MuxHdr);
 
 private:
     explicit Ntcp();
@@ -75,20 +178,60 @@ private:
     void _accept(uv_stream_t* listener);
     void _start_reading();
     void _alloc_for_read(uv_buf_t* buf, size_t suggested_size);
-    void _read_data(const uv_buf_t* buf, size_t nread);
+    void _read_data(const uv_buf_t* buf, ssize_t nread);
+    void _recv_parse();
+    void _recv_new_block();
+    void _recv_direct_done();
+    void _recv_frame_done(const RecvSlice& slice);
+    static void _recv_block_unref(RecvBlock* block);
+    static void _recv_block_buf_free(char* data, void* hint);
+    static void _recv_slice_free(const RecvSlice& slice);
+    static v8::Local<v8::Object> _recv_slice_buffer(const RecvSlice& slice);
+    void _mux_pump();
+    void _write_flush();
 
 private:
     uv_tcp_t _tcp_handle;
     MsgHdr _recv_hdr;
+    MuxHdr _recv_mux_hdr;
+    bool _recv_is_mux;
+    RecvBlock* _recv_block;
+    int _recv_block_start;
+    int _recv_block_end;
+    // direct read of a large payload into a pooled buffer
     char* _recv_payload;
-    int _recv_hdr_pos;
     int _recv_payload_pos;
+    int _recv_payload_len;
+    uint64_t _recv_syscalls;
+    uint64_t _recv_messages;
+    uint64_t _recv_bytes;
+    uint64_t _recv_direct;
+    uint64_t _recv_blocks;
     // uint64_t _send_msg_seq;
     uint64_t _recv_msg_seq;
     bool _closed;
     bool _reading;
     Nan::Persistent<v8::Object> _reading_persistent;
     int _local_port;
+    bool _mux;
+    uint32_t _mux_next_stream_id;
+    std::list<Msg*> _mux_queue;
+    // messages waiting for the streams limits before they are interleaved
+    std::list<Msg*> _mux_pending;
+    int _mux_send_streams;
+    int _mux_send_bytes;
+    int _mux_inflight;
+    Nan::Persistent<v8::Object> _mux_persistent;
+    std::unordered_map<uint32_t, MuxRecvStream> _mux_recv_streams;
+    int _mux_recv_bytes;
+    std::list<Msg*> _write_queue;
+    uv_prepare_t _write_prepare_handle;
+    int _write_inflight;
+    Nan::Persistent<v8::Object> _write_persistent;
+    uint64_t _write_batches;
+    uint64_t _write_messages;
+    static std::vector<Msg*> _msg_pool;
+    static std::vector<WriteBatch*> _write_batch_pool;
 };
 
 } // namespace noobaa
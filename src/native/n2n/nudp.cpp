@@ -1,10 +1,26 @@
 /* Copyright (C) 2016 NooBaa */
 #include "nudp.h"
 
+#include <algorithm>
 #include <zlib.h>
 
+#if NUDP_SENDMMSG
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+// glibc headers before 2.29 lack the gso socket option of linux/udp.h (linux 4.18)
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#endif
+
 #include "../third_party/libutp/utp.h"
 #include "../util/buf.h"
+#include "../util/buf_pool.h"
 #include "../util/endian.h"
 
 namespace noobaa
@@ -17,6 +33,7 @@ Nan::Persistent<v8::Function> Nudp::_ctor;
 static const int UTP_TARGET_DELAY_MICROS = 10000;
 static const int UTP_SNDBUF_SIZE = 128 * 1024;
 static const int UTP_RCVBUF_SIZE = 128 * 1024;
+static const int UTP_AUTOTUNE_MAX_BUF = 16 * 1024 * 1024;
 
 // static std::string addrinfo2str(const struct addrinfo *ai);
 static std::string sockaddr2str(const struct sockaddr* sa);
@@ -40,23 +57,64 @@ NAN_MODULE_INIT(Nudp::setup)
     NAN_SET(target, name, func);
 }
 
+static bool
+_nudp_option_int(v8::Local<v8::Object> options, const char* key, int* val)
+{
+    auto v = NAN_GET(options, key);
+    if (v->IsUndefined()) {
+        return true;
+    }
+    if (!v->IsInt32() || NAN_TO_INT(v) <= 0) {
+        return false;
+    }
+    *val = NAN_TO_INT(v);
+    return true;
+}
+
 NAN_METHOD(Nudp::new_instance)
 {
     NAN_MAKE_CTOR_CALL(_ctor);
-    Nudp* obj = new Nudp();
+    Tuning tuning;
+    if (info.Length() > 0 && info[0]->IsObject()) {
+        auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+        if (!_nudp_option_int(options, "target_delay", &tuning.target_delay) ||
+            !_nudp_option_int(options, "sndbuf", &tuning.sndbuf) ||
+            !_nudp_option_int(options, "rcvbuf", &tuning.rcvbuf) ||
+            !_nudp_option_int(options, "autotune_max_buf", &tuning.autotune_max_buf)) {
+            return Nan::ThrowError("Nudp: options should be positive integers");
+        }
+        auto autotune = NAN_GET(options, "autotune");
+        if (!autotune->IsUndefined()) {
+            tuning.autotune = Nan::To<bool>(autotune).FromJust();
+        }
+    }
+    Nudp* obj = new Nudp(tuning);
     obj->Wrap(info.This());
     info.GetReturnValue().Set(info.This());
 }
 
-Nudp::Nudp()
-    : _utp_socket(NULL), _recv_payload(NULL), _recv_hdr_pos(0), _recv_payload_pos(0), _send_msg_seq(1), _recv_msg_seq(1), _closed(false), _receiving(false), _local_port(0)
+Nudp::Tuning::Tuning()
+    : target_delay(UTP_TARGET_DELAY_MICROS)
+    , sndbuf(UTP_SNDBUF_SIZE)
+    , rcvbuf(UTP_RCVBUF_SIZE)
+    , autotune(false)
+    , autotune_max_buf(UTP_AUTOTUNE_MAX_BUF)
+{
+}
+
+Nudp::Nudp(const Tuning& tuning)
+    : _utp_socket(NULL), _recv_in_payload(false), _recv_hdr_pos(0), _recv_payload_pos(0), _recv_messages(0), _recv_segments(0), _recv_syscalls(0), _recv_packets(0), _send_syscalls(0), _send_packets(0), _send_gso_msgs(0)
+#if NUDP_SENDMMSG
+    , _send_batch_pos(0), _send_gso(true)
+#endif
+    , _send_msg_seq(1), _recv_msg_seq(1), _tuning(tuning), _tune_base(tuning), _tune_last_ms(0), _tune_sent_bytes(0), _tune_recv_bytes(0), _tune_send_rate(0), _tune_recv_rate(0), _tune_rtt(0), _tune_rtt_var(0), _tune_grows(0), _tune_shrinks(0), _tune_idle_ticks(0), _closed(false), _receiving(false), _local_port(0)
 {
     DBG2("Nudp::Nudp");
     _utp_ctx = utp_init(2); // version=2
     utp_context_set_userdata(_utp_ctx, this);
-    utp_context_set_option(_utp_ctx, UTP_TARGET_DELAY, UTP_TARGET_DELAY_MICROS);
-    utp_context_set_option(_utp_ctx, UTP_SNDBUF, UTP_SNDBUF_SIZE);
-    utp_context_set_option(_utp_ctx, UTP_RCVBUF, UTP_RCVBUF_SIZE);
+    utp_context_set_option(_utp_ctx, UTP_TARGET_DELAY, _tuning.target_delay);
+    utp_context_set_option(_utp_ctx, UTP_SNDBUF, _tuning.sndbuf);
+    utp_context_set_option(_utp_ctx, UTP_RCVBUF, _tuning.rcvbuf);
     utp_set_callback(_utp_ctx, UTP_SENDTO, &Nudp::utp_callback_sendto);
     utp_set_callback(_utp_ctx, UTP_ON_READ, &Nudp::utp_callback_on_read);
     utp_set_callback(_utp_ctx, UTP_ON_STATE_CHANGE, &Nudp::utp_callback_on_state_change);
@@ -74,7 +132,14 @@ Nudp::Nudp()
         utp_context_set_option(_utp_ctx, UTP_LOG_DEBUG, 1);
     }
 
+#if NUDP_RECVMMSG
+    NAUV_CALL(uv_udp_init_ex(uv_default_loop(), &_uv_udp_handle, AF_UNSPEC | UV_UDP_RECVMMSG));
+#else
     NAUV_CALL(uv_udp_init(uv_default_loop(), &_uv_udp_handle));
+#endif
+#if NUDP_SENDMMSG
+    _send_batch_data.resize(SEND_BATCH_MAX_BYTES);
+#endif
     NAUV_CALL(uv_timer_init(uv_default_loop(), &_uv_timer_handle));
     // the timer interval follows from libutp's TIMEOUT_CHECK_INTERVAL
     NAUV_CALL(uv_timer_start(&_uv_timer_handle, &Nudp::uv_callback_timer, 0, 520));
@@ -124,9 +189,11 @@ Nudp::_close()
         utp_destroy(_utp_ctx);
         _utp_ctx = NULL;
     }
-    if (_recv_payload) {
-        delete[] _recv_payload;
-    }
+    _recv_segs_free();
+#if NUDP_SENDMMSG
+    _send_batch.clear();
+    _send_batch_pos = 0;
+#endif
     while (!_messages.empty()) {
         Msg* m = _messages.front();
         v8::Local<v8::Value> argv[] = {NAN_ERR("NUDP CLOSED")};
@@ -297,6 +364,7 @@ Nudp::_write_data()
             DBG4("Nudp::_write_data: utp not writable. local_port " << _local_port);
             return;
         }
+        _tune_sent_bytes += sent;
         if (DBG_VISIBLE(9) && m->iov_index == 0) {
             Buf::hexdump(iop->iov_base, iop->iov_len, "Nudp::_write_data (header)");
         }
@@ -342,8 +410,9 @@ void
 Nudp::_read_data(const uint8_t* buf, int len)
 {
     DBG2("Nudp::_read_data: put buffer of length " << len << " local_port " << _local_port);
+    _tune_recv_bytes += len;
     while (len > 0) {
-        if (!_recv_payload) {
+        if (!_recv_in_payload) {
 
             // copy bytes to header
             int copy_len = MSG_HDR_SIZE - _recv_hdr_pos;
@@ -383,91 +452,146 @@ Nudp::_read_data(const uint8_t* buf, int len)
                         << _recv_hdr.len);
                     _recv_hdr.len = 0;
                 }
-                _recv_payload = new char[_recv_hdr.len];
+                // the segments are sized by the header but only taken from the pool
+                // when the payload reaches them, so a slow message holds what it received
+                assert(_recv_segs.empty());
+                _recv_segs.resize((_recv_hdr.len + RECV_SEG_SIZE - 1) / RECV_SEG_SIZE, NULL);
+                _recv_in_payload = true;
                 _recv_hdr_pos = 0;
                 _recv_payload_pos = 0;
+                if (!_recv_hdr.len) {
+                    _recv_message_done();
+                }
             }
         } else {
 
-            // copy bytes to payload
-            int copy_len = _recv_hdr.len - _recv_payload_pos;
+            // copy bytes to the current payload segment
+            const int seg_index = _recv_payload_pos / RECV_SEG_SIZE;
+            const int seg_pos = _recv_payload_pos % RECV_SEG_SIZE;
+            const int seg_len = std::min<int>(_recv_hdr.len - seg_index * RECV_SEG_SIZE, RECV_SEG_SIZE);
+            if (!_recv_segs[seg_index]) {
+                _recv_segs[seg_index] = nb_buf_pool_alloc(seg_len);
+                _recv_segments += 1;
+            }
+            int copy_len = seg_len - seg_pos;
             if (copy_len > len) {
                 copy_len = len;
             }
-            memcpy(_recv_payload + _recv_payload_pos, buf, copy_len);
+            memcpy(_recv_segs[seg_index] + seg_pos, buf, copy_len);
             buf += copy_len;
             len -= copy_len;
             _recv_payload_pos += copy_len;
 
             // process the payload when full
             if (_recv_payload_pos >= (int)_recv_hdr.len) {
+                _recv_message_done();
+            }
+        }
+    }
+}
+
+static void
+_nudp_pool_buf_free(char* data, void* hint)
+{
+    nb_buf_pool_free(reinterpret_cast<uint8_t*>(data));
+}
+
+void
+Nudp::_recv_message_done()
+{
 #if NUDP_CHECKSUM
-                uint32_t checksum = adler32(0, Z_NULL, 0);
-                checksum = adler32(checksum, (const uint8_t*)_recv_payload, _recv_hdr.len);
+    uint32_t checksum = adler32(0, Z_NULL, 0);
+    for (int i = 0; i < (int)_recv_segs.size(); ++i) {
+        const int seg_len = std::min<int>(_recv_hdr.len - i * RECV_SEG_SIZE, RECV_SEG_SIZE);
+        checksum = adler32(checksum, _recv_segs[i], seg_len);
+    }
 #endif
-                if (!_recv_hdr.is_valid() ||
+    if (!_recv_hdr.is_valid() ||
 #if NUDP_CHECKSUM
-                    checksum != _recv_hdr.checksum ||
+        checksum != _recv_hdr.checksum ||
 #endif
-                    _recv_hdr.seq != _recv_msg_seq) {
-                    Buf::hexdump(&_recv_hdr, MSG_HDR_SIZE, "Nudp::_read_data (header decoded)");
-                    Buf::hexdump(
-                        _recv_payload,
-                        _recv_hdr.len > 128 ? 128 : _recv_hdr.len,
-                        "Nudp::_read_data (payload)");
+        _recv_hdr.seq != _recv_msg_seq) {
+        Buf::hexdump(&_recv_hdr, MSG_HDR_SIZE, "Nudp::_read_data (header decoded)");
+        if (!_recv_segs.empty()) {
+            Buf::hexdump(
+                _recv_segs[0],
+                _recv_hdr.len > 128 ? 128 : _recv_hdr.len,
+                "Nudp::_read_data (payload)");
+        }
 // TODO close connection instead of panic
 #if NUDP_CHECKSUM
-                    PANIC(
-                        "bad message:"
-                        << " magic "
-                        << _recv_hdr.magic
-                        << " seq "
-                        << _recv_hdr.seq
-                        << " expected "
-                        << _recv_msg_seq
-                        << " checksum 0x"
-                        << std::hex
-                        << checksum
-                        << " expected 0x"
-                        << _recv_hdr.checksum
-                        << std::dec
-                        << " len "
-                        << _recv_hdr.len);
+        PANIC(
+            "bad message:"
+            << " magic "
+            << _recv_hdr.magic
+            << " seq "
+            << _recv_hdr.seq
+            << " expected "
+            << _recv_msg_seq
+            << " checksum 0x"
+            << std::hex
+            << checksum
+            << " expected 0x"
+            << _recv_hdr.checksum
+            << std::dec
+            << " len "
+            << _recv_hdr.len);
 #else
-                    PANIC(
-                        "bad message:"
-                        << " magic "
-                        << _recv_hdr.magic
-                        << " seq "
-                        << _recv_hdr.seq
-                        << " expected "
-                        << _recv_msg_seq
-                        << " len "
-                        << _recv_hdr.len);
+        PANIC(
+            "bad message:"
+            << " magic "
+            << _recv_hdr.magic
+            << " seq "
+            << _recv_hdr.seq
+            << " expected "
+            << _recv_msg_seq
+            << " len "
+            << _recv_hdr.len);
 #endif
-                }
-                _recv_msg_seq += 1;
-                // ownership on memory passed to the node buffer
-                Nan::HandleScope scope;
-                v8::Local<v8::Object> node_buf =
-                    Nan::NewBuffer(_recv_payload, _recv_hdr.len).ToLocalChecked();
-                _recv_payload = NULL;
-                _recv_hdr_pos = 0;
-                _recv_payload_pos = 0;
-                // emit the message buffer
-                DBG3(
-                    "Nudp::_read_data: incoming message completed"
-                    << " seq "
-                    << _recv_hdr.seq
-                    << " len "
-                    << _recv_hdr.len
-                    << " local_port "
-                    << _local_port);
-                v8::Local<v8::Value> argv[] = {NAN_STR("message"), node_buf};
-                NAN_CALLBACK(handle(), "emit", 2, argv);
-            }
-        }
     }
+    _recv_msg_seq += 1;
+    _recv_messages += 1;
+    // ownership on the segments passed to the node buffers,
+    // which return them to the pool when collected
+    Nan::HandleScope scope;
+    const int num_segs = _recv_segs.size();
+    auto node_bufs = Nan::New<v8::Array>(num_segs);
+    for (int i = 0; i < num_segs; ++i) {
+        const int seg_len = std::min<int>(_recv_hdr.len - i * RECV_SEG_SIZE, RECV_SEG_SIZE);
+        Nan::Set(
+            node_bufs,
+            i,
+            Nan::NewBuffer(
+                reinterpret_cast<char*>(_recv_segs[i]), seg_len, _nudp_pool_buf_free, NULL)
+                .ToLocalChecked());
+    }
+    _recv_segs.clear();
+    _recv_in_payload = false;
+    _recv_hdr_pos = 0;
+    _recv_payload_pos = 0;
+    // emit the message buffers
+    DBG3(
+        "Nudp::_read_data: incoming message completed"
+        << " seq "
+        << _recv_hdr.seq
+        << " len "
+        << _recv_hdr.len
+        << " segments "
+        << num_segs
+        << " local_port "
+        << _local_port);
+    v8::Local<v8::Value> argv[] = {NAN_STR("message"), node_bufs};
+    NAN_CALLBACK(handle(), "emit", 2, argv);
+}
+
+void
+Nudp::_recv_segs_free()
+{
+    for (uint8_t* seg : _recv_segs) {
+        nb_buf_pool_free(seg);
+    }
+    _recv_segs.clear();
+    _recv_in_payload = false;
 }
 
 void
@@ -484,15 +608,10 @@ Nudp::_bind(const char* address, int port)
     int sin_len = sizeof(sin);
     NAUV_IP4_ADDR(address, port, &sin);
     NAUV_CALL(uv_udp_bind(&_uv_udp_handle, NAUV_UDP_ADDR(&sin), 0));
-    // once we have a file descriptor we can set the
-    int udp_buffer_size = UTP_SNDBUF_SIZE;
-    NAUV_CALL(
-        uv_send_buffer_size(reinterpret_cast<uv_handle_t*>(&_uv_udp_handle), &udp_buffer_size));
-    udp_buffer_size = UTP_RCVBUF_SIZE;
-    NAUV_CALL(
-        uv_recv_buffer_size(reinterpret_cast<uv_handle_t*>(&_uv_udp_handle), &udp_buffer_size));
     NAUV_CALL(uv_udp_getsockname(&_uv_udp_handle, NAUV_UDP_ADDR(&sin), &sin_len));
     _local_port = ntohs(sin.sin_port);
+    // once we have a file descriptor we can set the udp buffers
+    _apply_tuning();
     _start_receiving();
 }
 
@@ -513,9 +632,8 @@ Nudp::_setup_socket(utp_socket* socket)
     // DBG5("original UTP_TARGET_DELAY " << utp_getsockopt(_utp_socket, UTP_TARGET_DELAY));
     // DBG5("original UTP_SNDBUF " << utp_getsockopt(_utp_socket, UTP_SNDBUF));
     // DBG5("original UTP_RCVBUF " << utp_getsockopt(_utp_socket, UTP_RCVBUF));
-    utp_setsockopt(_utp_socket, UTP_TARGET_DELAY, UTP_TARGET_DELAY_MICROS); // in microseconds
-    utp_setsockopt(_utp_socket, UTP_SNDBUF, UTP_SNDBUF_SIZE);
-    utp_setsockopt(_utp_socket, UTP_RCVBUF, UTP_RCVBUF_SIZE);
+    _apply_tuning();
+    _tune_last_ms = uv_now(uv_default_loop());
     // start receiving if not already
     _start_receiving();
 }
@@ -545,6 +663,123 @@ NAUV_CALLBACK(Nudp::uv_callback_timer, uv_timer_t* handle)
     }
     utp_issue_deferred_acks(self._utp_ctx);
     utp_check_timeouts(self._utp_ctx);
+    if (self._tuning.autotune && self._utp_socket) {
+        self._autotune();
+    }
+}
+
+void
+Nudp::_apply_tuning()
+{
+    if (_utp_socket) {
+        utp_setsockopt(_utp_socket, UTP_TARGET_DELAY, _tuning.target_delay); // in microseconds
+        utp_setsockopt(_utp_socket, UTP_SNDBUF, _tuning.sndbuf);
+        utp_setsockopt(_utp_socket, UTP_RCVBUF, _tuning.rcvbuf);
+    }
+    if (_local_port) {
+        // the kernel buffers of the udp socket should hold the utp windows
+        int udp_buffer_size = _tuning.sndbuf;
+        NAUV_CALL(uv_send_buffer_size(
+            reinterpret_cast<uv_handle_t*>(&_uv_udp_handle), &udp_buffer_size));
+        udp_buffer_size = _tuning.rcvbuf;
+        NAUV_CALL(uv_recv_buffer_size(
+            reinterpret_cast<uv_handle_t*>(&_uv_udp_handle), &udp_buffer_size));
+    }
+}
+
+/**
+ * autotune is called by the timer to measure the connection rates and rtt.
+ * a buffer limits the rate of its direction to buffer/rtt, so when the measured
+ * bandwidth delay product gets close to the buffer size it is doubled, up to the max.
+ * the target delay is raised above the rtt variance of the link (jitter),
+ * otherwise ledbat mistakes the jitter for queueing and backs off.
+ * after AUTOTUNE_SHRINK_TICKS without growth, a buffer that is more than 4 times its
+ * bandwidth delay product and a target delay that is more than twice the jitter are halved,
+ * so a connection that slowed down or went idle gives back its kernel buffers.
+ */
+void
+Nudp::_autotune()
+{
+    utp_socket_window w;
+    if (utp_get_window(_utp_socket, &w)) {
+        return;
+    }
+    const uint64_t now = uv_now(uv_default_loop());
+    const uint64_t elapsed = now - _tune_last_ms;
+    if (!elapsed) {
+        return;
+    }
+    _tune_send_rate = _tune_sent_bytes * 1000 / elapsed;
+    _tune_recv_rate = _tune_recv_bytes * 1000 / elapsed;
+    _tune_sent_bytes = 0;
+    _tune_recv_bytes = 0;
+    _tune_last_ms = now;
+    _tune_rtt = w.rtt;
+    _tune_rtt_var = w.rtt_var;
+
+    // the delay that ledbat adds on top of the rtt is part of the pipe to fill
+    const uint64_t pipe_ms = w.rtt + _tuning.target_delay / 1000;
+    const uint64_t send_bdp = _tune_send_rate * pipe_ms / 1000;
+    const uint64_t recv_bdp = _tune_recv_rate * pipe_ms / 1000;
+    bool changed = false;
+
+    if (send_bdp * 4 >= (uint64_t)_tuning.sndbuf * 3 && _tuning.sndbuf < _tuning.autotune_max_buf) {
+        _tuning.sndbuf = std::min<int64_t>(int64_t(_tuning.sndbuf) * 2, _tuning.autotune_max_buf);
+        changed = true;
+    }
+    if (recv_bdp * 4 >= (uint64_t)_tuning.rcvbuf * 3 && _tuning.rcvbuf < _tuning.autotune_max_buf) {
+        _tuning.rcvbuf = std::min<int64_t>(int64_t(_tuning.rcvbuf) * 2, _tuning.autotune_max_buf);
+        changed = true;
+    }
+    const int jitter_delay = std::min<int64_t>(int64_t(w.rtt_var) * 2000, AUTOTUNE_MAX_TARGET_DELAY);
+    if (jitter_delay > _tuning.target_delay) {
+        _tuning.target_delay = jitter_delay;
+        changed = true;
+    }
+
+    if (changed) {
+        _tune_grows += 1;
+        _tune_idle_ticks = 0;
+    } else if (++_tune_idle_ticks >= AUTOTUNE_SHRINK_TICKS) {
+        _tune_idle_ticks = 0;
+        if (send_bdp * 4 < (uint64_t)_tuning.sndbuf && _tuning.sndbuf > _tune_base.sndbuf) {
+            _tuning.sndbuf = std::max(_tuning.sndbuf / 2, _tune_base.sndbuf);
+            changed = true;
+        }
+        if (recv_bdp * 4 < (uint64_t)_tuning.rcvbuf && _tuning.rcvbuf > _tune_base.rcvbuf) {
+            _tuning.rcvbuf = std::max(_tuning.rcvbuf / 2, _tune_base.rcvbuf);
+            changed = true;
+        }
+        if (jitter_delay * 2 < _tuning.target_delay && _tuning.target_delay > _tune_base.target_delay) {
+            _tuning.target_delay = std::max(_tuning.target_delay / 2, _tune_base.target_delay);
+            changed = true;
+        }
+        if (changed) {
+            _tune_shrinks += 1;
+        }
+    }
+
+    if (changed) {
+        DBG1(
+            "Nudp::_autotune:"
+            << " local_port "
+            << _local_port
+            << " rtt "
+            << w.rtt
+            << " rtt_var "
+            << w.rtt_var
+            << " send_rate "
+            << _tune_send_rate
+            << " recv_rate "
+            << _tune_recv_rate
+            << " target_delay "
+            << _tuning.target_delay
+            << " sndbuf "
+            << _tuning.sndbuf
+            << " rcvbuf "
+            << _tuning.rcvbuf);
+        _apply_tuning();
+    }
 }
 
 NAUV_CALLBACK(Nudp::uv_callback_prepare, uv_prepare_t* handle)
@@ -555,13 +790,41 @@ NAUV_CALLBACK(Nudp::uv_callback_prepare, uv_prepare_t* handle)
         return;
     }
     utp_issue_deferred_acks(self._utp_ctx);
+#if NUDP_SENDMMSG
+    // the packets utp sent since the last loop iteration go out together before polling
+    self._send_batch_flush();
+#endif
 }
 
+#if NUDP_RECVMMSG
+static inline bool
+_nudp_using_recvmmsg(uv_udp_t* handle)
+{
+#if UV_VERSION_HEX >= 0x012700
+    return uv_udp_using_recvmmsg(handle);
+#else
+    // before libuv 1.39 there is no way to ask, but the handle was created with UV_UDP_RECVMMSG,
+    // and the larger buffer only goes unused on kernels without recvmmsg
+    return true;
+#endif
+}
+#endif
+
 void
 Nudp::uv_callback_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
 {
+    Nudp& self = *reinterpret_cast<Nudp*>(handle->data);
+    // every alloc is followed by a single receive syscall
+    self._recv_syscalls += 1;
+    // datagram buffers are recycled by the pool instead of a new allocation per packet
     buf->len = suggested_size;
-    buf->base = new char[buf->len];
+#if NUDP_RECVMMSG
+    // libuv receives with recvmmsg into slots of the suggested size that fit in the buffer
+    if (_nudp_using_recvmmsg(reinterpret_cast<uv_udp_t*>(handle))) {
+        buf->len = suggested_size * RECV_MMSG_SLOTS;
+    }
+#endif
+    buf->base = reinterpret_cast<char*>(nb_buf_pool_alloc(buf->len));
     DBG9("Nudp::uv_callback_alloc: allocating " << buf->len << " suggested " << suggested_size);
 }
 
@@ -597,13 +860,27 @@ Nudp::uv_callback_receive(
             << " buf len "
             << buf->len);
     }
-    if (nread <= 0) {
-        delete[] buf->base;
+    if (nread > 0) {
+        assert(addr);
+        self._recv_packets += 1;
+        self._recv_packet(reinterpret_cast<const uint8_t*>(buf->base), nread, addr);
+    }
+#if NUDP_RECVMMSG
+    // with recvmmsg every packet is a chunk of one buffer, which is passed again
+    // to a last callback to be freed - flagged UV_UDP_MMSG_FREE since libuv 1.40,
+    // and before that with nread 0 and no flags, so both fall through to the free.
+    if (flags & UV_UDP_MMSG_CHUNK) {
         return;
     }
-    assert(addr);
-    if (is_stun_packet(buf->base, nread)) {
-        DBG2("Nudp::uv_callback_receive: got STUN packet local_port " << self._local_port);
+#endif
+    nb_buf_pool_free(reinterpret_cast<uint8_t*>(buf->base));
+}
+
+void
+Nudp::_recv_packet(const uint8_t* data, int len, const struct sockaddr* addr)
+{
+    if (is_stun_packet(data, len)) {
+        DBG2("Nudp::uv_callback_receive: got STUN packet local_port " << _local_port);
         Nan::HandleScope scope;
         auto rinfo = NAN_NEW_OBJ();
         // char s[INET6_ADDRSTRLEN];
@@ -622,17 +899,20 @@ Nudp::uv_callback_receive(
             NAN_SET_STR(rinfo, "address", name6);
             NAN_SET_INT(rinfo, "port", ntohs(sin6->sin6_port));
         }
-        // the node buffer takes ownership on the memory, so not deleting the allocation in this
-        // path
+        // stun packets are rare, so they are copied out of the receive buffer
+        // and the node buffer returns the copy to the pool
+        uint8_t* stun_buf = nb_buf_pool_alloc(len);
+        memcpy(stun_buf, data, len);
         v8::Local<v8::Value> argv[] = {
-            NAN_STR("stun"), Nan::NewBuffer(buf->base, nread).ToLocalChecked(), rinfo};
-        NAN_CALLBACK(self.handle(), "emit", 3, argv);
+            NAN_STR("stun"),
+            Nan::NewBuffer(reinterpret_cast<char*>(stun_buf), len, _nudp_pool_buf_free, NULL)
+                .ToLocalChecked(),
+            rinfo};
+        NAN_CALLBACK(handle(), "emit", 3, argv);
     } else {
-        const byte* data = reinterpret_cast<const byte*>(buf->base);
-        if (!utp_process_udp(self._utp_ctx, data, nread, addr, sizeof(struct sockaddr))) {
+        if (!utp_process_udp(_utp_ctx, data, len, addr, sizeof(struct sockaddr))) {
             DBG3("Nudp::uv_callback_receive: UDP packet not handled by UTP. Ignoring.");
         }
-        delete[] buf->base;
     }
 }
 
@@ -651,13 +931,6 @@ Nudp::utp_callback_sendto(utp_callback_arguments* a)
         DBG5("Nudp::utp_callback_sendto: closed. ignoring.");
         return 0;
     }
-    uv_udp_send_t* req = new uv_udp_send_t;
-    SendUtpPacketReq* data = new SendUtpPacketReq;
-    req->data = data;
-    data->buf = new char[a->len];
-    memcpy(data->buf, a->buf, a->len);
-    uv_buf_t buf = uv_buf_init(data->buf, a->len);
-    data->sin = *reinterpret_cast<const struct sockaddr_in*>(a->address);
     DBG3(
         "Nudp::utp_callback_sendto:"
         << " local_port "
@@ -669,16 +942,160 @@ Nudp::utp_callback_sendto(utp_callback_arguments* a)
     if (DBG_VISIBLE(9)) {
         Buf::hexdump(a->buf, a->len > 128 ? 128 : a->len, "Nudp::utp_callback_sendto");
     }
+    const struct sockaddr_in* sin = reinterpret_cast<const struct sockaddr_in*>(a->address);
+#if NUDP_SENDMMSG
+    self._send_batch_push(a->buf, a->len, sin);
+#else
+    self._send_packet(a->buf, a->len, sin);
+#endif
+    return 0;
+}
+
+void
+Nudp::_send_packet(const uint8_t* packet, int len, const struct sockaddr_in* sin)
+{
+    uv_udp_send_t* req = new uv_udp_send_t;
+    SendUtpPacketReq* data = new SendUtpPacketReq;
+    req->data = data;
+    data->buf = new char[len];
+    memcpy(data->buf, packet, len);
+    uv_buf_t buf = uv_buf_init(data->buf, len);
+    data->sin = *sin;
+    _send_syscalls += 1;
+    _send_packets += 1;
     NAUV_CALL(uv_udp_send(
         req,
-        &self._uv_udp_handle,
+        &_uv_udp_handle,
         &buf,
         1,
         NAUV_UDP_ADDR(&data->sin),
         &Nudp::uv_callback_send_utp));
-    return 0;
 }
 
+#if NUDP_SENDMMSG
+
+void
+Nudp::_send_batch_push(const uint8_t* packet, int len, const struct sockaddr_in* sin)
+{
+    if ((int)_send_batch.size() >= SEND_BATCH_MAX_PACKETS ||
+        _send_batch_pos + len > (int)_send_batch_data.size()) {
+        _send_batch_flush();
+    }
+    if (len > (int)_send_batch_data.size()) {
+        _send_packet(packet, len, sin);
+        return;
+    }
+    SendBatchPacket p;
+    p.offset = _send_batch_pos;
+    p.len = len;
+    p.sin = *sin;
+    memcpy(_send_batch_data.data() + _send_batch_pos, packet, len);
+    _send_batch_pos += len;
+    _send_batch.push_back(p);
+}
+
+static inline bool
+_nudp_same_addr(const struct sockaddr_in& a, const struct sockaddr_in& b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+/**
+ * send the packets batched during the loop iteration with a single sendmmsg.
+ * with gso a run of packets to the same address is sent as one message
+ * that the kernel (or the nic) splits back to datagrams of the first packet size.
+ */
+void
+Nudp::_send_batch_flush()
+{
+    const int count = _send_batch.size();
+    if (!count) {
+        return;
+    }
+    uv_os_fd_t fd = -1;
+    NAUV_CALL(uv_fileno(reinterpret_cast<uv_handle_t*>(&_uv_udp_handle), &fd));
+
+    struct mmsghdr msgs[SEND_BATCH_MAX_PACKETS];
+    struct iovec iovs[SEND_BATCH_MAX_PACKETS];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctrls[SEND_BATCH_MAX_PACKETS];
+    int msg_first_packet[SEND_BATCH_MAX_PACKETS + 1];
+
+    int first = 0;
+    while (first < count) {
+        int num_msgs = 0;
+        for (int i = first; i < count;) {
+            SendBatchPacket& p = _send_batch[i];
+            int bytes = p.len;
+            int j = i + 1;
+            while (_send_gso && j < count && j - i < SEND_GSO_MAX_SEGS &&
+                   _send_batch[j].len <= p.len && bytes + _send_batch[j].len <= SEND_GSO_MAX_BYTES &&
+                   _nudp_same_addr(_send_batch[j].sin, p.sin)) {
+                bytes += _send_batch[j].len;
+                // only the last segment can be shorter
+                if (_send_batch[j++].len < p.len) break;
+            }
+            // the batched packets are contiguous so a run of them is a single iovec
+            struct msghdr& h = msgs[num_msgs].msg_hdr;
+            memset(&msgs[num_msgs], 0, sizeof(msgs[num_msgs]));
+            iovs[num_msgs].iov_base = _send_batch_data.data() + p.offset;
+            iovs[num_msgs].iov_len = bytes;
+            h.msg_name = &p.sin;
+            h.msg_namelen = sizeof(p.sin);
+            h.msg_iov = &iovs[num_msgs];
+            h.msg_iovlen = 1;
+            if (j - i > 1) {
+                h.msg_control = ctrls[num_msgs].buf;
+                h.msg_controllen = sizeof(ctrls[num_msgs].buf);
+                struct cmsghdr* cm = CMSG_FIRSTHDR(&h);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *reinterpret_cast<uint16_t*>(CMSG_DATA(cm)) = p.len;
+                _send_gso_msgs += 1;
+            }
+            msg_first_packet[num_msgs] = i;
+            num_msgs += 1;
+            i = j;
+        }
+        msg_first_packet[num_msgs] = count;
+
+        const int res = sendmmsg(fd, msgs, num_msgs, 0);
+        _send_syscalls += 1;
+        if (res >= 0) {
+            _send_packets += msg_first_packet[res] - first;
+            first = msg_first_packet[res];
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (_send_gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+            // the kernel or the device cannot segment, so resend without gso from now on
+            LOG("Nudp::_send_batch_flush: disabling gso errno " << errno << " local_port " << _local_port);
+            _send_gso = false;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // the socket buffer is full, the rest will wait in the uv send queue
+            for (int i = first; i < count; ++i) {
+                const SendBatchPacket& p = _send_batch[i];
+                _send_packet(_send_batch_data.data() + p.offset, p.len, &p.sin);
+            }
+        } else {
+            // dropped packets are retransmitted by utp like any lost datagram
+            DBG1("Nudp::_send_batch_flush: sendmmsg errno " << errno << " dropped " << count - first);
+        }
+        break;
+    }
+    _send_batch.clear();
+    _send_batch_pos = 0;
+}
+
+#endif
+
 void
 Nudp::uv_callback_send_utp(uv_udp_send_t* req, int status)
 {
@@ -798,20 +1215,58 @@ NAN_METHOD(Nudp::stats)
         NAN_RETURN(Nan::Undefined());
         return;
     }
+    auto obj = NAN_NEW_OBJ();
+    // libutp keeps its socket stats only in debug builds
     utp_socket_stats* stats = utp_get_stats(self._utp_socket);
-    if (!stats) {
-        NAN_RETURN(Nan::Undefined());
-        return;
+    if (stats) {
+        NAN_SET_NUM(obj, "bytes_sent", stats->nbytes_xmit);
+        NAN_SET_NUM(obj, "bytes_received", stats->nbytes_recv);
+        NAN_SET_INT(obj, "packets_sent", stats->nxmit);
+        NAN_SET_INT(obj, "packets_received", stats->nrecv);
+        NAN_SET_INT(obj, "packets_received_dup", stats->nduprecv);
+        NAN_SET_INT(obj, "retransmits", stats->rexmit);
+        NAN_SET_INT(obj, "retransmits_fast", stats->fastrexmit);
+        NAN_SET_INT(obj, "mtu_guess", stats->mtu_guess);
     }
-    auto obj = NAN_NEW_OBJ();
-    NAN_SET_NUM(obj, "bytes_sent", stats->nbytes_xmit);
-    NAN_SET_NUM(obj, "bytes_received", stats->nbytes_recv);
-    NAN_SET_INT(obj, "packets_sent", stats->nxmit);
-    NAN_SET_INT(obj, "packets_received", stats->nrecv);
-    NAN_SET_INT(obj, "packets_received_dup", stats->nduprecv);
-    NAN_SET_INT(obj, "retransmits", stats->rexmit);
-    NAN_SET_INT(obj, "retransmits_fast", stats->fastrexmit);
-    NAN_SET_INT(obj, "mtu_guess", stats->mtu_guess);
+    utp_socket_window w;
+    if (!utp_get_window(self._utp_socket, &w)) {
+        NAN_SET_INT(obj, "rtt", w.rtt);
+        NAN_SET_INT(obj, "rtt_var", w.rtt_var);
+        NAN_SET_INT(obj, "cur_window", w.cur_window);
+        NAN_SET_INT(obj, "max_window", w.max_window);
+    }
+    NAN_SET_INT(obj, "target_delay", self._tuning.target_delay);
+    NAN_SET_INT(obj, "sndbuf", self._tuning.sndbuf);
+    NAN_SET_INT(obj, "rcvbuf", self._tuning.rcvbuf);
+    NAN_SET(obj, "autotune", Nan::New(self._tuning.autotune));
+    if (self._tuning.autotune) {
+        NAN_SET_INT(obj, "autotune_max_buf", self._tuning.autotune_max_buf);
+        NAN_SET_NUM(obj, "autotune_send_rate", self._tune_send_rate);
+        NAN_SET_NUM(obj, "autotune_recv_rate", self._tune_recv_rate);
+        NAN_SET_INT(obj, "autotune_grows", self._tune_grows);
+        NAN_SET_INT(obj, "autotune_shrinks", self._tune_shrinks);
+    }
+    NAN_SET_NUM(obj, "send_syscalls", self._send_syscalls);
+    NAN_SET_NUM(obj, "send_packets", self._send_packets);
+    NAN_SET_NUM(obj, "send_gso_msgs", self._send_gso_msgs);
+    NAN_SET(obj, "send_mmsg", Nan::New(bool(NUDP_SENDMMSG)));
+    NAN_SET(obj, "recv_mmsg", Nan::New(bool(NUDP_RECVMMSG)));
+    NAN_SET_NUM(
+        obj,
+        "send_packets_per_syscall",
+        self._send_syscalls ? double(self._send_packets) / self._send_syscalls : 0);
+    NAN_SET_NUM(obj, "recv_syscalls", self._recv_syscalls);
+    NAN_SET_NUM(obj, "recv_packets", self._recv_packets);
+    NAN_SET_NUM(
+        obj,
+        "recv_packets_per_syscall",
+        self._recv_syscalls ? double(self._recv_packets) / self._recv_syscalls : 0);
+    NAN_SET_NUM(obj, "recv_messages", self._recv_messages);
+    NAN_SET_NUM(obj, "recv_segments", self._recv_segments);
+    struct NB_Buf_Pool_Stats pool_stats;
+    nb_buf_pool_stats(&pool_stats);
+    NAN_SET_NUM(obj, "recv_pool_allocs", pool_stats.allocs);
+    NAN_SET_NUM(obj, "recv_pool_reuses", pool_stats.reuses);
     NAN_RETURN(obj);
 }
 
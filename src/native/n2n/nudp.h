@@ -2,11 +2,25 @@
 #pragma once
 
 #include <list>
+#include <vector>
 
 #include "../util/nan.h"
 
 #define NUDP_CHECKSUM 0
 
+// linux batched udp i/o - sendmmsg and gso are done by nudp on the socket fd,
+// so they only need uv_fileno, while recvmmsg is done by libuv since 1.37 (UV_UDP_RECVMMSG)
+#if defined(__linux__)
+#define NUDP_SENDMMSG 1
+#else
+#define NUDP_SENDMMSG 0
+#endif
+#if defined(__linux__) && UV_VERSION_HEX >= 0x012500
+#define NUDP_RECVMMSG 1
+#else
+#define NUDP_RECVMMSG 0
+#endif
+
 // utp.h forward declerations
 struct utp_iovec;
 typedef struct UTPSocket utp_socket;
@@ -58,6 +72,22 @@ private:
 
 private:
     static const int MAX_MSG_LEN = 64 * 1024 * 1024;
+    // received payloads are scattered into pooled segments of up to this size,
+    // and the segments are handed to JS as an array of buffers without another copy
+    static const int RECV_SEG_SIZE = 1024 * 1024;
+    // recvmmsg slots per receive buffer, libuv caps the batch at 20 datagrams
+    static const int RECV_MMSG_SLOTS = 16;
+    // packets sent by utp in a loop iteration are batched up to these limits
+    static const int SEND_BATCH_MAX_PACKETS = 128;
+    static const int SEND_BATCH_MAX_BYTES = 256 * 1024;
+    // a gso message is limited by the kernel segments count and the udp length
+    static const int SEND_GSO_MAX_SEGS = 64;
+    static const int SEND_GSO_MAX_BYTES = 60 * 1024;
+    // autotune never raises the utp target delay above this (microseconds)
+    static const int AUTOTUNE_MAX_TARGET_DELAY = 100000;
+    // timer ticks without growth after which autotune halves what is far above the demand,
+    // down to the configured tuning
+    static const int AUTOTUNE_SHRINK_TICKS = 20;
     static const int MSG_MAGIC_LEN = 4;
     static const char MSG_HDR_MAGIC[MSG_MAGIC_LEN];
 
@@ -99,16 +129,38 @@ private:
 
     static const int MSG_HDR_SIZE = sizeof(MsgHdr);
 
+    // utp congestion and buffer parameters of the connection,
+    // the defaults fit a low latency lan and can be set by the constructor options
+    struct Tuning {
+        int target_delay; // microseconds
+        int sndbuf;
+        int rcvbuf;
+        // grow the buffers to the measured bandwidth delay product up to autotune_max_buf
+        bool autotune;
+        int autotune_max_buf;
+        Tuning();
+    };
+
 private:
-    explicit Nudp();
+    explicit Nudp(const Tuning& tuning);
     ~Nudp();
     void _close();
     void _submit_close();
     void _write_data();
     void _read_data(const uint8_t* buf, int len);
+    void _recv_message_done();
+    void _recv_packet(const uint8_t* data, int len, const struct sockaddr* addr);
+    void _send_packet(const uint8_t* packet, int len, const struct sockaddr_in* sin);
+#if NUDP_SENDMMSG
+    void _send_batch_push(const uint8_t* packet, int len, const struct sockaddr_in* sin);
+    void _send_batch_flush();
+#endif
+    void _recv_segs_free();
     void _bind(const char* address, int port);
     void _setup_socket(utp_socket* socket);
     void _start_receiving();
+    void _apply_tuning();
+    void _autotune();
 
 private:
     utp_context* _utp_ctx;
@@ -119,11 +171,43 @@ private:
     uv_udp_t _uv_udp_handle;
     std::list<Msg*> _messages;
     MsgHdr _recv_hdr;
-    char* _recv_payload;
+    std::vector<uint8_t*> _recv_segs;
+    bool _recv_in_payload;
     int _recv_hdr_pos;
     int _recv_payload_pos;
+    uint64_t _recv_messages;
+    uint64_t _recv_segments;
+    uint64_t _recv_syscalls;
+    uint64_t _recv_packets;
+    uint64_t _send_syscalls;
+    uint64_t _send_packets;
+    uint64_t _send_gso_msgs;
+#if NUDP_SENDMMSG
+    struct SendBatchPacket {
+        int offset;
+        int len;
+        struct sockaddr_in sin;
+    };
+    std::vector<SendBatchPacket> _send_batch;
+    std::vector<uint8_t> _send_batch_data;
+    int _send_batch_pos;
+    bool _send_gso;
+#endif
     uint64_t _send_msg_seq;
     uint64_t _recv_msg_seq;
+    Tuning _tuning;
+    // the configured tuning that autotune grows from and shrinks back to
+    Tuning _tune_base;
+    uint64_t _tune_last_ms;
+    uint64_t _tune_sent_bytes;
+    uint64_t _tune_recv_bytes;
+    uint64_t _tune_send_rate;
+    uint64_t _tune_recv_rate;
+    uint32_t _tune_rtt;
+    uint32_t _tune_rtt_var;
+    int _tune_grows;
+    int _tune_shrinks;
+    int _tune_idle_ticks;
     bool _closed;
     bool _receiving;
     int _local_port;
@@ -35,7 +35,13 @@
             '<@(napi_dependencies)',
             'third_party/cm256.gyp:cm256',
             'third_party/snappy.gyp:snappy',
+            'third_party/isa-l.gyp:isa-l-aes',
             'third_party/isa-l.gyp:isa-l-ec',
+            'third_party/isa-l.gyp:isa-l-igzip',
+            'third_party/isa-l.gyp:isa-l-md5',
+            'third_party/isa-l.gyp:isa-l-sha1',
+            'third_party/isa-l.gyp:isa-l-sha256',
+            'third_party/isa-l.gyp:isa-l-sha512',
         ],
         'sources': [
             # module
@@ -44,6 +50,8 @@
             'chunk/coder_napi.cpp',
             'chunk/coder.h',
             'chunk/coder.cpp',
+            'chunk/coder_pool.h',
+            'chunk/coder_pool.cpp',
             'chunk/splitter_napi.cpp',
             'chunk/splitter.h',
             'chunk/splitter.cpp',
@@ -52,20 +60,46 @@
             'tools/ssl_napi.cpp',
             'tools/syslog_napi.cpp',
             # util
+            'util/aes_gcm.h',
+            'util/aes_gcm.cpp',
+            'util/arena.h',
+            'util/arena.cpp',
             'util/b64.h',
             'util/b64.cpp',
             'util/backtrace.h',
+            'util/buf_pool.h',
+            'util/buf_pool.cpp',
             'util/struct_buf.h',
             'util/struct_buf.cpp',
             'util/common.h',
+            'util/mb_digest.h',
+            'util/mb_digest.cpp',
+            'util/mpmc_ring.h',
+            'util/mpsc_queue.h',
+            'util/mutex.h',
             'util/napi.h',
             'util/napi.cpp',
             'util/rabin.h',
             'util/rabin.cpp',
+            'util/gear.h',
+            'util/gear.cpp',
+            'util/lz4.h',
+            'util/lz4.cpp',
+            'util/numa.h',
+            'util/numa.cpp',
             'util/snappy.h',
             'util/snappy.cpp',
+            'util/spsc_ring.h',
+            'util/work_stealing.h',
+            'util/work_stealing.cpp',
             'util/zlib.h',
             'util/zlib.cpp',
+            'util/zstd.h',
+            'util/zstd.cpp',
+        ],
+        'libraries': [
+            '-lzstd',
+            '-llz4',
         ],
     }, {
         'target_name': 'nb_native_nan',
@@ -87,9 +121,13 @@
             'util/gf2.h',
             'util/rabin_fingerprint.h',
             'util/backtrace.h',
+            'util/arena.cpp',
+            'util/arena.h',
             'util/b64.cpp',
             'util/buf.cpp',
             'util/buf.h',
+            'util/buf_pool.cpp',
+            'util/buf_pool.h',
             'util/common.h',
             'util/compression.cpp',
             'util/compression.h',
@@ -97,8 +135,16 @@
             'util/nan.h',
             'util/mutex.h',
             'util/rabin_fingerprint.h',
+            'util/struct_buf.cpp',
+            'util/struct_buf.h',
+            'util/mpmc_ring.h',
+            'util/mpsc_queue.h',
+            'util/numa.cpp',
+            'util/numa.h',
             'util/tpool.cpp',
             'util/tpool.h',
+            'util/work_stealing.cpp',
+            'util/work_stealing.h',
         ],
     }, {
         'target_name': 'kube_pv_chown',
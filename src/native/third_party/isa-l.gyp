@@ -94,6 +94,50 @@
             ],
         },
 
+        {
+            'target_name': 'isa-l-igzip',
+            'type': 'static_library',
+            'includes': ['../asm.gypi'],
+            'include_dirs': [
+                'isa-l/include/',
+                'isa-l/igzip/',
+            ],
+            'sources': [
+                'isa-l/igzip/igzip.c',
+                'isa-l/igzip/hufftables_c.c',
+                'isa-l/igzip/igzip_base.c',
+                'isa-l/igzip/igzip_icf_base.c',
+                'isa-l/igzip/crc32_gzip_base.c',
+                'isa-l/igzip/flatten_ll.c',
+                'isa-l/igzip/encode_df.c',
+                'isa-l/igzip/huff_codes.c',
+                'isa-l/igzip/igzip_inflate.c',
+                'isa-l/igzip/igzip_body_01.asm',
+                'isa-l/igzip/igzip_body_02.asm',
+                'isa-l/igzip/igzip_body_04.asm',
+                'isa-l/igzip/igzip_finish.asm',
+                'isa-l/igzip/igzip_icf_body_01.asm',
+                'isa-l/igzip/igzip_icf_body_02.asm',
+                'isa-l/igzip/igzip_icf_body_04.asm',
+                'isa-l/igzip/igzip_icf_finish.asm',
+                'isa-l/igzip/rfc1951_lookup.asm',
+                'isa-l/igzip/crc32_gzip.asm',
+                'isa-l/igzip/detect_repeated_char.asm',
+                'isa-l/igzip/adler32_sse.asm',
+                'isa-l/igzip/adler32_avx2_4.asm',
+                'isa-l/igzip/igzip_multibinary.asm',
+                'isa-l/igzip/igzip_update_histogram_01.asm',
+                'isa-l/igzip/igzip_update_histogram_04.asm',
+                'isa-l/igzip/igzip_decode_block_stateless_01.asm',
+                'isa-l/igzip/igzip_decode_block_stateless_04.asm',
+                'isa-l/igzip/igzip_inflate_multibinary.asm',
+                'isa-l/igzip/encode_df_04.asm',
+                'isa-l/igzip/encode_df_06.asm',
+                'isa-l/igzip/proc_heap.asm',
+                'isa-l/igzip/igzip_deflate_hash.asm',
+            ],
+        },
+
         {
             'target_name': 'isa-l-rolling-hash',
             'type': 'static_library',
@@ -258,6 +302,30 @@
             ],
         },
 
+        {
+            'target_name': 'isa-l-aes',
+            'type': 'static_library',
+            'includes': ['../asm.gypi'],
+            'include_dirs': [
+                'isa-l_crypto/include/',
+                'isa-l_crypto/aes/',
+            ],
+            'sources': [
+                'isa-l_crypto/aes/gcm_pre.c',
+                'isa-l_crypto/aes/gcm_multibinary.asm',
+                'isa-l_crypto/aes/gcm128_sse.asm',
+                'isa-l_crypto/aes/gcm128_avx_gen2.asm',
+                'isa-l_crypto/aes/gcm128_avx_gen4.asm',
+                'isa-l_crypto/aes/gcm256_sse.asm',
+                'isa-l_crypto/aes/gcm256_avx_gen2.asm',
+                'isa-l_crypto/aes/gcm256_avx_gen4.asm',
+                'isa-l_crypto/aes/keyexp_multibinary.asm',
+                'isa-l_crypto/aes/keyexp_128.asm',
+                'isa-l_crypto/aes/keyexp_192.asm',
+                'isa-l_crypto/aes/keyexp_256.asm',
+            ],
+        },
+
         # tests
 
         {
@@ -139,6 +139,15 @@ typedef struct {
 	uint32 mtu_guess;	// Best guess at MTU
 } utp_socket_stats;
 
+// NOOBAA MOD - added utp_get_window() to let the application tune the buffers of a connection
+// Returned by utp_get_window()
+typedef struct {
+	uint32 rtt;			// round trip time in milliseconds
+	uint32 rtt_var;		// round trip time variance in milliseconds
+	uint32 cur_window;	// bytes in flight
+	uint32 max_window;	// congestion window
+} utp_socket_window;
+
 #define UTP_IOV_MAX 1024
 
 // For utp_writev, to writes data from multiple buffers
@@ -173,6 +182,7 @@ int				utp_getpeername					(utp_socket *s, struct sockaddr *addr, socklen_t *add
 void			utp_read_drained				(utp_socket *s);
 int				utp_get_delays					(utp_socket *s, uint32 *ours, uint32 *theirs, uint32 *age);
 utp_socket_stats* utp_get_stats					(utp_socket *s);
+int				utp_get_window					(utp_socket *s, utp_socket_window *w); // NOOBAA MOD
 utp_context*	utp_get_context					(utp_socket *s);
 void			utp_close						(utp_socket *s);
 
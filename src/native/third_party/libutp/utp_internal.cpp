@@ -3438,6 +3438,18 @@ inline bool struct_utp_context::would_log(int level)
 	return true;
 }
 
+// NOOBAA MOD - unlike utp_get_stats() this is available in release builds
+int utp_get_window(utp_socket *socket, utp_socket_window *w)
+{
+	assert(socket);
+	if (!socket) return -1;
+	w->rtt = socket->rtt;
+	w->rtt_var = socket->rtt_var;
+	w->cur_window = (uint32)socket->cur_window;
+	w->max_window = (uint32)socket->max_window;
+	return 0;
+}
+
 utp_socket_stats* utp_get_stats(utp_socket *socket)
 {
 	#ifdef _DEBUG
@@ -0,0 +1,127 @@
+/* Copyright (C) 2016 NooBaa */
+#include "aes_gcm.h"
+#include "../third_party/isa-l_crypto/include/aes_gcm.h"
+#include <assert.h>
+#include <openssl/crypto.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace noobaa
+{
+
+struct NB_Aes_Gcm {
+    struct gcm_key_data key_data;
+    struct gcm_context_data context_data;
+    // the key that key_data was expanded from
+    uint8_t key[GCM_256_KEY_LEN];
+    int key_len;
+};
+
+static bool
+_nb_aes_gcm_cpu_supported()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return (ecx & bit_AES) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+#else
+    return false;
+#endif
+}
+
+bool
+nb_aes_gcm_supported(int key_len)
+{
+    static const bool cpu_supported = _nb_aes_gcm_cpu_supported();
+    return cpu_supported && (key_len == GCM_128_KEY_LEN || key_len == GCM_256_KEY_LEN);
+}
+
+struct NB_Aes_Gcm*
+nb_aes_gcm_thread_ctx()
+{
+    // zero initialized so the first init expands the key
+    static thread_local struct NB_Aes_Gcm gcm;
+    return &gcm;
+}
+
+void
+nb_aes_gcm_init(struct NB_Aes_Gcm* gcm, const uint8_t* key, int key_len, const uint8_t* iv)
+{
+    assert(key_len == GCM_128_KEY_LEN || key_len == GCM_256_KEY_LEN);
+    if (gcm->key_len != key_len || memcmp(gcm->key, key, key_len)) {
+        if (key_len == GCM_256_KEY_LEN) {
+            aes_gcm_pre_256(key, &gcm->key_data);
+        } else {
+            aes_gcm_pre_128(key, &gcm->key_data);
+        }
+        memcpy(gcm->key, key, key_len);
+        gcm->key_len = key_len;
+    }
+    // isa-l takes a non const iv but only reads it
+    uint8_t iv_copy[NB_AES_GCM_IV_LEN];
+    memcpy(iv_copy, iv, NB_AES_GCM_IV_LEN);
+    if (key_len == GCM_256_KEY_LEN) {
+        aes_gcm_init_256(&gcm->key_data, &gcm->context_data, iv_copy, 0, 0);
+    } else {
+        aes_gcm_init_128(&gcm->key_data, &gcm->context_data, iv_copy, 0, 0);
+    }
+}
+
+void
+nb_aes_gcm_encrypt(struct NB_Aes_Gcm* gcm, uint8_t* out, const uint8_t* in, int len)
+{
+    if (gcm->key_len == GCM_256_KEY_LEN) {
+        aes_gcm_enc_256_update(&gcm->key_data, &gcm->context_data, out, in, len);
+    } else {
+        aes_gcm_enc_128_update(&gcm->key_data, &gcm->context_data, out, in, len);
+    }
+}
+
+void
+nb_aes_gcm_decrypt(struct NB_Aes_Gcm* gcm, uint8_t* out, const uint8_t* in, int len)
+{
+    if (gcm->key_len == GCM_256_KEY_LEN) {
+        aes_gcm_dec_256_update(&gcm->key_data, &gcm->context_data, out, in, len);
+    } else {
+        aes_gcm_dec_128_update(&gcm->key_data, &gcm->context_data, out, in, len);
+    }
+}
+
+void
+nb_aes_gcm_encrypt_final(struct NB_Aes_Gcm* gcm, uint8_t* tag, int tag_len)
+{
+    if (gcm->key_len == GCM_256_KEY_LEN) {
+        aes_gcm_enc_256_finalize(&gcm->key_data, &gcm->context_data, tag, tag_len);
+    } else {
+        aes_gcm_enc_128_finalize(&gcm->key_data, &gcm->context_data, tag, tag_len);
+    }
+}
+
+bool
+nb_aes_gcm_decrypt_final(struct NB_Aes_Gcm* gcm, const uint8_t* tag, int tag_len)
+{
+    uint8_t computed[NB_AES_GCM_TAG_LEN];
+    if (tag_len <= 0 || tag_len > NB_AES_GCM_TAG_LEN) return false;
+    if (gcm->key_len == GCM_256_KEY_LEN) {
+        aes_gcm_dec_256_finalize(&gcm->key_data, &gcm->context_data, computed, tag_len);
+    } else {
+        aes_gcm_dec_128_finalize(&gcm->key_data, &gcm->context_data, computed, tag_len);
+    }
+    // constant time compare
+    uint8_t diff = 0;
+    for (int i = 0; i < tag_len; ++i) {
+        diff |= computed[i] ^ tag[i];
+    }
+    return !diff;
+}
+
+void
+nb_aes_gcm_wipe(struct NB_Aes_Gcm* gcm)
+{
+    // OPENSSL_cleanse is not optimized away like a memset of memory that is not read again
+    OPENSSL_cleanse(gcm, sizeof(*gcm));
+}
+}
@@ -0,0 +1,34 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <stdint.h>
+
+namespace noobaa
+{
+
+// aes-gcm with the isa-l_crypto aesni kernels, streamed like EVP_EncryptUpdate().
+// the output and tag are byte-compatible with EVP aes-128-gcm / aes-256-gcm with a 12 byte iv.
+// every thread has its own context, which keeps the expanded key of the last key it used,
+// so a key that is used for many chunks is expanded once per thread and not per chunk.
+// callers wipe the context after a key that should not outlive its use (e.g. a random chunk key).
+
+#define NB_AES_GCM_IV_LEN 12
+#define NB_AES_GCM_TAG_LEN 16
+
+struct NB_Aes_Gcm;
+
+// the cpu has aesni and pclmul and the key length is 16 or 32
+bool nb_aes_gcm_supported(int key_len);
+
+// the context of the calling thread, which is valid until the thread exits
+struct NB_Aes_Gcm* nb_aes_gcm_thread_ctx();
+
+void nb_aes_gcm_init(struct NB_Aes_Gcm* gcm, const uint8_t* key, int key_len, const uint8_t* iv);
+void nb_aes_gcm_encrypt(struct NB_Aes_Gcm* gcm, uint8_t* out, const uint8_t* in, int len);
+void nb_aes_gcm_decrypt(struct NB_Aes_Gcm* gcm, uint8_t* out, const uint8_t* in, int len);
+void nb_aes_gcm_encrypt_final(struct NB_Aes_Gcm* gcm, uint8_t* tag, int tag_len);
+// returns false if the tag does not match
+bool nb_aes_gcm_decrypt_final(struct NB_Aes_Gcm* gcm, const uint8_t* tag, int tag_len);
+// clears the key, its expanded schedule and the stream state
+void nb_aes_gcm_wipe(struct NB_Aes_Gcm* gcm);
+}
@@ -0,0 +1,108 @@
+/* Copyright (C) 2016 NooBaa */
+#include "arena.h"
+#include "buf_pool.h"
+#include <assert.h>
+#include <atomic>
+
+namespace noobaa
+{
+
+struct NB_Arena_Block {
+    struct NB_Arena_Block* next;
+    int pos;
+    int cap;
+};
+
+// the block header is padded to keep the allocations aligned
+#define NB_ARENA_HEADER_SIZE \
+    ((int)((sizeof(struct NB_Arena_Block) + NB_ARENA_ALIGN - 1) & ~(NB_ARENA_ALIGN - 1)))
+
+static std::atomic<uint64_t> g_arena_allocs(0);
+static std::atomic<uint64_t> g_arena_bytes(0);
+static std::atomic<uint64_t> g_arena_blocks(0);
+static std::atomic<uint64_t> g_arena_large_blocks(0);
+static std::atomic<uint64_t> g_arena_frees(0);
+
+static struct NB_Arena_Block*
+_nb_arena_new_block(struct NB_Arena_Block* next, int cap)
+{
+    struct NB_Arena_Block* block = (struct NB_Arena_Block*)nb_buf_pool_alloc(cap);
+    block->next = next;
+    block->pos = NB_ARENA_HEADER_SIZE;
+    block->cap = cap;
+    return block;
+}
+
+void
+nb_arena_init(struct NB_Arena* arena)
+{
+    // the first block is only taken on the first alloc
+    arena->head = 0;
+}
+
+void
+nb_arena_free(struct NB_Arena* arena)
+{
+    if (!arena->head) return;
+    struct NB_Arena_Block* block = arena->head;
+    while (block) {
+        struct NB_Arena_Block* next = block->next;
+        nb_buf_pool_free((uint8_t*)block);
+        block = next;
+    }
+    arena->head = 0;
+    g_arena_frees++;
+}
+
+void*
+nb_arena_alloc(struct NB_Arena* arena, int len)
+{
+    assert(len >= 0);
+    const int size = (len + NB_ARENA_ALIGN - 1) & ~(NB_ARENA_ALIGN - 1);
+    struct NB_Arena_Block* block = arena->head;
+    g_arena_allocs++;
+    g_arena_bytes += size;
+
+    if (!block || block->pos + size > block->cap) {
+        if (NB_ARENA_HEADER_SIZE + size > NB_ARENA_BLOCK_SIZE / 2) {
+            // large allocations get their own block behind the current one,
+            // so the rest of the current block can still be used
+            struct NB_Arena_Block* large = _nb_arena_new_block(
+                block ? block->next : 0, NB_ARENA_HEADER_SIZE + size);
+            g_arena_large_blocks++;
+            if (block) {
+                block->next = large;
+            } else {
+                arena->head = large;
+            }
+            large->pos = large->cap;
+            return (uint8_t*)large + NB_ARENA_HEADER_SIZE;
+        }
+        block = _nb_arena_new_block(block, NB_ARENA_BLOCK_SIZE);
+        arena->head = block;
+        g_arena_blocks++;
+    }
+
+    void* p = (uint8_t*)block + block->pos;
+    block->pos += size;
+    return p;
+}
+
+void
+nb_arena_stats(struct NB_Arena_Stats* stats)
+{
+    stats->allocs = g_arena_allocs;
+    stats->bytes = g_arena_bytes;
+    stats->blocks = g_arena_blocks;
+    stats->large_blocks = g_arena_large_blocks;
+    stats->frees = g_arena_frees;
+}
+
+uint8_t*
+nb_buf_init_arena(struct NB_Buf* buf, struct NB_Arena* arena, int len)
+{
+    uint8_t* data = (uint8_t*)nb_arena_alloc(arena, len);
+    nb_buf_init_shared(buf, data, len);
+    return data;
+}
+}
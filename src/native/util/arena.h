@@ -0,0 +1,42 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include "struct_buf.h"
+
+namespace noobaa
+{
+
+// arena - bump allocator for the many small and transient allocations of a single owner
+// (e.g. a coded chunk - its frags array, digests, keys and bufs arrays),
+// which are all released at once by nb_arena_free() instead of one by one.
+// the blocks are taken from the buffer pool so in steady state no malloc is needed at all.
+// an arena is not thread safe, but can be handed over between threads.
+
+#define NB_ARENA_BLOCK_SIZE (16 * 1024)
+#define NB_ARENA_ALIGN 16
+
+struct NB_Arena_Block;
+
+struct NB_Arena {
+    struct NB_Arena_Block* head;
+};
+
+struct NB_Arena_Stats {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t large_blocks;
+    uint64_t frees;
+};
+
+void nb_arena_init(struct NB_Arena* arena);
+void nb_arena_free(struct NB_Arena* arena);
+void* nb_arena_alloc(struct NB_Arena* arena, int len);
+void nb_arena_stats(struct NB_Arena_Stats* stats);
+
+#define nb_arena_new_arr(arena, count, type) \
+    ((type*)nb_arena_alloc((arena), (count) * (int)sizeof(type)))
+
+// the buf memory belongs to the arena so the buf has no deleter
+uint8_t* nb_buf_init_arena(struct NB_Buf* buf, struct NB_Arena* arena, int len);
+}
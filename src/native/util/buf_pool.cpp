@@ -0,0 +1,200 @@
+/* Copyright (C) 2016 NooBaa */
+#include "buf_pool.h"
+#include "mutex.h"
+#include "numa.h"
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+namespace noobaa
+{
+
+// size classes are 4 steps per power of two above NB_BUF_POOL_MIN_SIZE
+// so a buffer wastes at most 25% of its capacity
+#define NB_BUF_POOL_MIN_SHIFT 12
+#define NB_BUF_POOL_CLASSES 57
+
+static_assert(NB_BUF_POOL_MIN_SIZE == (1 << NB_BUF_POOL_MIN_SHIFT), "pool min size");
+
+struct NB_Buf_Pool_Header {
+    uint8_t* raw;
+    int size_class;
+    int cap;
+    int node;
+};
+
+static_assert(sizeof(NB_Buf_Pool_Header) <= NB_BUF_POOL_ALIGN, "pool header size");
+
+struct NB_Buf_Pool_Class {
+    Mutex mutex;
+    std::vector<uint8_t*> free_list;
+};
+
+// free lists are kept per numa node, so a thread pinned to a node reuses memory
+// that was first touched on that node, and a buffer always returns to the node it came from.
+// threads that are not pinned share the lists of node 0.
+static NB_Buf_Pool_Class g_pool_classes[NB_NUMA_MAX_NODES][NB_BUF_POOL_CLASSES];
+static std::atomic<int64_t> g_pool_retained_bytes(0);
+static std::atomic<int64_t> g_pool_exposed_bytes(0);
+static std::atomic<uint64_t> g_pool_allocs(0);
+static std::atomic<uint64_t> g_pool_reuses(0);
+static std::atomic<uint64_t> g_pool_frees(0);
+static std::atomic<uint64_t> g_pool_releases(0);
+
+static Mutex g_pool_exposed_mutex;
+static std::unordered_map<uint8_t*, uint32_t> g_pool_exposed;
+static uint32_t g_pool_exposed_gen = 0;
+
+static inline NB_Buf_Pool_Header*
+_nb_buf_pool_header(uint8_t* data)
+{
+    return (NB_Buf_Pool_Header*)(data - NB_BUF_POOL_ALIGN);
+}
+
+static int
+_nb_buf_pool_class(int len, int* cap)
+{
+    if (len <= NB_BUF_POOL_MIN_SIZE) {
+        *cap = NB_BUF_POOL_MIN_SIZE;
+        return 0;
+    }
+    if (len > NB_BUF_POOL_MAX_SIZE) {
+        *cap = len;
+        return -1;
+    }
+    const uint32_t n = len - 1;
+    int msb = 31;
+    while (!(n & (1u << msb))) --msb;
+    const uint32_t quarter = n >> (msb - 2); // 4..7
+    *cap = (int)((quarter + 1) << (msb - 2));
+    return (msb - NB_BUF_POOL_MIN_SHIFT) * 4 + (int)(quarter - 4) + 1;
+}
+
+uint8_t*
+nb_buf_pool_alloc(int len)
+{
+    int cap = 0;
+    const int size_class = _nb_buf_pool_class(len, &cap);
+    const int node = std::max(0, nb_numa_thread_node());
+    g_pool_allocs++;
+
+    if (size_class >= 0) {
+        NB_Buf_Pool_Class& c = g_pool_classes[node][size_class];
+        Mutex::Lock lock(c.mutex);
+        if (!c.free_list.empty()) {
+            uint8_t* data = c.free_list.back();
+            c.free_list.pop_back();
+            g_pool_retained_bytes -= cap;
+            g_pool_reuses++;
+            return data;
+        }
+    }
+
+    uint8_t* raw = nb_new_mem(cap + 2 * NB_BUF_POOL_ALIGN);
+    uint8_t* data = raw + 2 * NB_BUF_POOL_ALIGN - ((uintptr_t)raw % NB_BUF_POOL_ALIGN);
+    NB_Buf_Pool_Header* h = _nb_buf_pool_header(data);
+    assert((uint8_t*)h >= raw);
+    h->raw = raw;
+    h->size_class = size_class;
+    h->cap = cap;
+    h->node = node;
+    return data;
+}
+
+// adds cap to the retained bytes unless it would pass the max.
+// the free lists are locked per class, so the check and the add must be one atomic step
+// or concurrent frees to different classes could all pass the check and overshoot the max.
+static bool
+_nb_buf_pool_reserve(int cap)
+{
+    int64_t retained = g_pool_retained_bytes.load();
+    do {
+        if (retained + cap > NB_BUF_POOL_MAX_RETAINED) return false;
+    } while (!g_pool_retained_bytes.compare_exchange_weak(retained, retained + cap));
+    return true;
+}
+
+void
+nb_buf_pool_free(uint8_t* data)
+{
+    if (!data) return;
+    NB_Buf_Pool_Header* h = _nb_buf_pool_header(data);
+    g_pool_frees++;
+    if (h->size_class >= 0 && _nb_buf_pool_reserve(h->cap)) {
+        NB_Buf_Pool_Class& c = g_pool_classes[h->node][h->size_class];
+        Mutex::Lock lock(c.mutex);
+        c.free_list.push_back(data);
+        return;
+    }
+    nb_free(h->raw);
+}
+
+void
+nb_buf_pool_deleter(void* arg, const char* data, size_t len)
+{
+    nb_buf_pool_free((uint8_t*)data);
+}
+
+struct NB_Buf*
+nb_bufs_push_pooled(struct NB_Bufs* bufs, int len)
+{
+    struct NB_Buf b;
+    b.data = nb_buf_pool_alloc(len);
+    b.len = len;
+    b.deleter = nb_buf_pool_deleter;
+    b.deleter_arg = 0;
+    return nb_bufs_push(bufs, &b);
+}
+
+void
+nb_buf_pool_stats(struct NB_Buf_Pool_Stats* stats)
+{
+    stats->allocs = g_pool_allocs;
+    stats->reuses = g_pool_reuses;
+    stats->frees = g_pool_frees;
+    stats->releases = g_pool_releases;
+    stats->retained_bytes = g_pool_retained_bytes;
+    stats->exposed_bytes = g_pool_exposed_bytes;
+}
+
+uint32_t
+nb_buf_pool_expose(uint8_t* data, int len)
+{
+    Mutex::Lock lock(g_pool_exposed_mutex);
+    const uint32_t gen = ++g_pool_exposed_gen;
+    g_pool_exposed[data] = gen;
+    g_pool_exposed_bytes += _nb_buf_pool_header(data)->cap;
+    return gen;
+}
+
+void
+nb_buf_pool_unexpose(uint8_t* data, uint32_t gen)
+{
+    {
+        Mutex::Lock lock(g_pool_exposed_mutex);
+        auto it = g_pool_exposed.find(data);
+        // already released explicitly, and maybe reused and exposed again
+        if (it == g_pool_exposed.end() || it->second != gen) return;
+        g_pool_exposed.erase(it);
+        g_pool_exposed_bytes -= _nb_buf_pool_header(data)->cap;
+    }
+    nb_buf_pool_free(data);
+}
+
+bool
+nb_buf_pool_release(uint8_t* data)
+{
+    {
+        Mutex::Lock lock(g_pool_exposed_mutex);
+        auto it = g_pool_exposed.find(data);
+        if (it == g_pool_exposed.end()) return false;
+        g_pool_exposed.erase(it);
+        g_pool_exposed_bytes -= _nb_buf_pool_header(data)->cap;
+    }
+    g_pool_releases++;
+    nb_buf_pool_free(data);
+    return true;
+}
+}
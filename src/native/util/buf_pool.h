@@ -0,0 +1,41 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include "struct_buf.h"
+
+namespace noobaa
+{
+
+// buffer pool - size classed and cache line aligned buffers that are recycled
+// instead of going back to malloc, for the large and short lived coder outputs.
+// a buffer returns to the pool by nb_buf_pool_free(), which is also the deleter
+// of pooled NB_Buf's, or when the JS buffer it was exposed as is collected or released.
+
+#define NB_BUF_POOL_ALIGN 64
+#define NB_BUF_POOL_MIN_SIZE (4 * 1024)
+#define NB_BUF_POOL_MAX_SIZE (64 * 1024 * 1024)
+#define NB_BUF_POOL_MAX_RETAINED (256 * 1024 * 1024)
+
+struct NB_Buf_Pool_Stats {
+    uint64_t allocs;
+    uint64_t reuses;
+    uint64_t frees;
+    uint64_t releases;
+    int64_t retained_bytes;
+    int64_t exposed_bytes;
+};
+
+uint8_t* nb_buf_pool_alloc(int len);
+void nb_buf_pool_free(uint8_t* data);
+void nb_buf_pool_deleter(void* arg, const char* data, size_t len);
+struct NB_Buf* nb_bufs_push_pooled(struct NB_Bufs* bufs, int len);
+void nb_buf_pool_stats(struct NB_Buf_Pool_Stats* stats);
+
+// exposing a pooled buffer to JS registers it and returns a generation
+// that the JS buffer finalizer passes back to nb_buf_pool_unexpose().
+// nb_buf_pool_release() returns an exposed buffer to the pool before it is collected,
+// and the late finalizer of that JS buffer will then find it unregistered and do nothing.
+uint32_t nb_buf_pool_expose(uint8_t* data, int len);
+void nb_buf_pool_unexpose(uint8_t* data, uint32_t gen);
+bool nb_buf_pool_release(uint8_t* data);
+}
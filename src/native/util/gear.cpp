@@ -0,0 +1,20 @@
+/* Copyright (C) 2016 NooBaa */
+#include "gear.h"
+
+namespace noobaa
+{
+
+Gear::Gear(uint64_t seed)
+{
+    // splitmix64 - a simple generator with well mixed output bits
+    // which is fully defined here so the table is the same on every platform
+    uint64_t x = seed;
+    for (int i = 0; i < 256; ++i) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        _gear_table[i] = z ^ (z >> 31);
+    }
+}
+}
@@ -0,0 +1,43 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <stdint.h>
+
+namespace noobaa
+{
+
+/**
+ * Gear rolling hash as used by FastCDC -
+ * every byte shifts the hash one bit left and adds a random value from the gear table,
+ * so a byte affects the top bits for 64 bytes and then shifts out of the hash,
+ * which makes a sliding window of 64 bytes without ever having to pop the old byte.
+ *
+ * The gear table is generated from a fixed seed and must never change,
+ * since the split points of stored chunks depend on it for dedup.
+ */
+class Gear
+{
+public:
+    typedef uint64_t Hash;
+
+    Gear(uint64_t seed);
+
+    inline Hash
+    update(Hash hash, uint8_t byte_in)
+    {
+        return (hash << 1) + _gear_table[byte_in];
+    }
+
+    // mask of the top bits which depend on all the bytes in the window
+    static inline Hash
+    mask(int bits)
+    {
+        if (bits <= 0) return 0;
+        if (bits >= 64) return ~(Hash)0;
+        return ~(Hash)0 << (64 - bits);
+    }
+
+private:
+    Hash _gear_table[256];
+};
+}
@@ -0,0 +1,241 @@
+/* Copyright (C) 2016 NooBaa */
+#include "lz4.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lz4frame.h>
+
+#include "../util/common.h"
+
+namespace noobaa
+{
+
+DBG_INIT(0);
+
+// input is fed to lz4 in slices of a single lz4 block, so the output space
+// needed by every update is bounded by LZ4F_compressBound() of one slice
+#define NB_LZ4_SLICE_SIZE (64 * 1024)
+
+// compressed output is collected in buffers that can hold a few slices
+#define NB_LZ4_OUT_SLICES 4
+
+// the maximal size of an lz4 frame header (LZ4F_HEADER_SIZE_MAX of newer lz4frame.h)
+#define NB_LZ4_HEADER_SIZE_MAX 19
+
+int
+nb_lz4_compress(struct NB_Bufs* bufs, int level, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    size_t z_res;
+    LZ4F_cctx* cctx = 0;
+    LZ4F_preferences_t prefs;
+    struct NB_Bufs out;
+    struct NB_Buf* o = 0;
+    int o_pos = 0;
+
+    nb_bufs_init(&out);
+
+    StackCleaner cleaner([&] {
+        nb_bufs_free(&out);
+        LZ4F_freeCompressionContext(cctx);
+    });
+
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.contentSize = bufs->len;
+
+    z_res = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+    if (LZ4F_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_compress: LZ4F_createCompressionContext() error %s", LZ4F_getErrorName(z_res));
+        return -1;
+    }
+
+    const int bound = (int)LZ4F_compressBound(NB_LZ4_SLICE_SIZE, &prefs);
+
+    // make room for the next call that might need up to bound bytes,
+    // the current buffer is cut to its used length before moving to a new one
+    auto reserve = [&]() {
+        if (o && o->len - o_pos >= bound) return;
+        if (o) {
+            out.len -= o->len - o_pos;
+            o->len = o_pos;
+        }
+        o = nb_bufs_push_alloc(&out, bound * NB_LZ4_OUT_SLICES);
+        o_pos = 0;
+    };
+
+    reserve();
+    z_res = LZ4F_compressBegin(cctx, o->data, o->len, &prefs);
+    if (LZ4F_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_compress: LZ4F_compressBegin() level %i error %s", level, LZ4F_getErrorName(z_res));
+        return -1;
+    }
+    o_pos += (int)z_res;
+
+    for (int i = 0; i < bufs->count; ++i) {
+        struct NB_Buf* b = nb_bufs_get(bufs, i);
+        for (int pos = 0; pos < b->len;) {
+            const int len = b->len - pos > NB_LZ4_SLICE_SIZE ? NB_LZ4_SLICE_SIZE : b->len - pos;
+            if (tap) tap(tap_arg, b->data + pos, len);
+            reserve();
+            z_res = LZ4F_compressUpdate(cctx, o->data + o_pos, o->len - o_pos, b->data + pos, len, 0);
+            if (LZ4F_isError(z_res)) {
+                nb_bufs_push_printf(
+                    errors, 256, "nb_lz4_compress: LZ4F_compressUpdate() error %s", LZ4F_getErrorName(z_res));
+                return -1;
+            }
+            o_pos += (int)z_res;
+            pos += len;
+        }
+    }
+
+    reserve();
+    z_res = LZ4F_compressEnd(cctx, o->data + o_pos, o->len - o_pos, 0);
+    if (LZ4F_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_compress: LZ4F_compressEnd() error %s", LZ4F_getErrorName(z_res));
+        return -1;
+    }
+    o_pos += (int)z_res;
+    nb_bufs_truncate(&out, out.len - (o->len - o_pos));
+
+    DBG1("nb_lz4_compress: " << DVAL(level) << DVAL(bufs->len) << DVAL(bufs->count) << DVAL(out.len) << DVAL(out.count));
+
+    nb_bufs_free(bufs);
+    *bufs = out;
+    nb_bufs_init(&out);
+    return 0;
+}
+
+int
+nb_lz4_uncompress(struct NB_Bufs* bufs, int uncompressed_len, struct NB_Bufs* errors)
+{
+    size_t z_res = 0;
+    LZ4F_dctx* dctx = 0;
+    struct NB_Bufs out;
+
+    nb_bufs_init(&out);
+
+    StackCleaner cleaner([&] {
+        nb_bufs_free(&out);
+        LZ4F_freeDecompressionContext(dctx);
+    });
+
+    z_res = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    if (LZ4F_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_uncompress: LZ4F_createDecompressionContext() error %s", LZ4F_getErrorName(z_res));
+        return -1;
+    }
+
+    // the uncompressed size is known so the output is decompressed into a single buffer
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, uncompressed_len);
+    int o_pos = 0;
+
+    for (int i = 0; i < bufs->count; ++i) {
+        struct NB_Buf* b = nb_bufs_get(bufs, i);
+        for (int pos = 0; pos < b->len;) {
+            size_t dst_size = o->len - o_pos;
+            size_t src_size = b->len - pos;
+            z_res = LZ4F_decompress(dctx, o->data + o_pos, &dst_size, b->data + pos, &src_size, 0);
+            if (LZ4F_isError(z_res)) {
+                nb_bufs_push_printf(
+                    errors, 256, "nb_lz4_uncompress: LZ4F_decompress() error %s", LZ4F_getErrorName(z_res));
+                return -1;
+            }
+            if (!dst_size && !src_size) {
+                nb_bufs_push_printf(
+                    errors, 256, "nb_lz4_uncompress: output exceeds uncompressed length %i", uncompressed_len);
+                return -1;
+            }
+            o_pos += (int)dst_size;
+            pos += (int)src_size;
+        }
+    }
+
+    // a non zero hint means the frame was not fully decoded
+    if (z_res) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_uncompress: truncated frame output %i", o_pos);
+        return -1;
+    }
+
+    nb_bufs_truncate(&out, o_pos);
+
+    DBG1("nb_lz4_uncompress: " << DVAL(bufs->len) << DVAL(bufs->count) << DVAL(out.len) << DVAL(out.count));
+
+    nb_bufs_free(bufs);
+    *bufs = out;
+    nb_bufs_init(&out);
+    return 0;
+}
+
+int
+nb_lz4_store(struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    size_t z_res;
+    LZ4F_cctx* cctx = 0;
+    LZ4F_preferences_t prefs;
+    struct NB_Bufs out;
+
+    nb_bufs_init(&out);
+
+    StackCleaner cleaner([&] {
+        nb_bufs_free(&out);
+        LZ4F_freeCompressionContext(cctx);
+    });
+
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.contentSize = bufs->len;
+
+    z_res = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+    if (LZ4F_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_store: LZ4F_createCompressionContext() error %s", LZ4F_getErrorName(z_res));
+        return -1;
+    }
+
+    const int len = bufs->len;
+    const int blocks = (len + NB_LZ4_SLICE_SIZE - 1) / NB_LZ4_SLICE_SIZE;
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_LZ4_HEADER_SIZE_MAX + (4 * blocks) + len + 4);
+    uint8_t* p = o->data;
+
+    // only the frame header is written by lz4, the blocks are written here as uncompressed blocks
+    z_res = LZ4F_compressBegin(cctx, p, o->len, &prefs);
+    if (LZ4F_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_lz4_store: LZ4F_compressBegin() error %s", LZ4F_getErrorName(z_res));
+        return -1;
+    }
+    p += z_res;
+
+    for (int pos = 0; pos < len;) {
+        const int n = len - pos < NB_LZ4_SLICE_SIZE ? len - pos : NB_LZ4_SLICE_SIZE;
+        // block size little endian with the highest bit marking an uncompressed block
+        const uint32_t header = (uint32_t)n | 0x80000000u;
+        *p++ = (uint8_t)header;
+        *p++ = (uint8_t)(header >> 8);
+        *p++ = (uint8_t)(header >> 16);
+        *p++ = (uint8_t)(header >> 24);
+        nb_bufs_read_at(bufs, pos, p, n);
+        if (tap) tap(tap_arg, p, n);
+        p += n;
+        pos += n;
+    }
+
+    // end mark
+    memset(p, 0, 4);
+    p += 4;
+
+    nb_bufs_truncate(&out, p - o->data);
+    nb_bufs_free(bufs);
+    *bufs = out;
+    nb_bufs_init(&out);
+    return 0;
+}
+}
@@ -0,0 +1,16 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include "struct_buf.h"
+
+namespace noobaa
+{
+
+// level 0 means the fast lz4 compressor, higher levels use lz4hc
+int nb_lz4_compress(
+    struct NB_Bufs* bufs, int level, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
+int nb_lz4_uncompress(struct NB_Bufs* bufs, int uncompressed_len, struct NB_Bufs* errors);
+// stores the data in uncompressed blocks of an lz4 frame, without compressing it
+int nb_lz4_store(
+    struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
+}
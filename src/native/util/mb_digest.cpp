@@ -0,0 +1,169 @@
+/* Copyright (C) 2016 NooBaa */
+#include "mb_digest.h"
+#include "../third_party/isa-l_crypto/include/md5_mb.h"
+#include "../third_party/isa-l_crypto/include/sha1_mb.h"
+#include "../third_party/isa-l_crypto/include/sha256_mb.h"
+#include "../third_party/isa-l_crypto/include/sha512_mb.h"
+#include <assert.h>
+#include <openssl/obj_mac.h>
+#include <vector>
+
+namespace noobaa
+{
+
+// the mb managers and contexts hold simd lane state that must be aligned
+#define MB_DIGEST_ALIGN 64
+
+// hasher traits for the generic _nb_mb_digest()
+// md5 words are written little endian and the sha words big endian, same as EVP.
+
+struct NB_MB_MD5 {
+    typedef MD5_HASH_CTX_MGR Mgr;
+    typedef MD5_HASH_CTX Ctx;
+    typedef MD5_WORD_T Word;
+    static const int NWORDS = MD5_DIGEST_NWORDS;
+    static const bool BIG_ENDIAN_WORDS = false;
+    static void init(Mgr* mgr) { md5_ctx_mgr_init(mgr); }
+    static Ctx* submit(Mgr* mgr, Ctx* ctx, const void* data, uint32_t len, HASH_CTX_FLAG flags)
+    {
+        return md5_ctx_mgr_submit(mgr, ctx, data, len, flags);
+    }
+    static Ctx* flush(Mgr* mgr) { return md5_ctx_mgr_flush(mgr); }
+};
+
+struct NB_MB_SHA1 {
+    typedef SHA1_HASH_CTX_MGR Mgr;
+    typedef SHA1_HASH_CTX Ctx;
+    typedef SHA1_WORD_T Word;
+    static const int NWORDS = SHA1_DIGEST_NWORDS;
+    static const bool BIG_ENDIAN_WORDS = true;
+    static void init(Mgr* mgr) { sha1_ctx_mgr_init(mgr); }
+    static Ctx* submit(Mgr* mgr, Ctx* ctx, const void* data, uint32_t len, HASH_CTX_FLAG flags)
+    {
+        return sha1_ctx_mgr_submit(mgr, ctx, data, len, flags);
+    }
+    static Ctx* flush(Mgr* mgr) { return sha1_ctx_mgr_flush(mgr); }
+};
+
+struct NB_MB_SHA256 {
+    typedef SHA256_HASH_CTX_MGR Mgr;
+    typedef SHA256_HASH_CTX Ctx;
+    typedef SHA256_WORD_T Word;
+    static const int NWORDS = SHA256_DIGEST_NWORDS;
+    static const bool BIG_ENDIAN_WORDS = true;
+    static void init(Mgr* mgr) { sha256_ctx_mgr_init(mgr); }
+    static Ctx* submit(Mgr* mgr, Ctx* ctx, const void* data, uint32_t len, HASH_CTX_FLAG flags)
+    {
+        return sha256_ctx_mgr_submit(mgr, ctx, data, len, flags);
+    }
+    static Ctx* flush(Mgr* mgr) { return sha256_ctx_mgr_flush(mgr); }
+};
+
+struct NB_MB_SHA512 {
+    typedef SHA512_HASH_CTX_MGR Mgr;
+    typedef SHA512_HASH_CTX Ctx;
+    typedef SHA512_WORD_T Word;
+    static const int NWORDS = SHA512_DIGEST_NWORDS;
+    static const bool BIG_ENDIAN_WORDS = true;
+    static void init(Mgr* mgr) { sha512_ctx_mgr_init(mgr); }
+    static Ctx* submit(Mgr* mgr, Ctx* ctx, const void* data, uint32_t len, HASH_CTX_FLAG flags)
+    {
+        return sha512_ctx_mgr_submit(mgr, ctx, data, len, flags);
+    }
+    static Ctx* flush(Mgr* mgr) { return sha512_ctx_mgr_flush(mgr); }
+};
+
+template <typename H>
+static void
+_nb_mb_digest(struct NB_Bufs** bufs, struct NB_Buf** digests, int count)
+{
+    typedef typename H::Ctx Ctx;
+    typedef typename H::Mgr Mgr;
+    typedef typename H::Word Word;
+
+    const size_t mgr_size =
+        (sizeof(Mgr) + MB_DIGEST_ALIGN - 1) / MB_DIGEST_ALIGN * MB_DIGEST_ALIGN;
+    const size_t ctx_size =
+        (sizeof(Ctx) + MB_DIGEST_ALIGN - 1) / MB_DIGEST_ALIGN * MB_DIGEST_ALIGN;
+    uint8_t* mem = nb_new_mem(MB_DIGEST_ALIGN + mgr_size + count * ctx_size);
+    uint8_t* aligned = mem + MB_DIGEST_ALIGN - ((uintptr_t)mem % MB_DIGEST_ALIGN);
+    Mgr* mgr = (Mgr*)aligned;
+    H::init(mgr);
+
+    // each context hashes its bufs piece by piece, and a piece can be submitted
+    // only once the manager returned the context from the previous one.
+    std::vector<int> next_piece(count, 0);
+    auto submit_next = [&](Ctx* ctx) -> Ctx* {
+        assert(hash_ctx_error(ctx) == HASH_CTX_ERROR_NONE);
+        const int i = (int)(intptr_t)hash_ctx_user_data(ctx);
+        struct NB_Bufs* b = bufs[i];
+        const int j = next_piece[i]++;
+        if (b->count == 0 && j == 0) {
+            return H::submit(mgr, ctx, "", 0, HASH_ENTIRE);
+        }
+        if (j >= b->count) return 0;
+        struct NB_Buf* piece = nb_bufs_get(b, j);
+        const int flags = (j == 0 ? HASH_FIRST : HASH_UPDATE) | (j + 1 == b->count ? HASH_LAST : HASH_UPDATE);
+        return H::submit(mgr, ctx, piece->data, piece->len, (HASH_CTX_FLAG)flags);
+    };
+
+    for (int i = 0; i < count; ++i) {
+        Ctx* ctx = (Ctx*)(aligned + mgr_size + i * ctx_size);
+        hash_ctx_init(ctx);
+        ctx->user_data = (void*)(intptr_t)i;
+        while (ctx) {
+            ctx = submit_next(ctx);
+        }
+    }
+    for (Ctx* ctx = H::flush(mgr); ctx; ctx = H::flush(mgr)) {
+        while (ctx) {
+            ctx = submit_next(ctx);
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        Ctx* ctx = (Ctx*)(aligned + mgr_size + i * ctx_size);
+        assert(hash_ctx_complete(ctx));
+        const Word* words = hash_ctx_digest(ctx);
+        struct NB_Buf* digest = digests[i];
+        nb_buf_free(digest);
+        uint8_t* p = nb_buf_init_alloc(digest, H::NWORDS * sizeof(Word));
+        for (int w = 0; w < H::NWORDS; ++w) {
+            for (int k = 0; k < (int)sizeof(Word); ++k) {
+                const int shift = H::BIG_ENDIAN_WORDS ? 8 * ((int)sizeof(Word) - 1 - k) : 8 * k;
+                *p++ = (uint8_t)(words[w] >> shift);
+            }
+        }
+    }
+
+    nb_free(mem);
+}
+
+bool
+nb_mb_digest_supported(int nid)
+{
+    return nid == NID_md5 || nid == NID_sha1 || nid == NID_sha256 || nid == NID_sha512;
+}
+
+void
+nb_mb_digest(int nid, struct NB_Bufs** bufs, struct NB_Buf** digests, int count)
+{
+    switch (nid) {
+    case NID_md5:
+        _nb_mb_digest<NB_MB_MD5>(bufs, digests, count);
+        break;
+    case NID_sha1:
+        _nb_mb_digest<NB_MB_SHA1>(bufs, digests, count);
+        break;
+    case NID_sha256:
+        _nb_mb_digest<NB_MB_SHA256>(bufs, digests, count);
+        break;
+    case NID_sha512:
+        _nb_mb_digest<NB_MB_SHA512>(bufs, digests, count);
+        break;
+    default:
+        assert(!"nb_mb_digest: unsupported digest");
+        break;
+    }
+}
+}
@@ -0,0 +1,17 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include "struct_buf.h"
+
+namespace noobaa
+{
+
+// multi-buffer digests - hashes several bufs at once in the simd lanes of the
+// isa-l_crypto mb hashers, which is much faster than hashing them one by one
+// when there are enough bufs to fill the lanes (such as the frags of a chunk).
+// the digest type is the openssl nid, and the output is byte-compatible with EVP.
+
+bool nb_mb_digest_supported(int nid);
+
+void nb_mb_digest(int nid, struct NB_Bufs** bufs, struct NB_Buf** digests, int count);
+}
@@ -0,0 +1,97 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace noobaa
+{
+
+/**
+ * Lock free bounded ring for any number of producer and consumer threads.
+ * Every cell has a sequence number that tells if it is ready to be written
+ * for the current lap of the ring or ready to be read, so producers and consumers
+ * only race on a CAS of _tail or _head, each on its own cache line.
+ * N must be a power of two.
+ */
+template <typename T, size_t N>
+class MpmcRing
+{
+    static_assert(N && !(N & (N - 1)), "MpmcRing size must be a power of two");
+
+public:
+    MpmcRing()
+        : _head(0)
+        , _tail(0)
+    {
+        for (size_t i = 0; i < N; ++i) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(const T& item)
+    {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = _cells[pos & (N - 1)];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.item = item;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false; // full
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T* item)
+    {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = _cells[pos & (N - 1)];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            const intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *item = cell.item;
+                    cell.seq.store(pos + N, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false; // empty
+            } else {
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // only a hint when other threads are pushing or popping
+    bool empty() const
+    {
+        return _head.load(std::memory_order_acquire) >= _tail.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    // padded to separate cache lines instead of alignas,
+    // which would make the owners over aligned for plain new in c++11
+    Cell _cells[N];
+    char _pad0[64];
+    std::atomic<size_t> _head;
+    char _pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> _tail;
+    char _pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
+} // namespace noobaa
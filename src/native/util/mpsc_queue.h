@@ -0,0 +1,58 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <atomic>
+
+namespace noobaa
+{
+
+/**
+ * Lock free intrusive queue for many producer threads and a single consumer thread.
+ * Producers push with a CAS on the top of a stack, and the consumer takes the whole
+ * stack at once and reverses it to get the items in push order.
+ * T must have a T* mpsc_next member which the queue owns while the item is queued.
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+        : _top(0)
+    {
+    }
+
+    // any thread - returns true if the queue was empty so the consumer should be woken up
+    bool push(T* item)
+    {
+        T* top = _top.load(std::memory_order_relaxed);
+        do {
+            item->mpsc_next = top;
+        } while (!_top.compare_exchange_weak(
+            top, item, std::memory_order_release, std::memory_order_relaxed));
+        return !top;
+    }
+
+    // consumer only - returns the first item, and the rest are linked by mpsc_next
+    T* pop_all()
+    {
+        T* item = _top.exchange(0, std::memory_order_acquire);
+        T* first = 0;
+        while (item) {
+            T* next = item->mpsc_next;
+            item->mpsc_next = first;
+            first = item;
+            item = next;
+        }
+        return first;
+    }
+
+    bool empty() const
+    {
+        return !_top.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<T*> _top;
+};
+
+} // namespace noobaa
@@ -101,6 +101,11 @@ public:
         uv_cond_signal(&_cond);
     }
 
+    void broadcast()
+    {
+        uv_cond_broadcast(&_cond);
+    }
+
 protected:
     uv_cond_t _cond;
 };
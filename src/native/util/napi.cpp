@@ -1,6 +1,7 @@
 /* Copyright (C) 2016 NooBaa */
 #include "napi.h"
 #include "b64.h"
+#include "buf_pool.h"
 
 namespace noobaa
 {
@@ -21,6 +22,14 @@ nb_napi_set_int(napi_env env, napi_value obj, const char* name, int num)
     napi_set_named_property(env, obj, name, v);
 }
 
+void
+nb_napi_set_int64(napi_env env, napi_value obj, const char* name, int64_t num)
+{
+    napi_value v = 0;
+    napi_create_int64(env, num, &v);
+    napi_set_named_property(env, obj, name, v);
+}
+
 void
 nb_napi_get_str(napi_env env, napi_value obj, const char* name, char* str, int max)
 {
@@ -139,9 +148,30 @@ void
 nb_napi_set_bufs(napi_env env, napi_value obj, const char* name, struct NB_Bufs* bufs)
 {
     napi_value v = 0;
-    struct NB_Buf b;
-    nb_bufs_detach(bufs, &b);
-    napi_create_external_buffer(env, b.len, b.data, nb_napi_finalize_free_data, 0, &v);
+    struct NB_Buf* b0 = bufs->count ? nb_bufs_get(bufs, 0) : 0;
+    if (!b0 || (bufs->count == 1 && b0->deleter == nb_buf_default_deleter)) {
+        struct NB_Buf b;
+        nb_bufs_detach(bufs, &b);
+        napi_create_external_buffer(env, b.len, b.data, nb_napi_finalize_free_data, 0, &v);
+    } else {
+        // pooled buffers are handed over as is, and anything else that needs
+        // to be merged for a single buffer is copied into a pooled buffer,
+        // either way the buffer returns to the pool when collected or released.
+        uint8_t* data = 0;
+        const int len = bufs->len;
+        if (bufs->count == 1 && b0->deleter == nb_buf_pool_deleter) {
+            data = b0->data;
+            nb_bufs_init(bufs);
+        } else {
+            data = nb_buf_pool_alloc(len);
+            nb_bufs_read(bufs, data, len);
+            nb_bufs_free(bufs);
+            nb_bufs_init(bufs);
+        }
+        const uint32_t gen = nb_buf_pool_expose(data, len);
+        napi_create_external_buffer(
+            env, len, data, nb_napi_finalize_pool_data, (void*)(uintptr_t)gen, &v);
+    }
     napi_set_named_property(env, obj, name, v);
 }
 
@@ -150,4 +180,10 @@ nb_napi_finalize_free_data(napi_env env, void* data, void* hint)
 {
     nb_free(data);
 }
+
+void
+nb_napi_finalize_pool_data(napi_env env, void* data, void* hint)
+{
+    nb_buf_pool_unexpose((uint8_t*)data, (uint32_t)(uintptr_t)hint);
+}
 }
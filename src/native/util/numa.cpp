@@ -0,0 +1,206 @@
+/* Copyright (C) 2016 NooBaa */
+#include "numa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+namespace noobaa
+{
+
+// flags of get_mempolicy(2) from linux/mempolicy.h
+#define NB_MPOL_F_NODE (1 << 0)
+#define NB_MPOL_F_ADDR (1 << 1)
+
+// nodes are indexed densely, node_ids maps them to the kernel node ids which can have gaps
+struct NB_Numa_Topology {
+    int ncpus;
+    int nnodes;
+    int node_ids[NB_NUMA_MAX_NODES];
+    std::vector<int> node_cpus[NB_NUMA_MAX_NODES];
+};
+
+static thread_local int t_numa_node = -1;
+
+// parses a sysfs cpu list such as "0-3,8-11"
+static void
+_nb_numa_parse_cpulist(const char* str, std::vector<int>* cpus)
+{
+    const char* p = str;
+    while (*p) {
+        char* end = 0;
+        const long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < NB_NUMA_MAX_CPUS; ++cpu) {
+            cpus->push_back((int)cpu);
+        }
+        if (*p != ',') break;
+        ++p;
+    }
+}
+
+static NB_Numa_Topology*
+_nb_numa_read_topology()
+{
+    NB_Numa_Topology* topo = new NB_Numa_Topology;
+    topo->nnodes = 0;
+    topo->ncpus = 0;
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool has_allowed = !sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int node_id = 0; node_id < 64 && topo->nnodes < NB_NUMA_MAX_NODES; ++node_id) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node_id);
+        FILE* f = fopen(path, "r");
+        if (!f) continue;
+        char line[4096];
+        std::vector<int> cpus;
+        if (fgets(line, sizeof(line), f)) {
+            _nb_numa_parse_cpulist(line, &cpus);
+        }
+        fclose(f);
+        // nodes without cpus the process may run on are not useful for placement
+        for (int cpu : cpus) {
+            if (!has_allowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                topo->node_cpus[topo->nnodes].push_back(cpu);
+            }
+        }
+        if (!topo->node_cpus[topo->nnodes].empty()) {
+            topo->node_ids[topo->nnodes] = node_id;
+            topo->ncpus += topo->node_cpus[topo->nnodes].size();
+            topo->nnodes++;
+        }
+    }
+    if (!topo->nnodes && has_allowed) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu < NB_NUMA_MAX_CPUS; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) topo->node_cpus[0].push_back(cpu);
+        }
+    }
+#endif
+
+    if (!topo->nnodes) {
+        if (topo->node_cpus[0].empty()) {
+            const long n = sysconf(_SC_NPROCESSORS_ONLN);
+            for (int cpu = 0; cpu < n && cpu < NB_NUMA_MAX_CPUS; ++cpu) {
+                topo->node_cpus[0].push_back(cpu);
+            }
+        }
+        topo->node_ids[0] = 0;
+        topo->ncpus = topo->node_cpus[0].size();
+        topo->nnodes = 1;
+    }
+    return topo;
+}
+
+static const NB_Numa_Topology&
+_nb_numa_topology()
+{
+    // never deleted, read once on first use
+    static NB_Numa_Topology* topo = _nb_numa_read_topology();
+    return *topo;
+}
+
+int
+nb_numa_nodes()
+{
+    return _nb_numa_topology().nnodes;
+}
+
+int
+nb_numa_cpus()
+{
+    return _nb_numa_topology().ncpus;
+}
+
+int
+nb_numa_node_cpus(int node, int* cpus, int max)
+{
+    const NB_Numa_Topology& topo = _nb_numa_topology();
+    if (node < 0 || node >= topo.nnodes) return 0;
+    const std::vector<int>& node_cpus = topo.node_cpus[node];
+    int count = 0;
+    for (; count < (int)node_cpus.size() && count < max; ++count) {
+        cpus[count] = node_cpus[count];
+    }
+    return count;
+}
+
+int
+nb_numa_node_of_addr(const void* addr)
+{
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+    const NB_Numa_Topology& topo = _nb_numa_topology();
+    if (!addr || topo.nnodes <= 1) return -1;
+    int node_id = -1;
+    if (syscall(SYS_get_mempolicy, &node_id, NULL, 0, addr, NB_MPOL_F_NODE | NB_MPOL_F_ADDR)) {
+        return -1;
+    }
+    for (int node = 0; node < topo.nnodes; ++node) {
+        if (topo.node_ids[node] == node_id) return node;
+    }
+    return -1;
+#else
+    return -1;
+#endif
+}
+
+bool
+nb_numa_pin_thread(const int* cpus, int count, int node)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (count > 0) {
+        for (int i = 0; i < count; ++i) {
+            if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+        }
+    } else {
+        const NB_Numa_Topology& topo = _nb_numa_topology();
+        for (int n = 0; n < topo.nnodes; ++n) {
+            for (int cpu : topo.node_cpus[n]) {
+                if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+            }
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        return false;
+    }
+    t_numa_node = count > 0 ? node : -1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+int
+nb_numa_thread_node()
+{
+    return t_numa_node;
+}
+
+int
+nb_numa_current_cpu()
+{
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+}
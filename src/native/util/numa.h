@@ -0,0 +1,28 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+namespace noobaa
+{
+
+// cpu topology and thread placement without a libnuma dependency -
+// the topology is read once from sysfs and limited to the cpus the process may run on.
+// on platforms without numa info everything is a single node and pinning does nothing.
+
+#define NB_NUMA_MAX_NODES 16
+#define NB_NUMA_MAX_CPUS 1024
+
+int nb_numa_nodes();
+int nb_numa_cpus();
+// fills the cpus of the node and returns their count
+int nb_numa_node_cpus(int node, int* cpus, int max);
+
+// the node of the page that holds addr, or -1 if unknown (e.g. not touched yet)
+int nb_numa_node_of_addr(const void* addr);
+
+// pins the calling thread to the cpus and remembers its node for nb_numa_thread_node().
+// count == 0 unpins the thread to all the process cpus.
+bool nb_numa_pin_thread(const int* cpus, int count, int node);
+// the node the calling thread was pinned to, or -1 when not pinned
+int nb_numa_thread_node();
+int nb_numa_current_cpu();
+}
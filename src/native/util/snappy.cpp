@@ -14,9 +14,11 @@ public:
     int index;
     int offset;
     int pos;
+    NB_Bufs_Tap tap;
+    void* tap_arg;
 
-    BufsSource(struct NB_Bufs* input)
-        : bufs(input), index(0), offset(0), pos(0) {}
+    BufsSource(struct NB_Bufs* input, NB_Bufs_Tap tap_fn = 0, void* tap_fn_arg = 0)
+        : bufs(input), index(0), offset(0), pos(0), tap(tap_fn), tap_arg(tap_fn_arg) {}
     virtual ~BufsSource() {}
 
     virtual size_t
@@ -48,6 +50,7 @@ public:
             assert(b);
             assert(b->len >= offset);
             int avail = b->len - offset;
+            if (tap) tap(tap_arg, b->data + offset, avail <= (int)n ? avail : (int)n);
             if (avail <= (int)n) {
                 index++;
                 offset = 0;
@@ -134,12 +137,14 @@ public:
 #define DBG 0
 
 int
-nb_snappy_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors)
+nb_snappy_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
 {
     struct NB_Bufs out;
     nb_bufs_init(&out);
 
-    BufsSource source(bufs);
+    // snappy skips the source after compressing each block of up to 64 KB
+    // so the tap sees every block right after it was read
+    BufsSource source(bufs, tap, tap_arg);
     BufsSink sink(&out);
 
     int compressed_len = (int)snappy::Compress(&source, &sink);
@@ -199,4 +204,44 @@ nb_snappy_uncompress(struct NB_Bufs* bufs, struct NB_Bufs* errors)
     *bufs = out;
     return 0;
 }
+
+// a literal element with 2 bytes of length holds up to 64 KB
+#define NB_SNAPPY_STORE_BLOCK (64 * 1024)
+
+int
+nb_snappy_store(struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    struct NB_Bufs out;
+    nb_bufs_init(&out);
+
+    const int len = bufs->len;
+    const int blocks = (len + NB_SNAPPY_STORE_BLOCK - 1) / NB_SNAPPY_STORE_BLOCK;
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, 5 + (3 * blocks) + len);
+    uint8_t* p = o->data;
+
+    // varint32 of the uncompressed length
+    uint32_t v = len;
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+
+    for (int pos = 0; pos < len;) {
+        const int n = len - pos < NB_SNAPPY_STORE_BLOCK ? len - pos : NB_SNAPPY_STORE_BLOCK;
+        // literal tag 61 means the length-1 follows in 2 bytes
+        *p++ = 61 << 2;
+        *p++ = (uint8_t)((n - 1) & 0xff);
+        *p++ = (uint8_t)((n - 1) >> 8);
+        nb_bufs_read_at(bufs, pos, p, n);
+        if (tap) tap(tap_arg, p, n);
+        p += n;
+        pos += n;
+    }
+
+    nb_bufs_truncate(&out, p - o->data);
+    nb_bufs_free(bufs);
+    *bufs = out;
+    return 0;
+}
 }
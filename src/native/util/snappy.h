@@ -6,6 +6,10 @@
 namespace noobaa
 {
 
-int nb_snappy_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors);
+int nb_snappy_compress(
+    struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
 int nb_snappy_uncompress(struct NB_Bufs* bufs, struct NB_Bufs* errors);
+// stores the data as snappy literals, which any snappy reader decodes, without compressing it
+int nb_snappy_store(
+    struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
 }
@@ -0,0 +1,69 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+namespace noobaa
+{
+
+/**
+ * Lock free ring for a single producer thread and a single consumer thread.
+ * The producer only writes _tail and the consumer only writes _head,
+ * each on its own cache line, and the release/acquire pairs publish the items.
+ * N must be a power of two.
+ */
+template <typename T, size_t N>
+class SpscRing
+{
+    static_assert(N && !(N & (N - 1)), "SpscRing size must be a power of two");
+
+public:
+    SpscRing()
+        : _head(0)
+        , _tail(0)
+    {
+    }
+
+    // producer only
+    bool try_push(const T& item)
+    {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) >= N) return false;
+        _items[tail & (N - 1)] = item;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only
+    bool try_pop(T* item)
+    {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) return false;
+        *item = _items[head & (N - 1)];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+    }
+
+    bool full() const
+    {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire) >= N;
+    }
+
+private:
+    // padded to separate cache lines instead of alignas,
+    // which would make the owners over aligned for plain new in c++11
+    char _pad0[64];
+    std::atomic<size_t> _head;
+    char _pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> _tail;
+    char _pad2[64 - sizeof(std::atomic<size_t>)];
+    T _items[N];
+};
+
+} // namespace noobaa
@@ -1,11 +1,13 @@
 /* Copyright (C) 2016 NooBaa */
 #include "struct_buf.h"
+#include "arena.h"
 #include <stdio.h>
 
 namespace noobaa
 {
 
 static uint8_t _from_hex(char c);
+static struct NB_Buf* _nb_bufs_push_ptr(struct NB_Bufs* bufs);
 
 void
 nb_buf_init(struct NB_Buf* buf)
@@ -52,17 +54,14 @@ nb_buf_init_alloc(struct NB_Buf* buf, int len)
     return data;
 }
 
-uint8_t* g_zero_buf = 0;
+// static storage is zeroed without any lazy init that coder threads could race on
 const int g_zero_buf_len = 128 * 1024;
+static uint8_t g_zero_buf[g_zero_buf_len];
 
 void
 nb_buf_init_zeros(struct NB_Buf* buf, int len)
 {
     if (len <= g_zero_buf_len) {
-        if (!g_zero_buf) {
-            g_zero_buf = nb_new_mem(g_zero_buf_len);
-            memset(g_zero_buf, 0, g_zero_buf_len);
-        }
         buf->data = g_zero_buf;
         buf->len = len;
         buf->deleter = 0;
@@ -113,8 +112,15 @@ nb_buf_default_deleter(void* arg, const char* data, size_t len)
 
 void
 nb_bufs_init(struct NB_Bufs* bufs)
+{
+    nb_bufs_init_arena(bufs, 0);
+}
+
+void
+nb_bufs_init_arena(struct NB_Bufs* bufs, struct NB_Arena* arena)
 {
     nb_pre_list_init(bufs);
+    bufs->arena = arena;
     bufs->len = 0;
 }
 
@@ -125,13 +131,13 @@ nb_bufs_free(struct NB_Bufs* bufs)
     for (int i = 0; i < bufs->count; ++i, ++b) {
         nb_buf_free(b);
     }
-    nb_pre_list_free(bufs);
+    if (!bufs->arena) nb_pre_list_free(bufs);
 }
 
 struct NB_Buf*
 nb_bufs_push(struct NB_Bufs* bufs, struct NB_Buf* buf)
 {
-    nb_pre_list_push(bufs, struct NB_Buf, *buf);
+    *_nb_bufs_push_ptr(bufs) = *buf;
     bufs->len += buf->len;
     return buf;
 }
@@ -139,8 +145,7 @@ nb_bufs_push(struct NB_Bufs* bufs, struct NB_Buf* buf)
 struct NB_Buf*
 nb_bufs_push_shared(struct NB_Bufs* bufs, uint8_t* data, int len)
 {
-    struct NB_Buf* b;
-    nb_pre_list_get_push_ptr(bufs, struct NB_Buf, b);
+    struct NB_Buf* b = _nb_bufs_push_ptr(bufs);
     nb_buf_init_shared(b, data, len);
     bufs->len += len;
     return b;
@@ -149,8 +154,7 @@ nb_bufs_push_shared(struct NB_Bufs* bufs, uint8_t* data, int len)
 struct NB_Buf*
 nb_bufs_push_owned(struct NB_Bufs* bufs, uint8_t* data, int len)
 {
-    struct NB_Buf* b;
-    nb_pre_list_get_push_ptr(bufs, struct NB_Buf, b);
+    struct NB_Buf* b = _nb_bufs_push_ptr(bufs);
     nb_buf_init_owned(b, data, len);
     bufs->len += len;
     return b;
@@ -159,8 +163,7 @@ nb_bufs_push_owned(struct NB_Bufs* bufs, uint8_t* data, int len)
 struct NB_Buf*
 nb_bufs_push_copy(struct NB_Bufs* bufs, uint8_t* data, int len)
 {
-    struct NB_Buf* b;
-    nb_pre_list_get_push_ptr(bufs, struct NB_Buf, b);
+    struct NB_Buf* b = _nb_bufs_push_ptr(bufs);
     nb_buf_init_copy(b, data, len);
     bufs->len += len;
     return b;
@@ -169,8 +172,7 @@ nb_bufs_push_copy(struct NB_Bufs* bufs, uint8_t* data, int len)
 struct NB_Buf*
 nb_bufs_push_alloc(struct NB_Bufs* bufs, int len)
 {
-    struct NB_Buf* b;
-    nb_pre_list_get_push_ptr(bufs, struct NB_Buf, b);
+    struct NB_Buf* b = _nb_bufs_push_ptr(bufs);
     nb_buf_init_alloc(b, len);
     bufs->len += len;
     return b;
@@ -179,8 +181,7 @@ nb_bufs_push_alloc(struct NB_Bufs* bufs, int len)
 struct NB_Buf*
 nb_bufs_push_zeros(struct NB_Bufs* bufs, int len)
 {
-    struct NB_Buf* b;
-    nb_pre_list_get_push_ptr(bufs, struct NB_Buf, b);
+    struct NB_Buf* b = _nb_bufs_push_ptr(bufs);
     nb_buf_init_zeros(b, len);
     bufs->len += len;
     return b;
@@ -198,6 +199,7 @@ nb_bufs_copy(struct NB_Bufs* bufs, struct NB_Bufs* source)
 uint8_t*
 nb_bufs_merge(struct NB_Bufs* bufs, struct NB_Buf* b)
 {
+    struct NB_Buf local_buf;
     if (bufs->count <= 0) {
         if (b) nb_buf_init(b);
         return 0;
@@ -210,12 +212,11 @@ nb_bufs_merge(struct NB_Bufs* bufs, struct NB_Buf* b)
             b = b0;
         }
     } else {
-        struct NB_Buf local_buf;
         if (!b) b = &local_buf;
         nb_buf_init_alloc(b, bufs->len);
         nb_bufs_read(bufs, b->data, b->len);
         nb_bufs_free(bufs);
-        nb_bufs_init(bufs);
+        nb_bufs_init_arena(bufs, bufs->arena);
         nb_bufs_push(bufs, b);
     }
     return b->data;
@@ -224,21 +225,23 @@ nb_bufs_merge(struct NB_Bufs* bufs, struct NB_Buf* b)
 uint8_t*
 nb_bufs_detach(struct NB_Bufs* bufs, struct NB_Buf* b)
 {
+    struct NB_Buf local_buf;
     if (bufs->count <= 0) {
         if (b) nb_buf_init(b);
         return 0;
     }
     struct NB_Buf* b0 = nb_pre_list_at(bufs, 0);
     if (bufs->count == 1 && b0->deleter == nb_buf_default_deleter) {
-        if (b) *b = *b0;
-        nb_bufs_init(bufs);
+        if (!b) b = &local_buf;
+        *b = *b0;
+        if (!bufs->arena) nb_pre_list_free(bufs);
+        nb_bufs_init_arena(bufs, bufs->arena);
     } else {
-        struct NB_Buf local_buf;
         if (!b) b = &local_buf;
         nb_buf_init_alloc(b, bufs->len);
         nb_bufs_read(bufs, b->data, b->len);
         nb_bufs_free(bufs);
-        nb_bufs_init(bufs);
+        nb_bufs_init_arena(bufs, bufs->arena);
     }
     return b->data;
 }
@@ -259,6 +262,28 @@ nb_bufs_read(struct NB_Bufs* bufs, void* target, int len)
     return pos;
 }
 
+/**
+ * reads up to len bytes starting from pos of the bufs into target,
+ * returns the number of bytes read.
+ */
+int
+nb_bufs_read_at(struct NB_Bufs* bufs, int pos, void* target, int len)
+{
+    int n = 0;
+    struct NB_Buf* b = nb_pre_list_at(bufs, 0);
+    for (int i = 0; i < bufs->count && n < len; ++i, ++b) {
+        if (pos >= b->len) {
+            pos -= b->len;
+            continue;
+        }
+        const int copy = b->len - pos < len - n ? b->len - pos : len - n;
+        memcpy(((char*)target) + n, b->data + pos, copy);
+        n += copy;
+        pos = 0;
+    }
+    return n;
+}
+
 void
 nb_bufs_truncate(struct NB_Bufs* bufs, int len)
 {
@@ -297,6 +322,22 @@ nb_bufs_push_vprintf(struct NB_Bufs* bufs, int alloc, const char* fmt, va_list v
     b->len -= trunc;
 }
 
+static struct NB_Buf*
+_nb_bufs_push_ptr(struct NB_Bufs* bufs)
+{
+    struct NB_Buf* b;
+    if (bufs->arena && bufs->count == bufs->capacity) {
+        // arena memory is not reallocated, so grow into a new array and leave the old one
+        const int capacity = bufs->capacity < 8 ? 8 : bufs->capacity * 2;
+        struct NB_Buf* arr = nb_arena_new_arr(bufs->arena, capacity, struct NB_Buf);
+        memcpy(arr, bufs->arr ? bufs->arr : bufs->prealloc, bufs->count * sizeof(struct NB_Buf));
+        bufs->arr = arr;
+        bufs->capacity = capacity;
+    }
+    nb_pre_list_get_push_ptr(bufs, struct NB_Buf, b);
+    return b;
+}
+
 static uint8_t
 _from_hex(char c)
 {
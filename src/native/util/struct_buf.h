@@ -17,6 +17,10 @@ namespace noobaa
 
 typedef void (*NB_Buf_Deleter)(void*, const char*, size_t);
 
+// called with every range of input consumed by a bufs transform (see nb_snappy_compress)
+// to let the caller work on the input while it is still hot in the cache
+typedef void (*NB_Bufs_Tap)(void* arg, const uint8_t* data, int len);
+
 struct NB_Buf {
     uint8_t* data;
     int len;
@@ -24,9 +28,13 @@ struct NB_Buf {
     void* deleter_arg;
 };
 
+struct NB_Arena;
+
 struct NB_Bufs {
     struct NB_Buf prealloc[2];
     struct NB_Buf* arr;
+    // when set the arr grows in the arena (see nb_bufs_init_arena)
+    struct NB_Arena* arena;
     int capacity;
     int count;
     int len;
@@ -150,6 +158,7 @@ void nb_buf_free(struct NB_Buf* buf);
 void nb_buf_default_deleter(void* arg, const char* data, size_t len);
 
 void nb_bufs_init(struct NB_Bufs* bufs);
+void nb_bufs_init_arena(struct NB_Bufs* bufs, struct NB_Arena* arena);
 void nb_bufs_free(struct NB_Bufs* bufs);
 struct NB_Buf* nb_bufs_push(struct NB_Bufs* bufs, struct NB_Buf* buf);
 struct NB_Buf* nb_bufs_push_shared(struct NB_Bufs* bufs, uint8_t* data, int len);
@@ -161,6 +170,7 @@ void nb_bufs_copy(struct NB_Bufs* bufs, struct NB_Bufs* source);
 uint8_t* nb_bufs_merge(struct NB_Bufs* bufs, struct NB_Buf* b);
 uint8_t* nb_bufs_detach(struct NB_Bufs* bufs, struct NB_Buf* b);
 int nb_bufs_read(struct NB_Bufs* bufs, void* target, int len);
+int nb_bufs_read_at(struct NB_Bufs* bufs, int pos, void* target, int len);
 void nb_bufs_truncate(struct NB_Bufs* bufs, int len);
 void nb_bufs_push_printf(struct NB_Bufs* bufs, int alloc, const char* fmt, ...);
 void nb_bufs_push_vprintf(struct NB_Bufs* bufs, int alloc, const char* fmt, va_list va);
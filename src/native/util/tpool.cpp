@@ -13,9 +13,29 @@ NAN_MODULE_INIT(ThreadPool::setup)
     tpl->SetClassName(NAN_STR(name));
     tpl->InstanceTemplate()->SetInternalFieldCount(1);
     Nan::SetAccessor(tpl->InstanceTemplate(), NAN_STR("nthreads"), &nthreads_getter, &nthreads_setter);
+    Nan::SetAccessor(tpl->InstanceTemplate(), NAN_STR("placement"), &placement_getter, &placement_setter);
+    Nan::SetPrototypeMethod(tpl, "stats", ThreadPool::stats);
     auto func = Nan::GetFunction(tpl).ToLocalChecked();
     _ctor.Reset(func);
     NAN_SET(target, name, func);
+    Nan::SetMethod(target, "work_stealing_attach", ThreadPool::work_stealing_attach);
+}
+
+/**
+ * work_stealing_attach(buf) takes the address of the shared pool of nb_native
+ * (see work_stealing_shared) so that the workers of every ThreadPool run on its threads.
+ * called by nb_native.js once both modules are loaded, before any ThreadPool is created.
+ */
+NAN_METHOD(ThreadPool::work_stealing_attach)
+{
+    if (!node::Buffer::HasInstance(info[0]) || node::Buffer::Length(info[0]) != sizeof(WorkStealingPool*)) {
+        return Nan::ThrowError("first argument should be the buffer of work_stealing_shared()");
+    }
+    WorkStealingPool* pool = 0;
+    memcpy(&pool, node::Buffer::Data(info[0]), sizeof(pool));
+    if (!WorkStealingPool::attach_shared(pool)) {
+        return Nan::ThrowError("work_stealing_attach: shared pool already in use");
+    }
 }
 
 NAN_METHOD(ThreadPool::new_instance)
@@ -34,8 +54,8 @@ NAN_METHOD(ThreadPool::new_instance)
 }
 
 ThreadPool::ThreadPool(int nthreads)
-    : _mutex()
-    , _nthreads(0)
+    : _nthreads(0)
+    , _pool(WorkStealingPool::shared())
     , _refs(0)
 {
     LOG("ThreadPool created with " << nthreads << " threads");
@@ -51,30 +71,19 @@ ThreadPool::ThreadPool(int nthreads)
 
 ThreadPool::~ThreadPool()
 {
+    // the shared pool is not stopped - the object is kept referenced (see submit())
+    // while any worker is in the pool, so nothing is left in it for this ThreadPool
     _nthreads = 0;
-    while (!_thread_ids.empty()) {
-        uv_thread_t tid = _thread_ids.front();
-        _thread_ids.pop_front();
-        uv_thread_join(&tid);
-    }
     uv_close(reinterpret_cast<uv_handle_t*>(&_async_completion), NULL);
 }
 
 void
 ThreadPool::set_nthreads(int nthreads)
 {
-    MutexCond::Lock lock(_mutex);
-    int prev_nthreads = _nthreads;
     _nthreads = nthreads;
-    for (int i = prev_nthreads; i < nthreads; ++i) {
-        uv_thread_t tid;
-        uv_thread_create(
-            &tid,
-            &thread_main_uv,
-            new ThreadSpec(this, i));
-        _thread_ids.push_back(tid);
+    if (nthreads > _pool.get_nthreads()) {
+        _pool.set_nthreads(nthreads);
     }
-    _mutex.signal();
 }
 
 struct UvWorker {
@@ -94,17 +103,19 @@ struct UvWorker {
 };
 
 void
-ThreadPool::submit(ThreadPool::Worker* worker)
+ThreadPool::submit(ThreadPool::Worker* worker, WorkStealingPool::Priority priority)
 {
     if (_nthreads > 0) {
-        MutexCond::Lock lock(_mutex);
         if (_refs == 0) {
             // see ctor comment on async handle
             uv_ref(reinterpret_cast<uv_handle_t*>(&_async_completion));
+            // the pool outlives this object, so it must not be collected while workers are pending
+            Ref();
         }
         _refs++;
-        _pending_workers.push_back(worker);
-        _mutex.signal();
+        worker->tpool = this;
+        worker->priority = priority;
+        _pool.submit(worker);
     } else if (_nthreads < 0) {
         UvWorker* w = new UvWorker;
         w->worker = worker;
@@ -118,69 +129,43 @@ ThreadPool::submit(ThreadPool::Worker* worker)
 }
 
 void
-ThreadPool::thread_main(ThreadPool::ThreadSpec& spec)
+ThreadPool::Worker::run()
 {
-    int index = spec.index;
-    Worker* worker = 0;
-
-    while (index < _nthreads) {
-
-        if (worker) {
-            // running lockless
-            try {
-                worker->work();
-            } catch (const std::exception& ex) {
-                PANIC("ThreadPool Worker work exception " << ex.what());
-            }
-        }
-
-        // scope to unlock the mutex before accessing shared structures
-        MutexCond::Lock lock(_mutex);
-
-        if (worker) {
-            // push last worker to done queue and notify the uv event loop to process the done queue
-            _completed_workers.push_back(worker);
-            worker = 0;
-            uv_async_send(&_async_completion);
-        }
-
-        // wait for signal if no items
-        // while waiting the mutex is released, and re-acquired before wait returns
-        while (index < _nthreads && _pending_workers.empty()) {
-            _mutex.wait();
-        }
-        if (index < _nthreads) {
-            worker = _pending_workers.front();
-            _pending_workers.pop_front();
-        }
+    // running lockless on a pool thread
+    try {
+        work();
+    } catch (const std::exception& ex) {
+        PANIC("ThreadPool Worker work exception " << ex.what());
+    }
+    // the worker can be deleted by the event loop as soon as it is pushed
+    ThreadPool* tp = tpool;
+    if (tp->_completed_workers.push(this)) {
+        // notify the uv event loop to process the done queue
+        uv_async_send(&tp->_async_completion);
     }
 }
 
 void
 ThreadPool::completion_cb()
 {
-    // under mutex we make copy of the list
-    // to avoid recursive mutex locking which uv doesnt support cross platform
-    std::list<Worker*> completed;
-    {
-        MutexCond::Lock lock(_mutex);
-        completed = _completed_workers;
-        _completed_workers = std::list<Worker*>();
-        _refs -= completed.size();
-        if (_refs == 0) {
-            // see ctor comment on async handle
-            uv_unref(reinterpret_cast<uv_handle_t*>(&_async_completion));
-        }
-    }
-    // call after_work() of each worker not under mutex
-    while (!completed.empty()) {
-        Worker* worker = completed.front();
-        completed.pop_front();
+    // the queue is taken at once without locking,
+    // and after_work() can submit more workers to the pool meanwhile
+    Worker* worker = _completed_workers.pop_all();
+    if (!worker) return;
+    while (worker) {
+        Worker* next = worker->mpsc_next;
+        _refs--;
         try {
             worker->after_work();
         } catch (const std::exception& ex) {
             PANIC("ThreadPool Worker after_work exception " << ex.what());
         }
+        worker = next;
+    }
+    if (_refs == 0) {
+        // see ctor comment on async handle
+        uv_unref(reinterpret_cast<uv_handle_t*>(&_async_completion));
+        Unref();
     }
 }
 
@@ -196,12 +181,61 @@ NAN_SETTER(ThreadPool::nthreads_setter)
     tpool.set_nthreads(NAN_TO_INT(value));
 }
 
-void
-ThreadPool::thread_main_uv(void* arg)
+NAN_GETTER(ThreadPool::placement_getter)
+{
+    ThreadPool& tpool = *NAN_UNWRAP_THIS(ThreadPool);
+    NAN_RETURN(NAN_STR(WorkStealingPool::placement_name(tpool._pool.get_placement())));
+}
+
+// 'none', 'cores' or 'numa' - applies to the shared pool, so to the CoderPool threads too
+NAN_SETTER(ThreadPool::placement_setter)
 {
-    ThreadPool::ThreadSpec* spec = static_cast<ThreadPool::ThreadSpec*>(arg);
-    spec->tpool->thread_main(*spec);
-    delete spec;
+    ThreadPool& tpool = *NAN_UNWRAP_THIS(ThreadPool);
+    WorkStealingPool::Placement placement = WorkStealingPool::PLACEMENT_NONE;
+    if (!WorkStealingPool::placement_parse(*Nan::Utf8String(value), &placement)) {
+        return Nan::ThrowError("placement should be one of none, cores, numa");
+    }
+    tpool._pool.set_placement(placement);
+}
+
+NAN_METHOD(ThreadPool::stats)
+{
+    ThreadPool& tpool = *NAN_UNWRAP_THIS(ThreadPool);
+    struct NB_Work_Stealing_Stats stats;
+    tpool._pool.stats(&stats);
+    auto obj = NAN_NEW_OBJ();
+    NAN_SET_INT(obj, "nthreads", tpool.get_nthreads());
+    NAN_SET_NUM(obj, "tasks", stats.tasks);
+    NAN_SET_NUM(obj, "steals", stats.steals);
+    NAN_SET_NUM(obj, "overflows", stats.overflows);
+    NAN_SET_NUM(obj, "sleeps", stats.sleeps);
+    NAN_SET_NUM(obj, "inline_tasks", stats.inline_tasks);
+    NAN_SET(obj, "placement", NAN_STR(stats.placement));
+    NAN_SET_INT(obj, "numa_nodes", stats.numa_nodes);
+    NAN_SET_INT(obj, "numa_cpus", stats.numa_cpus);
+    NAN_SET_NUM(obj, "routed", stats.routed);
+    NAN_SET_NUM(obj, "steals_remote", stats.steals_remote);
+    auto thread_nodes = NAN_NEW_ARR(stats.nthreads);
+    auto thread_cpus = NAN_NEW_ARR(stats.nthreads);
+    for (int i = 0; i < stats.nthreads && i < WORK_STEALING_MAX_THREADS; ++i) {
+        NAN_SET_INT(thread_nodes, i, stats.thread_nodes[i]);
+        NAN_SET_INT(thread_cpus, i, stats.thread_cpus[i]);
+    }
+    NAN_SET(obj, "thread_nodes", thread_nodes);
+    NAN_SET(obj, "thread_cpus", thread_cpus);
+    auto priorities = NAN_NEW_OBJ();
+    for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+        const struct NB_Work_Stealing_Priority_Stats& ps = stats.priorities[p];
+        auto priority = NAN_NEW_OBJ();
+        NAN_SET_NUM(priority, "tasks", ps.tasks);
+        NAN_SET_INT(priority, "pending", ps.pending);
+        NAN_SET_NUM(priority, "wait_us", ps.wait_us);
+        NAN_SET_NUM(priority, "wait_max_us", ps.wait_max_us);
+        NAN_SET_NUM(priority, "run_us", ps.run_us);
+        NAN_SET(priorities, WorkStealingPool::priority_name((WorkStealingPool::Priority)p), priority);
+    }
+    NAN_SET(obj, "priorities", priorities);
+    NAN_RETURN(obj);
 }
 
 NAUV_WORK_CB(ThreadPool::work_completed_uv)
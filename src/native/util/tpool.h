@@ -1,11 +1,10 @@
 /* Copyright (C) 2016 NooBaa */
 #pragma once
 
-#include <list>
-
 #include "common.h"
-#include "mutex.h"
+#include "mpsc_queue.h"
 #include "nan.h"
+#include "work_stealing.h"
 
 namespace noobaa
 {
@@ -20,12 +19,17 @@ private:
     static NAN_METHOD(new_instance);
     static NAN_GETTER(nthreads_getter);
     static NAN_SETTER(nthreads_setter);
+    static NAN_GETTER(placement_getter);
+    static NAN_SETTER(placement_setter);
+    static NAN_METHOD(stats);
+    static NAN_METHOD(work_stealing_attach);
 
 public:
     /**
      * nthreads <= -1: use uv threadpool
      * nthreads == 0: no threads, run all inline in event loop thread
-     * nthreads >= 1: create own threads
+     * nthreads >= 1: use the shared WorkStealingPool, growing it to at least nthreads threads.
+     *                its threads are shared with CoderPool, so it is never shrunk from here.
      */
     explicit ThreadPool(int nthreads);
     virtual ~ThreadPool();
@@ -33,35 +37,33 @@ public:
     void set_nthreads(int nthreads);
     int get_nthreads() { return _nthreads; }
 
-    struct Worker {
+    struct Worker : public WorkStealingPool::Task {
+        Worker()
+            : mpsc_next(0)
+            , tpool(0)
+        {
+        }
         virtual ~Worker() {}
         virtual void work() = 0; // called from pooled thread
         virtual void after_work() = 0; // called on event loop
+        virtual void run();
+        Worker* mpsc_next;
+        ThreadPool* tpool;
     };
-    void submit(Worker* worker);
+    // called on event loop - the priority class applies only to the shared pool (nthreads >= 1)
+    void submit(Worker* worker, WorkStealingPool::Priority priority = WorkStealingPool::PRIORITY_NORMAL);
 
 private:
-    struct ThreadSpec {
-        ThreadPool* tpool;
-        int index;
-        ThreadSpec(ThreadPool* tp, int i)
-            : tpool(tp)
-            , index(i)
-        {
-        }
-    };
-    void thread_main(ThreadSpec& spec);
     void completion_cb();
-    static void thread_main_uv(void* arg);
     static NAUV_WORK_CB(work_completed_uv);
 
 private:
-    MutexCond _mutex;
     int _nthreads;
+    WorkStealingPool& _pool;
+    // workers are pushed by the pool threads and drained on the event loop
+    MpscQueue<Worker> _completed_workers;
     uv_async_t _async_completion;
-    std::list<uv_thread_t> _thread_ids;
-    std::list<Worker*> _pending_workers;
-    std::list<Worker*> _completed_workers;
+    // only accessed on the event loop
     int _refs;
 };
 
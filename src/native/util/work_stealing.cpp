@@ -0,0 +1,450 @@
+/* Copyright (C) 2016 NooBaa */
+#include "work_stealing.h"
+
+#include <string.h>
+#include <vector>
+
+#include "common.h"
+
+namespace noobaa
+{
+
+// an idle thread retries the queues this many times before going to sleep,
+// which saves the cond wakeup when tasks are submitted back to back
+#define WORK_STEALING_SPINS 64
+
+// takes per round of every priority class while all the classes have pending tasks
+static const int WORK_STEALING_PRIORITY_WEIGHTS[WORK_STEALING_PRIORITIES] = { 16, 4, 1 };
+
+static inline uint64_t
+_work_stealing_now_us()
+{
+    return uv_hrtime() / 1000;
+}
+
+// the shared pool of this module, or the one attached from the other module
+static std::atomic<WorkStealingPool*> g_work_stealing_shared(0);
+
+WorkStealingPool&
+WorkStealingPool::shared()
+{
+    WorkStealingPool* pool = g_work_stealing_shared;
+    if (pool) return *pool;
+    // never deleted to avoid racing with threads that are still running at exit
+    WorkStealingPool* created = new WorkStealingPool();
+    if (g_work_stealing_shared.compare_exchange_strong(pool, created)) return *created;
+    delete created;
+    return *pool;
+}
+
+bool
+WorkStealingPool::attach_shared(WorkStealingPool* pool)
+{
+    WorkStealingPool* current = 0;
+    return g_work_stealing_shared.compare_exchange_strong(current, pool) || current == pool;
+}
+
+WorkStealingPool::WorkStealingPool()
+    : _nthreads(0)
+    , _nqueues(0)
+    , _next_queue(0)
+    , _pending(0)
+    , _sleeping(0)
+    , _overflow_count(0)
+    , _tasks(0)
+    , _steals(0)
+    , _overflows(0)
+    , _sleeps(0)
+    , _placement(PLACEMENT_NONE)
+    , _placement_gen(0)
+    , _routed(0)
+    , _steals_remote(0)
+    , _inline(0)
+{
+    for (int i = 0; i < WORK_STEALING_MAX_THREADS; ++i) {
+        _alive[i] = false;
+        _thread_nodes[i] = -1;
+        _thread_cpus[i] = -1;
+    }
+    for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+        _priority_pending[p] = 0;
+        _priority_tasks[p] = 0;
+        _priority_wait_us[p] = 0;
+        _priority_wait_max_us[p] = 0;
+        _priority_run_us[p] = 0;
+        for (int i = 0; i < WORK_STEALING_MAX_THREADS; ++i) {
+            _queues[p][i] = 0;
+        }
+    }
+}
+
+const char*
+WorkStealingPool::placement_name(Placement placement)
+{
+    switch (placement) {
+    case PLACEMENT_CORES:
+        return "cores";
+    case PLACEMENT_NUMA:
+        return "numa";
+    default:
+        return "none";
+    }
+}
+
+bool
+WorkStealingPool::placement_parse(const char* name, Placement* placement)
+{
+    if (!strcmp(name, "none")) {
+        *placement = PLACEMENT_NONE;
+    } else if (!strcmp(name, "cores")) {
+        *placement = PLACEMENT_CORES;
+    } else if (!strcmp(name, "numa")) {
+        *placement = PLACEMENT_NUMA;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char*
+WorkStealingPool::priority_name(Priority priority)
+{
+    switch (priority) {
+    case PRIORITY_HIGH:
+        return "high";
+    case PRIORITY_LOW:
+        return "low";
+    default:
+        return "normal";
+    }
+}
+
+bool
+WorkStealingPool::priority_parse(const char* name, Priority* priority)
+{
+    if (!strcmp(name, "high")) {
+        *priority = PRIORITY_HIGH;
+    } else if (!strcmp(name, "normal")) {
+        *priority = PRIORITY_NORMAL;
+    } else if (!strcmp(name, "low")) {
+        *priority = PRIORITY_LOW;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    stop();
+    for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+        for (int i = 0; i < WORK_STEALING_MAX_THREADS; ++i) {
+            delete _queues[p][i];
+        }
+    }
+}
+
+void
+WorkStealingPool::stop()
+{
+    set_nthreads(0);
+    std::list<uv_thread_t> thread_ids;
+    {
+        MutexCond::Lock lock(_cond);
+        thread_ids.swap(_thread_ids);
+    }
+    // threads exit once all the queued tasks were taken
+    for (uv_thread_t& tid : thread_ids) {
+        uv_thread_join(&tid);
+    }
+}
+
+void
+WorkStealingPool::set_nthreads(int nthreads)
+{
+    if (nthreads < 0) nthreads = 0;
+    if (nthreads > WORK_STEALING_MAX_THREADS) nthreads = WORK_STEALING_MAX_THREADS;
+    MutexCond::Lock lock(_cond);
+    for (int i = _nqueues; i < nthreads; ++i) {
+        for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+            _queues[p][i] = new Queue;
+        }
+    }
+    // the queues are published before any thread or submit can index them
+    if (nthreads > _nqueues) _nqueues = nthreads;
+    _nthreads = nthreads;
+    for (int i = 0; i < nthreads; ++i) {
+        if (_alive[i]) continue;
+        uv_thread_t tid;
+        _alive[i] = true;
+        uv_thread_create(&tid, &thread_main_uv, new ThreadSpec(this, i));
+        _thread_ids.push_back(tid);
+    }
+    _cond.broadcast();
+}
+
+void
+WorkStealingPool::set_placement(Placement placement)
+{
+    MutexCond::Lock lock(_cond);
+    if (placement == _placement) return;
+    _placement = placement;
+    _placement_gen++;
+    // wake up the sleeping threads to apply it
+    _cond.broadcast();
+}
+
+void
+WorkStealingPool::submit(Task* const* tasks, int count)
+{
+    if (count <= 0) return;
+    const int nthreads = _nthreads;
+    const bool route = _placement != PLACEMENT_NONE;
+    const uint64_t now = _work_stealing_now_us();
+    for (int i = 0; i < count; ++i) {
+        Task* task = tasks[i];
+        task->submit_time = now;
+    }
+    // without threads there is no queue to take the tasks from, so they run on the caller
+    if (nthreads <= 0) {
+        for (int i = 0; i < count; ++i) {
+            _inline++;
+            run_task(tasks[i]);
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        _priority_pending[tasks[i]->priority]++;
+    }
+    _pending += count;
+    for (int i = 0; i < count; ++i) {
+        Task* task = tasks[i];
+        Queue** queues = _queues[task->priority];
+        bool pushed = route && task->node >= 0 && push_to_node(task, nthreads);
+        for (int j = 0; j < nthreads && !pushed; ++j) {
+            pushed = queues[_next_queue++ % nthreads]->try_push(task);
+        }
+        if (!pushed) {
+            MutexCond::Lock lock(_cond);
+            _overflow[task->priority].push_back(task);
+            _overflow_count++;
+            _overflows++;
+        }
+    }
+    // a thread that is about to sleep checks _pending under the cond mutex
+    // after it marked itself sleeping, so one of us always sees the other
+    if (_sleeping > 0) {
+        MutexCond::Lock lock(_cond);
+        if (count == 1) {
+            _cond.signal();
+        } else {
+            _cond.broadcast();
+        }
+    }
+}
+
+// round robin over the threads of the task node, false if none of them has room
+bool
+WorkStealingPool::push_to_node(Task* task, int nthreads)
+{
+    const unsigned start = _next_queue++;
+    for (int j = 0; j < nthreads; ++j) {
+        const int index = (start + j) % nthreads;
+        if (_thread_nodes[index] == task->node && _queues[task->priority][index]->try_push(task)) {
+            _routed++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+WorkStealingPool::stats(struct NB_Work_Stealing_Stats* stats)
+{
+    stats->nthreads = _nthreads;
+    stats->tasks = _tasks;
+    stats->steals = _steals;
+    stats->overflows = _overflows;
+    stats->sleeps = _sleeps;
+    stats->inline_tasks = _inline;
+    stats->placement = placement_name(get_placement());
+    stats->numa_nodes = nb_numa_nodes();
+    stats->numa_cpus = nb_numa_cpus();
+    stats->routed = _routed;
+    stats->steals_remote = _steals_remote;
+    for (int i = 0; i < WORK_STEALING_MAX_THREADS; ++i) {
+        stats->thread_nodes[i] = _thread_nodes[i];
+        stats->thread_cpus[i] = _thread_cpus[i];
+    }
+    for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+        stats->priorities[p].tasks = _priority_tasks[p];
+        stats->priorities[p].pending = _priority_pending[p];
+        stats->priorities[p].wait_us = _priority_wait_us[p];
+        stats->priorities[p].wait_max_us = _priority_wait_max_us[p];
+        stats->priorities[p].run_us = _priority_run_us[p];
+    }
+}
+
+// weighted round robin over the priorities - every class with pending tasks
+// takes up to its weight of the round, and the round restarts once none of them has credits left,
+// so the lower classes are never starved by a backlog of the higher ones.
+bool
+WorkStealingPool::take(int index, int* credits, Task** task)
+{
+    for (int round = 0; round < 2; ++round) {
+        for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+            if (credits[p] <= 0 || _priority_pending[p] <= 0) continue;
+            if (take_priority(index, p, task)) {
+                credits[p]--;
+                return true;
+            }
+        }
+        for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+            credits[p] = WORK_STEALING_PRIORITY_WEIGHTS[p];
+        }
+    }
+    return false;
+}
+
+bool
+WorkStealingPool::take_priority(int index, int priority, Task** task)
+{
+    Queue** queues = _queues[priority];
+    const int nqueues = _nqueues;
+    if (queues[index]->try_pop(task)) {
+        _priority_pending[priority]--;
+        _pending--;
+        return true;
+    }
+    // steal from the threads on the same node first, when not pinned all nodes are -1
+    const int node = _thread_nodes[index];
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 1; i < nqueues; ++i) {
+            const int victim = (index + i) % nqueues;
+            const bool local = _thread_nodes[victim] == node;
+            if (local != (pass == 0)) continue;
+            if (queues[victim]->try_pop(task)) {
+                _priority_pending[priority]--;
+                _pending--;
+                _steals++;
+                if (!local) _steals_remote++;
+                return true;
+            }
+        }
+    }
+    if (_overflow_count > 0) {
+        MutexCond::Lock lock(_cond);
+        std::deque<Task*>& overflow = _overflow[priority];
+        if (!overflow.empty()) {
+            *task = overflow.front();
+            overflow.pop_front();
+            _overflow_count--;
+            _priority_pending[priority]--;
+            _pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+WorkStealingPool::run_task(Task* task)
+{
+    // the task may be deleted by run() so everything needed later is copied first
+    const int priority = task->priority;
+    const uint64_t start = _work_stealing_now_us();
+    const uint64_t wait_us = start > task->submit_time ? start - task->submit_time : 0;
+    try {
+        task->run();
+    } catch (const std::exception& ex) {
+        PANIC("WorkStealingPool Task run exception " << ex.what());
+    }
+    _priority_run_us[priority] += _work_stealing_now_us() - start;
+    _priority_wait_us[priority] += wait_us;
+    uint64_t wait_max_us = _priority_wait_max_us[priority];
+    while (wait_us > wait_max_us &&
+           !_priority_wait_max_us[priority].compare_exchange_weak(wait_max_us, wait_us)) {
+    }
+    _priority_tasks[priority]++;
+    _tasks++;
+}
+
+void
+WorkStealingPool::place_thread(int index)
+{
+    const Placement placement = get_placement();
+    if (placement == PLACEMENT_NONE) {
+        nb_numa_pin_thread(0, 0, -1);
+        _thread_nodes[index] = -1;
+        _thread_cpus[index] = -1;
+        return;
+    }
+    // threads are spread round robin over the nodes, and then over the cpus of every node
+    const int nnodes = nb_numa_nodes();
+    const int node = index % nnodes;
+    std::vector<int> cpus(NB_NUMA_MAX_CPUS);
+    const int ncpus = nb_numa_node_cpus(node, cpus.data(), NB_NUMA_MAX_CPUS);
+    bool pinned = false;
+    int cpu = -1;
+    if (ncpus > 0 && placement == PLACEMENT_CORES) {
+        cpu = cpus[(index / nnodes) % ncpus];
+        pinned = nb_numa_pin_thread(&cpu, 1, node);
+    } else if (ncpus > 0) {
+        pinned = nb_numa_pin_thread(cpus.data(), ncpus, node);
+    }
+    _thread_nodes[index] = pinned ? node : -1;
+    _thread_cpus[index] = pinned ? cpu : -1;
+}
+
+void
+WorkStealingPool::thread_main(int index)
+{
+    Task* task = 0;
+    int spins = 0;
+    int placement_gen = 0;
+    int credits[WORK_STEALING_PRIORITIES];
+    for (int p = 0; p < WORK_STEALING_PRIORITIES; ++p) {
+        credits[p] = WORK_STEALING_PRIORITY_WEIGHTS[p];
+    }
+    while (true) {
+
+        if (placement_gen != _placement_gen) {
+            placement_gen = _placement_gen;
+            place_thread(index);
+        }
+
+        if (take(index, credits, &task)) {
+            spins = 0;
+            run_task(task);
+            continue;
+        }
+
+        if (_pending > 0 || ++spins < WORK_STEALING_SPINS) {
+            continue;
+        }
+        spins = 0;
+
+        MutexCond::Lock lock(_cond);
+        if (index >= _nthreads) {
+            // nothing is pending so no task is left behind in this queue
+            _alive[index] = false;
+            return;
+        }
+        _sleeping++;
+        while (_pending <= 0 && index < _nthreads && placement_gen == _placement_gen) {
+            _sleeps++;
+            _cond.wait();
+        }
+        _sleeping--;
+    }
+}
+
+void
+WorkStealingPool::thread_main_uv(void* arg)
+{
+    ThreadSpec* spec = static_cast<ThreadSpec*>(arg);
+    spec->pool->thread_main(spec->index);
+    delete spec;
+}
+
+} // namespace noobaa
@@ -0,0 +1,199 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <list>
+
+#include "mpmc_ring.h"
+#include "mutex.h"
+#include "numa.h"
+
+namespace noobaa
+{
+
+#define WORK_STEALING_MAX_THREADS 64
+#define WORK_STEALING_QUEUE_SIZE 4096
+#define WORK_STEALING_PRIORITIES 3
+
+// per priority class - pending is the current queue depth,
+// and the times are the total microseconds from submit to run and of the runs
+struct NB_Work_Stealing_Priority_Stats {
+    uint64_t tasks;
+    int pending;
+    uint64_t wait_us;
+    uint64_t wait_max_us;
+    uint64_t run_us;
+};
+
+struct NB_Work_Stealing_Stats {
+    int nthreads;
+    uint64_t tasks;
+    uint64_t steals;
+    uint64_t overflows;
+    uint64_t sleeps;
+    // tasks that were run by submit() since the pool had no threads
+    uint64_t inline_tasks;
+    // placement
+    const char* placement;
+    int numa_nodes;
+    int numa_cpus;
+    uint64_t routed;
+    uint64_t steals_remote;
+    // node and cpu of every thread, -1 when not pinned
+    int thread_nodes[WORK_STEALING_MAX_THREADS];
+    int thread_cpus[WORK_STEALING_MAX_THREADS];
+    struct NB_Work_Stealing_Priority_Stats priorities[WORK_STEALING_PRIORITIES];
+};
+
+/**
+ *
+ * WorkStealingPool
+ *
+ * Native threads that run tasks from per thread lock free queues.
+ * Submitted tasks are spread round robin over the queues of the threads,
+ * a thread runs the tasks of its own queue and steals from the other queues when it is empty,
+ * so there is no shared lock on the hot path and no allocation per task.
+ * Threads sleep on a cond only when all the queues are empty,
+ * and submit() takes the cond mutex only to wake up sleeping threads.
+ * ThreadPool and CoderPool submit to the same process-wide pool, see shared(),
+ * so the threads are sized once against the cores and the priority classes
+ * order the tasks of both.
+ *
+ * Threads can be pinned to cores or to numa nodes, spread round robin over the nodes.
+ * A task with a node is then routed to the queue of a thread on that node,
+ * and idle threads steal from threads on their own node before the other nodes.
+ *
+ * Every task has a priority class with its own queues. Threads take from the classes
+ * by weighted round robin, so high priority tasks go first when there is a backlog,
+ * but every class gets its share of every round and a flood of low priority tasks
+ * (e.g. rebuilds) only delays the high priority ones (e.g. client reads) by a bounded amount.
+ *
+ */
+class WorkStealingPool
+{
+public:
+    enum Priority {
+        PRIORITY_HIGH,
+        PRIORITY_NORMAL,
+        PRIORITY_LOW,
+    };
+
+    static const char* priority_name(Priority priority);
+    static bool priority_parse(const char* name, Priority* priority);
+
+    struct Task {
+        Task()
+            : node(-1)
+            , priority(PRIORITY_NORMAL)
+            , submit_time(0)
+        {
+        }
+        virtual ~Task() {}
+        // called from a pool thread, the pool does not touch the task once it returns
+        virtual void run() = 0;
+        // the numa node that owns the task memory, or -1 for any
+        int node;
+        Priority priority;
+        // set by submit() for the wait time stats
+        uint64_t submit_time;
+    };
+
+    enum Placement {
+        PLACEMENT_NONE, // threads float across all cpus
+        PLACEMENT_CORES, // every thread is pinned to a single cpu
+        PLACEMENT_NUMA, // every thread is pinned to the cpus of a numa node
+    };
+
+    static const char* placement_name(Placement placement);
+    static bool placement_parse(const char* name, Placement* placement);
+
+    /**
+     * The process-wide pool. nb_native and nb_native_nan each compile their own copy of
+     * this code, so nb_native.js hands the shared pool of nb_native over to nb_native_nan
+     * (see attach_shared) before anything is submitted, and the modules share its threads.
+     * Both copies are built from the same sources so they agree on the layout of the pool.
+     */
+    static WorkStealingPool& shared();
+    // uses the given pool as shared(), false if this module already has another one
+    static bool attach_shared(WorkStealingPool* pool);
+
+    WorkStealingPool();
+    ~WorkStealingPool();
+
+    /**
+     * nthreads == 0: no threads, submit() runs the tasks on the calling thread
+     * nthreads >= 1: create own threads (shrinking lets threads exit once all the queues are empty)
+     */
+    void set_nthreads(int nthreads);
+    int get_nthreads() { return _nthreads; }
+
+    // lets the threads finish the queued tasks and joins them
+    void stop();
+
+    // threads apply a new placement before they take their next task
+    void set_placement(Placement placement);
+    Placement get_placement() { return (Placement)_placement.load(); }
+
+    // can be called from any thread
+    void submit(Task* task) { submit(&task, 1); }
+    void submit(Task* const* tasks, int count);
+
+    void stats(struct NB_Work_Stealing_Stats* stats);
+
+private:
+    typedef MpmcRing<Task*, WORK_STEALING_QUEUE_SIZE> Queue;
+
+    struct ThreadSpec {
+        WorkStealingPool* pool;
+        int index;
+        ThreadSpec(WorkStealingPool* p, int i)
+            : pool(p)
+            , index(i)
+        {
+        }
+    };
+
+    bool push_to_node(Task* task, int nthreads);
+    bool take(int index, int* credits, Task** task);
+    bool take_priority(int index, int priority, Task** task);
+    void run_task(Task* task);
+    void place_thread(int index);
+    void thread_main(int index);
+    static void thread_main_uv(void* arg);
+
+    // guards the sleeping threads, the overflow and the thread lifecycle
+    MutexCond _cond;
+    std::atomic<int> _nthreads;
+    std::atomic<int> _nqueues;
+    std::atomic<unsigned> _next_queue;
+    // number of submitted tasks that were not yet taken by a thread.
+    // incremented before the tasks are pushed so it never goes below the queued count.
+    std::atomic<int> _pending;
+    std::atomic<int> _sleeping;
+    std::atomic<int> _overflow_count;
+    std::atomic<uint64_t> _tasks;
+    std::atomic<uint64_t> _steals;
+    std::atomic<uint64_t> _overflows;
+    std::atomic<uint64_t> _sleeps;
+    std::atomic<int> _placement;
+    std::atomic<int> _placement_gen;
+    std::atomic<uint64_t> _routed;
+    std::atomic<uint64_t> _steals_remote;
+    std::atomic<uint64_t> _inline;
+    std::atomic<int> _thread_nodes[WORK_STEALING_MAX_THREADS];
+    std::atomic<int> _thread_cpus[WORK_STEALING_MAX_THREADS];
+    std::atomic<int> _priority_pending[WORK_STEALING_PRIORITIES];
+    std::atomic<uint64_t> _priority_tasks[WORK_STEALING_PRIORITIES];
+    std::atomic<uint64_t> _priority_wait_us[WORK_STEALING_PRIORITIES];
+    std::atomic<uint64_t> _priority_wait_max_us[WORK_STEALING_PRIORITIES];
+    std::atomic<uint64_t> _priority_run_us[WORK_STEALING_PRIORITIES];
+    // tasks that did not fit in any queue of their priority
+    std::deque<Task*> _overflow[WORK_STEALING_PRIORITIES];
+    bool _alive[WORK_STEALING_MAX_THREADS];
+    std::list<uv_thread_t> _thread_ids;
+    // allocated on first use and kept until the pool is deleted
+    Queue* _queues[WORK_STEALING_PRIORITIES][WORK_STEALING_MAX_THREADS];
+};
+
+} // namespace noobaa
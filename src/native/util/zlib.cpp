@@ -4,9 +4,11 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <zlib.h>
 
+#include "../third_party/isa-l/include/igzip_lib.h"
 #include "../util/common.h"
 
 namespace noobaa
@@ -14,8 +16,138 @@ namespace noobaa
 
 DBG_INIT(0);
 
+// input is fed to deflate in slices of this size when tapped,
+// which does not change the output since deflate buffers its own window
+#define NB_ZLIB_TAP_SIZE (64 * 1024)
+
+// igzip output is collected in buffers of this size
+#define NB_IGZIP_OUT_SIZE (64 * 1024)
+
+// zlib stream framing around the raw deflate data - RFC 1950
+#define NB_ZLIB_HDR_SIZE 2
+#define NB_ZLIB_TRL_SIZE 4
+
+// igzip streams are large (the lvl1 buffer alone is about 260 KB) so every thread
+// allocates its own on first use and reuses them for all chunks.
+// they are kept out of the thread local storage itself which is limited for addons.
+struct NB_Igzip_Contexts {
+    struct isal_zstream* zstream;
+    uint8_t* level_buf;
+    struct inflate_state* istate;
+    NB_Igzip_Contexts()
+        : zstream(0), level_buf(0), istate(0) {}
+    ~NB_Igzip_Contexts()
+    {
+        free(zstream);
+        free(level_buf);
+        free(istate);
+    }
+};
+
+static thread_local NB_Igzip_Contexts _nb_igzip_contexts;
+
+static int _nb_deflate(
+    struct NB_Bufs* bufs, int level, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg);
+static int _nb_igzip_deflate(
+    struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg);
+
+/**
+ * The fast levels are compressed by igzip (isa-l), whose deflate body is picked
+ * at load time by cpu features (sse/avx/avx2/avx512) by the isa-l multibinary dispatch.
+ * igzip only implements the fastest levels so higher levels go to zlib deflate.
+ * both write a standard zlib stream so either one can decode the other.
+ */
 int
-nb_zlib_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors)
+nb_zlib_compress(struct NB_Bufs* bufs, int level, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    if (level <= ISAL_DEF_MAX_LEVEL) {
+        return _nb_igzip_deflate(bufs, errors, tap, tap_arg);
+    }
+    return _nb_deflate(bufs, level, errors, tap, tap_arg);
+}
+
+static int
+_nb_igzip_deflate(struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    int z_res;
+    struct NB_Bufs out;
+
+    nb_bufs_init(&out);
+
+    StackCleaner cleaner([&] {
+        nb_bufs_free(&out);
+    });
+
+    if (!_nb_igzip_contexts.zstream) {
+        struct isal_zstream* zstream = (struct isal_zstream*)malloc(sizeof(struct isal_zstream));
+        uint8_t* level_buf = (uint8_t*)malloc(ISAL_DEF_LVL1_DEFAULT);
+        if (!zstream || !level_buf) {
+            free(zstream);
+            free(level_buf);
+            nb_bufs_push_printf(errors, 256, "nb_zlib_compress: igzip stream allocation failed");
+            return -1;
+        }
+        _nb_igzip_contexts.zstream = zstream;
+        _nb_igzip_contexts.level_buf = level_buf;
+    }
+    struct isal_zstream* strm = _nb_igzip_contexts.zstream;
+
+    isal_deflate_init(strm);
+    strm->level = 1;
+    strm->level_buf = _nb_igzip_contexts.level_buf;
+    strm->level_buf_size = ISAL_DEF_LVL1_DEFAULT;
+    strm->gzip_flag = IGZIP_ZLIB;
+    strm->flush = NO_FLUSH;
+    strm->next_out = 0;
+    strm->avail_out = 0;
+
+    // the last slice of input marks the end of stream, and then deflate runs until
+    // the final block and the zlib trailer are written
+    auto deflate_slice = [&](uint8_t* data, int len) {
+        strm->next_in = data;
+        strm->avail_in = len;
+        strm->end_of_stream = strm->total_in + len == (uint32_t)bufs->len;
+        while (strm->avail_in || (strm->end_of_stream && strm->internal_state.state != ZSTATE_END)) {
+            if (!strm->avail_out) {
+                struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_IGZIP_OUT_SIZE);
+                strm->next_out = o->data;
+                strm->avail_out = o->len;
+            }
+            z_res = isal_deflate(strm);
+            if (z_res != COMP_OK) {
+                nb_bufs_push_printf(
+                    errors, 256, "nb_zlib_compress: isal_deflate() error %i avail_in %u", z_res, strm->avail_in);
+                return -1;
+            }
+        }
+        return 0;
+    };
+
+    if (!bufs->len && deflate_slice(0, 0)) return -1;
+
+    for (int i = 0; i < bufs->count; ++i) {
+        struct NB_Buf* b = nb_bufs_get(bufs, i);
+        for (int pos = 0; pos < b->len;) {
+            const int len = b->len - pos > NB_ZLIB_TAP_SIZE ? NB_ZLIB_TAP_SIZE : b->len - pos;
+            if (tap) tap(tap_arg, b->data + pos, len);
+            if (deflate_slice(b->data + pos, len)) return -1;
+            pos += len;
+        }
+    }
+
+    assert(out.len >= (int)strm->total_out);
+    nb_bufs_truncate(&out, strm->total_out);
+
+    DBG1("nb_zlib_compress: igzip " << DVAL(bufs->len) << DVAL(bufs->count) << DVAL(out.len) << DVAL(out.count));
+
+    nb_bufs_free(bufs);
+    *bufs = out;
+    nb_bufs_init(&out);
+    return 0;
+}
+
+static int
+_nb_deflate(struct NB_Bufs* bufs, int level, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
 {
     int z_res;
     z_stream strm;
@@ -36,45 +168,56 @@ nb_zlib_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors)
         deflateEnd(&strm);
     });
 
-    z_res = deflateInit(&strm, Z_BEST_SPEED);
+    z_res = deflateInit(&strm, level);
     if (z_res != Z_OK) {
         nb_bufs_push_printf(
-            errors, 256, "nb_zlib_compress: deflateInit() error %i %s", z_res, strm.msg);
+            errors, 256, "nb_zlib_compress: deflateInit() level %i error %i %s", level, z_res, strm.msg);
         return -1;
     }
 
     for (int i = 0; i < bufs->count; ++i) {
         struct NB_Buf* b = nb_bufs_get(bufs, i);
-        strm.next_in = b->data;
-        strm.avail_in = b->len;
-        while (strm.avail_in) {
-            if (!strm.avail_out) {
-                struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_BUF_PAGE_SIZE);
-                strm.next_out = o->data;
-                strm.avail_out = o->len;
-            }
-            z_res = deflate(&strm, Z_NO_FLUSH);
-            switch (z_res) {
-            case Z_OK:
-            case Z_STREAM_END:
-            case Z_BUF_ERROR:
-                break;
-            default:
-                nb_bufs_push_printf(
-                    errors,
-                    256,
-                    "nb_zlib_compress: deflate(Z_NO_FLUSH) error %i %s avail_in %i avail_out %i",
-                    z_res,
-                    strm.msg,
-                    strm.avail_in,
-                    strm.avail_out);
-                return -1;
+        for (int pos = 0; pos < b->len;) {
+            const int len = (tap && b->len - pos > NB_ZLIB_TAP_SIZE) ? NB_ZLIB_TAP_SIZE : b->len - pos;
+            if (tap) tap(tap_arg, b->data + pos, len);
+            strm.next_in = b->data + pos;
+            strm.avail_in = len;
+            pos += len;
+            while (strm.avail_in) {
+                if (!strm.avail_out) {
+                    struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_BUF_PAGE_SIZE);
+                    strm.next_out = o->data;
+                    strm.avail_out = o->len;
+                }
+                z_res = deflate(&strm, Z_NO_FLUSH);
+                switch (z_res) {
+                case Z_OK:
+                case Z_STREAM_END:
+                case Z_BUF_ERROR:
+                    break;
+                default:
+                    nb_bufs_push_printf(
+                        errors,
+                        256,
+                        "nb_zlib_compress: deflate(Z_NO_FLUSH) error %i %s avail_in %i avail_out %i",
+                        z_res,
+                        strm.msg,
+                        strm.avail_in,
+                        strm.avail_out);
+                    return -1;
+                }
             }
         }
     }
 
     bool end = false;
     while (!end) {
+        // an empty input never got an output buffer and deflate refuses a null next_out
+        if (!strm.next_out) {
+            struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_BUF_PAGE_SIZE);
+            strm.next_out = o->data;
+            strm.avail_out = o->len;
+        }
         z_res = deflate(&strm, Z_FINISH);
         switch (z_res) {
         case Z_STREAM_END:
@@ -115,97 +258,99 @@ nb_zlib_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors)
     return 0;
 }
 
+/**
+ * Decodes zlib streams written by either igzip or zlib deflate.
+ * isa-l inflate only handles the raw deflate data here, so the zlib header
+ * is checked before and the adler32 trailer is compared after.
+ */
 int
 nb_zlib_uncompress(struct NB_Bufs* bufs, int uncompressed_len, struct NB_Bufs* errors)
 {
     int z_res;
-    z_stream strm;
     struct NB_Bufs out;
+    uint8_t hdr[NB_ZLIB_HDR_SIZE];
+    uint8_t trl[NB_ZLIB_TRL_SIZE];
 
     nb_bufs_init(&out);
 
-    strm.zalloc = 0;
-    strm.zfree = 0;
-    strm.opaque = 0;
-    strm.next_out = 0;
-    strm.avail_out = 0;
-    strm.next_in = 0;
-    strm.avail_in = 0;
-
     StackCleaner cleaner([&] {
         nb_bufs_free(&out);
-        inflateEnd(&strm);
     });
 
-    z_res = inflateInit(&strm);
-    if (z_res != Z_OK) {
+    if (bufs->len < NB_ZLIB_HDR_SIZE + NB_ZLIB_TRL_SIZE) {
+        nb_bufs_push_printf(errors, 256, "nb_zlib_uncompress: truncated stream length %i", bufs->len);
+        return -1;
+    }
+
+    // CM must be deflate with a window of up to 32 KB, and no preset dictionary
+    nb_bufs_read(bufs, hdr, NB_ZLIB_HDR_SIZE);
+    if ((hdr[0] & 0x0f) != 8 || (hdr[0] >> 4) > 7 || (hdr[1] & 0x20) ||
+        ((hdr[0] << 8) | hdr[1]) % 31) {
         nb_bufs_push_printf(
-            errors, 256, "nb_zlib_uncompress: inflateInit() error %i %s", z_res, strm.msg);
+            errors, 256, "nb_zlib_uncompress: invalid zlib header 0x%02x%02x", hdr[0], hdr[1]);
         return -1;
     }
 
-    for (int i = 0; i < bufs->count; ++i) {
-        struct NB_Buf* b = nb_bufs_get(bufs, i);
-        strm.next_in = b->data;
-        strm.avail_in = b->len;
-        while (strm.avail_in) {
-            if (!strm.avail_out) {
-                struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_BUF_PAGE_SIZE);
-                strm.next_out = o->data;
-                strm.avail_out = o->len;
-            }
-            z_res = inflate(&strm, Z_NO_FLUSH);
-            switch (z_res) {
-            case Z_OK:
-            case Z_STREAM_END:
-            case Z_BUF_ERROR:
-                break;
-            default:
-                nb_bufs_push_printf(
-                    errors,
-                    256,
-                    "nb_zlib_compress: inflate(Z_NO_FLUSH) error %i %s",
-                    z_res,
-                    strm.msg);
-                return -1;
-            }
+    if (!_nb_igzip_contexts.istate) {
+        _nb_igzip_contexts.istate = (struct inflate_state*)malloc(sizeof(struct inflate_state));
+        if (!_nb_igzip_contexts.istate) {
+            nb_bufs_push_printf(errors, 256, "nb_zlib_uncompress: igzip inflate state allocation failed");
+            return -1;
         }
     }
+    struct inflate_state* state = _nb_igzip_contexts.istate;
 
-    bool end = false;
-    while (!end) {
-        z_res = inflate(&strm, Z_FINISH);
-        switch (z_res) {
-        case Z_STREAM_END:
-            end = true;
-            break;
-        case Z_OK:
-            break; // need to allocate on Z_OK too ???
-        case Z_BUF_ERROR:
-            if (!strm.avail_out) {
-                struct NB_Buf* o = nb_bufs_push_alloc(&out, NB_BUF_PAGE_SIZE);
-                strm.next_out = o->data;
-                strm.avail_out = o->len;
-            }
-            break;
-        default:
+    isal_inflate_init(state);
+    state->crc_flag = ISAL_ZLIB_NO_HDR;
+
+    // the uncompressed size is known so the output is decompressed into a single buffer
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, uncompressed_len);
+    state->next_out = o->data;
+    state->avail_out = o->len;
+
+    const int end = bufs->len - NB_ZLIB_TRL_SIZE;
+    for (int i = 0, pos = 0; i < bufs->count; pos += nb_bufs_get(bufs, i)->len, ++i) {
+        struct NB_Buf* b = nb_bufs_get(bufs, i);
+        for (int j = end > pos ? end - pos : 0; j < b->len; ++j) {
+            trl[pos + j - end] = b->data[j];
+        }
+        const int from = pos < NB_ZLIB_HDR_SIZE ? NB_ZLIB_HDR_SIZE - pos : 0;
+        const int to = end - pos < b->len ? end - pos : b->len;
+        if (from >= to) continue;
+        state->next_in = b->data + from;
+        state->avail_in = to - from;
+        z_res = isal_inflate(state);
+        if (z_res < 0) {
+            nb_bufs_push_printf(errors, 256, "nb_zlib_uncompress: isal_inflate() error %i", z_res);
+            return -1;
+        }
+        if (state->avail_in && state->block_state != ISAL_BLOCK_FINISH) {
             nb_bufs_push_printf(
-                errors, 256, "nb_zlib_compress: inflate(Z_FINISH) error %i %s", z_res, strm.msg);
+                errors, 256, "nb_zlib_uncompress: output exceeds uncompressed length %i", uncompressed_len);
             return -1;
         }
     }
 
-    assert(out.len >= (int)strm.total_out);
-    nb_bufs_truncate(&out, strm.total_out);
-    out.len = strm.total_out;
+    // flush whatever is still held in the inflate history buffer
+    if (state->block_state != ISAL_BLOCK_FINISH) {
+        state->avail_in = 0;
+        z_res = isal_inflate(state);
+        if (z_res < 0 || state->block_state != ISAL_BLOCK_FINISH) {
+            nb_bufs_push_printf(
+                errors, 256, "nb_zlib_uncompress: truncated stream error %i output %u", z_res, state->total_out);
+            return -1;
+        }
+    }
 
-    z_res = inflateEnd(&strm);
-    if (z_res != Z_OK) {
+    const uint32_t adler32 = (trl[0] << 24) | (trl[1] << 16) | (trl[2] << 8) | trl[3];
+    if (state->crc != adler32) {
         nb_bufs_push_printf(
-            errors, 256, "nb_zlib_compress: inflateEnd() error %i %s", z_res, strm.msg);
+            errors, 256, "nb_zlib_uncompress: adler32 mismatch 0x%08x expected 0x%08x", state->crc, adler32);
         return -1;
     }
 
+    nb_bufs_truncate(&out, state->total_out);
+
     DBG1("nb_zlib_uncompress: " << DVAL(bufs->len) << DVAL(bufs->count) << DVAL(out.len) << DVAL(out.count));
 
     nb_bufs_free(bufs);
@@ -213,4 +358,52 @@ nb_zlib_uncompress(struct NB_Bufs* bufs, int uncompressed_len, struct NB_Bufs* e
     nb_bufs_init(&out);
     return 0;
 }
+
+// deflate stored blocks hold up to 64 KB - 1
+#define NB_ZLIB_STORE_BLOCK (32 * 1024)
+
+int
+nb_zlib_store(struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    struct NB_Bufs out;
+    nb_bufs_init(&out);
+
+    const int len = bufs->len;
+    // empty input still needs one final block
+    const int blocks = len ? (len + NB_ZLIB_STORE_BLOCK - 1) / NB_ZLIB_STORE_BLOCK : 1;
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, 2 + (5 * blocks) + len + 4);
+    uint8_t* p = o->data;
+    uLong adler = adler32(0, Z_NULL, 0);
+
+    // zlib header - deflate with 32 KB window, no dictionary, fastest level, and the header check bits
+    *p++ = 0x78;
+    *p++ = 0x01;
+
+    int pos = 0;
+    do {
+        const int n = len - pos < NB_ZLIB_STORE_BLOCK ? len - pos : NB_ZLIB_STORE_BLOCK;
+        // BFINAL in the first bit and BTYPE 00 (stored), then LEN and NLEN little endian
+        *p++ = pos + n >= len ? 1 : 0;
+        *p++ = (uint8_t)(n & 0xff);
+        *p++ = (uint8_t)(n >> 8);
+        *p++ = (uint8_t)(~n & 0xff);
+        *p++ = (uint8_t)((~n >> 8) & 0xff);
+        nb_bufs_read_at(bufs, pos, p, n);
+        if (tap) tap(tap_arg, p, n);
+        adler = adler32(adler, p, n);
+        p += n;
+        pos += n;
+    } while (pos < len);
+
+    // adler32 trailer big endian
+    *p++ = (uint8_t)(adler >> 24);
+    *p++ = (uint8_t)(adler >> 16);
+    *p++ = (uint8_t)(adler >> 8);
+    *p++ = (uint8_t)adler;
+
+    nb_bufs_truncate(&out, p - o->data);
+    nb_bufs_free(bufs);
+    *bufs = out;
+    return 0;
+}
 }
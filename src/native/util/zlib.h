@@ -6,6 +6,11 @@
 namespace noobaa
 {
 
-int nb_zlib_compress(struct NB_Bufs* bufs, struct NB_Bufs* errors);
+// levels 0 (default) and 1 are compressed by igzip, higher levels by zlib deflate
+int nb_zlib_compress(
+    struct NB_Bufs* bufs, int level, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
 int nb_zlib_uncompress(struct NB_Bufs* bufs, int uncompressed_len, struct NB_Bufs* errors);
+// stores the data in deflate stored blocks of a zlib stream, without compressing it
+int nb_zlib_store(
+    struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
 }
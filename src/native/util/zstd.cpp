@@ -0,0 +1,450 @@
+/* Copyright (C) 2016 NooBaa */
+#include "zstd.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include "../util/common.h"
+#include "../util/mutex.h"
+
+namespace noobaa
+{
+
+DBG_INIT(0);
+
+// input is fed to zstd in slices of this size, which lets the tap see the data
+// while it is still in cache, and does not change the output of the stream
+#define NB_ZSTD_SLICE_SIZE (128 * 1024)
+
+// compressed output is collected in buffers of this size
+#define NB_ZSTD_OUT_SIZE (64 * 1024)
+
+// zstd contexts hold large tables that depend on the level (tens of MB for high levels)
+// so every thread keeps its own contexts and only resets them between chunks
+struct NB_Zstd_Contexts {
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+    NB_Zstd_Contexts()
+        : cctx(0), dctx(0) {}
+    ~NB_Zstd_Contexts()
+    {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+};
+
+static thread_local NB_Zstd_Contexts _nb_zstd_contexts;
+
+/**
+ * NB_Zstd_Dict keeps a dictionary digested for decompression, and for compression
+ * once per level (a CDict is bound to the level it was created with).
+ * digesting builds the entropy tables and the match state of the dictionary content,
+ * which costs much more than compressing a small chunk, so it is done once and shared
+ * by all the coder threads. the coder holds a reference while in use so that unload
+ * does not free it under a running chunk.
+ */
+struct NB_Zstd_Dict {
+    struct NB_Buf data;
+    ZSTD_DDict* ddict;
+    // levels are few so a map under the registry lock is enough
+    std::map<int, ZSTD_CDict*> cdicts;
+    NB_Zstd_Dict()
+        : ddict(0)
+    {
+        nb_buf_init(&data);
+    }
+    ~NB_Zstd_Dict()
+    {
+        for (auto& it : cdicts) ZSTD_freeCDict(it.second);
+        ZSTD_freeDDict(ddict);
+        nb_buf_free(&data);
+    }
+};
+
+typedef std::shared_ptr<NB_Zstd_Dict> NB_Zstd_Dict_Ptr;
+
+static Mutex _nb_zstd_dicts_mutex;
+static std::unordered_map<int, NB_Zstd_Dict_Ptr> _nb_zstd_dicts;
+static std::atomic<uint64_t> _nb_zstd_dict_compress(0);
+static std::atomic<uint64_t> _nb_zstd_dict_uncompress(0);
+
+static NB_Zstd_Dict_Ptr
+_nb_zstd_dict_get(int dict_id)
+{
+    Mutex::Lock lock(_nb_zstd_dicts_mutex);
+    auto it = _nb_zstd_dicts.find(dict_id);
+    return it == _nb_zstd_dicts.end() ? NB_Zstd_Dict_Ptr() : it->second;
+}
+
+static const ZSTD_CDict*
+_nb_zstd_dict_get_cdict(NB_Zstd_Dict* dict, int level)
+{
+    {
+        Mutex::Lock lock(_nb_zstd_dicts_mutex);
+        auto it = dict->cdicts.find(level);
+        if (it != dict->cdicts.end()) return it->second;
+    }
+
+    // digesting outside the lock - concurrent misses on the same level
+    // might digest it more than once, but only the first one is kept
+    ZSTD_CDict* cdict = ZSTD_createCDict(dict->data.data, dict->data.len, level);
+    if (!cdict) return 0;
+
+    Mutex::Lock lock(_nb_zstd_dicts_mutex);
+    auto it = dict->cdicts.find(level);
+    if (it != dict->cdicts.end()) {
+        ZSTD_freeCDict(cdict);
+        return it->second;
+    }
+    dict->cdicts[level] = cdict;
+    return cdict;
+}
+
+int
+nb_zstd_dict_load(int dict_id, const uint8_t* data, int len, struct NB_Bufs* errors)
+{
+    if (dict_id <= 0) {
+        nb_bufs_push_printf(errors, 256, "nb_zstd_dict_load: invalid dict id %i", dict_id);
+        return -1;
+    }
+
+    NB_Zstd_Dict_Ptr existing = _nb_zstd_dict_get(dict_id);
+    if (existing) {
+        if (existing->data.len == len && memcmp(existing->data.data, data, len) == 0) return 0;
+        nb_bufs_push_printf(
+            errors, 256, "nb_zstd_dict_load: dict id %i is already loaded with different content", dict_id);
+        return -1;
+    }
+
+    NB_Zstd_Dict_Ptr dict = std::make_shared<NB_Zstd_Dict>();
+    nb_buf_init_copy(&dict->data, (uint8_t*)data, len);
+    dict->ddict = ZSTD_createDDict(dict->data.data, dict->data.len);
+    if (!dict->ddict) {
+        nb_bufs_push_printf(errors, 256, "nb_zstd_dict_load: ZSTD_createDDict() failed dict id %i", dict_id);
+        return -1;
+    }
+
+    Mutex::Lock lock(_nb_zstd_dicts_mutex);
+    // a concurrent load of the same id wins, and is checked for the same content as above
+    auto it = _nb_zstd_dicts.find(dict_id);
+    if (it != _nb_zstd_dicts.end()) {
+        NB_Zstd_Dict* d = it->second.get();
+        if (d->data.len == len && memcmp(d->data.data, data, len) == 0) return 0;
+        nb_bufs_push_printf(
+            errors, 256, "nb_zstd_dict_load: dict id %i is already loaded with different content", dict_id);
+        return -1;
+    }
+    _nb_zstd_dicts[dict_id] = dict;
+
+    DBG1("nb_zstd_dict_load: " << DVAL(dict_id) << DVAL(len) << DVAL(ZSTD_getDictID_fromDict(data, len)));
+    return 0;
+}
+
+bool
+nb_zstd_dict_unload(int dict_id)
+{
+    Mutex::Lock lock(_nb_zstd_dicts_mutex);
+    return _nb_zstd_dicts.erase(dict_id) > 0;
+}
+
+int
+nb_zstd_dict_train(struct NB_Bufs* samples, int dict_size, struct NB_Bufs* dict, struct NB_Bufs* errors)
+{
+    // zdict takes the samples concatenated in a single buffer
+    std::vector<size_t> sizes(samples->count);
+    struct NB_Buf all;
+    nb_buf_init_alloc(&all, samples->len);
+    StackCleaner cleaner([&] {
+        nb_buf_free(&all);
+    });
+    for (int i = 0, pos = 0; i < samples->count; ++i) {
+        struct NB_Buf* b = nb_bufs_get(samples, i);
+        memcpy(all.data + pos, b->data, b->len);
+        sizes[i] = b->len;
+        pos += b->len;
+    }
+
+    struct NB_Buf* o = nb_bufs_push_alloc(dict, dict_size);
+    size_t z_res = ZDICT_trainFromBuffer(o->data, o->len, all.data, sizes.data(), samples->count);
+    if (ZDICT_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors,
+            256,
+            "nb_zstd_dict_train: ZDICT_trainFromBuffer() samples %i bytes %i error %s",
+            samples->count,
+            samples->len,
+            ZDICT_getErrorName(z_res));
+        return -1;
+    }
+    nb_bufs_truncate(dict, (int)z_res);
+
+    DBG1("nb_zstd_dict_train: " << DVAL(samples->count) << DVAL(samples->len) << DVAL(dict_size) << DVAL(z_res));
+    return 0;
+}
+
+void
+nb_zstd_dict_stats(struct NB_Zstd_Dict_Stats* stats)
+{
+    Mutex::Lock lock(_nb_zstd_dicts_mutex);
+    stats->dicts = (int)_nb_zstd_dicts.size();
+    stats->dict_bytes = 0;
+    stats->cdicts = 0;
+    stats->ddicts = 0;
+    for (auto& it : _nb_zstd_dicts) {
+        stats->dict_bytes += it.second->data.len;
+        stats->cdicts += (int)it.second->cdicts.size();
+        stats->ddicts += it.second->ddict ? 1 : 0;
+    }
+    stats->compress = _nb_zstd_dict_compress;
+    stats->uncompress = _nb_zstd_dict_uncompress;
+}
+
+int
+nb_zstd_compress(
+    struct NB_Bufs* bufs, int level, int dict_id, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    size_t z_res;
+    struct NB_Bufs out;
+    struct NB_Buf* o = 0;
+    ZSTD_outBuffer output = { 0, 0, 0 };
+
+    nb_bufs_init(&out);
+
+    StackCleaner cleaner([&] {
+        nb_bufs_free(&out);
+    });
+
+    if (!_nb_zstd_contexts.cctx) {
+        _nb_zstd_contexts.cctx = ZSTD_createCCtx();
+        if (!_nb_zstd_contexts.cctx) {
+            nb_bufs_push_printf(errors, 256, "nb_zstd_compress: ZSTD_createCCtx() failed");
+            return -1;
+        }
+    }
+    ZSTD_CCtx* cctx = _nb_zstd_contexts.cctx;
+
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    z_res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(z_res)) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_zstd_compress: invalid level %i %s", level, ZSTD_getErrorName(z_res));
+        return -1;
+    }
+    // the pledged size is written to the frame header and lets zstd size its window to the chunk
+    ZSTD_CCtx_setPledgedSrcSize(cctx, bufs->len);
+
+    // the reference keeps the dictionary alive until the frame is done
+    NB_Zstd_Dict_Ptr dict;
+    if (dict_id) {
+        dict = _nb_zstd_dict_get(dict_id);
+        if (!dict) {
+            nb_bufs_push_printf(errors, 256, "nb_zstd_compress: dict id %i is not loaded", dict_id);
+            return -1;
+        }
+        const ZSTD_CDict* cdict = _nb_zstd_dict_get_cdict(dict.get(), level);
+        if (!cdict) {
+            nb_bufs_push_printf(
+                errors, 256, "nb_zstd_compress: ZSTD_createCDict() failed dict id %i level %i", dict_id, level);
+            return -1;
+        }
+        // the level of the cdict takes over the level parameter
+        z_res = ZSTD_CCtx_refCDict(cctx, cdict);
+        if (ZSTD_isError(z_res)) {
+            nb_bufs_push_printf(
+                errors, 256, "nb_zstd_compress: ZSTD_CCtx_refCDict() error %s", ZSTD_getErrorName(z_res));
+            return -1;
+        }
+        _nb_zstd_dict_compress++;
+    }
+
+    for (int i = 0; i < bufs->count; ++i) {
+        struct NB_Buf* b = nb_bufs_get(bufs, i);
+        for (int pos = 0; pos < b->len;) {
+            const int len = b->len - pos > NB_ZSTD_SLICE_SIZE ? NB_ZSTD_SLICE_SIZE : b->len - pos;
+            if (tap) tap(tap_arg, b->data + pos, len);
+            ZSTD_inBuffer input = { b->data + pos, (size_t)len, 0 };
+            pos += len;
+            while (input.pos < input.size) {
+                if (output.pos == output.size) {
+                    o = nb_bufs_push_alloc(&out, NB_ZSTD_OUT_SIZE);
+                    output.dst = o->data;
+                    output.size = o->len;
+                    output.pos = 0;
+                }
+                z_res = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_continue);
+                if (ZSTD_isError(z_res)) {
+                    nb_bufs_push_printf(
+                        errors, 256, "nb_zstd_compress: ZSTD_compressStream2() error %s", ZSTD_getErrorName(z_res));
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // flush until zstd reports nothing is left
+    do {
+        if (output.pos == output.size) {
+            o = nb_bufs_push_alloc(&out, NB_ZSTD_OUT_SIZE);
+            output.dst = o->data;
+            output.size = o->len;
+            output.pos = 0;
+        }
+        ZSTD_inBuffer input = { 0, 0, 0 };
+        z_res = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(z_res)) {
+            nb_bufs_push_printf(
+                errors, 256, "nb_zstd_compress: ZSTD_compressStream2(ZSTD_e_end) error %s", ZSTD_getErrorName(z_res));
+            return -1;
+        }
+    } while (z_res);
+
+    // only the last output buffer can be partially filled
+    const int out_len = out.len - (int)(output.size - output.pos);
+    nb_bufs_truncate(&out, out_len);
+
+    DBG1("nb_zstd_compress: " << DVAL(level) << DVAL(dict_id) << DVAL(bufs->len) << DVAL(bufs->count) << DVAL(out.len) << DVAL(out.count));
+
+    nb_bufs_free(bufs);
+    *bufs = out;
+    nb_bufs_init(&out);
+    return 0;
+}
+
+int
+nb_zstd_uncompress(struct NB_Bufs* bufs, int uncompressed_len, int dict_id, struct NB_Bufs* errors)
+{
+    size_t z_res = 0;
+    struct NB_Bufs out;
+
+    nb_bufs_init(&out);
+
+    StackCleaner cleaner([&] {
+        nb_bufs_free(&out);
+    });
+
+    if (!_nb_zstd_contexts.dctx) {
+        _nb_zstd_contexts.dctx = ZSTD_createDCtx();
+        if (!_nb_zstd_contexts.dctx) {
+            nb_bufs_push_printf(errors, 256, "nb_zstd_uncompress: ZSTD_createDCtx() failed");
+            return -1;
+        }
+    }
+    ZSTD_DCtx* dctx = _nb_zstd_contexts.dctx;
+    // resetting the parameters also drops the dictionary referenced by the previous chunk
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+
+    NB_Zstd_Dict_Ptr dict;
+    if (dict_id) {
+        dict = _nb_zstd_dict_get(dict_id);
+        if (!dict) {
+            nb_bufs_push_printf(errors, 256, "nb_zstd_uncompress: dict id %i is not loaded", dict_id);
+            return -1;
+        }
+        z_res = ZSTD_DCtx_refDDict(dctx, dict->ddict);
+        if (ZSTD_isError(z_res)) {
+            nb_bufs_push_printf(
+                errors, 256, "nb_zstd_uncompress: ZSTD_DCtx_refDDict() error %s", ZSTD_getErrorName(z_res));
+            return -1;
+        }
+        _nb_zstd_dict_uncompress++;
+    }
+
+    // the uncompressed size is known so the output is decompressed into a single buffer
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, uncompressed_len);
+    ZSTD_outBuffer output = { o->data, (size_t)o->len, 0 };
+
+    for (int i = 0; i < bufs->count; ++i) {
+        struct NB_Buf* b = nb_bufs_get(bufs, i);
+        ZSTD_inBuffer input = { b->data, (size_t)b->len, 0 };
+        while (input.pos < input.size) {
+            const size_t in_pos = input.pos;
+            const size_t out_pos = output.pos;
+            z_res = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(z_res)) {
+                nb_bufs_push_printf(
+                    errors, 256, "nb_zstd_uncompress: ZSTD_decompressStream() error %s", ZSTD_getErrorName(z_res));
+                return -1;
+            }
+            if (input.pos == in_pos && output.pos == out_pos) {
+                nb_bufs_push_printf(
+                    errors, 256, "nb_zstd_uncompress: output exceeds uncompressed length %i", uncompressed_len);
+                return -1;
+            }
+        }
+    }
+
+    // a non zero hint means the frame was not fully decoded
+    if (z_res) {
+        nb_bufs_push_printf(
+            errors, 256, "nb_zstd_uncompress: truncated frame output %i", (int)output.pos);
+        return -1;
+    }
+
+    nb_bufs_truncate(&out, (int)output.pos);
+
+    DBG1("nb_zstd_uncompress: " << DVAL(dict_id) << DVAL(bufs->len) << DVAL(bufs->count) << DVAL(out.len) << DVAL(out.count));
+
+    nb_bufs_free(bufs);
+    *bufs = out;
+    nb_bufs_init(&out);
+    return 0;
+}
+
+// the maximal block size of zstd
+#define NB_ZSTD_STORE_BLOCK (128 * 1024)
+
+int
+nb_zstd_store(struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap, void* tap_arg)
+{
+    struct NB_Bufs out;
+    nb_bufs_init(&out);
+
+    const int len = bufs->len;
+    // empty input still needs one last block
+    const int blocks = len ? (len + NB_ZSTD_STORE_BLOCK - 1) / NB_ZSTD_STORE_BLOCK : 1;
+    struct NB_Buf* o = nb_bufs_push_alloc(&out, 4 + 1 + 4 + (3 * blocks) + len);
+    uint8_t* p = o->data;
+
+    // frame magic number little endian
+    *p++ = 0x28;
+    *p++ = 0xb5;
+    *p++ = 0x2f;
+    *p++ = 0xfd;
+    // frame header descriptor - single segment with 4 bytes of content size, no checksum and no dict id.
+    // a single segment frame has no window descriptor, the window is the content size.
+    *p++ = 0xa0;
+    *p++ = (uint8_t)len;
+    *p++ = (uint8_t)(len >> 8);
+    *p++ = (uint8_t)(len >> 16);
+    *p++ = (uint8_t)(len >> 24);
+
+    int pos = 0;
+    do {
+        const int n = len - pos < NB_ZSTD_STORE_BLOCK ? len - pos : NB_ZSTD_STORE_BLOCK;
+        // block header - last block bit, block type 0 (raw) and the block size, little endian
+        const uint32_t header = ((uint32_t)n << 3) | (pos + n >= len ? 1 : 0);
+        *p++ = (uint8_t)header;
+        *p++ = (uint8_t)(header >> 8);
+        *p++ = (uint8_t)(header >> 16);
+        nb_bufs_read_at(bufs, pos, p, n);
+        if (tap) tap(tap_arg, p, n);
+        p += n;
+        pos += n;
+    } while (pos < len);
+
+    nb_bufs_truncate(&out, p - o->data);
+    nb_bufs_free(bufs);
+    *bufs = out;
+    return 0;
+}
+}
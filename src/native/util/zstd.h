@@ -0,0 +1,45 @@
+/* Copyright (C) 2016 NooBaa */
+#pragma once
+
+#include "struct_buf.h"
+
+namespace noobaa
+{
+
+// level 0 means the zstd default level.
+// dict_id 0 means no dictionary, otherwise the dictionary must be loaded with nb_zstd_dict_load()
+int nb_zstd_compress(
+    struct NB_Bufs* bufs,
+    int level,
+    int dict_id,
+    struct NB_Bufs* errors,
+    NB_Bufs_Tap tap = 0,
+    void* tap_arg = 0);
+int nb_zstd_uncompress(struct NB_Bufs* bufs, int uncompressed_len, int dict_id, struct NB_Bufs* errors);
+// stores the data in raw blocks of a zstd frame, without compressing it.
+// raw blocks do not refer to a dictionary, so the frame decodes with or without one.
+int nb_zstd_store(
+    struct NB_Bufs* bufs, struct NB_Bufs* errors, NB_Bufs_Tap tap = 0, void* tap_arg = 0);
+
+// dictionaries are registered by the id that the chunk coder config refers to,
+// and since configs are immutable so are the dictionaries - loading a different
+// dictionary with an existing id fails, and loading the same one again is a no-op.
+int nb_zstd_dict_load(int dict_id, const uint8_t* data, int len, struct NB_Bufs* errors);
+bool nb_zstd_dict_unload(int dict_id);
+
+// trains a dictionary of up to dict_size bytes, every buf of samples is a single sample
+int nb_zstd_dict_train(
+    struct NB_Bufs* samples, int dict_size, struct NB_Bufs* dict, struct NB_Bufs* errors);
+
+struct NB_Zstd_Dict_Stats {
+    int dicts;
+    uint64_t dict_bytes;
+    // digested dictionaries, one per compression level in use and one for decompression
+    int cdicts;
+    int ddicts;
+    uint64_t compress;
+    uint64_t uncompress;
+};
+
+void nb_zstd_dict_stats(struct NB_Zstd_Dict_Stats* stats);
+}
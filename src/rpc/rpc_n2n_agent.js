@@ -15,6 +15,7 @@ const ssl_utils = require('../util/ssl_utils');
 const nb_native = require('../util/nb_native');
 const EventEmitter = require('events').EventEmitter;
 const RpcN2NConnection = require('./rpc_n2n');
+const RpcNudpConnection = require('./rpc_nudp');
 
 const N2N_CONFIG_PORT_PICK = ['min', 'max', 'port'];
 const N2N_CONFIG_FIELDS_PICK = [
@@ -106,7 +107,7 @@ class RpcN2NAgent extends EventEmitter {
             // callback to create and bind nudp socket
             // TODO implement nudp dtls
             udp_socket: (udp_port, dtls) => {
-                let nudp = new Nudp();
+                let nudp = new Nudp(RpcNudpConnection.nudp_options());
                 return P.ninvoke(nudp, 'bind', 0, '0.0.0.0').then(port => {
                     nudp.port = port;
                     return nudp;
@@ -3,6 +3,7 @@
 
 // let _ = require('lodash');
 // let P = require('../util/promise');
+let config = require('../../config');
 let RpcBaseConnection = require('./rpc_base_conn');
 let nb_native = require('../util/nb_native');
 // let dbg = require('../util/debug_module')(__filename);
@@ -24,7 +25,7 @@ class RpcNtcpConnection extends RpcBaseConnection {
      */
     _connect() {
         let Ntcp = nb_native().Ntcp;
-        this.ntcp = new Ntcp();
+        this.ntcp = new Ntcp({ mux: config.NTCP_MUX });
         this.ntcp.connect(this.url.port, this.url.hostname,
             () => this.emit('connect'));
         this._init_tcp();
@@ -58,7 +59,8 @@ class RpcNtcpConnection extends RpcBaseConnection {
             this.emit('error', closed_err);
         });
         ntcp.on('error', err => this.emit('error', err));
-        ntcp.on('message', msg => this.emit('message', [msg]));
+        // multiplexed messages arrive as the array of their chunks
+        ntcp.on('message', msg => this.emit('message', Array.isArray(msg) ? msg : [msg]));
     }
 
 }
@@ -5,6 +5,7 @@
 // const P = require('../util/promise');
 const url = require('url');
 const dbg = require('../util/debug_module')(__filename);
+const config = require('../../config');
 const nb_native = require('../util/nb_native');
 const EventEmitter = require('events').EventEmitter;
 const RpcNtcpConnection = require('./rpc_ntcp');
@@ -20,7 +21,7 @@ class RpcNtcpServer extends EventEmitter {
         super();
         this.protocol = (tls_options ? 'ntls:' : 'ntcp:');
         let Ntcp = nb_native().Ntcp;
-        this.server = new Ntcp();
+        this.server = new Ntcp({ mux: config.NTCP_MUX });
         this.server.on('connection', ntcp => this._on_connection(ntcp));
         this.server.on('close', err => {
                 dbg.log0('on close::', err);
@@ -3,6 +3,7 @@
 
 // let _ = require('lodash');
 let P = require('../util/promise');
+let config = require('../../config');
 // let url = require('url');
 let RpcBaseConnection = require('./rpc_base_conn');
 let nb_native = require('../util/nb_native');
@@ -19,9 +20,23 @@ class RpcNudpConnection extends RpcBaseConnection {
 
     // constructor(addr_url) { super(addr_url); }
 
+    /**
+     * the utp tuning of new nudp sockets, a connection can override it
+     * by setting this.nudp_options before connect or accept.
+     */
+    static nudp_options() {
+        return {
+            target_delay: config.NUDP_TARGET_DELAY_MICROS,
+            sndbuf: config.NUDP_SNDBUF,
+            rcvbuf: config.NUDP_RCVBUF,
+            autotune: config.NUDP_AUTOTUNE,
+            autotune_max_buf: config.NUDP_AUTOTUNE_MAX_BUF,
+        };
+    }
+
     _connect() {
         let Nudp = nb_native().Nudp;
-        this.nudp = new Nudp();
+        this.nudp = new Nudp(this.nudp_options || RpcNudpConnection.nudp_options());
         this._init_nudp();
         return P.ninvoke(this.nudp, 'bind', 0, '0.0.0.0')
             .then(port => P.ninvoke(this.nudp, 'connect', this.url.port, this.url.hostname))
@@ -43,7 +58,7 @@ class RpcNudpConnection extends RpcBaseConnection {
 
     accept(port) {
         let Nudp = nb_native().Nudp;
-        this.nudp = new Nudp();
+        this.nudp = new Nudp(this.nudp_options || RpcNudpConnection.nudp_options());
         this._init_nudp();
         return P.ninvoke(this.nudp, 'bind', port, '0.0.0.0')
             // TODO emit event from native code?
@@ -56,7 +71,8 @@ class RpcNudpConnection extends RpcBaseConnection {
         let nudp = this.nudp;
         nudp.on('close', () => this.emit('error', new Error('NUDP CLOSED')));
         nudp.on('error', err => this.emit('error', err));
-        nudp.on('message', msg => this.emit('message', [msg]));
+        // nudp emits every message as an array of pooled segment buffers
+        nudp.on('message', msg_buffers => this.emit('message', msg_buffers));
         nudp.on('stun', (buffer, rinfo) => console.log('STUN:', rinfo, buffer));
     }
 
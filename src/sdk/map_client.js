@@ -13,6 +13,7 @@ const config = require('../../config');
 const nb_native = require('../util/nb_native');
 const LRUCache = require('../util/lru_cache');
 const Semaphore = require('../util/semaphore');
+const chunk_coder_batch = require('../util/chunk_coder_batch');
 const KeysSemaphore = require('../util/keys_semaphore');
 const block_store_client = require('../agent/block_store_services/block_store_client').instance();
 
@@ -59,6 +60,33 @@ const chunk_read_cache = new LRUCache({
     },
 });
 
+// compression dictionaries are immutable per id, so each process fetches a dictionary
+// once and keeps it loaded in the native coder, concurrent callers share the same fetch
+/** @type {Map<number, Promise<void>>} */
+const compress_dicts_loading = new Map();
+
+/**
+ * Loads the compression dictionary of the config (if any) into the native coder
+ * @param {Object} rpc_client
+ * @param {nb.ChunkCoderConfig} chunk_coder_config
+ * @returns {Promise<void>}
+ */
+async function load_compress_dict(rpc_client, chunk_coder_config) {
+    const dict_id = chunk_coder_config && chunk_coder_config.compress_dict_id;
+    if (!dict_id) return;
+    let loading = compress_dicts_loading.get(dict_id);
+    if (!loading) {
+        loading = rpc_client.bucket.read_compress_dict({ dict_id })
+            .then(res => nb_native().chunk_coder_dict_load(dict_id, Buffer.from(res.dict_b64, 'base64')))
+            .catch(err => {
+                // let the next chunk retry
+                compress_dicts_loading.delete(dict_id);
+                throw err;
+            });
+        compress_dicts_loading.set(dict_id, loading);
+    }
+    return loading;
+}
 
 /**
  * @param {nb.Chunk[]} res_chunks
@@ -90,6 +118,7 @@ class MapClient {
      * @param {boolean} [props.verification_mode]
      * @param {Object} props.rpc_client
      * @param {string} [props.desc]
+     * @param {'high'|'normal'|'low'} [props.priority] class of the chunks coding in the native coder pool
      * @param { (block_md: nb.BlockMD, action: 'write'|'replicate'|'read', err: Error) => Promise<void> } props.report_error
      */
     constructor(props) {
@@ -104,7 +133,9 @@ class MapClient {
         this.desc = props.desc;
         this.report_error = props.report_error;
         this.had_errors = false;
+        this.had_write_errors = false;
         this.verification_mode = props.verification_mode || false;
+        this.coder_options = { priority: props.priority || 'normal' };
         Object.seal(this);
     }
 
@@ -179,7 +210,8 @@ class MapClient {
 
         if (chunk.dup_chunk_id) return chunk;
 
-        if (chunk.is_building_frags) {
+        const built_chunk = chunk.is_building_frags ? chunk : undefined;
+        if (built_chunk) {
             await this.read_chunk(chunk);
             await this.encode_chunk(chunk);
         }
@@ -203,9 +235,23 @@ class MapClient {
                 if (chunk.dup_chunk_id) return chunk;
             }
         }
+        // the rebuilt frags are written, the reallocated chunk shares their buffers
+        if (built_chunk) this.release_coded_buffers([built_chunk, chunk]);
         return chunk;
     }
 
+    /**
+     * Returns the pooled buffers of coded chunks (and all the chunks sharing them)
+     * to the native pool once their frags were written, instead of waiting for GC.
+     * Skipped after a failed write, since a timed out write might still hold its buffer.
+     * @param {Object[]} chunks
+     * @returns {number}
+     */
+    release_coded_buffers(chunks) {
+        if (this.had_write_errors) return 0;
+        return nb_native().chunk_coder_release(chunks);
+    }
+
     /**
      * @param {nb.Chunk} chunk 
      * @param {nb.Frag} frag 
@@ -256,6 +302,7 @@ class MapClient {
                 await this.write_block(block_md, buffer);
                 done = true;
             } catch (err) {
+                this.had_write_errors = true;
                 await this.report_error(block_md, 'write', err);
                 if (err.rpc_code === 'NO_BLOCK_STORE_SPACE') throw err;
                 retries += 1;
@@ -438,15 +485,13 @@ class MapClient {
     }
 
     async decode_chunk(chunk) {
-        await new Promise((resolve, reject) =>
-            nb_native().chunk_coder('dec', chunk, err => (err ? reject(err) : resolve()))
-        );
+        await load_compress_dict(this.rpc_client, chunk.chunk_coder_config);
+        await chunk_coder_batch.code_chunk('dec', chunk, this.coder_options);
     }
 
     async encode_chunk(chunk) {
-        await new Promise((resolve, reject) =>
-            nb_native().chunk_coder('enc', chunk, err => (err ? reject(err) : resolve()))
-        );
+        await load_compress_dict(this.rpc_client, chunk.chunk_coder_config);
+        await chunk_coder_batch.code_chunk('enc', chunk, this.coder_options);
     }
 
     /**
@@ -545,3 +590,4 @@ class MapClient {
 }
 
 exports.MapClient = MapClient;
+exports.load_compress_dict = load_compress_dict;
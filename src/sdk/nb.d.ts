@@ -9,7 +9,7 @@ type SensitiveString = import('../util/sensitive_string');
 type BigInt = number | { n: number; peta: number; };
 type Region = string;
 type DigestType = 'sha1' | 'sha256' | 'sha384' | 'sha512';
-type CompressType = 'snappy' | 'zlib';
+type CompressType = 'snappy' | 'zlib' | 'zstd' | 'lz4';
 type CipherType = 'aes-256-gcm';
 type ParityType = 'isa-c1' | 'isa-rs' | 'cm256';
 type ResourceType = 'HOSTS' | 'CLOUD' | 'INTERNAL';
@@ -197,6 +197,8 @@ interface ChunkCoderConfig {
     digest_type: DigestType;
     frag_digest_type: DigestType;
     compress_type: CompressType;
+    compress_level?: number;
+    compress_dict_id?: number;
     cipher_type: CipherType;
     data_frags: number;
     parity_frags: number;
@@ -513,6 +515,14 @@ interface ChunkSchemaDB {
     objects?: any[]; // see MDStore.load_parts_objects_for_chunks()
 }
 
+interface CompressDictSchemaDB {
+    _id: ID;
+    system: ID;
+    bucket: ID;
+    dict_id: number;
+    dict: DBBuffer;
+}
+
 interface FragSchemaDB {
     _id: ID;
     data_index?: number;
@@ -17,7 +17,7 @@ const ChunkSplitter = require('../util/chunk_splitter');
 const CoalesceStream = require('../util/coalesce_stream');
 const ChunkedContentDecoder = require('../util/chunked_content_decoder');
 
-const { MapClient } = require('./map_client');
+const { MapClient, load_compress_dict } = require('./map_client');
 const { ChunkAPI } = require('./map_api_types');
 const { RpcError } = require('../rpc');
 
@@ -333,6 +333,8 @@ class ObjectIO {
         params.desc = _.pick(params, 'obj_id', 'num', 'bucket', 'key');
         dbg.log0('UPLOAD:', params.desc, 'streaming to', params.bucket, params.key);
 
+        await load_compress_dict(params.client, params.chunk_coder_config);
+
         // start and seq are set to zero even for multiparts and will be fixed
         // when multiparts are combined to object in complete_object_upload
         params.start = 0;
@@ -347,6 +349,7 @@ class ObjectIO {
             watermark: 50,
             calc_md5: true,
             calc_sha256: Boolean(params.sha256_b64),
+            digest_thread: params.size >= config.CHUNK_SPLIT_DIGEST_THREAD_MIN_SIZE,
             chunk_split_config: params.chunk_split_config,
         });
 
@@ -356,6 +359,8 @@ class ObjectIO {
             concurrency: 20,
             coder: 'enc',
             chunk_coder_config: params.chunk_coder_config,
+            // client I/O goes ahead of background rebuilds in the native coder pool
+            priority: 'high',
             // TODO: Load the key from KMS as well
             cipher_key_b64: params.encryption && params.encryption.key_b64
         });
@@ -444,10 +449,13 @@ class ObjectIO {
                 check_dups: !is_using_encryption,
                 rpc_client: params.client,
                 desc: params.desc,
+                priority: 'high',
                 report_error: (block_md, action, err) => this._report_error_on_object_upload(params, block_md, action, err),
             });
             await mc.run();
             if (mc.had_errors) throw new Error('Upload map errors');
+            // the frags are written, give their buffers back to the coder pool
+            mc.release_coded_buffers(chunks);
             return callback();
         } catch (err) {
             dbg.error('UPLOAD: _upload_chunks', err.stack || err);
@@ -603,6 +611,7 @@ class ObjectIO {
             location_info: this.location_info,
             rpc_client: params.client,
             verification_mode: this._verification_mode,
+            priority: 'high',
             report_error: (block_md, action, err) => this._report_error_on_object_read(params, block_md, err),
         });
         await mc.run_read_object();
@@ -0,0 +1,68 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+/** @typedef {typeof import('../../sdk/nb')} nb */
+
+const _ = require('lodash');
+
+const P = require('../../util/promise');
+const dbg = require('../../util/debug_module')(__filename);
+const config = require('../../../config');
+const nb_native = require('../../util/nb_native');
+const MDStore = require('./md_store').MDStore;
+const map_server = require('./map_server');
+const server_rpc = require('../server_rpc');
+const auth_server = require('../common_services/auth_server');
+const { RpcError } = require('../../rpc');
+const { ChunkDB } = require('./map_db_types');
+const { MapClient } = require('../../sdk/map_client');
+
+/**
+ * Trains a compression dictionary for the bucket from a sample of its newest small chunks.
+ * The chunks are read and decoded like a normal read, and chunks that cannot be decoded
+ * by the server (e.g. SSE-C) are left out of the sample.
+ * @param {nb.Bucket} bucket
+ * @param {number} dict_size
+ * @returns {Promise<{ dict: Buffer, samples: number, sample_bytes: number }>}
+ */
+async function train_compress_dict(bucket, dict_size) {
+    const chunks_db = await MDStore.instance().find_chunks_sample_by_bucket(
+        bucket,
+        config.CHUNK_CODER_COMPRESS_DICT_SAMPLE_MAX_SIZE,
+        config.CHUNK_CODER_COMPRESS_DICT_SAMPLES
+    );
+    /** @type {nb.Chunk[]} */
+    const chunks = chunks_db.map(chunk_db => new ChunkDB(chunk_db));
+    await map_server.prepare_chunks({ chunks });
+
+    const mc = new MapClient({
+        chunks,
+        rpc_client: server_rpc.rpc.new_client({
+            auth_token: auth_server.make_auth_token({
+                system_id: bucket.system._id,
+                role: 'admin',
+            })
+        }),
+        desc: 'CompressDictTrainer',
+        priority: 'low',
+        report_error: async () => {
+            // nothing to report, unreadable chunks are just left out of the sample
+        },
+    });
+    await mc.read_chunks();
+
+    const samples = chunks.filter(chunk => !chunk.had_errors && chunk.data).map(chunk => chunk.data);
+    const sample_bytes = _.sumBy(samples, 'length');
+    dbg.log0('train_compress_dict:', bucket.name,
+        'chunks', chunks.length, 'samples', samples.length, 'sample_bytes', sample_bytes);
+    if (!samples.length) {
+        throw new RpcError('BAD_REQUEST', `No chunks to sample for compress dict in bucket ${bucket.name}`);
+    }
+
+    /** @type {Buffer} */
+    const dict = await P.fromCallback(callback =>
+        nb_native().chunk_coder_dict_train({ samples, dict_size }, callback));
+    return { dict, samples: samples.length, sample_bytes };
+}
+
+exports.train_compress_dict = train_compress_dict;
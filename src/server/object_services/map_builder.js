@@ -182,6 +182,8 @@ class MapBuilder {
                 })
             }),
             desc: 'MapBuilder',
+            // rebuilds must not delay the client reads and writes
+            priority: 'low',
             report_error: async () => {
                 // TODO MApClient.report_error
             },
@@ -24,6 +24,8 @@ const data_chunk_schema = require('./schemas/data_chunk_schema');
 const data_chunk_indexes = require('./schemas/data_chunk_indexes');
 const data_block_schema = require('./schemas/data_block_schema');
 const data_block_indexes = require('./schemas/data_block_indexes');
+const compress_dict_schema = require('./schemas/compress_dict_schema');
+const compress_dict_indexes = require('./schemas/compress_dict_indexes');
 const config = require('../../../config');
 
 
@@ -58,6 +60,11 @@ class MDStore {
         this._sequences = mongo_client.instance().define_collection({
             name: 'mdsequences' + test_suffix,
         });
+        this._compress_dicts = mongo_client.instance().define_collection({
+            name: 'compressdicts' + test_suffix,
+            schema: compress_dict_schema,
+            db_indexes: compress_dict_indexes,
+        });
     }
 
     /**
@@ -1291,6 +1298,87 @@ class MDStore {
         return chunks;
     }
 
+    /**
+     * Returns the newest chunks of the bucket up to max_size (uncompressed) with their blocks,
+     * which is what a compression dictionary for the bucket should be trained on.
+     * @param {nb.Bucket} bucket
+     * @param {number} max_size
+     * @param {number} limit
+     * @returns {Promise<nb.ChunkSchemaDB[]>}
+     */
+    async find_chunks_sample_by_bucket(bucket, max_size, limit) {
+        /** @type {nb.ChunkSchemaDB[]} */
+        const chunks = await this._chunks.col().find({
+                system: bucket.system._id,
+                bucket: bucket._id,
+                size: { $lte: max_size },
+                deleted: null,
+            }, {
+                sort: {
+                    _id: -1 // get newer chunks first
+                },
+                limit,
+            })
+            .toArray();
+        await this.load_blocks_for_chunks(chunks);
+        return chunks;
+    }
+
+    ////////////////////
+    // COMPRESS DICTS //
+    ////////////////////
+
+    /**
+     * dictionaries are kept out of the system store since every process loads the system store,
+     * while only the coders of chunks that use a dictionary need it, and fetch it once by id.
+     * the dict_id is allocated here as the next id of the system - the unique index on
+     * {system, dict_id} makes concurrent inserts that picked the same id retry with the next one.
+     * @param {Omit<nb.CompressDictSchemaDB, 'dict_id'>} compress_dict
+     * @returns {Promise<number>} the allocated dict_id
+     */
+    async insert_compress_dict(compress_dict) {
+        for (;;) {
+            const last = await this._compress_dicts.col().findOne({ system: compress_dict.system }, {
+                sort: { system: 1, dict_id: -1 },
+                projection: { dict_id: 1 },
+            });
+            const dict_id = last ? last.dict_id + 1 : 1;
+            const doc = { ...compress_dict, dict_id };
+            this._compress_dicts.validate(doc);
+            try {
+                await this._compress_dicts.col().insertOne(doc);
+                return dict_id;
+            } catch (err) {
+                if (!mongo_utils.is_err_duplicate_key(err)) throw err;
+                dbg.log0('insert_compress_dict: dict_id taken, retrying', dict_id);
+            }
+        }
+    }
+
+    /**
+     * only for dictionaries that no chunk config refers to yet (a train that failed to commit)
+     * @param {nb.ID} system_id
+     * @param {number} dict_id
+     */
+    async delete_compress_dict(system_id, dict_id) {
+        await this._compress_dicts.col().deleteOne({
+            system: system_id,
+            dict_id,
+        });
+    }
+
+    /**
+     * @param {nb.ID} system_id
+     * @param {number} dict_id
+     * @returns {Promise<nb.CompressDictSchemaDB>}
+     */
+    find_compress_dict(system_id, dict_id) {
+        return this._compress_dicts.col().findOne({
+            system: system_id,
+            dict_id,
+        });
+    }
+
     iterate_all_chunks_in_buckets(lower_marker, upper_marker, buckets, limit) {
         return this._chunks.col().find(compact({
                 _id: lower_marker ? compact({
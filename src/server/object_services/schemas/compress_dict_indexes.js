@@ -0,0 +1,12 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+module.exports = [{
+    fields: {
+        system: 1,
+        dict_id: 1,
+    },
+    options: {
+        unique: true,
+    }
+}];
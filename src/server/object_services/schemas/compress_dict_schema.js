@@ -0,0 +1,40 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+module.exports = {
+    id: 'compress_dict_schema',
+    type: 'object',
+    required: [
+        '_id',
+        'system',
+        'bucket',
+        'dict_id',
+        'dict',
+    ],
+    properties: {
+
+        _id: {
+            objectid: true
+        },
+
+        system: {
+            objectid: true
+        },
+
+        // the bucket that the dictionary was trained on,
+        // reading the dictionary requires permission on this bucket
+        bucket: {
+            objectid: true
+        },
+
+        // chunk_coder_config.compress_dict_id of the chunk configs that compress with it.
+        // a retrained dictionary gets a new id, so like the configs
+        // the dictionary must never change once chunks were written with it.
+        dict_id: {
+            type: 'integer'
+        },
+
+        dict: { binary: true },
+
+    }
+};
@@ -27,6 +27,20 @@ module.exports = [{
             }
         }
     },
+    {
+        // find_chunks_sample_by_bucket() - the newest chunks of the bucket
+        fields: {
+            bucket: 1,
+            _id: -1,
+        },
+        options: {
+            unique: false,
+            partialFilterExpression: {
+                deleted: null,
+                bucket: { $exists: true },
+            }
+        }
+    },
     {
         // aggregate_chunks_by_delete_dates()
         fields: {
@@ -33,6 +33,7 @@ const system_utils = require('../utils/system_utils');
 const azure_storage = require('../../util/azure_storage_wrap');
 const usage_aggregator = require('../bg_services/usage_aggregator');
 const chunk_config_utils = require('../utils/chunk_config_utils');
+const compress_dict_trainer = require('../object_services/compress_dict_trainer');
 const NetStorage = require('../../util/NetStorageKit-Node-master/lib/netstorage');
 const { OP_NAME_TO_ACTION } = require('../../endpoint/s3/s3_utils');
 
@@ -458,6 +459,87 @@ async function read_bucket_sdk_info(req) {
     return reply;
 }
 
+/**
+ *
+ * TRAIN_BUCKET_COMPRESS_DICT
+ *
+ * trains a new version of the compression dictionary of the bucket and switches the tiers
+ * of the bucket to new chunk configs that compress with it. the previous configs and their
+ * dictionaries are kept since existing chunks still refer to them.
+ *
+ */
+async function train_bucket_compress_dict(req) {
+    dbg.log0('train_bucket_compress_dict:', req.rpc_params);
+    const bucket = find_bucket(req);
+    if (!bucket.tiering) {
+        throw new RpcError('BAD_REQUEST', 'Cannot train compress dict for namespace bucket ' + bucket.name);
+    }
+    const dict_size = req.rpc_params.dict_size || config.CHUNK_CODER_COMPRESS_DICT_SIZE;
+    const { dict, samples, sample_bytes } = await compress_dict_trainer.train_compress_dict(bucket, dict_size);
+
+    // tiers with different coding get their own config, all with the same dictionary and id.
+    // the dictionary is inserted (which allocates its id) before any config refers to it,
+    // and deleted if the configs fail to commit so it does not linger unreferenced.
+    const dict_id = await MDStore.instance().insert_compress_dict({
+        _id: MDStore.instance().make_md_id(),
+        system: req.system._id,
+        bucket: bucket._id,
+        dict,
+    });
+    const chunk_configs = new Map();
+    const changes = { insert: { chunk_configs: [] }, update: { tiers: [] } };
+    for (const { tier } of bucket.tiering.tiers) {
+        let chunk_config = chunk_configs.get(tier.chunk_config);
+        if (!chunk_config) {
+            chunk_config = chunk_config_utils.new_compress_dict_chunk_config(tier.chunk_config, dict_id);
+            chunk_config._id = system_store.new_system_store_id();
+            chunk_configs.set(tier.chunk_config, chunk_config);
+            changes.insert.chunk_configs.push(chunk_config);
+        }
+        changes.update.tiers.push({ _id: tier._id, chunk_config: chunk_config._id });
+    }
+    try {
+        await system_store.make_changes(changes);
+    } catch (err) {
+        dbg.error('train_bucket_compress_dict: failed to commit the chunk configs, deleting dict', dict_id, err);
+        await MDStore.instance().delete_compress_dict(req.system._id, dict_id);
+        throw err;
+    }
+
+    dbg.log0('train_bucket_compress_dict:', bucket.name, 'compress_dict_id', dict_id, 'dict_size', dict.length);
+    return {
+        compress_dict_id: dict_id,
+        dict_size: dict.length,
+        samples,
+        sample_bytes,
+    };
+}
+
+/**
+ *
+ * READ_COMPRESS_DICT
+ *
+ * a dictionary holds samples of the bucket data, so accounts must have access
+ * to the bucket it was trained on. internal tokens (no account) may read any.
+ *
+ */
+async function read_compress_dict(req) {
+    const { dict_id } = req.rpc_params;
+    const compress_dict = await MDStore.instance().find_compress_dict(req.system._id, dict_id);
+    if (!compress_dict) {
+        throw new RpcError('NOT_FOUND', 'No such compress dict: ' + dict_id);
+    }
+    if (req.account) {
+        const bucket = system_store.data.get_by_id(compress_dict.bucket);
+        if (!bucket) throw new RpcError('UNAUTHORIZED', 'No permission to read compress dict: ' + dict_id);
+        req.check_bucket_permission(bucket);
+    }
+    return {
+        dict_id,
+        dict_b64: compress_dict.dict.toString('base64'),
+    };
+}
+
 /**
  *
  * UPDATE_BUCKET
@@ -1735,6 +1817,8 @@ exports.delete_bucket_lifecycle = delete_bucket_lifecycle;
 exports.set_bucket_lifecycle_configuration_rules = set_bucket_lifecycle_configuration_rules;
 exports.get_bucket_lifecycle_configuration_rules = get_bucket_lifecycle_configuration_rules;
 exports.read_bucket_sdk_info = read_bucket_sdk_info;
+exports.train_bucket_compress_dict = train_bucket_compress_dict;
+exports.read_compress_dict = read_compress_dict;
 exports.list_buckets = list_buckets;
 exports.update_buckets = update_buckets;
 //exports.generate_bucket_access = generate_bucket_access;
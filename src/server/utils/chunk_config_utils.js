@@ -9,6 +9,7 @@ function new_chunk_code_config_defaults(chunk_coder_config) {
             digest_type: config.CHUNK_CODER_DIGEST_TYPE,
             frag_digest_type: config.CHUNK_CODER_FRAG_DIGEST_TYPE,
             compress_type: config.CHUNK_CODER_COMPRESS_TYPE,
+            compress_level: config.CHUNK_CODER_COMPRESS_LEVEL,
             cipher_type: config.CHUNK_CODER_CIPHER_TYPE,
             ...chunk_coder_config
         },
@@ -46,8 +47,11 @@ function resolve_chunk_config(chunk_coder_config, account, system) {
 
     // Look for an existing config item in the system store
     // by matching the properties of the coder config
-    const existing_chunk_config = _.find(system.chunk_configs_by_id,
-        _.matches({ chunk_coder_config: chunk_coder_config_full }));
+    // a config with a compression dictionary is only reused when that dictionary was asked for,
+    // otherwise the partial match would hand it to any config that did not mention a dictionary
+    const existing_chunk_config = _.find(system.chunk_configs_by_id, chunk_config =>
+        chunk_config.chunk_coder_config.compress_dict_id === chunk_coder_config_full.compress_dict_id &&
+        _.isMatch(chunk_config, { chunk_coder_config: chunk_coder_config_full }));
 
     if (existing_chunk_config) return existing_chunk_config;
 
@@ -60,5 +64,27 @@ function resolve_chunk_config(chunk_coder_config, account, system) {
     return insert_chunk_config;
 }
 
+/**
+ * Returns a new chunk config that compresses with zstd and the given dictionary id,
+ * keeping the rest of the coding (digests, cipher, replicas/EC) of the current config.
+ * the dictionary itself is kept in the md store (see MDStore.insert_compress_dict).
+ * @param {nb.ChunkConfig} chunk_config
+ * @param {number} dict_id
+ */
+function new_compress_dict_chunk_config(chunk_config, dict_id) {
+    const ccc = chunk_config.chunk_coder_config;
+    return {
+        system: chunk_config.system,
+        chunk_coder_config: _.omitBy({
+            ...ccc,
+            compress_type: 'zstd',
+            // the level is meaningful only if the config was already zstd
+            compress_level: ccc.compress_type === 'zstd' ? ccc.compress_level : undefined,
+            compress_dict_id: dict_id,
+        }, _.isUndefined),
+    };
+}
+
 exports.new_chunk_code_config_defaults = new_chunk_code_config_defaults;
 exports.resolve_chunk_config = resolve_chunk_config;
+exports.new_compress_dict_chunk_config = new_compress_dict_chunk_config;
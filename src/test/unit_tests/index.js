@@ -18,6 +18,8 @@ require('./test_lru');
 require('./test_prefetch');
 require('./test_promise_utils');
 require('./test_rpc');
+require('./test_nudp');
+require('./test_ntcp');
 require('./test_semaphore');
 require('./test_fs_utils');
 require('./test_signature_utils');
@@ -4,6 +4,7 @@
 const _ = require('lodash');
 const mocha = require('mocha');
 const stream = require('stream');
+const zlib = require('zlib');
 const crypto = require('crypto');
 const Chance = require('chance');
 const assert = require('assert');
@@ -14,10 +15,12 @@ const Pipeline = require('../../util/pipeline');
 const nb_native = require('../../util/nb_native');
 const RandStream = require('../../util/rand_stream');
 const ChunkCoder = require('../../util/chunk_coder');
+const chunk_coder_batch = require('../../util/chunk_coder_batch');
 const ChunkEraser = require('../../util/chunk_eraser');
 const Speedometer = require('../../util/speedometer');
 const FlattenStream = require('../../util/flatten_stream');
 const ChunkSplitter = require('../../util/chunk_splitter');
+const { MapClient } = require('../../sdk/map_client');
 
 const chance = new Chance();
 
@@ -49,6 +52,8 @@ const FRAG_DIGEST_TYPES = [
 const COMPRESS_TYPES = [
     'snappy',
     'zlib',
+    'zstd',
+    'lz4',
     undefined,
 ];
 const CIPHER_TYPES = [
@@ -247,8 +252,760 @@ mocha.describe('nb_native chunk_coder', function() {
             });
         });
     });
+
+    mocha.describe('lrc', function() {
+
+        const lrc_config = {
+            digest_type: 'sha384',
+            frag_digest_type: 'sha1',
+            compress_type: 'snappy',
+            cipher_type: 'aes-256-gcm',
+            data_frags: 8,
+            parity_frags: 4,
+            parity_type: 'isa-c1',
+            lrc_group: 4,
+            lrc_frags: 1,
+        };
+
+        mocha.it('encodes-local-parity-frags', function() {
+            const chunk = prepare_chunk(lrc_config);
+            const lrc_frags = chunk.frags.filter(frag => frag.lrc_index >= 0);
+            assert.deepStrictEqual(lrc_frags.map(_frag_index), ['L0', 'L1', 'L2']);
+            call_chunk_coder_must_succeed('dec', chunk);
+        });
+
+        mocha.it('repairs-from-local-group-without-global-parity', function() {
+            const chunk = prepare_chunk(lrc_config);
+            pull_frags(chunk, ['D1', 'D6', 'P0', 'P1', 'P2', 'P3']);
+            call_chunk_coder_must_succeed('dec', chunk);
+        });
+
+        mocha.it('repairs-global-parity-locally-to-complete-decode', function() {
+            const chunk = prepare_chunk(lrc_config);
+            // group 0 is lost entirely and P0 can only be recovered from its local group
+            pull_frags(chunk, ['D0', 'D1', 'D2', 'D3', 'P0']);
+            call_chunk_coder_must_succeed('dec', chunk);
+        });
+
+        mocha.it('fails-when-local-and-global-parity-are-not-enough', function() {
+            const chunk = prepare_chunk(lrc_config);
+            pull_frags(chunk, ['D0', 'D1', 'P0', 'P1', 'P2', 'P3']);
+            call_chunk_coder_must_fail('dec', chunk);
+        });
+
+        mocha.it('repairs-from-local-group-with-lrc-type-isa-rs', function() {
+            const rs_config = { ...lrc_config, lrc_type: 'isa-rs' };
+            const chunk = prepare_chunk(rs_config);
+            const c1_chunk = prepare_chunk(lrc_config, chunk);
+            const lrc_data = c => c.frags.filter(frag => frag.lrc_index >= 0).map(frag => frag.data);
+            assert.notDeepStrictEqual(lrc_data(chunk), lrc_data(c1_chunk));
+            pull_frags(chunk, ['D1', 'D6', 'P0', 'P1', 'P2', 'P3']);
+            call_chunk_coder_must_succeed('dec', chunk);
+        });
+
+        mocha.it('rejects-unsupported-lrc-type', function() {
+            const chunk = {
+                data: crypto.randomBytes(SP_A),
+                size: SP_A,
+                chunk_coder_config: { ...lrc_config, lrc_type: 'cm256' },
+            };
+            call_chunk_coder_must_fail('enc', chunk);
+            assert(chunk.errors[0].startsWith('Chunk Encoder: unsupported lrc type cm256'),
+                'expected error: unsupported lrc type. got: ' + chunk.errors[0]);
+        });
+
+        mocha.it('digests-more-frags-than-the-max-total-frags', function() {
+            // 32+32 global frags plus 8 groups of 2 local frags takes the count above 64
+            const wide_config = { ...lrc_config, data_frags: 32, parity_frags: 32, lrc_group: 8, lrc_frags: 2 };
+            const chunk = prepare_chunk(wide_config);
+            assert.strictEqual(chunk.frags.length, 80);
+            for (const frag of chunk.frags) {
+                const digest_b64 = crypto.createHash(wide_config.frag_digest_type).update(frag.data).digest('base64');
+                assert.strictEqual(frag.digest_b64, digest_b64, _frag_index(frag));
+            }
+            pull_frags(chunk, ['D1', 'D9', 'P0', 'P1']);
+            call_chunk_coder_must_succeed('dec', chunk);
+        });
+    });
+
+    mocha.describe('multi-buffer frag digests', function() {
+
+        ['md5', 'sha1', 'sha256', 'sha512', 'sha384'].forEach(frag_digest_type => {
+            mocha.it(`matches-node-crypto-${frag_digest_type}`, function() {
+                const chunk = prepare_chunk({
+                    frag_digest_type,
+                    data_frags: 8,
+                    parity_frags: 4,
+                    parity_type: 'isa-c1',
+                });
+                chunk.frags.forEach(frag => {
+                    const digest_b64 = crypto.createHash(frag_digest_type).update(frag.data).digest('base64');
+                    assert.strictEqual(frag.digest_b64, digest_b64);
+                });
+                pull_frags(chunk, ['D3', 'P1']);
+                call_chunk_coder_must_succeed('dec', chunk);
+            });
+        });
+    });
+
+    mocha.describe('cipher', function() {
+
+        [
+            { cipher_type: 'aes-256-gcm', key_len: 32, iv_len: 12 },
+            { cipher_type: 'aes-128-gcm', key_len: 16, iv_len: 12 },
+            { cipher_type: 'aes-256-ctr', key_len: 32, iv_len: 16 },
+        ].forEach(({ cipher_type, key_len, iv_len }) => {
+            mocha.it(`matches-node-crypto-${cipher_type}`, function() {
+                const cipher_key = crypto.randomBytes(key_len);
+                const cipher_iv = crypto.randomBytes(iv_len);
+                const chunk = prepare_chunk({ cipher_type, data_frags: 1, parity_frags: 0 }, {
+                    original: crypto.randomBytes(10000),
+                    cipher_key_b64: cipher_key.toString('base64'),
+                    cipher_iv_b64: cipher_iv.toString('base64'),
+                });
+                const encrypted = crypto.createCipheriv(cipher_type, cipher_key, cipher_iv).update(chunk.original);
+                assert(chunk.frags[0].data.slice(0, encrypted.length).equals(encrypted));
+                call_chunk_coder_must_succeed('dec', chunk);
+                assert(chunk.data.equals(chunk.original));
+            });
+        });
+
+        // odd buffer lengths split the cipher updates at non block boundaries within and across frags,
+        // and a random key chunk in between switches the keys of the thread context
+        [
+            { cipher_type: 'aes-256-gcm', key_len: 32, iv_len: 12 },
+            { cipher_type: 'aes-128-gcm', key_len: 16, iv_len: 12 },
+            { cipher_type: 'aes-256-ctr', key_len: 32, iv_len: 16 },
+        ].forEach(({ cipher_type, key_len, iv_len }) => {
+            mocha.it(`matches-node-crypto-multi-buffer-${cipher_type}`, function() {
+                nb_native().chunk_coder_gcm_auth_tag(true);
+                const is_gcm = cipher_type.endsWith('-gcm');
+                const cipher_key = crypto.randomBytes(key_len);
+                const coder_config = { cipher_type, data_frags: 4, parity_frags: 2, parity_type: 'isa-c1' };
+                const encode = (original, key) => {
+                    const chunk = {
+                        data: [],
+                        original,
+                        size: original.length,
+                        chunk_coder_config: coder_config,
+                    };
+                    let pos = 0;
+                    for (const len of [1, 15, 17, 33, 4095, 5, 10001, 7]) {
+                        chunk.data.push(original.slice(pos, pos + len));
+                        pos += len;
+                    }
+                    chunk.data.push(original.slice(pos));
+                    if (key) {
+                        chunk.cipher_key_b64 = key.toString('base64');
+                        chunk.cipher_iv_b64 = crypto.randomBytes(iv_len).toString('base64');
+                    }
+                    call_chunk_coder_must_succeed('enc', chunk);
+                    return chunk;
+                };
+                for (let i = 0; i < 3; ++i) {
+                    const chunk = encode(crypto.randomBytes(30000 + i), cipher_key);
+                    const other = encode(crypto.randomBytes(20000), null);
+                    const frags = _.sortBy(chunk.frags.filter(f => f.data_index >= 0), 'data_index');
+                    const encrypted = Buffer.concat(frags.map(f => f.data));
+                    const plain = Buffer.concat([chunk.original, Buffer.alloc(encrypted.length - chunk.size)]);
+                    const cipher = crypto.createCipheriv(
+                        cipher_type, cipher_key, Buffer.from(chunk.cipher_iv_b64, 'base64'));
+                    assert(Buffer.concat([cipher.update(plain), cipher.final()]).equals(encrypted));
+                    if (is_gcm) {
+                        assert.strictEqual(chunk.cipher_auth_tag_b64, cipher.getAuthTag().toString('base64'));
+                    }
+                    for (const c of [chunk, other]) {
+                        c.data = null;
+                        pull_frags(c, ['D1', 'D2']);
+                        call_chunk_coder_must_succeed('dec', c);
+                    }
+                }
+            });
+        });
+
+        const tag_config = {
+            digest_type: 'sha384',
+            cipher_type: 'aes-256-gcm',
+            data_frags: 4,
+            parity_frags: 2,
+            parity_type: 'isa-c1',
+        };
+
+        let saved_auth_tag;
+        mocha.before(function() {
+            saved_auth_tag = nb_native().chunk_coder_gcm_auth_tag();
+        });
+        mocha.after(function() {
+            nb_native().chunk_coder_gcm_auth_tag(saved_auth_tag);
+        });
+
+        mocha.it('verifies-auth-tag-instead-of-chunk-digest', function() {
+            nb_native().chunk_coder_gcm_auth_tag(true);
+            const chunk = prepare_chunk(tag_config);
+            assert.strictEqual(Buffer.from(chunk.cipher_auth_tag_b64, 'base64').length, 16);
+            const { cipher } = nb_native().chunk_coder_stats();
+            pull_frags(chunk, ['D1', 'P0']);
+            call_chunk_coder_must_succeed('dec', chunk);
+            assert(chunk.data.equals(chunk.original));
+            const stats = nb_native().chunk_coder_stats().cipher;
+            assert.strictEqual(stats.auth_tags_verified, cipher.auth_tags_verified + 1);
+            assert.strictEqual(stats.digest_skips, cipher.digest_skips + 1);
+        });
+
+        mocha.it('detects-mismatch-auth-tag', function() {
+            nb_native().chunk_coder_gcm_auth_tag(true);
+            const chunk = prepare_chunk(tag_config);
+            const tag = Buffer.from(chunk.cipher_auth_tag_b64, 'base64');
+            tag.writeUInt8((tag.readUInt8(0) + 1) % 256, 0);
+            chunk.cipher_auth_tag_b64 = tag.toString('base64');
+            call_chunk_coder_must_fail('dec', chunk);
+            assert(chunk.errors[0].startsWith('Chunk Decoder: cipher decrypt final failed'),
+                'expected error: cipher decrypt final failed. got: ' + chunk.errors[0]);
+        });
+
+        mocha.it('decodes-chunks-without-auth-tag-by-chunk-digest', function() {
+            nb_native().chunk_coder_gcm_auth_tag(false);
+            const chunk = prepare_chunk(tag_config);
+            assert.strictEqual(chunk.cipher_auth_tag_b64, undefined);
+            nb_native().chunk_coder_gcm_auth_tag(true);
+            const { cipher } = nb_native().chunk_coder_stats();
+            call_chunk_coder_must_succeed('dec', chunk);
+            assert(chunk.data.equals(chunk.original));
+            assert.strictEqual(nb_native().chunk_coder_stats().cipher.digest_skips, cipher.digest_skips);
+        });
+    });
+
+    mocha.describe('coder pool', function() {
+
+        const pool_config = {
+            digest_type: 'sha384',
+            frag_digest_type: 'sha1',
+            compress_type: 'snappy',
+            cipher_type: 'aes-256-gcm',
+            data_frags: 4,
+            parity_frags: 2,
+            parity_type: 'isa-c1',
+        };
+
+        let saved_nthreads;
+        mocha.before(function() {
+            saved_nthreads = nb_native().chunk_coder_pool_threads();
+            nb_native().chunk_coder_pool_threads(3);
+        });
+        mocha.after(function() {
+            nb_native().chunk_coder_pool_threads(saved_nthreads);
+        });
+
+        mocha.it('codes-a-batch-with-one-callback', async function() {
+            const chunks = _.times(20, () => ({
+                data: crypto.randomBytes(SP_I),
+                size: SP_I,
+                chunk_coder_config: pool_config,
+            }));
+            const originals = chunks.map(chunk => chunk.data);
+            const stats1 = nb_native().chunk_coder_stats().pool;
+            await chunk_coder_async('enc', chunks);
+            const stats2 = nb_native().chunk_coder_stats().pool;
+            assert.strictEqual(stats2.threads, 3);
+            assert.strictEqual(stats2.batches, stats1.batches + 1);
+            assert.strictEqual(stats2.chunks, stats1.chunks + chunks.length);
+            chunks.forEach(chunk => {
+                chunk.data = null;
+                pull_frags(chunk, ['D1']);
+            });
+            await chunk_coder_async('dec', chunks);
+            chunks.forEach((chunk, i) => assert.deepStrictEqual(chunk.data, originals[i]));
+        });
+
+        mocha.it('batches-chunks-coded-in-the-same-tick', async function() {
+            const chunks = _.times(10, () => ({
+                data: crypto.randomBytes(SP_I),
+                size: SP_I,
+                chunk_coder_config: pool_config,
+            }));
+            const originals = chunks.map(chunk => chunk.data);
+            const stats1 = nb_native().chunk_coder_stats().pool;
+            await Promise.all(chunks.map(chunk => chunk_coder_batch.code_chunk('enc', chunk)));
+            const stats2 = nb_native().chunk_coder_stats().pool;
+            assert.strictEqual(stats2.batches, stats1.batches + 1);
+            assert.strictEqual(stats2.chunks, stats1.chunks + chunks.length);
+            chunks.forEach(chunk => {
+                chunk.data = null;
+            });
+            // only the chunk that cannot be decoded fails, the rest of its batch succeeds
+            pull_frags(chunks[3], ['D0', 'D1', 'D2']);
+            const results = await Promise.all(chunks.map(chunk =>
+                chunk_coder_batch.code_chunk('dec', chunk).then(() => null, err => err)));
+            results.forEach((err, i) => {
+                if (i === 3) {
+                    assert.strictEqual(err.message, 'had chunk errors');
+                    assert.deepStrictEqual(err.chunks, [chunks[3]]);
+                } else {
+                    assert.strictEqual(err, null);
+                    assert.deepStrictEqual(chunks[i].data, originals[i]);
+                }
+            });
+        });
+
+        mocha.it('codes-by-priority-class', async function() {
+            const make_chunks = () => _.times(10, () => ({
+                data: crypto.randomBytes(SP_I),
+                size: SP_I,
+                chunk_coder_config: pool_config,
+            }));
+            const stats1 = nb_native().chunk_coder_stats().pool.priorities;
+            await Promise.all([
+                chunk_coder_async('enc', make_chunks(), { priority: 'low' }),
+                chunk_coder_async('enc', make_chunks(), { priority: 'high' }),
+                chunk_coder_async('enc', make_chunks()),
+            ]);
+            const stats2 = nb_native().chunk_coder_stats().pool.priorities;
+            for (const priority of ['high', 'normal', 'low']) {
+                assert.strictEqual(stats2[priority].tasks, stats1[priority].tasks + 10);
+                assert.strictEqual(stats2[priority].pending, 0);
+                assert(stats2[priority].wait_max_us >= stats1[priority].wait_max_us);
+            }
+            assert.throws(() => nb_native().chunk_coder('enc', make_chunks(), _.noop, { priority: 'urgent' }));
+        });
+
+        mocha.it('pins-threads-by-placement', async function() {
+            const saved_placement = nb_native().chunk_coder_pool_placement();
+            try {
+                assert.strictEqual(nb_native().chunk_coder_pool_placement('numa'), 'numa');
+                const chunks = _.times(20, () => ({
+                    data: crypto.randomBytes(SP_I),
+                    size: SP_I,
+                    chunk_coder_config: pool_config,
+                }));
+                await chunk_coder_async('enc', chunks);
+                const stats = nb_native().chunk_coder_stats().pool;
+                assert.strictEqual(stats.placement, 'numa');
+                assert(stats.numa_nodes >= 1);
+                assert(stats.numa_cpus >= stats.numa_nodes);
+                assert.strictEqual(stats.thread_nodes.length, 3);
+                // threads pin themselves when they wake up, and the numa placement leaves the cpu unset
+                stats.thread_nodes.forEach(node => assert(node >= -1 && node < stats.numa_nodes));
+                stats.thread_cpus.forEach(cpu => assert.strictEqual(cpu, -1));
+                assert.throws(() => nb_native().chunk_coder_pool_placement('everywhere'));
+            } finally {
+                nb_native().chunk_coder_pool_placement(saved_placement);
+            }
+        });
+    });
+
+    mocha.describe('uv fallback', function() {
+
+        const uv_config = {
+            digest_type: 'sha384',
+            frag_digest_type: 'sha1',
+            compress_type: 'snappy',
+            cipher_type: 'aes-256-gcm',
+            data_frags: 4,
+            parity_frags: 2,
+            parity_type: 'isa-c1',
+        };
+
+        let saved_nthreads;
+        mocha.before(function() {
+            saved_nthreads = nb_native().chunk_coder_pool_threads();
+            nb_native().chunk_coder_pool_threads(0);
+        });
+        mocha.after(function() {
+            nb_native().chunk_coder_pool_threads(saved_nthreads);
+        });
+
+        // more chunks than uv works per batch, and fewer
+        for (const count of [0, 1, 3, 21]) {
+            mocha.it(`codes-a-batch-of-${count}-on-the-uv-threadpool`, async function() {
+                const chunks = _.times(count, () => ({
+                    data: crypto.randomBytes(SP_I),
+                    size: SP_I,
+                    chunk_coder_config: uv_config,
+                }));
+                const originals = chunks.map(chunk => chunk.data);
+                const stats1 = nb_native().chunk_coder_stats().pool;
+                await chunk_coder_async('enc', chunks);
+                chunks.forEach(chunk => {
+                    chunk.data = null;
+                    pull_frags(chunk, ['D2']);
+                });
+                await chunk_coder_async('dec', chunks);
+                chunks.forEach((chunk, i) => assert.deepStrictEqual(chunk.data, originals[i]));
+                const stats2 = nb_native().chunk_coder_stats().pool;
+                assert.strictEqual(stats2.threads, 0);
+                assert.strictEqual(stats2.batches, stats1.batches);
+                assert.strictEqual(stats2.uv_batches, stats1.uv_batches + 2);
+            });
+        }
+
+        mocha.it('queues-one-low-priority-batch-at-a-time', async function() {
+            const make_chunks = () => _.times(5, () => ({
+                data: crypto.randomBytes(SP_I),
+                size: SP_I,
+                chunk_coder_config: uv_config,
+            }));
+            const stats1 = nb_native().chunk_coder_stats().pool;
+            const done = [];
+            await Promise.all([
+                chunk_coder_async('enc', make_chunks(), { priority: 'low' }).then(() => done.push('low1')),
+                chunk_coder_async('enc', make_chunks(), { priority: 'low' }).then(() => done.push('low2')),
+                chunk_coder_async('enc', make_chunks(), { priority: 'low' }).then(() => done.push('low3')),
+                chunk_coder_async('enc', make_chunks(), { priority: 'high' }),
+                chunk_coder_async('enc', make_chunks()),
+            ]);
+            const stats2 = nb_native().chunk_coder_stats().pool;
+            assert.strictEqual(stats2.uv_batches, stats1.uv_batches + 5);
+            assert.strictEqual(stats2.uv_low_held, stats1.uv_low_held + 2);
+            // the held low batches keep their order
+            assert.deepStrictEqual(done, ['low1', 'low2', 'low3']);
+        });
+    });
+
+    mocha.describe('buf pool', function() {
+
+        mocha.it('releases-frag-buffers-for-reuse', function() {
+            const ec_config = {
+                frag_digest_type: 'sha1',
+                cipher_type: 'aes-256-gcm',
+                data_frags: 4,
+                parity_frags: 2,
+                parity_type: 'isa-c1',
+            };
+            const chunk = prepare_chunk(ec_config);
+            const stats1 = nb_native().chunk_coder_stats().buf_pool;
+            assert.strictEqual(nb_native().chunk_coder_release(chunk), chunk.frags.length);
+            chunk.frags.forEach(frag => assert.strictEqual(frag.data, null));
+            // already released buffers are not released twice
+            assert.strictEqual(nb_native().chunk_coder_release(chunk), 0);
+            const stats2 = nb_native().chunk_coder_stats().buf_pool;
+            assert.strictEqual(stats2.releases, stats1.releases + chunk.frags.length);
+            prepare_chunk(ec_config);
+            const stats3 = nb_native().chunk_coder_stats().buf_pool;
+            assert(stats3.reuses >= stats2.reuses + chunk.frags.length);
+        });
+
+        mocha.it('map-client-releases-only-after-clean-writes', function() {
+            const ec_config = {
+                frag_digest_type: 'sha1',
+                cipher_type: 'aes-256-gcm',
+                data_frags: 4,
+                parity_frags: 2,
+                parity_type: 'isa-c1',
+            };
+            const mc = new MapClient({ rpc_client: null, report_error: null });
+            const chunk1 = prepare_chunk(ec_config);
+            assert.strictEqual(mc.release_coded_buffers([chunk1]), chunk1.frags.length);
+            chunk1.frags.forEach(frag => assert.strictEqual(frag.data, null));
+            // a failed write might still hold the buffers, so they are left to be collected
+            mc.had_write_errors = true;
+            const chunk2 = prepare_chunk(ec_config);
+            assert.strictEqual(mc.release_coded_buffers([chunk2]), 0);
+            chunk2.frags.forEach(frag => assert(Buffer.isBuffer(frag.data)));
+        });
+    });
+
+    mocha.describe('compress level', function() {
+
+        // compressible input so that the levels make a difference
+        const text = Buffer.from(_.times(20000, i => `noobaa ${i % 97} chunk ${i % 13}\n`).join(''));
+
+        function encode_decode(compress_type, compress_level) {
+            const chunk = {
+                data: Buffer.from(text),
+                original: text,
+                size: text.length,
+                chunk_coder_config: { compress_type, compress_level, data_frags: 1, parity_frags: 0 },
+            };
+            call_chunk_coder_must_succeed('enc', chunk);
+            assert(chunk.compress_size < text.length);
+            const compress_size = chunk.compress_size;
+            chunk.data = null;
+            call_chunk_coder_must_succeed('dec', chunk);
+            return compress_size;
+        }
+
+        mocha.it('zstd-higher-level-compresses-better', function() {
+            assert(encode_decode('zstd', 19) < encode_decode('zstd', 1));
+        });
+
+        mocha.it('lz4-hc-level-compresses-better', function() {
+            assert(encode_decode('lz4', 9) < encode_decode('lz4', 0));
+        });
+
+        mocha.it('zlib-default-level-is-best-speed', function() {
+            assert.strictEqual(encode_decode('zlib', undefined), encode_decode('zlib', 1));
+            assert(encode_decode('zlib', 9) <= encode_decode('zlib', 1));
+        });
+    });
+
+    mocha.describe('zlib', function() {
+
+        const text = Buffer.from(_.times(20000, i => `noobaa ${i % 97} chunk ${i % 13}\n`).join(''));
+
+        function encode(original, compress_level) {
+            const chunk = {
+                data: Buffer.from(original),
+                original,
+                size: original.length,
+                chunk_coder_config: { compress_type: 'zlib', compress_level, data_frags: 1, parity_frags: 0 },
+            };
+            call_chunk_coder_must_succeed('enc', chunk);
+            chunk.data = null;
+            return chunk;
+        }
+
+        // without cipher and erasure coding the single frag holds the zlib stream as is
+        function set_stream(chunk, stream_data) {
+            chunk.frags[0].data = stream_data;
+            chunk.compress_size = stream_data.length;
+            chunk.frag_size = stream_data.length;
+        }
+
+        [undefined, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9].forEach(compress_level => {
+            mocha.it(`level-${compress_level}-inflates-with-zlib`, function() {
+                const chunk = encode(text, compress_level);
+                const stream_data = chunk.frags[0].data.slice(0, chunk.compress_size);
+                assert.deepStrictEqual(zlib.inflateSync(stream_data), text);
+            });
+        });
+
+        [1, 6, 9].forEach(level => {
+            mocha.it(`decodes-zlib-deflate-level-${level}`, function() {
+                const chunk = encode(text, 1);
+                set_stream(chunk, zlib.deflateSync(text, { level }));
+                call_chunk_coder_must_succeed('dec', chunk);
+                assert.deepStrictEqual(chunk.data, text);
+            });
+        });
+
+        mocha.it('rejects-corrupt-zlib-header', function() {
+            const chunk = encode(text, 1);
+            const stream_data = Buffer.from(chunk.frags[0].data.slice(0, chunk.compress_size));
+            stream_data[1] ^= 1; // breaks the header check bits
+            set_stream(chunk, stream_data);
+            call_chunk_coder_must_fail('dec', chunk);
+            assert(chunk.errors.some(err => err.includes('invalid zlib header')), chunk.errors.join(','));
+        });
+
+        mocha.it('rejects-corrupt-adler32', function() {
+            const chunk = encode(text, 1);
+            const stream_data = Buffer.from(chunk.frags[0].data.slice(0, chunk.compress_size));
+            stream_data[stream_data.length - 1] ^= 1;
+            set_stream(chunk, stream_data);
+            call_chunk_coder_must_fail('dec', chunk);
+            assert(chunk.errors.some(err => err.includes('adler32 mismatch')), chunk.errors.join(','));
+        });
+
+        [1, 9].forEach(compress_level => {
+            mocha.it(`empty-input-level-${compress_level}`, function() {
+                const empty = Buffer.alloc(0);
+                const chunk = encode(empty, compress_level);
+                assert.deepStrictEqual(zlib.inflateSync(chunk.frags[0].data.slice(0, chunk.compress_size)), empty);
+                call_chunk_coder_must_succeed('dec', chunk);
+                assert.strictEqual(chunk.data.length, 0);
+            });
+        });
+    });
+
+    mocha.describe('compress probe', function() {
+
+        const size = 64 * 1024;
+        const text = Buffer.from(_.times(size / 16, i => `noobaa chunk ${i % 10}\n`).join('')).slice(0, size);
+
+        let saved_min_gain;
+        mocha.before(function() {
+            saved_min_gain = nb_native().chunk_coder_compress_min_gain();
+            nb_native().chunk_coder_compress_min_gain(5);
+        });
+        mocha.after(function() {
+            nb_native().chunk_coder_compress_min_gain(saved_min_gain);
+        });
+
+        function encode_decode(original, compress_type) {
+            const chunk = {
+                data: Buffer.from(original),
+                original,
+                size: original.length,
+                chunk_coder_config: { compress_type, cipher_type: 'aes-256-gcm', data_frags: 1, parity_frags: 0 },
+            };
+            call_chunk_coder_must_succeed('enc', chunk);
+            const { compress_size } = chunk;
+            chunk.data = null;
+            call_chunk_coder_must_succeed('dec', chunk);
+            return compress_size;
+        }
+
+        ['snappy', 'zlib', 'zstd', 'lz4'].forEach(compress_type => {
+            mocha.it(`skips-incompressible-${compress_type}`, function() {
+                const stats1 = nb_native().chunk_coder_stats().compress;
+                // stored in the frame of the compress type, so only the framing is added
+                const compress_size = encode_decode(crypto.randomBytes(size), compress_type);
+                assert(compress_size > size && compress_size < size + 64, `compress_size ${compress_size}`);
+                const stats2 = nb_native().chunk_coder_stats().compress;
+                assert.strictEqual(stats2.skips, stats1.skips + 1);
+                assert.strictEqual(stats2.skipped_bytes, stats1.skipped_bytes + size);
+            });
+
+            mocha.it(`compresses-compressible-${compress_type}`, function() {
+                const stats1 = nb_native().chunk_coder_stats().compress;
+                assert(encode_decode(text, compress_type) < size);
+                const stats2 = nb_native().chunk_coder_stats().compress;
+                assert.strictEqual(stats2.probes, stats1.probes + 1);
+                assert.strictEqual(stats2.skips, stats1.skips);
+            });
+        });
+
+        mocha.it('stores-incompressible-zlib-as-a-standard-zlib-stream', function() {
+            const original = crypto.randomBytes(size);
+            const chunk = {
+                data: Buffer.from(original),
+                size: original.length,
+                chunk_coder_config: { compress_type: 'zlib', data_frags: 1, parity_frags: 0 },
+            };
+            call_chunk_coder_must_succeed('enc', chunk);
+            // readers that uncompress every zlib chunk still get the original data
+            assert.deepStrictEqual(zlib.inflateSync(chunk.frags[0].data.slice(0, chunk.compress_size)), original);
+        });
+
+        mocha.it('compresses-everything-when-disabled', function() {
+            nb_native().chunk_coder_compress_min_gain(0);
+            try {
+                assert(encode_decode(crypto.randomBytes(size), 'snappy') > size);
+            } finally {
+                nb_native().chunk_coder_compress_min_gain(5);
+            }
+        });
+    });
+
+    mocha.describe('compress dict', function() {
+
+        // small objects that share structure but are too small to compress well on their own
+        const samples = _.times(1000, i => Buffer.from(JSON.stringify({
+            id: i,
+            name: `object-${i}`,
+            owner: `account-${i % 7}`,
+            tags: ['noobaa', 'chunk', `tag-${i % 11}`],
+        })));
+        const dict_id = 1000 + chance.integer({ min: 0, max: 1000000 });
+
+        mocha.before(async function() {
+            const dict = await new Promise((resolve, reject) =>
+                nb_native().chunk_coder_dict_train({ samples, dict_size: 4096 },
+                    (err, res) => (err ? reject(err) : resolve(res))));
+            assert(dict.length > 0 && dict.length <= 4096);
+            nb_native().chunk_coder_dict_load(dict_id, dict);
+            // loading the same dictionary again is allowed
+            nb_native().chunk_coder_dict_load(dict_id, dict);
+        });
+        mocha.after(function() {
+            assert.strictEqual(nb_native().chunk_coder_dict_unload(dict_id), true);
+            assert.strictEqual(nb_native().chunk_coder_dict_unload(dict_id), false);
+        });
+
+        function encode_decode(original, compress_dict_id) {
+            const chunk = {
+                data: Buffer.from(original),
+                original,
+                size: original.length,
+                chunk_coder_config: {
+                    compress_type: 'zstd',
+                    compress_dict_id,
+                    cipher_type: 'aes-256-gcm',
+                    data_frags: 1,
+                    parity_frags: 0,
+                },
+            };
+            call_chunk_coder_must_succeed('enc', chunk);
+            const compress_size = chunk.compress_size || original.length;
+            chunk.data = null;
+            call_chunk_coder_must_succeed('dec', chunk);
+            return compress_size;
+        }
+
+        mocha.it('compresses-small-objects-better-with-dict', function() {
+            const stats1 = nb_native().chunk_coder_stats().compress.dicts;
+            const with_dict = _.sumBy(samples, sample => encode_decode(sample, dict_id));
+            const without_dict = _.sumBy(samples, sample => encode_decode(sample, undefined));
+            assert(with_dict < without_dict, `with_dict ${with_dict} without_dict ${without_dict}`);
+            const stats2 = nb_native().chunk_coder_stats().compress.dicts;
+            assert(stats2.compress > stats1.compress);
+            assert(stats2.uncompress > stats1.uncompress);
+        });
+
+        mocha.it('rejects-loading-different-dict-with-same-id', function() {
+            assert.throws(() => nb_native().chunk_coder_dict_load(dict_id, Buffer.from('not the same dictionary')));
+        });
+
+        mocha.it('fails-without-loaded-dict', function() {
+            const chunk = {
+                data: Buffer.from(samples[0]),
+                size: samples[0].length,
+                chunk_coder_config: { compress_type: 'zstd', compress_dict_id: dict_id + 1 },
+            };
+            call_chunk_coder_must_fail('enc', chunk);
+        });
+
+        mocha.it('fails-with-non-zstd-compress-type', function() {
+            const chunk = {
+                data: Buffer.from(samples[0]),
+                size: samples[0].length,
+                chunk_coder_config: { compress_type: 'snappy', compress_dict_id: dict_id },
+            };
+            call_chunk_coder_must_fail('enc', chunk);
+        });
+    });
+
+    mocha.describe('arena', function() {
+
+        mocha.it('allocates-chunk-memory-from-arena', function() {
+            const stats1 = nb_native().chunk_coder_stats().arena;
+            prepare_chunk({
+                digest_type: 'sha384',
+                frag_digest_type: 'sha1',
+                cipher_type: 'aes-256-gcm',
+                data_frags: 4,
+                parity_frags: 2,
+                parity_type: 'isa-c1',
+            });
+            const stats2 = nb_native().chunk_coder_stats().arena;
+            // at least the frags array, digests and cipher key
+            assert(stats2.allocs >= stats1.allocs + 3);
+            assert(stats2.frees > stats1.frees);
+        });
+    });
+
+    mocha.describe('ec tables cache', function() {
+
+        mocha.it('reuses-tables-for-same-config-and-erasures', function() {
+            const ec_config = {
+                data_frags: 4,
+                parity_frags: 2,
+                parity_type: 'isa-c1',
+            };
+            const chunk = prepare_chunk(ec_config);
+            pull_frags(chunk, ['D0', 'D2']);
+            call_chunk_coder_must_succeed('dec', chunk);
+            const stats1 = nb_native().chunk_coder_stats().ec_tables;
+            const chunk2 = prepare_chunk(ec_config);
+            pull_frags(chunk2, ['D0', 'D2']);
+            call_chunk_coder_must_succeed('dec', chunk2);
+            const stats2 = nb_native().chunk_coder_stats().ec_tables;
+            assert.strictEqual(stats2.misses, stats1.misses);
+            assert.strictEqual(stats2.hits, stats1.hits + 2);
+            assert(stats2.size <= stats2.capacity);
+        });
+    });
 });
 
+function chunk_coder_async(coder, chunks, options) {
+    return new Promise((resolve, reject) =>
+        nb_native().chunk_coder(coder, chunks, err => (err ? reject(err) : resolve()), options));
+}
+
+function pull_frags(chunk, frag_indexes) {
+    chunk.frags = chunk.frags.filter(frag => !frag_indexes.includes(_frag_index(frag)));
+}
+
 function test_stream({ erase, decode, generator, input_size, chunk_split_config, chunk_coder_config }) {
 
     const speedometer = new Speedometer('Chunk Coder Speed');
@@ -371,13 +1128,19 @@ function prepare_chunk(chunk_coder_config, copy_from_chunk) {
 
     call_chunk_coder_must_succeed('enc', chunk);
 
-    assert.strictEqual(chunk.frags.length, chunk_coder_config.data_frags + chunk_coder_config.parity_frags);
+    assert.strictEqual(chunk.frags.length,
+        chunk_coder_config.data_frags + chunk_coder_config.parity_frags + _lrc_total_frags(chunk_coder_config));
     assert.strictEqual(chunk.errors, undefined);
 
     chunk.data = null;
     return chunk;
 }
 
+function _lrc_total_frags({ data_frags, parity_frags, lrc_group, lrc_frags }) {
+    if (!lrc_group || !lrc_frags) return 0;
+    return Math.floor((data_frags + parity_frags) / lrc_group) * lrc_frags;
+}
+
 function _frag_index(frag) {
     if (frag.data_index >= 0) return `D${frag.data_index}`;
     if (frag.parity_index >= 0) return `P${frag.parity_index}`;
@@ -85,4 +85,35 @@ mocha.describe('chunk_config_utils', function() {
         assert.strictEqual(cc, system.chunk_configs_by_id.ec_8_2);
     });
 
+    mocha.describe('compress dict', function() {
+
+        mocha.before(function() {
+            const cc = chunk_config_utils.new_compress_dict_chunk_config(system.chunk_configs_by_id.default, 1);
+            cc._id = 'dict';
+            system.chunk_configs_by_id.dict = cc;
+        });
+
+        mocha.after(function() {
+            delete system.chunk_configs_by_id.dict;
+        });
+
+        mocha.it('keeps the coding of the config and switches to zstd', function() {
+            const cc = system.chunk_configs_by_id.dict;
+            const def = system.chunk_configs_by_id.default.chunk_coder_config;
+            assert.strictEqual(cc.chunk_coder_config.compress_dict_id, 1);
+            assert.strictEqual(cc.chunk_coder_config.compress_type, 'zstd');
+            assert.strictEqual(cc.chunk_coder_config.cipher_type, def.cipher_type);
+            assert.strictEqual(cc.chunk_coder_config.replicas, def.replicas);
+        });
+
+        mocha.it('does not match a dict config unless asked for', function() {
+            const cc = chunk_config_utils.resolve_chunk_config({ compress_type: 'zstd' }, account, system);
+            assert.strictEqual(cc._id, undefined);
+            assert.strictEqual(cc.chunk_coder_config.compress_dict_id, undefined);
+            const cc_dict = chunk_config_utils.resolve_chunk_config(
+                { compress_type: 'zstd', compress_dict_id: 1 }, account, system);
+            assert.strictEqual(cc_dict, system.chunk_configs_by_id.dict);
+        });
+    });
+
 });
@@ -7,6 +7,7 @@ const crypto = require('crypto');
 const assert = require('assert');
 
 const P = require('../../util/promise');
+const nb_native = require('../../util/nb_native');
 const RandStream = require('../../util/rand_stream');
 const ChunkSplitter = require('../../util/chunk_splitter');
 
@@ -35,6 +36,114 @@ mocha.describe('ChunkSplitter', function() {
             });
     });
 
+    mocha.it('gear is consistent', function() {
+        this.timeout(100000); // eslint-disable-line no-invalid-this
+        const options = {
+            avg_chunk: 4503,
+            delta_chunk: 1231,
+            split_type: 'gear',
+            len: 1517203,
+            cipher_seed: Buffer.from('ChunkSplitter gear is consistent!'),
+        };
+        return P.all(_.times(10, i => split_stream(options)))
+            .then(res => {
+                const points = res[0];
+                for (let i = 1; i < res.length; ++i) {
+                    const points2 = res[i];
+                    assert.deepStrictEqual(points, points2);
+                }
+            });
+    });
+
+    mocha.it('gear splits within min and max chunk', function() {
+        const avg_chunk = 4000;
+        const delta_chunk = 1000;
+        const data = crypto.randomBytes(1000000);
+        return P.map(['rabin', 'gear'], split_type => split_buffer({ avg_chunk, delta_chunk, split_type, data }))
+            .then(([rabin_points, gear_points]) => {
+                assert.strictEqual(_.sum(gear_points), data.length);
+                gear_points.slice(0, -1).forEach(size => {
+                    assert(size >= avg_chunk - delta_chunk, `gear chunk ${size} below min`);
+                    assert(size <= avg_chunk + delta_chunk, `gear chunk ${size} above max`);
+                });
+                // both should average near avg_chunk on random data
+                const gear_avg = data.length / gear_points.length;
+                assert(gear_avg > avg_chunk * 0.75 && gear_avg < avg_chunk * 1.25, `gear avg ${gear_avg}`);
+                assert.notDeepStrictEqual(rabin_points, gear_points);
+            });
+    });
+
+    mocha.it('rejects unknown split_type', function() {
+        const state = {
+            min_chunk: 3000,
+            max_chunk: 5000,
+            avg_chunk_bits: 10,
+            calc_md5: false,
+            calc_sha256: false,
+            split_type: 'nope',
+        };
+        assert.throws(() => nb_native().chunk_splitter(state, [Buffer.alloc(10000)]), /Invalid splitter config/);
+    });
+
+    mocha.it('digest thread calculates the same md5 and sha256', function() {
+        this.timeout(100000); // eslint-disable-line no-invalid-this
+        const data = crypto.randomBytes(7 * 1024 * 1024);
+        const md5 = crypto.createHash('md5').update(data).digest();
+        const sha256 = crypto.createHash('sha256').update(data).digest();
+        return P.map([false, true], digest_thread => new Promise((resolve, reject) => {
+                const points = [];
+                const splitter = new ChunkSplitter({
+                    watermark: 100,
+                    calc_md5: true,
+                    calc_sha256: true,
+                    digest_thread,
+                    chunk_split_config: { avg_chunk: 1024 * 1024, delta_chunk: 256 * 1024 }
+                });
+                splitter.once('error', reject);
+                splitter.once('end', () => resolve({ points, md5: splitter.md5, sha256: splitter.sha256 }));
+                splitter.on('data', chunk => points.push(chunk.size));
+                // write in small buffers to pass many of them through the ring
+                for (let pos = 0; pos < data.length; pos += 60000) {
+                    splitter.write(data.slice(pos, pos + 60000));
+                }
+                splitter.end();
+            }))
+            .then(([res, res_thread]) => {
+                assert.deepStrictEqual(res.md5, md5);
+                assert.deepStrictEqual(res.sha256, sha256);
+                assert.deepStrictEqual(res_thread.md5, md5);
+                assert.deepStrictEqual(res_thread.sha256, sha256);
+                assert.deepStrictEqual(res_thread.points, res.points);
+            });
+    });
+
+    mocha.it('returns split points in an Int32Array', function() {
+        const data = crypto.randomBytes(100000);
+        const state = {
+            min_chunk: 3000,
+            max_chunk: 5000,
+            avg_chunk_bits: 10,
+            calc_md5: false,
+            calc_sha256: false,
+        };
+        const points = nb_native().chunk_splitter(state, [data]);
+        assert(points instanceof Int32Array);
+        assert(points.length > 0);
+        points.forEach(size => assert(size >= 3000 && size <= 5000));
+
+        // with points_array the same points are written to it
+        const state2 = { ...state, points_array: new Int32Array(100) };
+        const points2 = nb_native().chunk_splitter(state2, [data]);
+        assert.strictEqual(points2.buffer, state2.points_array.buffer);
+        assert.deepStrictEqual(points2, points);
+
+        // and when it is too small a new array is returned
+        const state3 = { ...state, points_array: new Int32Array(1) };
+        const points3 = nb_native().chunk_splitter(state3, [data]);
+        assert.notStrictEqual(points3.buffer, state3.points_array.buffer);
+        assert.deepStrictEqual(points3, points);
+    });
+
     mocha.it.skip('splits almost the same when pushing bytes at the start', function() {
         const avg_chunk = 1000;
         const delta_chunk = 500;
@@ -69,7 +178,7 @@ mocha.describe('ChunkSplitter', function() {
             });
     });
 
-    function split_stream({ avg_chunk, delta_chunk, len, cipher_seed }) {
+    function split_stream({ avg_chunk, delta_chunk, split_type, len, cipher_seed }) {
         return new Promise((resolve, reject) => {
             const points = [];
             const input = new RandStream(len, { cipher_seed });
@@ -77,7 +186,7 @@ mocha.describe('ChunkSplitter', function() {
                 watermark: 100,
                 calc_md5: true,
                 calc_sha256: false,
-                chunk_split_config: { avg_chunk, delta_chunk }
+                chunk_split_config: { avg_chunk, delta_chunk, split_type }
             });
             input.once('error', reject);
             splitter.once('error', reject);
@@ -87,14 +196,14 @@ mocha.describe('ChunkSplitter', function() {
         });
     }
 
-    function split_buffer({ avg_chunk, delta_chunk, data }) {
+    function split_buffer({ avg_chunk, delta_chunk, split_type, data }) {
         return new Promise((resolve, reject) => {
             const points = [];
             const splitter = new ChunkSplitter({
                 watermark: 100,
                 calc_md5: true,
                 calc_sha256: false,
-                chunk_split_config: { avg_chunk, delta_chunk }
+                chunk_split_config: { avg_chunk, delta_chunk, split_type }
             });
             splitter.once('error', reject);
             splitter.once('end', () => resolve(points));
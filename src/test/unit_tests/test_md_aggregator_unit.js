@@ -407,6 +407,44 @@ mocha.describe('md_aggregator', function() {
                 });
         });
 
+        mocha.it('should aggregate chunks capacity of legacy chunks', function() {
+            const self = this; // eslint-disable-line no-invalid-this
+            self.timeout(30000);
+            const last_update = Date.now();
+            const target_now = last_update + (2 * CYCLE);
+            const system_store = make_test_system_store(last_update, md_store);
+            const bucket = system_store.data.buckets[0];
+            const system_id = system_store.data.systems[0]._id;
+            // legacy chunks that were coded without compression have no compress_size
+            const legacy_chunk_id = md_store.make_md_id_from_time(last_update + sub_cycle());
+
+            return P.resolve()
+                .then(() => md_store.insert_chunks([{
+                    _id: legacy_chunk_id,
+                    system: system_id,
+                    bucket: bucket._id,
+                    size: 230,
+                }, {
+                    _id: md_store.make_md_id_from_time(last_update + sub_cycle()),
+                    system: system_id,
+                    bucket: bucket._id,
+                    size: 1000,
+                    compress_size: 400,
+                }]))
+                .then(() => md_store.update_chunks_by_ids([legacy_chunk_id], {
+                    deleted: new Date(last_update + CYCLE + sub_cycle())
+                }))
+                .then(() => md_aggregator.run_md_aggregator(md_store, system_store, target_now, 0))
+                .then(() => {
+                    assert.strictEqual(system_store.changes_list.length, 4);
+                    // the legacy chunk is counted as 0 when added, and so it must be when deleted
+                    const changes0 = system_store.changes_list[0];
+                    assert.strictEqual(changes0.update.buckets[0].storage_stats.chunks_capacity, 400);
+                    const changes1 = system_store.changes_list[2];
+                    assert.strictEqual(changes1.update.buckets[0].storage_stats.chunks_capacity, 400);
+                });
+        });
+
         mocha.it('should aggregate petabytes', function() {
             const self = this; // eslint-disable-line no-invalid-this
             self.timeout(30000);
@@ -259,6 +259,41 @@ mocha.describe('md_store', function() {
 
     });
 
+    mocha.describe('compress-dicts', function() {
+
+        const compress_dict = {
+            system: system_id,
+            bucket: bucket_id,
+            dict: Buffer.from('compress dict content'),
+        };
+
+        mocha.it('insert_compress_dict() allocates the dict_id', async function() {
+            const dict_id = await md_store.insert_compress_dict({ ...compress_dict, _id: md_store.make_md_id() });
+            assert.strictEqual(dict_id, 1);
+        });
+
+        mocha.it('insert_compress_dict() allocates distinct ids concurrently', async function() {
+            const dict_ids = await Promise.all(_.times(4, () =>
+                md_store.insert_compress_dict({ ...compress_dict, _id: md_store.make_md_id() })));
+            assert.deepStrictEqual(_.sortBy(dict_ids), [2, 3, 4, 5]);
+        });
+
+        mocha.it('find_compress_dict()', async function() {
+            const res = await md_store.find_compress_dict(system_id, 1);
+            assert_equal(res.bucket, bucket_id);
+            assert(res.dict.buffer.equals(compress_dict.dict));
+            assert.strictEqual(await md_store.find_compress_dict(system_id, 6), null);
+        });
+
+        mocha.it('delete_compress_dict() does not block the next insert', async function() {
+            // a train that failed to commit deletes its dict and the next one takes the id
+            await md_store.delete_compress_dict(system_id, 5);
+            assert.strictEqual(await md_store.find_compress_dict(system_id, 5), null);
+            const dict_id = await md_store.insert_compress_dict({ ...compress_dict, _id: md_store.make_md_id() });
+            assert.strictEqual(dict_id, 5);
+        });
+    });
+
     mocha.describe('dedup-index', function() {
         mocha.it('get_dedup_index_size()', async function() {
             return md_store.get_dedup_index_size();
@@ -0,0 +1,153 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+const _ = require('lodash');
+const net = require('net');
+const mocha = require('mocha');
+const assert = require('assert');
+const crypto = require('crypto');
+
+const P = require('../../util/promise');
+const nb_native = require('../../util/nb_native');
+
+mocha.describe('ntcp', function() {
+
+    const Ntcp = nb_native().Ntcp;
+    const MUX_MAX_STREAMS = 64;
+
+    const closers = [];
+
+    mocha.afterEach(function() {
+        for (const c of closers) c.close();
+        closers.length = 0;
+    });
+
+    async function listen(mux) {
+        const server = new Ntcp({ mux });
+        closers.push(server);
+        const port = server.listen(0, '127.0.0.1');
+        const conn = new P(resolve => server.once('connection', resolve));
+        return { server, port, conn };
+    }
+
+    async function connect_pair(server_mux, client_mux) {
+        const { port, conn } = await listen(server_mux);
+        const client = new Ntcp({ mux: client_mux });
+        closers.push(client);
+        await P.ninvoke(client, 'connect', port, '127.0.0.1');
+        const server_conn = await conn;
+        closers.push(server_conn);
+        return { client, server_conn };
+    }
+
+    // messages carry their index first since mux interleaves their chunks
+    function make_messages(count, size) {
+        return _.times(count, i => {
+            const data = crypto.randomBytes(size);
+            data.writeUInt32BE(i, 0);
+            return data;
+        });
+    }
+
+    function receive_messages(ntcp, count) {
+        const received = [];
+        let num_received = 0;
+        let on_close;
+        let on_message;
+        return new P((resolve, reject) => {
+                on_close = () => reject(new Error('NTCP CLOSED'));
+                on_message = msg => {
+                    // mux messages arrive as the array of their chunks
+                    const data = Array.isArray(msg) ? Buffer.concat(msg) : msg;
+                    received[data.readUInt32BE(0)] = data;
+                    num_received += 1;
+                    if (num_received === count) resolve(received);
+                };
+                ntcp.on('close', on_close);
+                ntcp.on('message', on_message);
+            })
+            .finally(() => {
+                ntcp.removeListener('close', on_close);
+                ntcp.removeListener('message', on_message);
+            });
+    }
+
+    async function send_and_check(sender, receiver, count, size) {
+        const messages = make_messages(count, size);
+        const received = receive_messages(receiver, count);
+        await P.all(_.map(messages, data => P.ninvoke(sender, 'write', data)));
+        const res = await received;
+        for (let i = 0; i < count; ++i) {
+            assert(res[i].equals(messages[i]), `message ${i}`);
+        }
+    }
+
+    for (const [server_mux, client_mux] of [
+            [false, false],
+            [true, false],
+            [false, true],
+            [true, true],
+        ]) {
+        mocha.it(`server mux ${server_mux} client mux ${client_mux}`, async function() {
+            this.timeout(30000); // eslint-disable-line no-invalid-this
+            const { client, server_conn } = await connect_pair(server_mux, client_mux);
+            for (const size of [4, 100, 64 * 1024, 1024 * 1024]) {
+                await send_and_check(client, server_conn, 8, size);
+                await send_and_check(server_conn, client, 8, size);
+            }
+        });
+    }
+
+    mocha.it('mux sender keeps within the streams limit', async function() {
+        this.timeout(30000); // eslint-disable-line no-invalid-this
+        const { client, server_conn } = await connect_pair(true, true);
+        // more messages than streams, each of several mux chunks
+        await send_and_check(client, server_conn, 2 * MUX_MAX_STREAMS + 1, 300 * 1024);
+    });
+
+    mocha.it('rejects a message bigger than the max', async function() {
+        const { client } = await connect_pair(false, true);
+        await assert.rejects(P.ninvoke(client, 'write', Buffer.alloc(64 * 1024 * 1024 + 1)), /too big/);
+    });
+
+    mocha.it('closes a peer that opens too many mux streams', async function() {
+        const { port, conn } = await listen(true);
+        const socket = net.connect(port, '127.0.0.1');
+        socket.on('error', _.noop); // the server resets the connection
+        closers.push({ close: () => socket.destroy() });
+        const server_conn = await conn;
+        closers.push(server_conn);
+        const closed = new P(resolve => server_conn.once('close', resolve));
+        // one byte chunks of streams that never end
+        for (let stream_id = 1; stream_id <= MUX_MAX_STREAMS + 1; ++stream_id) {
+            const frame = Buffer.alloc(13);
+            frame.writeUInt8(0x80, 0);
+            frame.writeUInt32BE(stream_id, 4);
+            frame.writeUInt32BE(1, 8);
+            socket.write(frame);
+        }
+        await closed;
+    });
+
+    mocha.it('closes a peer that sends a mux message too big', async function() {
+        const { port, conn } = await listen(true);
+        const socket = net.connect(port, '127.0.0.1');
+        socket.on('error', _.noop); // the server resets the connection
+        closers.push({ close: () => socket.destroy() });
+        const server_conn = await conn;
+        closers.push(server_conn);
+        const closed = new P(resolve => server_conn.once('close', resolve));
+        // chunks of 1MB of the same stream past the 64MB max
+        const chunk = Buffer.alloc(1024 * 1024);
+        const hdr = Buffer.alloc(12);
+        hdr.writeUInt8(0x80, 0);
+        hdr.writeUInt32BE(1, 4);
+        hdr.writeUInt32BE(chunk.length, 8);
+        for (let i = 0; i <= 64; ++i) {
+            socket.write(hdr);
+            socket.write(chunk);
+        }
+        await closed;
+    });
+
+});
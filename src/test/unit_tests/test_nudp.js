@@ -0,0 +1,116 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+const util = require('util');
+const mocha = require('mocha');
+const assert = require('assert');
+const crypto = require('crypto');
+
+const P = require('../../util/promise');
+const nb_native = require('../../util/nb_native');
+
+mocha.describe('nudp', function() {
+
+    const Nudp = nb_native().Nudp;
+
+    mocha.describe('options', function() {
+
+        const closers = [];
+
+        mocha.afterEach(function() {
+            for (const c of closers) c.close();
+            closers.length = 0;
+        });
+
+        // stats are available once the nudp has a utp socket
+        async function connected_stats(options) {
+            const server = new Nudp();
+            const client = new Nudp(options);
+            closers.push(server, client);
+            const port = await P.ninvoke(server, 'bind', 0, '127.0.0.1');
+            await P.ninvoke(client, 'bind', 0, '127.0.0.1');
+            await P.ninvoke(client, 'connect', port, '127.0.0.1');
+            return client.stats();
+        }
+
+        for (const key of ['target_delay', 'sndbuf', 'rcvbuf', 'autotune_max_buf']) {
+            for (const val of [0, -1, 1.5, '1024', 2 ** 31, NaN, null, {}]) {
+                mocha.it(`rejects ${key} ${util.inspect(val)}`, function() {
+                    assert.throws(() => new Nudp({ [key]: val }), /options should be positive integers/);
+                });
+            }
+        }
+
+        mocha.it('uses the defaults without options', async function() {
+            const stats = await connected_stats();
+            assert.strictEqual(stats.target_delay, 10000);
+            assert.strictEqual(stats.sndbuf, 128 * 1024);
+            assert.strictEqual(stats.rcvbuf, 128 * 1024);
+            assert.strictEqual(stats.autotune, false);
+        });
+
+        mocha.it('applies the options', async function() {
+            const stats = await connected_stats({
+                target_delay: 20000,
+                sndbuf: 256 * 1024,
+                rcvbuf: 512 * 1024,
+                autotune: true,
+                autotune_max_buf: 1024 * 1024,
+            });
+            assert.strictEqual(stats.target_delay, 20000);
+            assert.strictEqual(stats.sndbuf, 256 * 1024);
+            assert.strictEqual(stats.rcvbuf, 512 * 1024);
+            assert.strictEqual(stats.autotune, true);
+            assert.strictEqual(stats.autotune_max_buf, 1024 * 1024);
+            assert.strictEqual(stats.autotune_grows, 0);
+            assert.strictEqual(stats.autotune_shrinks, 0);
+        });
+    });
+
+    mocha.describe('loopback', function() {
+
+        let server;
+        let client;
+
+        mocha.before(async function() {
+            server = new Nudp();
+            client = new Nudp();
+            const port = await P.ninvoke(server, 'bind', 0, '127.0.0.1');
+            await P.ninvoke(client, 'bind', 0, '127.0.0.1');
+            await P.ninvoke(client, 'connect', port, '127.0.0.1');
+        });
+
+        mocha.after(function() {
+            if (client) client.close();
+            if (server) server.close();
+        });
+
+        mocha.it('sends a message and batches the packets', async function() {
+            this.timeout(30000); // eslint-disable-line no-invalid-this
+            const data = crypto.randomBytes(4 * 1024 * 1024);
+            const received = new P((resolve, reject) => {
+                server.once('message', resolve);
+                server.once('error', reject);
+            });
+            await P.ninvoke(client, 'send', data);
+            const msg_buffers = await received;
+            assert(Buffer.concat(msg_buffers).equals(data));
+
+            const send_stats = client.stats();
+            assert(send_stats.send_syscalls > 0);
+            assert(send_stats.send_packets >= send_stats.send_syscalls);
+            if (send_stats.send_mmsg) {
+                // utp sends many packets per loop iteration and they go out with one sendmmsg
+                assert(send_stats.send_packets > send_stats.send_syscalls,
+                    `send_packets ${send_stats.send_packets} send_syscalls ${send_stats.send_syscalls}`);
+            }
+
+            const recv_stats = server.stats();
+            assert(recv_stats.recv_syscalls > 0);
+            assert(recv_stats.recv_packets > 0);
+            assert.strictEqual(recv_stats.recv_messages, 1);
+        });
+
+    });
+
+});
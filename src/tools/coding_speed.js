@@ -32,6 +32,8 @@ argv.sha256 = Boolean(argv.sha256); // default is false
 argv.compare = Boolean(argv.compare); // default is false
 argv.verbose = Boolean(argv.verbose); // default is false
 argv.sse_c = Boolean(argv.sse_c); // default is false
+argv.compress = argv.compress || config.CHUNK_CODER_COMPRESS_TYPE; // snappy|zlib|zstd|lz4
+argv.compress_level = argv.compress_level || config.CHUNK_CODER_COMPRESS_LEVEL;
 delete argv._;
 
 const master_speedometer = new Speedometer('Total Speed');
@@ -70,7 +72,8 @@ function main() {
         chunk_coder_config: {
             digest_type: config.CHUNK_CODER_DIGEST_TYPE,
             frag_digest_type: config.CHUNK_CODER_FRAG_DIGEST_TYPE,
-            compress_type: config.CHUNK_CODER_COMPRESS_TYPE,
+            compress_type: argv.compress,
+            compress_level: argv.compress_level,
             cipher_type: config.CHUNK_CODER_CIPHER_TYPE,
             data_frags: 1,
             ...(argv.ec ? {
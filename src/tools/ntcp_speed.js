@@ -24,13 +24,13 @@ function main() {
 }
 
 function usage() {
-    console.log('\nUsage: --server [--port X] [--size X]\n');
-    console.log('\nUsage: --client <host> [--port X] [--size X]\n');
+    console.log('\nUsage: --server [--port X] [--size X] [--mux] [--stats]\n');
+    console.log('\nUsage: --client <host> [--port X] [--size X] [--mux] [--stats]\n');
 }
 
 function run_server(port) {
     console.log('SERVER', port, 'size', argv.size);
-    let server = new Ntcp();
+    let server = new Ntcp({ mux: Boolean(argv.mux) });
     g_servers.push(server);
     server.on('connection', conn => {
         setup_conn(conn);
@@ -48,7 +48,7 @@ function run_server(port) {
 
 function run_client(port, host) {
     console.log('CLIENT', host + ':' + port, 'size', argv.size);
-    let conn = new Ntcp();
+    let conn = new Ntcp({ mux: Boolean(argv.mux) });
     conn.connect(port, host, () => run_sender(conn));
     setup_conn(conn);
 }
@@ -62,6 +62,9 @@ function setup_conn(conn) {
         console.log('done.');
         process.exit();
     });
+    if (argv.stats) {
+        setInterval(() => console.log('Ntcp Stats', conn.stats()), 5000).unref();
+    }
 }
 
 function run_sender(conn) {
@@ -80,5 +83,6 @@ function run_sender(conn) {
 
 function run_receiver(conn) {
     let recv_speedometer = new Speedometer('Receive Speed');
-    conn.on('message', data => recv_speedometer.update(data.length));
+    conn.on('message', data => recv_speedometer.update(
+        Array.isArray(data) ? data.reduce((sum, buf) => sum + buf.length, 0) : data.length));
 }
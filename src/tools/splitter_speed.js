@@ -0,0 +1,71 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+const crypto = require('crypto');
+const argv = require('minimist')(process.argv);
+
+const config = require('../../config');
+const nb_native = require('../util/nb_native');
+
+require('../util/console_wrapper').original_console();
+
+argv.size = argv.size || 1024; // MB per run
+argv.buf = argv.buf || 1024; // KB per pushed buffer
+argv.avg_chunk = argv.avg_chunk || config.CHUNK_SPLIT_AVG_CHUNK;
+argv.delta_chunk = argv.delta_chunk || config.CHUNK_SPLIT_DELTA_CHUNK;
+argv.split_types = argv.split_types ? String(argv.split_types).split(',') : ['rabin', 'gear'];
+argv.inputs = argv.inputs ? String(argv.inputs).split(',') : ['random', 'text', 'zeros'];
+delete argv._;
+
+const INPUTS = {
+    random: len => crypto.randomBytes(len),
+    // low entropy input - short words from a small dictionary
+    text: len => {
+        const words = ['noobaa', 'chunk', 'split', 'the', 'of', 'data', 'bucket', 'object', '\n'];
+        const buf = Buffer.allocUnsafe(len);
+        let pos = 0;
+        while (pos < len) {
+            pos += buf.write(words[crypto.randomBytes(1)[0] % words.length] + ' ', pos);
+        }
+        return buf;
+    },
+    zeros: len => Buffer.alloc(len),
+};
+
+function main() {
+    console.log('Arguments:', JSON.stringify(argv, null, 2));
+    for (const input of argv.inputs) {
+        const buf = INPUTS[input](argv.buf * 1024);
+        for (const split_type of argv.split_types) {
+            run(input, buf, split_type);
+        }
+    }
+}
+
+function run(input, buf, split_type) {
+    const { avg_chunk, delta_chunk } = argv;
+    const state = {
+        min_chunk: avg_chunk - delta_chunk,
+        max_chunk: avg_chunk + delta_chunk,
+        avg_chunk_bits: delta_chunk >= 1 ? Math.round(Math.log2(delta_chunk)) : 0,
+        calc_md5: false,
+        calc_sha256: false,
+        split_type,
+    };
+    const total = argv.size * 1024 * 1024;
+    let size = 0;
+    let chunks = 0;
+    const start = process.hrtime.bigint();
+    while (size < total) {
+        chunks += nb_native().chunk_splitter(state, [buf]).length;
+        size += buf.length;
+    }
+    const took_ms = Number(process.hrtime.bigint() - start) / 1e6;
+    console.log(
+        `${split_type.padEnd(6)} ${input.padEnd(7)}`,
+        `${(size / 1024 / 1024 / took_ms * 1000).toFixed(1)} MB/sec`,
+        `chunks ${chunks} avg ${chunks ? (size / chunks).toFixed(0) : '-'}`
+    );
+}
+
+main();
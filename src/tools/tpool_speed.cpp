@@ -0,0 +1,165 @@
+/**
+ * Contention benchmark of the native thread pool scheduler.
+ *
+ * Compares WorkStealingPool with the single mutex + list queue that ThreadPool used before,
+ * by submitting small tasks from several submitter threads and measuring the task rate.
+ *
+ * compile with:
+ *   g++ --std=c++11 -O2 -o tpool_speed src/tools/tpool_speed.cpp src/native/util/work_stealing.cpp src/native/util/numa.cpp -luv -lpthread
+ *
+ * usage:
+ *   tpool_speed [threads=4] [tasks=1000000] [submitters=1] [work=100]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "../native/util/mutex.h"
+#include "../native/util/work_stealing.h"
+
+using noobaa::MutexCond;
+using noobaa::NB_Work_Stealing_Stats;
+using noobaa::WorkStealingPool;
+using std::cout;
+using std::endl;
+
+struct BenchTask : public WorkStealingPool::Task {
+    int work;
+    std::atomic<int>* done;
+    virtual void run()
+    {
+        // a few dependent multiplications that the compiler cannot drop
+        volatile uint64_t x = 1;
+        for (int i = 0; i < work; ++i) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        done->fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * the scheduler of the previous ThreadPool - one mutex and one list shared by all
+ */
+class MutexListPool
+{
+public:
+    explicit MutexListPool(int nthreads)
+        : _stop(false)
+    {
+        for (int i = 0; i < nthreads; ++i) {
+            _threads.push_back(std::thread([this] { thread_main(); }));
+        }
+    }
+
+    ~MutexListPool()
+    {
+        {
+            MutexCond::Lock lock(_mutex);
+            _stop = true;
+            _mutex.broadcast();
+        }
+        for (auto& t : _threads) {
+            t.join();
+        }
+    }
+
+    void submit(WorkStealingPool::Task* task)
+    {
+        MutexCond::Lock lock(_mutex);
+        _pending.push_back(task);
+        _mutex.signal();
+    }
+
+private:
+    void thread_main()
+    {
+        while (true) {
+            WorkStealingPool::Task* task = 0;
+            {
+                MutexCond::Lock lock(_mutex);
+                while (!_stop && _pending.empty()) {
+                    _mutex.wait();
+                }
+                if (_stop) return;
+                task = _pending.front();
+                _pending.pop_front();
+            }
+            task->run();
+        }
+    }
+
+    MutexCond _mutex;
+    bool _stop;
+    std::list<WorkStealingPool::Task*> _pending;
+    std::vector<std::thread> _threads;
+};
+
+template <typename Pool>
+double
+run_bench(Pool& pool, int ntasks, int nsubmitters, int work)
+{
+    std::vector<BenchTask> tasks(ntasks);
+    std::atomic<int> done(0);
+    for (auto& t : tasks) {
+        t.work = work;
+        t.done = &done;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::thread> submitters;
+    for (int s = 0; s < nsubmitters; ++s) {
+        submitters.push_back(std::thread([&, s] {
+            for (int i = s; i < ntasks; i += nsubmitters) {
+                pool.submit(&tasks[i]);
+            }
+        }));
+    }
+    for (auto& t : submitters) {
+        t.join();
+    }
+    while (done.load() < ntasks) {
+        std::this_thread::yield();
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    const double secs = std::chrono::duration<double>(end_time - start_time).count();
+    return ntasks / secs;
+}
+
+int main(int ac, char** av)
+{
+    const int nthreads = ac > 1 ? atoi(av[1]) : 4;
+    const int ntasks = ac > 2 ? atoi(av[2]) : 1000000;
+    const int nsubmitters = ac > 3 ? atoi(av[3]) : 1;
+    const int work = ac > 4 ? atoi(av[4]) : 100;
+
+    cout << "threads " << nthreads
+         << " tasks " << ntasks
+         << " submitters " << nsubmitters
+         << " work " << work
+         << endl;
+
+    {
+        MutexListPool pool(nthreads);
+        const double rate = run_bench(pool, ntasks, nsubmitters, work);
+        cout << "MutexListPool:    " << int(rate) << " tasks/sec" << endl;
+    }
+
+    {
+        WorkStealingPool pool;
+        pool.set_nthreads(nthreads);
+        const double rate = run_bench(pool, ntasks, nsubmitters, work);
+        struct NB_Work_Stealing_Stats stats;
+        pool.stats(&stats);
+        cout << "WorkStealingPool: " << int(rate) << " tasks/sec"
+             << " steals " << stats.steals
+             << " overflows " << stats.overflows
+             << " sleeps " << stats.sleeps
+             << endl;
+    }
+
+    return 0;
+}
@@ -5,7 +5,7 @@ const stream = require('stream');
 
 const P = require('./promise');
 const Semaphore = require('./semaphore');
-const nb_native = require('./nb_native');
+const chunk_coder_batch = require('./chunk_coder_batch');
 
 /**
  *
@@ -17,7 +17,7 @@ const nb_native = require('./nb_native');
  */
 class ChunkCoder extends stream.Transform {
 
-    constructor({ watermark, concurrency, coder, chunk_coder_config, cipher_key_b64 }) {
+    constructor({ watermark, concurrency, coder, chunk_coder_config, cipher_key_b64, priority }) {
         super({
             objectMode: true,
             allowHalfOpen: false,
@@ -26,6 +26,8 @@ class ChunkCoder extends stream.Transform {
         this.coder = coder;
         this.cipher_key_b64 = cipher_key_b64;
         this.chunk_coder_config = chunk_coder_config;
+        // priority class of the chunks in the native coder pool - 'high', 'normal' or 'low'
+        this.coder_options = { priority: priority || 'normal' };
         this.stream_promise = P.resolve();
         // using both local and global semaphore to avoid one stream overwhelming the global sem
         this.stream_sem = new Semaphore(concurrency);
@@ -42,7 +44,7 @@ class ChunkCoder extends stream.Transform {
     // The reason we need stream_sem is to avoid starvation by one stream to other streams.
     // 
     // Under the semaphores we do the following:
-    // - Submit the chunk for coding.
+    // - Submit the chunk for coding - chunks submitted in the same tick are coded in one native batch.
     // - Wait for the chunk coding and also the previous chunks before pushing down the stream to keep stream order.
     // - We *synchronously* call the transform stream callback because we want to accept more incoming chunks 
     //      from the stream which will call _transform in concurrency - the semaphores will limit it.
@@ -51,7 +53,7 @@ class ChunkCoder extends stream.Transform {
         this.stream_sem.surround(() => ChunkCoder.global_sem.surround(() => {
                 chunk.chunk_coder_config = chunk.chunk_coder_config || this.chunk_coder_config;
                 if (this.cipher_key_b64) chunk.cipher_key_b64 = this.cipher_key_b64;
-                const chunk_promise = P.fromCallback(cb => nb_native().chunk_coder(this.coder, chunk, cb));
+                const chunk_promise = chunk_coder_batch.code_chunk(this.coder, chunk, this.coder_options);
                 // TODO: Need to remove the cipher_key in case of SSE-C
                 this.stream_promise = P.join(chunk_promise, this.stream_promise).then(() => this.push(chunk));
                 callback();
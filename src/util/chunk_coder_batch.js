@@ -0,0 +1,69 @@
+/* Copyright (C) 2016 NooBaa */
+'use strict';
+
+const config = require('../../config');
+const nb_native = require('./nb_native');
+
+/**
+ *
+ * chunk_coder_batch
+ *
+ * Codes chunks with the native chunk_coder, and batches the chunks that are submitted
+ * in the same event loop tick (per coder and priority) into a single native call.
+ * The native coder runs the chunks of a batch in parallel and calls back once,
+ * instead of a callback from the threadpool for every chunk.
+ *
+ */
+
+/** @type {Map<string, { coder: string, coder_options: Object, items: Object[] }>} */
+const batches = new Map();
+
+/**
+ * @param {'enc'|'dec'} coder
+ * @param {Object} chunk
+ * @param {{ priority?: string }} [coder_options]
+ * @returns {Promise<void>}
+ */
+function code_chunk(coder, chunk, coder_options) {
+    return new Promise((resolve, reject) => {
+        const priority = (coder_options && coder_options.priority) || 'normal';
+        const key = `${coder}/${priority}`;
+        let batch = batches.get(key);
+        if (!batch) {
+            batch = { coder, coder_options, items: [] };
+            batches.set(key, batch);
+            setImmediate(() => submit_batch(key, batch));
+        }
+        batch.items.push({ chunk, resolve, reject });
+        if (batch.items.length >= config.CHUNK_CODER_BATCH_SIZE) submit_batch(key, batch);
+    });
+}
+
+function submit_batch(key, batch) {
+    if (batches.get(key) !== batch) return; // already submitted when it became full
+    batches.delete(key);
+    const { items } = batch;
+    try {
+        nb_native().chunk_coder(batch.coder, items.map(item => item.chunk), err => {
+            // the error lists only the chunks that failed, the rest of the batch succeeded
+            const failed = err && err.chunks ? new Set(err.chunks) : undefined;
+            for (const item of items) {
+                if (!err) {
+                    item.resolve();
+                } else if (!failed) {
+                    item.reject(err);
+                } else if (failed.has(item.chunk)) {
+                    const chunk_err = new Error(err.message);
+                    chunk_err.chunks = [item.chunk];
+                    item.reject(chunk_err);
+                } else {
+                    item.resolve();
+                }
+            }
+        }, batch.coder_options);
+    } catch (err) {
+        for (const item of items) item.reject(err);
+    }
+}
+
+exports.code_chunk = code_chunk;
@@ -10,12 +10,24 @@ const nb_native = require('./nb_native');
  *
  * ChunkSplitter
  *
- * Split a data stream to chunks using native rabin sliding window hash
+ * Split a data stream to chunks using native rabin sliding window hash,
+ * or a gear hash (FastCDC style) when chunk_split_config.split_type is 'gear'
  *
  */
 class ChunkSplitter extends stream.Transform {
 
-    constructor({ watermark, chunk_split_config: { avg_chunk, delta_chunk }, calc_md5, calc_sha256 }) {
+    /**
+     * @param {Object} params
+     * @param {boolean} [params.digest_thread] calculate md5/sha256 on a dedicated native thread
+     *  in parallel to the split scan, which is worth a thread only for large streams.
+     */
+    constructor({
+        watermark,
+        chunk_split_config: { avg_chunk, delta_chunk, split_type },
+        calc_md5,
+        calc_sha256,
+        digest_thread,
+    }) {
         super({
             objectMode: true,
             allowHalfOpen: false,
@@ -26,8 +38,13 @@ class ChunkSplitter extends stream.Transform {
             min_chunk: avg_chunk - delta_chunk,
             max_chunk: avg_chunk + delta_chunk,
             avg_chunk_bits: delta_chunk >= 1 ? Math.round(Math.log2(delta_chunk)) : 0,
+            split_type: split_type || 'rabin',
             calc_md5: Boolean(calc_md5),
             calc_sha256: Boolean(calc_sha256),
+            digest_thread: Boolean(digest_thread),
+            // the native splitter writes the split points of every call here when they fit,
+            // which is more than the points of a single split_batch unless chunks are tiny.
+            points_array: new Int32Array(64),
         };
         this.pending_split = [];
         this.pending_split_len = 0;
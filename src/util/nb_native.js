@@ -8,6 +8,8 @@ const events = require('events');
 const chance = require('chance')();
 const child_process = require('child_process');
 
+const config = require('../../config');
+
 const async_exec = util.promisify(child_process.exec);
 const async_delay = util.promisify(setTimeout);
 const async_open_fd = util.promisify(fs.open);
@@ -28,8 +30,15 @@ function nb_native() {
     const nb_native_nan = bindings('nb_native_nan.node');
     inherits(nb_native_nan.Nudp, events.EventEmitter);
     inherits(nb_native_nan.Ntcp, events.EventEmitter);
+    // the ThreadPool workers of nb_native_nan run on the same threads as the chunk coder
+    nb_native_nan.work_stealing_attach(nb_native_napi.work_stealing_shared());
     _.defaults(nb_native_napi, nb_native_nan);
 
+    nb_native_napi.chunk_coder_pool_threads(config.CHUNK_CODER_POOL_THREADS);
+    nb_native_napi.chunk_coder_pool_placement(config.CHUNK_CODER_POOL_PLACEMENT);
+    nb_native_napi.chunk_coder_compress_min_gain(config.CHUNK_CODER_COMPRESS_MIN_GAIN);
+    nb_native_napi.chunk_coder_gcm_auth_tag(config.CHUNK_CODER_GCM_AUTH_TAG);
+
     init_rand_seed();
 
     return nb_native_napi;